@@ -120,6 +120,14 @@ pub struct DhcpServiceConfig {
     pub interface: String,
     #[serde(default = "default_kea_control_port")]
     pub control_port: u16,
+    /// Scopes are applied to the running Kea by the etcd hook
+    /// (scopes_enabled) instead of being written into the config file
+    #[serde(default)]
+    pub incremental_scopes: bool,
+    /// Leases are mirrored into etcd by the etcd hook (lease_sync_enabled);
+    /// loads the hook even without incremental scopes
+    #[serde(default)]
+    pub lease_sync: bool,
 }
 
 fn default_dhcp_engine() -> String {
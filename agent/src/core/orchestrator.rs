@@ -129,6 +129,8 @@ impl Orchestrator {
                 kea_service
                     .set_node_name(self.config.node.name.clone())
                     .await;
+                // The etcd hook connects to the same etcd and prefix
+                kea_service.set_etcd_config(self.config.etcd.clone()).await;
 
                 let plugin: Arc<RwLock<Box<dyn ServicePlugin + Send + Sync>>> =
                     Arc::new(RwLock::new(Box::new(kea_service)));
@@ -283,6 +285,13 @@ impl Orchestrator {
                                     } else {
                                         info!("Deleted from cache: {}", key);
                                     }
+
+                                    // Notify plugins
+                                    if let Err(e) =
+                                        registry.notify_config_delete(key.as_ref()).await
+                                    {
+                                        error!("Failed to notify plugins: {}", e);
+                                    }
                                 }
                             }
                         }
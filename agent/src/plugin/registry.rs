@@ -54,6 +54,21 @@ impl PluginRegistry {
         Ok(())
     }
 
+    pub async fn notify_config_delete(&self, key: &str) -> Result<()> {
+        debug!("Notifying plugins of config delete: {}", key);
+
+        let plugins = self.plugins.read().await;
+        for (name, plugin) in plugins.iter() {
+            if let Err(e) = {
+                let mut guard = plugin.write().await;
+                guard.on_config_delete(key).await
+            } {
+                tracing::error!("Plugin {} failed to handle config delete: {}", name, e);
+            }
+        }
+        Ok(())
+    }
+
     pub async fn reload_all(&self) -> Result<()> {
         info!("Reloading all plugins");
 
@@ -12,6 +12,11 @@ pub trait ServicePlugin: Send + Sync {
     /// Handle configuration change notification
     async fn on_config_change(&mut self, key: &str, value: &[u8]) -> Result<()>;
 
+    /// Handle configuration deletion notification
+    async fn on_config_delete(&mut self, _key: &str) -> Result<()> {
+        Ok(())
+    }
+
     /// Reload/restart the service managed by this plugin
     async fn reload(&mut self) -> Result<()>;
 
@@ -1,4 +1,4 @@
-use crate::config::DhcpServiceConfig;
+use crate::config::{DhcpServiceConfig, EtcdConfig};
 use crate::plugin::ServicePlugin;
 use anyhow::{Context, Result};
 use async_trait::async_trait;
@@ -61,8 +61,13 @@ struct KeaOption {
 #[derive(Debug, Serialize, Deserialize)]
 struct KeaHook {
     library: String,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    parameters: Option<serde_json::Value>,
 }
 
+/// The NNOE etcd hook, as installed by integrations/kea-hooks
+const ETCD_HOOK_LIBRARY: &str = "/usr/lib/kea/hooks/libdhcp_etcd.so";
+
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 enum HaState {
     Primary,
@@ -83,6 +88,7 @@ pub struct KeaService {
     service_running: Arc<RwLock<bool>>,
     etcd_client: Arc<RwLock<Option<Arc<crate::etcd::EtcdClient>>>>,
     node_name: Arc<RwLock<Option<String>>>,
+    etcd_config: Arc<RwLock<Option<EtcdConfig>>>,
 }
 
 #[derive(Debug, Clone)]
@@ -107,6 +113,7 @@ impl KeaService {
             service_running: Arc::new(RwLock::new(false)),
             etcd_client: Arc::new(RwLock::new(None)),
             node_name: Arc::new(RwLock::new(None)),
+            etcd_config: Arc::new(RwLock::new(None)),
         }
     }
 
@@ -120,6 +127,12 @@ impl KeaService {
         *node_guard = Some(name);
     }
 
+    /// The etcd the hook loaded by incremental scopes talks to
+    pub async fn set_etcd_config(&self, config: EtcdConfig) {
+        let mut config_guard = self.etcd_config.write().await;
+        *config_guard = Some(config);
+    }
+
     async fn check_vip(&self) -> Result<bool> {
         // Check if VIP is present on the configured interface
         // Uses 'ip addr' command to check for VIP presence
@@ -263,8 +276,49 @@ impl KeaService {
         Ok(())
     }
 
+    /// With incremental scopes the etcd hook has to watch the scope prefix,
+    /// or the subnets left out of the file would never reach Kea; with
+    /// lease_sync it mirrors leases into etcd. It is pointed at the agent's
+    /// etcd and prefix, and mirrors leases only when lease_sync asks for it.
+    async fn hooks_libraries(&self) -> Vec<KeaHook> {
+        if !self.config.incremental_scopes && !self.config.lease_sync {
+            return vec![];
+        }
+
+        // Lease mirroring is on in the hook unless turned off explicitly
+        let mut parameters = serde_json::json!({
+            "scopes_enabled": self.config.incremental_scopes,
+            "lease_sync_enabled": self.config.lease_sync,
+        });
+        if let Some(ref etcd) = *self.etcd_config.read().await {
+            // The hook takes a single endpoint
+            if let Some(endpoint) = etcd.endpoints.first() {
+                parameters["etcd_endpoints"] = serde_json::json!(endpoint);
+            }
+            parameters["prefix"] = serde_json::json!(format!("{}/dhcp/leases", etcd.prefix));
+            parameters["scopes_prefix"] = serde_json::json!(format!("{}/dhcp/scopes", etcd.prefix));
+            if let Some(ref tls) = etcd.tls {
+                parameters["etcd_ca_file"] = serde_json::json!(tls.ca_cert);
+                parameters["etcd_cert_file"] = serde_json::json!(tls.cert);
+                parameters["etcd_key_file"] = serde_json::json!(tls.key);
+            }
+        }
+
+        vec![KeaHook {
+            library: ETCD_HOOK_LIBRARY.to_string(),
+            parameters: Some(parameters),
+        }]
+    }
+
     async fn generate_config(&self) -> Result<()> {
+        let hooks_libraries = self.hooks_libraries().await;
         let scopes = self.scopes.read().await;
+        // With incremental scopes the hook adds the subnets at runtime
+        let file_scopes: Vec<&KeaScopeData> = if self.config.incremental_scopes {
+            Vec::new()
+        } else {
+            scopes.values().collect()
+        };
 
         let kea_config = KeaConfig {
             Dhcp4: KeaDhcp4Config {
@@ -274,8 +328,8 @@ impl KeaService {
                 lease_database: KeaLeaseDatabase {
                     db_type: "memfile".to_string(),
                 },
-                subnet4: scopes
-                    .values()
+                subnet4: file_scopes
+                    .into_iter()
                     .map(|scope| KeaSubnet {
                         subnet: scope.subnet.clone(),
                         pools: vec![KeaPool {
@@ -291,7 +345,7 @@ impl KeaService {
                             .collect(),
                     })
                     .collect(),
-                hooks_libraries: vec![],
+                hooks_libraries,
             },
         };
 
@@ -562,6 +616,12 @@ impl ServicePlugin for KeaService {
                         scopes.insert(scope_id.to_string(), scope_data);
                         drop(scopes);
 
+                        if self.config.incremental_scopes {
+                            // The Kea hook applies the change from etcd itself
+                            debug!("DHCP scope {} left to the Kea hook", scope_id);
+                            return Ok(());
+                        }
+
                         // Regenerate Kea config
                         self.generate_config().await?;
 
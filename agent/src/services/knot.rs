@@ -7,7 +7,8 @@ use std::collections::HashMap;
 use std::path::PathBuf;
 use std::process::Command;
 use std::sync::Arc;
-use tokio::sync::RwLock;
+use std::time::Duration;
+use tokio::sync::{Mutex, RwLock};
 use tracing::{error, info, warn};
 
 #[derive(Debug, Serialize, Deserialize)]
@@ -51,12 +52,28 @@ struct DnssecKeyConfig {
     key_directory: Option<String>, // Directory for DNSSEC keys
 }
 
+/// How long DHCP record changes of a zone are collected before they are
+/// applied to Knot in one zone transaction
+const DHCP_FLUSH_DELAY: Duration = Duration::from_millis(200);
+
+type DhcpRecords = Arc<RwLock<HashMap<String, HashMap<String, DnsRecord>>>>;
+
 /// Knot DNS service integration
 pub struct KnotService {
     config: DnsServiceConfig,
     zones: Arc<RwLock<HashMap<String, KnotZoneData>>>,
     config_path: PathBuf,
     dnssec_keys: Arc<RwLock<HashMap<String, DnssecKeyInfo>>>, // zone -> key info
+    dhcp_records: DhcpRecords,                                // zone -> key -> record
+    // zone -> unapplied changes; a zone is present while its flush task runs
+    dhcp_changes: Arc<Mutex<HashMap<String, Vec<RecordChange>>>>,
+}
+
+/// A DHCP record change waiting to be applied to Knot
+#[derive(Debug, Clone)]
+enum RecordChange {
+    Set(DnsRecord),
+    Unset(DnsRecord),
 }
 
 #[derive(Debug, Clone)]
@@ -68,12 +85,13 @@ struct DnssecKeyInfo {
 
 #[derive(Debug, Clone)]
 struct KnotZoneData {
+    name: String,
     domain: String,
     zone_file_path: PathBuf,
     records: Vec<DnsRecord>,
 }
 
-#[derive(Debug, Clone, Serialize, Deserialize)]
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
 struct DnsRecord {
     name: String,
     #[serde(rename = "type")]
@@ -90,9 +108,176 @@ impl KnotService {
             zones: Arc::new(RwLock::new(HashMap::new())),
             config_path,
             dnssec_keys: Arc::new(RwLock::new(HashMap::new())),
+            dhcp_records: Arc::new(RwLock::new(HashMap::new())),
+            dhcp_changes: Arc::new(Mutex::new(HashMap::new())),
+        }
+    }
+
+    /// Split a DHCP-published record key (`<prefix>/dns/zones/<zone>/dhcp/<name>/<type>`,
+    /// written by the Kea hook) into its zone name and record key
+    fn parse_dhcp_record_key(key: &str) -> Option<(String, String)> {
+        let rest = &key[key.find("/dns/zones/")? + "/dns/zones/".len()..];
+        let (zone, record) = rest.split_once("/dhcp/")?;
+        if zone.is_empty() || zone.contains('/') || record.is_empty() {
+            return None;
+        }
+        Some((zone.to_string(), record.to_string()))
+    }
+
+    /// Queue DHCP record changes of a zone. The first change of a quiet zone
+    /// starts its flush task, so a burst of lease events costs one Knot zone
+    /// transaction instead of a zone file rewrite and reload per record. A
+    /// zone has one flush in flight at a time: Knot refuses a second
+    /// zone-begin on it, so changes queued meanwhile wait for the next round.
+    async fn queue_dhcp_changes(&self, zone_name: &str, changes: Vec<RecordChange>) {
+        if changes.is_empty() {
+            return;
+        }
+        {
+            let mut pending = self.dhcp_changes.lock().await;
+            if let Some(queue) = pending.get_mut(zone_name) {
+                queue.extend(changes);
+                return;
+            }
+            pending.insert(zone_name.to_string(), changes);
+        }
+
+        let zone_name = zone_name.to_string();
+        let zones = Arc::clone(&self.zones);
+        let dhcp_records = Arc::clone(&self.dhcp_records);
+        let dhcp_changes = Arc::clone(&self.dhcp_changes);
+        tokio::spawn(async move {
+            loop {
+                tokio::time::sleep(DHCP_FLUSH_DELAY).await;
+                let changes = dhcp_changes
+                    .lock()
+                    .await
+                    .get_mut(&zone_name)
+                    .map(std::mem::take)
+                    .unwrap_or_default();
+                if let Err(e) =
+                    Self::flush_dhcp_zone(&zones, &dhcp_records, &zone_name, changes).await
+                {
+                    error!("Failed to apply DHCP records to zone {}: {}", zone_name, e);
+                }
+
+                let mut pending = dhcp_changes.lock().await;
+                if pending
+                    .get(&zone_name)
+                    .map_or(true, |queue| queue.is_empty())
+                {
+                    pending.remove(&zone_name);
+                    break;
+                }
+            }
+        });
+    }
+
+    /// Apply collected DHCP record changes to a managed zone
+    async fn flush_dhcp_zone(
+        zones: &RwLock<HashMap<String, KnotZoneData>>,
+        dhcp_records: &DhcpRecords,
+        zone_name: &str,
+        changes: Vec<RecordChange>,
+    ) -> Result<()> {
+        if changes.is_empty() {
+            return Ok(());
+        }
+        let zone_data = {
+            let zones = zones.read().await;
+            zones.get(zone_name).cloned()
+        };
+        let zone_data = match zone_data {
+            Some(zone_data) => zone_data,
+            None => {
+                // Records are kept and applied once the zone itself arrives
+                info!("DHCP records for unmanaged zone {} held", zone_name);
+                return Ok(());
+            }
+        };
+
+        // knotc runs synchronously; keep it off the runtime's worker threads
+        let domain = zone_data.domain.clone();
+        let count = changes.len();
+        let applied =
+            tokio::task::spawn_blocking(move || Self::apply_zone_transaction(&domain, &changes))
+                .await
+                .context("knotc zone transaction task failed")?;
+
+        match applied {
+            Ok(()) => {
+                info!(
+                    "Applied {} DHCP record changes to zone {}",
+                    count, zone_name
+                );
+                Ok(())
+            }
+            Err(e) => {
+                // Knot's zone may be out of step with the records (or knotc
+                // unavailable): rewrite the file and reload just this zone
+                warn!(
+                    "Zone transaction for {} failed ({}), reloading the zone file",
+                    zone_name, e
+                );
+                Self::write_zone_file(&zone_data, dhcp_records).await?;
+                let domain = zone_data.domain.clone();
+                tokio::task::spawn_blocking(move || Self::knotc(&["zone-reload", &domain]))
+                    .await
+                    .context("knotc zone-reload task failed")?
+            }
         }
     }
 
+    /// Apply record changes to a loaded zone in one knotc zone transaction
+    fn apply_zone_transaction(domain: &str, changes: &[RecordChange]) -> Result<()> {
+        Self::knotc(&["zone-begin", domain])?;
+        let applied = changes.iter().try_for_each(|change| match change {
+            RecordChange::Set(record) => {
+                let ttl = record.ttl.unwrap_or(3600).to_string();
+                Self::knotc(&[
+                    "zone-set",
+                    domain,
+                    &record.name,
+                    &ttl,
+                    &record.record_type,
+                    &record.value,
+                ])
+            }
+            RecordChange::Unset(record) => Self::knotc(&[
+                "zone-unset",
+                domain,
+                &record.name,
+                &record.record_type,
+                &record.value,
+            ]),
+        });
+        match applied {
+            Ok(()) => Self::knotc(&["zone-commit", domain]),
+            Err(e) => {
+                Self::knotc(&["zone-abort", domain]).ok();
+                Err(e)
+            }
+        }
+    }
+
+    fn knotc(args: &[&str]) -> Result<()> {
+        let output = Command::new("knotc")
+            .args(args)
+            .output()
+            .context(format!("Failed to run knotc {}", args[0]))?;
+        if !output.status.success() {
+            let stderr = String::from_utf8_lossy(&output.stderr);
+            let stdout = String::from_utf8_lossy(&output.stdout);
+            return Err(anyhow::anyhow!(
+                "knotc {} failed: {} / {}",
+                args[0],
+                stderr,
+                stdout
+            ));
+        }
+        Ok(())
+    }
+
     /// Generate DNSSEC keys for a zone using keymgr (Knot's key management tool)
     async fn generate_dnssec_keys(
         &self,
@@ -283,6 +468,10 @@ impl KnotService {
     }
 
     async fn generate_zone_file(&self, zone_data: &KnotZoneData) -> Result<()> {
+        Self::write_zone_file(zone_data, &self.dhcp_records).await
+    }
+
+    async fn write_zone_file(zone_data: &KnotZoneData, dhcp_records: &DhcpRecords) -> Result<()> {
         // Create zone directory if it doesn't exist
         if let Some(parent) = zone_data.zone_file_path.parent() {
             std::fs::create_dir_all(parent)
@@ -312,6 +501,22 @@ impl KnotService {
             ));
         }
 
+        // Records published by the Kea hook from DHCP leases
+        let dhcp_records = dhcp_records.read().await;
+        if let Some(records) = dhcp_records.get(&zone_data.name) {
+            let mut keys: Vec<&String> = records.keys().collect();
+            keys.sort();
+            for key in keys {
+                let record = &records[key];
+                let ttl = record.ttl.unwrap_or(3600);
+                zone_content.push_str(&format!(
+                    "{}\t{}\t{}\t{}\n",
+                    record.name, ttl, record.record_type, record.value
+                ));
+            }
+        }
+        drop(dhcp_records);
+
         std::fs::write(&zone_data.zone_file_path, zone_content).context(format!(
             "Failed to write zone file: {:?}",
             zone_data.zone_file_path
@@ -499,6 +704,7 @@ impl KnotService {
             PathBuf::from(&self.config.zone_dir).join(format!("{}.zone", zone_name));
 
         Ok(KnotZoneData {
+            name: zone_name.to_string(),
             domain: zone_json.domain,
             zone_file_path,
             records: zone_json.records,
@@ -535,6 +741,25 @@ impl ServicePlugin for KnotService {
     }
 
     async fn on_config_change(&mut self, key: &str, value: &[u8]) -> Result<()> {
+        if let Some((zone_name, record_key)) = Self::parse_dhcp_record_key(key) {
+            let record: DnsRecord = serde_json::from_slice(value)
+                .context(format!("Failed to parse DHCP record {}", key))?;
+            let previous = {
+                let mut dhcp_records = self.dhcp_records.write().await;
+                dhcp_records
+                    .entry(zone_name.clone())
+                    .or_default()
+                    .insert(record_key, record.clone())
+            };
+            let changes = match previous {
+                Some(previous) if previous == record => Vec::new(),
+                Some(previous) => vec![RecordChange::Unset(previous), RecordChange::Set(record)],
+                None => vec![RecordChange::Set(record)],
+            };
+            self.queue_dhcp_changes(&zone_name, changes).await;
+            return Ok(());
+        }
+
         if key.contains("/dns/zones/") && !key.ends_with("/zonefile") {
             // Extract zone name from key (format: /nnoe/dns/zones/<zone-name>)
             let parts: Vec<&str> = key.split('/').collect();
@@ -610,6 +835,23 @@ impl ServicePlugin for KnotService {
         Ok(())
     }
 
+    async fn on_config_delete(&mut self, key: &str) -> Result<()> {
+        if let Some((zone_name, record_key)) = Self::parse_dhcp_record_key(key) {
+            let removed = {
+                let mut dhcp_records = self.dhcp_records.write().await;
+                dhcp_records
+                    .get_mut(&zone_name)
+                    .and_then(|records| records.remove(&record_key))
+            };
+            if let Some(record) = removed {
+                self.queue_dhcp_changes(&zone_name, vec![RecordChange::Unset(record)])
+                    .await;
+            }
+        }
+
+        Ok(())
+    }
+
     async fn reload(&mut self) -> Result<()> {
         info!("Reloading Knot DNS service");
         self.generate_config().await?;
@@ -1,6 +1,8 @@
 #[cfg(test)]
 mod tests {
-    use nnoe_agent::config::{CerbosServiceConfig, DhcpServiceConfig, DnsServiceConfig};
+    use nnoe_agent::config::{
+        CerbosServiceConfig, DhcpServiceConfig, DnsServiceConfig, EtcdConfig, TlsConfig,
+    };
     use nnoe_agent::services::cerbos::CerbosService;
     use nnoe_agent::services::kea::KeaService;
     use nnoe_agent::services::knot::KnotService;
@@ -41,6 +43,8 @@ mod tests {
             ha_pair_id: None,
             interface: "eth0".to_string(),
             control_port: 8000,
+            incremental_scopes: false,
+            lease_sync: false,
         };
 
         let mut service = KeaService::new(config);
@@ -50,6 +54,108 @@ mod tests {
         assert!(result.is_ok() || result.unwrap_err().to_string().contains("kea"));
     }
 
+    #[tokio::test]
+    async fn test_kea_incremental_scopes() {
+        use nnoe_agent::plugin::ServicePlugin;
+
+        setup_test_dir("/tmp/test-kea-incremental");
+
+        let config = DhcpServiceConfig {
+            enabled: true,
+            engine: "kea".to_string(),
+            config_path: "/tmp/test-kea-incremental/kea.conf".to_string(),
+            ha_pair_id: None,
+            interface: "eth0".to_string(),
+            control_port: 8000,
+            incremental_scopes: true,
+            lease_sync: false,
+        };
+
+        let mut service = KeaService::new(config);
+        service
+            .set_etcd_config(EtcdConfig {
+                endpoints: vec!["https://10.0.0.5:2379".to_string()],
+                prefix: "/site-a".to_string(),
+                timeout_secs: 5,
+                tls: Some(TlsConfig {
+                    ca_cert: "/etc/nnoe/ca.pem".to_string(),
+                    cert: "/etc/nnoe/client.pem".to_string(),
+                    key: "/etc/nnoe/client-key.pem".to_string(),
+                }),
+            })
+            .await;
+        service.init(&[]).await.unwrap();
+        let initial = fs::read_to_string("/tmp/test-kea-incremental/kea.conf").unwrap();
+
+        // Left to the hook: no config rewrite and no reload (which would
+        // fail here, without Kea)
+        let scope = br#"{"subnet": "192.168.10.0/24",
+                         "pool": {"start": "192.168.10.100", "end": "192.168.10.200"}}"#;
+        service
+            .on_config_change("/nnoe/dhcp/scopes/scope-1", scope)
+            .await
+            .unwrap();
+        let after = fs::read_to_string("/tmp/test-kea-incremental/kea.conf").unwrap();
+        assert_eq!(initial, after);
+
+        // Regenerated (init does not reload Kea), the file still leaves the
+        // scope out and loads the hook with its scope watch
+        service.init(&[]).await.unwrap();
+        let generated: serde_json::Value = serde_json::from_str(
+            &fs::read_to_string("/tmp/test-kea-incremental/kea.conf").unwrap(),
+        )
+        .unwrap();
+        let dhcp4 = &generated["Dhcp4"];
+        assert_eq!(dhcp4["subnet4"].as_array().unwrap().len(), 0);
+        let hooks = dhcp4["hooks-libraries"].as_array().unwrap();
+        assert_eq!(hooks.len(), 1);
+        assert!(hooks[0]["library"]
+            .as_str()
+            .unwrap()
+            .ends_with("libdhcp_etcd.so"));
+        let parameters = &hooks[0]["parameters"];
+        assert_eq!(parameters["scopes_enabled"], true);
+        // Loaded for the scopes only: no lease mirroring
+        assert_eq!(parameters["lease_sync_enabled"], false);
+        // Pointed at the agent's etcd, not the hook's built-in defaults
+        assert_eq!(parameters["etcd_endpoints"], "https://10.0.0.5:2379");
+        assert_eq!(parameters["scopes_prefix"], "/site-a/dhcp/scopes");
+        assert_eq!(parameters["prefix"], "/site-a/dhcp/leases");
+        assert_eq!(parameters["etcd_ca_file"], "/etc/nnoe/ca.pem");
+        assert_eq!(parameters["etcd_cert_file"], "/etc/nnoe/client.pem");
+        assert_eq!(parameters["etcd_key_file"], "/etc/nnoe/client-key.pem");
+    }
+
+    #[tokio::test]
+    async fn test_kea_lease_sync() {
+        use nnoe_agent::plugin::ServicePlugin;
+
+        setup_test_dir("/tmp/test-kea-lease-sync");
+
+        let config = DhcpServiceConfig {
+            enabled: true,
+            engine: "kea".to_string(),
+            config_path: "/tmp/test-kea-lease-sync/kea.conf".to_string(),
+            ha_pair_id: None,
+            interface: "eth0".to_string(),
+            control_port: 8000,
+            incremental_scopes: false,
+            lease_sync: true,
+        };
+
+        // The hook is loaded for lease mirroring alone; scopes stay in the file
+        let mut service = KeaService::new(config);
+        service.init(&[]).await.unwrap();
+        let generated: serde_json::Value =
+            serde_json::from_str(&fs::read_to_string("/tmp/test-kea-lease-sync/kea.conf").unwrap())
+                .unwrap();
+        let hooks = generated["Dhcp4"]["hooks-libraries"].as_array().unwrap();
+        assert_eq!(hooks.len(), 1);
+        let parameters = &hooks[0]["parameters"];
+        assert_eq!(parameters["lease_sync_enabled"], true);
+        assert_eq!(parameters["scopes_enabled"], false);
+    }
+
     #[tokio::test]
     #[ignore] // Requires Cerbos running
     async fn test_cerbos_service_connection() {
@@ -0,0 +1,158 @@
+/**
+ * Microbenchmark: lease address and identifier formatting
+ *
+ * Compares the formatters of text_format.h with what the hook used before:
+ * Kea's IOAddress/HWAddr/DUID toText() when built against Kea
+ * (NNOE_BENCH_KEA), and in any case with the calls those make internally
+ * (inet_ntop() and an ostringstream with setw/setfill), so the comparison
+ * can be run on hosts without Kea.
+ *
+ *   text_format_bench [iterations]
+ */
+
+#include "text_format.h"
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef NNOE_BENCH_KEA
+#include <asiolink/io_address.h>
+#include <dhcp/duid.h>
+#include <dhcp/hwaddr.h>
+#endif
+
+namespace {
+
+// Keeps results alive so the loops are not optimised away
+size_t sink = 0;
+
+template <typename Fn>
+void run(const char* name, size_t iterations, Fn fn) {
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        sink += fn(i);
+    }
+    const double ns = std::chrono::duration<double, std::nano>(
+                          std::chrono::steady_clock::now() - start).count();
+    std::printf("  %-34s %8.1f ns/op\n", name, ns / iterations);
+}
+
+std::string stream_hex(const std::vector<uint8_t>& data) {
+    std::ostringstream text;
+    text << std::hex;
+    for (size_t i = 0; i < data.size(); ++i) {
+        if (i) {
+            text << ":";
+        }
+        text << std::setw(2) << std::setfill('0') << static_cast<unsigned int>(data[i]);
+    }
+    return text.str();
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000000;
+    const size_t samples = 4096;
+
+    std::mt19937 rng(1);
+    std::vector<uint32_t> v4(samples);
+    std::vector<std::vector<uint8_t>> v6(samples, std::vector<uint8_t>(16));
+    std::vector<std::vector<uint8_t>> macs(samples, std::vector<uint8_t>(6));
+    std::vector<std::vector<uint8_t>> duids(samples, std::vector<uint8_t>(14));
+    for (size_t i = 0; i < samples; ++i) {
+        v4[i] = 0x0a000000 | (rng() & 0xffffff);
+        // 2001:db8:<site>:<subnet>::<host>, as DHCPv6 pools look
+        const uint32_t r = rng();
+        const uint8_t prefix[16] = {0x20, 0x01, 0x0d, 0xb8, 0, static_cast<uint8_t>(r >> 24),
+                                    0, static_cast<uint8_t>(r >> 16), 0, 0, 0, 0,
+                                    0, 0, static_cast<uint8_t>(r >> 8), static_cast<uint8_t>(r)};
+        v6[i].assign(prefix, prefix + 16);
+        for (auto& byte : macs[i]) {
+            byte = static_cast<uint8_t>(rng());
+        }
+        // DUID-LLT: type 1, hardware type 1, time, MAC
+        duids[i] = {0, 1, 0, 1, 0x2f, 0x1e, 0x3a, 0x4b};
+        duids[i].insert(duids[i].end(), macs[i].begin(), macs[i].end());
+    }
+    const size_t mask = samples - 1;
+
+#ifdef NNOE_BENCH_KEA
+    std::vector<isc::asiolink::IOAddress> kea_v4, kea_v6;
+    std::vector<isc::dhcp::HWAddr> kea_macs;
+    std::vector<isc::dhcp::DUID> kea_duids;
+    for (size_t i = 0; i < samples; ++i) {
+        kea_v4.push_back(isc::asiolink::IOAddress(v4[i]));
+        kea_v6.push_back(isc::asiolink::IOAddress::fromBytes(AF_INET6, v6[i].data()));
+        kea_macs.push_back(isc::dhcp::HWAddr(macs[i], 1));
+        kea_duids.push_back(isc::dhcp::DUID(duids[i]));
+    }
+#endif
+
+    std::printf("IPv4 address\n");
+#ifdef NNOE_BENCH_KEA
+    run("IOAddress::toText()", iterations, [&](size_t i) { return kea_v4[i & mask].toText().size(); });
+#endif
+    run("inet_ntop() + std::string", iterations, [&](size_t i) {
+        in_addr addr;
+        addr.s_addr = htonl(v4[i & mask]);
+        char text[INET_ADDRSTRLEN];
+        return std::string(inet_ntop(AF_INET, &addr, text, sizeof(text))).size();
+    });
+    run("format_ipv4() into a buffer", iterations, [&](size_t i) {
+        char text[nnoe::IPV4_TEXT_BUFFER];
+        return nnoe::format_ipv4(v4[i & mask], text) + text[0];
+    });
+    run("ipv4_text()", iterations, [&](size_t i) { return nnoe::ipv4_text(v4[i & mask]).size(); });
+
+    std::printf("IPv6 address\n");
+#ifdef NNOE_BENCH_KEA
+    run("IOAddress::toText()", iterations, [&](size_t i) { return kea_v6[i & mask].toText().size(); });
+#endif
+    run("inet_ntop() + std::string", iterations, [&](size_t i) {
+        char text[INET6_ADDRSTRLEN];
+        return std::string(inet_ntop(AF_INET6, v6[i & mask].data(), text, sizeof(text))).size();
+    });
+    run("format_ipv6() into a buffer", iterations, [&](size_t i) {
+        char text[nnoe::IPV6_TEXT_BUFFER];
+        return nnoe::format_ipv6(v6[i & mask].data(), text) + text[0];
+    });
+    run("ipv6_text()", iterations, [&](size_t i) { return nnoe::ipv6_text(v6[i & mask].data()).size(); });
+
+    std::printf("MAC address (6 bytes)\n");
+#ifdef NNOE_BENCH_KEA
+    run("HWAddr::toText(false)", iterations, [&](size_t i) {
+        return kea_macs[i & mask].toText(false).size();
+    });
+#endif
+    run("ostringstream", iterations, [&](size_t i) { return stream_hex(macs[i & mask]).size(); });
+    run("hex_colon_text()", iterations, [&](size_t i) {
+        return nnoe::hex_colon_text(macs[i & mask].data(), 6).size();
+    });
+
+    std::printf("DUID-LLT (14 bytes)\n");
+#ifdef NNOE_BENCH_KEA
+    run("DUID::toText()", iterations, [&](size_t i) { return kea_duids[i & mask].toText().size(); });
+#endif
+    run("ostringstream", iterations, [&](size_t i) { return stream_hex(duids[i & mask]).size(); });
+    run("hex_colon_text()", iterations, [&](size_t i) {
+        return nnoe::hex_colon_text(duids[i & mask].data(), 14).size();
+    });
+
+    std::vector<uint8_t> long_duid(duids[0]);
+    long_duid.resize(32, 0x5a);
+    std::printf("DUID (32 bytes, SIMD path)\n");
+    run("ostringstream", iterations / 4, [&](size_t) { return stream_hex(long_duid).size(); });
+    run("hex_colon_text()", iterations / 4, [&](size_t) {
+        return nnoe::hex_colon_text(long_duid.data(), long_duid.size()).size();
+    });
+
+    return sink == 0;
+}
@@ -0,0 +1,720 @@
+/**
+ * Zero-copy reader for NNOE lease records
+ *
+ * Header-only, no dependencies beyond the standard library. Reads etcd
+ * /v3/kv/range gateway responses and the lease values the Kea hook and the
+ * memfile tailer write under /nnoe/dhcp/leases:
+ *
+ *   std::string body = ...;  // raw HTTP response body
+ *   nnoe::RangeResponseReader range(&body[0], body.size());
+ *   nnoe::KeyValueView kv;
+ *   nnoe::LeaseView lease;
+ *   while (range.next(kv)) {
+ *       if (nnoe::parse_lease(kv.value, lease) == nnoe::LEASE_OK) { ... }
+ *   }
+ *
+ * Keys and values are base64-decoded in place inside the response buffer
+ * and every field is returned as a view into it, so a scan allocates
+ * nothing. Views stay valid as long as the buffer does. Base64 decoding
+ * uses SSSE3 when the CPU has it.
+ *
+ * String fields are JSON text. The rare one with escapes (a hostname with a
+ * quote or non-ASCII characters) is decoded into the buffer parse_lease is
+ * given, which may be the value's own storage; without one it is left raw
+ * and LeaseView::escaped tells the caller to fall back.
+ *
+ * Lease values carry a schema version in "v". Records without it are
+ * version 0, which has the same fields. Readers accept every version up to
+ * LEASE_SCHEMA_VERSION and skip fields they do not know.
+ */
+
+#ifndef NNOE_LEASE_READER_H
+#define NNOE_LEASE_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define NNOE_LEASE_READER_SSSE3 1
+#endif
+
+namespace nnoe {
+
+// Highest lease value schema this reader understands
+const uint32_t LEASE_SCHEMA_VERSION = 1;
+
+const size_t BASE64_INVALID = static_cast<size_t>(-1);
+
+namespace detail {
+
+struct Base64Table {
+    uint8_t value[256];
+
+    constexpr Base64Table() : value() {
+        const char alphabet[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (int i = 0; i < 256; ++i) {
+            value[i] = 0xff;
+        }
+        for (int i = 0; i < 64; ++i) {
+            value[static_cast<uint8_t>(alphabet[i])] = static_cast<uint8_t>(i);
+        }
+    }
+};
+
+inline constexpr Base64Table BASE64_TABLE{};
+
+// Decode len characters (a multiple of 4, '=' padding only in the last
+// quartet). out may alias in: output never overtakes unread input.
+inline size_t base64_decode_scalar(const char* in, size_t len, char* out) {
+    if (len % 4 != 0) {
+        return BASE64_INVALID;
+    }
+
+    const uint8_t* table = BASE64_TABLE.value;
+    size_t o = 0;
+    for (size_t i = 0; i < len; i += 4) {
+        const uint32_t a = table[static_cast<uint8_t>(in[i])];
+        const uint32_t b = table[static_cast<uint8_t>(in[i + 1])];
+
+        if (i + 4 == len && in[i + 3] == '=') {
+            if ((a | b) & 0xc0) {
+                return BASE64_INVALID;
+            }
+            if (in[i + 2] == '=') {
+                out[o++] = static_cast<char>((a << 2) | (b >> 4));
+                return o;
+            }
+            const uint32_t c = table[static_cast<uint8_t>(in[i + 2])];
+            if (c & 0xc0) {
+                return BASE64_INVALID;
+            }
+            out[o++] = static_cast<char>((a << 2) | (b >> 4));
+            out[o++] = static_cast<char>((b << 4) | (c >> 2));
+            return o;
+        }
+
+        const uint32_t c = table[static_cast<uint8_t>(in[i + 2])];
+        const uint32_t d = table[static_cast<uint8_t>(in[i + 3])];
+        if ((a | b | c | d) & 0xc0) {
+            return BASE64_INVALID;
+        }
+        const uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+        out[o++] = static_cast<char>(v >> 16);
+        out[o++] = static_cast<char>(v >> 8);
+        out[o++] = static_cast<char>(v);
+    }
+    return o;
+}
+
+#ifdef NNOE_LEASE_READER_SSSE3
+
+// 16 characters -> 12 bytes per step (nibble lookup validation, as in
+// Muła/Lemire). Stops early at anything outside the alphabet, including
+// padding, and leaves the rest to the scalar loop. Each step stores 16
+// bytes, so it only runs while at least 24 characters remain; the extra
+// bytes land on already consumed input when decoding in place.
+__attribute__((target("ssse3")))
+inline size_t base64_decode_ssse3(const char* in, size_t len, char* out, size_t& consumed) {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                           0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    const __m128i pack_pairs = _mm_set1_epi32(0x01400140);
+    const __m128i pack_quads = _mm_set1_epi32(0x00011000);
+    const __m128i order = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    size_t i = 0;
+    size_t o = 0;
+    while (len - i >= 24) {
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        const __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) {
+            break;
+        }
+
+        // Map characters to 6-bit values: the high nibble picks the offset,
+        // '/' shares its nibble with '+' and is told apart explicitly
+        const __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+        const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        str = _mm_add_epi8(str, roll);
+
+        // Pack four 6-bit values into three bytes, big-endian per group
+        str = _mm_maddubs_epi16(str, pack_pairs);
+        str = _mm_madd_epi16(str, pack_quads);
+        str = _mm_shuffle_epi8(str, order);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + o), str);
+        i += 16;
+        o += 12;
+    }
+
+    consumed = i;
+    return o;
+}
+
+inline bool cpu_has_ssse3() {
+    static const bool has = __builtin_cpu_supports("ssse3");
+    return has;
+}
+
+#endif // NNOE_LEASE_READER_SSSE3
+
+inline char* put_utf8(uint32_t code, char* out) {
+    if (code < 0x80) {
+        *out++ = static_cast<char>(code);
+    } else if (code < 0x800) {
+        *out++ = static_cast<char>(0xc0 | (code >> 6));
+        *out++ = static_cast<char>(0x80 | (code & 0x3f));
+    } else if (code < 0x10000) {
+        *out++ = static_cast<char>(0xe0 | (code >> 12));
+        *out++ = static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        *out++ = static_cast<char>(0x80 | (code & 0x3f));
+    } else {
+        *out++ = static_cast<char>(0xf0 | (code >> 18));
+        *out++ = static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+        *out++ = static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        *out++ = static_cast<char>(0x80 | (code & 0x3f));
+    }
+    return out;
+}
+
+inline bool hex4(const char* in, uint32_t& code) {
+    code = 0;
+    for (int i = 0; i < 4; ++i) {
+        const char c = in[i];
+        const uint32_t digit = c >= '0' && c <= '9' ? c - '0'
+                             : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                             : c >= 'A' && c <= 'F' ? c - 'A' + 10 : 16;
+        if (digit == 16) {
+            return false;
+        }
+        code = (code << 4) | digit;
+    }
+    return true;
+}
+
+// Decode the escapes of raw JSON string contents into out, which may alias
+// in: no escape decodes to more bytes than it takes. False on a malformed
+// escape or an unpaired surrogate.
+inline bool json_unescape(std::string_view in, char* out, size_t& size) {
+    const char* pos = in.data();
+    const char* end = pos + in.size();
+    char* o = out;
+    while (pos < end) {
+        if (*pos != '\\') {
+            *o++ = *pos++;
+            continue;
+        }
+        if (end - pos < 2) {
+            return false;
+        }
+        const char kind = pos[1];
+        pos += 2;
+        switch (kind) {
+        case '"': *o++ = '"'; break;
+        case '\\': *o++ = '\\'; break;
+        case '/': *o++ = '/'; break;
+        case 'b': *o++ = '\b'; break;
+        case 'f': *o++ = '\f'; break;
+        case 'n': *o++ = '\n'; break;
+        case 'r': *o++ = '\r'; break;
+        case 't': *o++ = '\t'; break;
+        case 'u': {
+            uint32_t code;
+            if (end - pos < 4 || !hex4(pos, code)) {
+                return false;
+            }
+            pos += 4;
+            if (code >= 0xdc00 && code <= 0xdfff) {
+                return false;
+            }
+            if (code >= 0xd800 && code <= 0xdbff) {
+                uint32_t low;
+                if (end - pos < 6 || pos[0] != '\\' || pos[1] != 'u' || !hex4(pos + 2, low) ||
+                    low < 0xdc00 || low > 0xdfff) {
+                    return false;
+                }
+                pos += 6;
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            }
+            o = put_utf8(code, o);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    size = static_cast<size_t>(o - out);
+    return true;
+}
+
+// Cursor over JSON text. Strings are returned raw (between the quotes,
+// escapes untouched); string() reports escapes so the caller can decode
+// them with json_unescape.
+class JsonCursor {
+public:
+    JsonCursor(const char* pos, const char* end) : pos_(pos), end_(end) {}
+
+    const char* pos() const { return pos_; }
+
+    void skip_ws() {
+        while (pos_ < end_ && (*pos_ == ' ' || *pos_ == '\n' || *pos_ == '\r' || *pos_ == '\t')) {
+            ++pos_;
+        }
+    }
+
+    bool consume(char c) {
+        skip_ws();
+        if (pos_ < end_ && *pos_ == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    bool string(std::string_view& out, bool* escaped = nullptr) {
+        if (!consume('"')) {
+            return false;
+        }
+        const char* start = pos_;
+        for (;;) {
+            const char* quote = static_cast<const char*>(std::memchr(pos_, '"', end_ - pos_));
+            if (!quote) {
+                return false;
+            }
+            // A quote preceded by an odd number of backslashes is escaped
+            size_t backslashes = 0;
+            while (quote - backslashes > start && quote[-1 - static_cast<ptrdiff_t>(backslashes)] == '\\') {
+                ++backslashes;
+            }
+            pos_ = quote + 1;
+            if (backslashes % 2 == 0) {
+                out = std::string_view(start, quote - start);
+                if (escaped) {
+                    *escaped = std::memchr(start, '\\', quote - start) != nullptr;
+                }
+                return true;
+            }
+        }
+    }
+
+    // Integer, bare or quoted (the gateway renders int64 as strings)
+    bool integer(int64_t& out) {
+        skip_ws();
+        const bool quoted = pos_ < end_ && *pos_ == '"';
+        if (quoted) {
+            ++pos_;
+        }
+        bool negative = false;
+        if (pos_ < end_ && *pos_ == '-') {
+            negative = true;
+            ++pos_;
+        }
+        const char* digits = pos_;
+        uint64_t value = 0;
+        while (pos_ < end_ && *pos_ >= '0' && *pos_ <= '9') {
+            value = value * 10 + static_cast<uint64_t>(*pos_ - '0');
+            ++pos_;
+        }
+        if (pos_ == digits || (quoted && !consume('"'))) {
+            return false;
+        }
+        out = negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+        return true;
+    }
+
+    bool boolean(bool& out) {
+        skip_ws();
+        if (end_ - pos_ >= 4 && std::memcmp(pos_, "true", 4) == 0) {
+            pos_ += 4;
+            out = true;
+            return true;
+        }
+        if (end_ - pos_ >= 5 && std::memcmp(pos_, "false", 5) == 0) {
+            pos_ += 5;
+            out = false;
+            return true;
+        }
+        return false;
+    }
+
+    bool skip_value() {
+        skip_ws();
+        if (pos_ >= end_) {
+            return false;
+        }
+        if (*pos_ == '"') {
+            std::string_view ignored;
+            return string(ignored);
+        }
+        if (*pos_ == '{' || *pos_ == '[') {
+            size_t depth = 0;
+            while (pos_ < end_) {
+                const char c = *pos_;
+                if (c == '"') {
+                    std::string_view ignored;
+                    if (!string(ignored)) {
+                        return false;
+                    }
+                    continue;
+                }
+                ++pos_;
+                if (c == '{' || c == '[') {
+                    ++depth;
+                } else if ((c == '}' || c == ']') && --depth == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        // Number or literal
+        const char* start = pos_;
+        while (pos_ < end_ && *pos_ != ',' && *pos_ != '}' && *pos_ != ']' &&
+               *pos_ != ' ' && *pos_ != '\n' && *pos_ != '\r' && *pos_ != '\t') {
+            ++pos_;
+        }
+        return pos_ != start;
+    }
+
+    // Walk the members of an object; member(name) must consume the value
+    template <typename Handler>
+    bool object(Handler member) {
+        if (!consume('{')) {
+            return false;
+        }
+        if (consume('}')) {
+            return true;
+        }
+        for (;;) {
+            std::string_view name;
+            if (!string(name) || !consume(':') || !member(name)) {
+                return false;
+            }
+            if (consume('}')) {
+                return true;
+            }
+            if (!consume(',')) {
+                return false;
+            }
+        }
+    }
+
+private:
+    const char* pos_;
+    const char* end_;
+};
+
+} // namespace detail
+
+// Decode base64 text; out may be the input itself. Returns the decoded
+// size, or BASE64_INVALID on malformed input.
+inline size_t base64_decode(const char* in, size_t len, char* out) {
+    size_t consumed = 0;
+    size_t written = 0;
+#ifdef NNOE_LEASE_READER_SSSE3
+    if (detail::cpu_has_ssse3()) {
+        written = detail::base64_decode_ssse3(in, len, out, consumed);
+    }
+#endif
+    const size_t tail = detail::base64_decode_scalar(in + consumed, len - consumed, out + written);
+    return tail == BASE64_INVALID ? BASE64_INVALID : written + tail;
+}
+
+// One lease value. String fields are views into the decoded buffer;
+// fields absent from the record keep their defaults.
+struct LeaseView {
+    uint32_t version = 0;
+    std::string_view ip;
+    std::string_view hwaddr;      // IPv4
+    std::string_view client_id;   // IPv4
+    std::string_view duid;        // IPv6
+    std::string_view hostname;
+    std::string_view operation;
+    std::string_view node;        // writing server, when it identifies itself
+    int32_t type = -1;            // IPv6 lease type (0 NA, 1 TA, 2 PD)
+    uint32_t iaid = 0;
+    uint32_t prefix_len = 128;
+    uint32_t subnet_id = 0;
+    uint32_t state = 0;
+    int64_t cltt = 0;
+    int64_t valid_lft = 0;
+    int64_t preferred_lft = 0;
+    int64_t expires_at = 0;
+    int64_t timestamp = 0;
+    uint64_t seq = 0;             // per-address event sequence
+    bool escaped = false;         // a string field is still raw JSON (no buffer given)
+
+    bool is_v6() const { return type >= 0 || !duid.empty(); }
+};
+
+enum LeaseParseStatus {
+    LEASE_OK,
+    LEASE_MALFORMED,
+    LEASE_UNSUPPORTED_VERSION  // written by a newer schema than this reader
+};
+
+// buffer, if given, holds value.size() bytes (value's own storage will do);
+// string fields with JSON escapes are decoded into it at their offset
+inline LeaseParseStatus parse_lease(std::string_view value, LeaseView& lease,
+                                    char* buffer = nullptr) {
+    lease = LeaseView();
+    detail::JsonCursor cursor(value.data(), value.data() + value.size());
+
+    auto text = [&](std::string_view& field) {
+        bool escaped = false;
+        if (!cursor.string(field, &escaped)) {
+            return false;
+        }
+        if (!escaped) {
+            return true;
+        }
+        if (!buffer) {
+            lease.escaped = true;
+            return true;
+        }
+        char* out = buffer + (field.data() - value.data());
+        size_t size = 0;
+        if (!detail::json_unescape(field, out, size)) {
+            return false;
+        }
+        field = std::string_view(out, size);
+        return true;
+    };
+
+    const bool ok = cursor.object([&](std::string_view name) {
+        int64_t number = 0;
+        bool parsed;
+        switch (name.empty() ? '\0' : name[0]) {
+        case 'v':
+            if (name == "v") {
+                parsed = cursor.integer(number);
+                lease.version = static_cast<uint32_t>(number);
+                return parsed;
+            }
+            if (name == "valid_lft") {
+                return cursor.integer(lease.valid_lft);
+            }
+            break;
+        case 'i':
+            if (name == "ip") {
+                return text(lease.ip);
+            }
+            if (name == "iaid") {
+                parsed = cursor.integer(number);
+                lease.iaid = static_cast<uint32_t>(number);
+                return parsed;
+            }
+            break;
+        case 'h':
+            if (name == "hwaddr") {
+                return text(lease.hwaddr);
+            }
+            if (name == "hostname") {
+                return text(lease.hostname);
+            }
+            break;
+        case 'c':
+            if (name == "cltt") {
+                return cursor.integer(lease.cltt);
+            }
+            if (name == "client_id") {
+                return text(lease.client_id);
+            }
+            break;
+        case 'd':
+            if (name == "duid") {
+                return text(lease.duid);
+            }
+            break;
+        case 'e':
+            if (name == "expires_at") {
+                return cursor.integer(lease.expires_at);
+            }
+            break;
+        case 'n':
+            if (name == "node") {
+                return text(lease.node);
+            }
+            break;
+        case 'o':
+            if (name == "operation") {
+                return text(lease.operation);
+            }
+            break;
+        case 'p':
+            if (name == "preferred_lft") {
+                return cursor.integer(lease.preferred_lft);
+            }
+            if (name == "prefix_len") {
+                parsed = cursor.integer(number);
+                lease.prefix_len = static_cast<uint32_t>(number);
+                return parsed;
+            }
+            break;
+        case 's':
+            if (name == "state") {
+                parsed = cursor.integer(number);
+                lease.state = static_cast<uint32_t>(number);
+                return parsed;
+            }
+            if (name == "seq") {
+                parsed = cursor.integer(number);
+                lease.seq = static_cast<uint64_t>(number);
+                return parsed;
+            }
+            if (name == "subnet_id") {
+                parsed = cursor.integer(number);
+                lease.subnet_id = static_cast<uint32_t>(number);
+                return parsed;
+            }
+            break;
+        case 't':
+            if (name == "type") {
+                parsed = cursor.integer(number);
+                lease.type = static_cast<int32_t>(number);
+                return parsed;
+            }
+            if (name == "timestamp") {
+                return cursor.integer(lease.timestamp);
+            }
+            break;
+        }
+        return cursor.skip_value();
+    });
+
+    if (!ok || lease.ip.empty()) {
+        return LEASE_MALFORMED;
+    }
+    if (lease.version > LEASE_SCHEMA_VERSION) {
+        return LEASE_UNSUPPORTED_VERSION;
+    }
+    return LEASE_OK;
+}
+
+struct KeyValueView {
+    std::string_view key;
+    std::string_view value;   // empty for keys_only responses
+    int64_t mod_revision = 0;
+};
+
+// Reader for a /v3/kv/range response body. The constructor indexes the
+// top-level fields; next() then walks the kvs array, base64-decoding each
+// key and value in place. The buffer is modified and must outlive the views.
+class RangeResponseReader {
+public:
+    RangeResponseReader(char* data, size_t size)
+        : data_(data), end_(data + size), kvs_(nullptr), first_(true),
+          valid_(false), more_(false), revision_(0) {
+        detail::JsonCursor cursor(data_, end_);
+        valid_ = cursor.object([&](std::string_view name) {
+            if (name == "header") {
+                return cursor.object([&](std::string_view field) {
+                    if (field == "revision") {
+                        return cursor.integer(revision_);
+                    }
+                    return cursor.skip_value();
+                });
+            }
+            if (name == "kvs") {
+                cursor.skip_ws();
+                kvs_ = cursor.pos();
+                return cursor.skip_value();
+            }
+            if (name == "more") {
+                return cursor.boolean(more_);
+            }
+            return cursor.skip_value();
+        });
+    }
+
+    // False if the response could not be parsed
+    bool valid() const { return valid_; }
+
+    // Revision the range was served at
+    int64_t revision() const { return revision_; }
+
+    // The range was cut by its limit; continue after the last key
+    bool more() const { return more_; }
+
+    // Next entry, false at the end of the array or on malformed input
+    bool next(KeyValueView& kv) {
+        if (!valid_ || !kvs_) {
+            return false;
+        }
+
+        detail::JsonCursor cursor(kvs_, end_);
+        if (first_ && !cursor.consume('[')) {
+            valid_ = false;
+            return false;
+        }
+        if (cursor.consume(']')) {
+            kvs_ = nullptr;
+            return false;
+        }
+        if (!first_ && !cursor.consume(',')) {
+            valid_ = false;
+            return false;
+        }
+        first_ = false;
+
+        kv = KeyValueView();
+        const bool ok = cursor.object([&](std::string_view name) {
+            if (name == "key") {
+                return decoded_string(cursor, kv.key);
+            }
+            if (name == "value") {
+                return decoded_string(cursor, kv.value);
+            }
+            if (name == "mod_revision") {
+                return cursor.integer(kv.mod_revision);
+            }
+            return cursor.skip_value();
+        });
+
+        if (!ok) {
+            valid_ = false;
+            return false;
+        }
+        kvs_ = cursor.pos();
+        return true;
+    }
+
+private:
+    // Read a base64 string and decode it over itself
+    bool decoded_string(detail::JsonCursor& cursor, std::string_view& out) {
+        std::string_view text;
+        if (!cursor.string(text)) {
+            return false;
+        }
+        char* start = data_ + (text.data() - data_);
+        const size_t size = base64_decode(start, text.size(), start);
+        if (size == BASE64_INVALID) {
+            return false;
+        }
+        out = std::string_view(start, size);
+        return true;
+    }
+
+    char* data_;
+    const char* end_;
+    const char* kvs_;   // read position in the kvs array, null when done
+    bool first_;
+    bool valid_;
+    bool more_;
+    int64_t revision_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_LEASE_READER_H
@@ -0,0 +1,70 @@
+/**
+ * Utilization-adaptive lease lifetimes for the NNOE Kea hook
+ */
+
+#include "adaptive_lifetime.h"
+
+#include <algorithm>
+
+namespace nnoe {
+
+namespace {
+
+const uint32_t INFINITE_LIFETIME = 0xffffffff;
+
+} // namespace
+
+AdaptiveLifetime::AdaptiveLifetime(const AdaptiveLifetimeConfig& config)
+    : config_(config), lengthened_(0), shortened_(0), unchanged_(0), untracked_(0) {
+    config_.high_percent = std::min<uint32_t>(std::max<uint32_t>(config_.high_percent, 1), 100);
+    config_.low_percent = std::min(config_.low_percent, config_.high_percent - 1);
+}
+
+bool AdaptiveLifetime::adapt(uint32_t& valid, uint32_t& preferred, uint64_t assigned,
+                             uint64_t total) {
+    if (valid == 0 || valid == INFINITE_LIFETIME || total == 0) {
+        unchanged_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    const uint64_t longest = config_.max_valid ? config_.max_valid : valid;
+    const uint64_t shortest = std::min<uint64_t>(config_.min_valid ? config_.min_valid : valid,
+                                                 longest);
+
+    // Utilization in ten-thousandths, to interpolate without floating point
+    const uint64_t used = std::min<uint64_t>(assigned, total) * 10000 / total;
+    const uint64_t low = static_cast<uint64_t>(config_.low_percent) * 100;
+    const uint64_t high = static_cast<uint64_t>(config_.high_percent) * 100;
+    uint64_t target;
+    if (used <= low) {
+        target = longest;
+    } else if (used >= high) {
+        target = shortest;
+    } else {
+        target = longest - (longest - shortest) * (used - low) / (high - low);
+    }
+
+    const uint32_t adapted = static_cast<uint32_t>(std::max<uint64_t>(target, 1));
+    if (adapted == valid) {
+        unchanged_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    (adapted > valid ? lengthened_ : shortened_).fetch_add(1, std::memory_order_relaxed);
+    if (preferred && preferred != INFINITE_LIFETIME) {
+        preferred = static_cast<uint32_t>(
+            std::min<uint64_t>(static_cast<uint64_t>(preferred) * adapted / valid, adapted));
+    }
+    valid = adapted;
+    return true;
+}
+
+AdaptiveLifetimeStats AdaptiveLifetime::stats() const {
+    AdaptiveLifetimeStats stats;
+    stats.lengthened = lengthened_.load(std::memory_order_relaxed);
+    stats.shortened = shortened_.load(std::memory_order_relaxed);
+    stats.unchanged = unchanged_.load(std::memory_order_relaxed);
+    stats.untracked = untracked_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+} // namespace nnoe
@@ -0,0 +1,70 @@
+/**
+ * Utilization-adaptive lease lifetimes for the NNOE Kea hook
+ *
+ * Short lease times only pay off where addresses are scarce, but Kea
+ * configures them per subnet or globally, so large and mostly empty pools
+ * renew as often as crowded ones, and every renewal is an etcd write. The
+ * lease selection and renewal callouts hand each lease to this policy with
+ * the utilization of its pool, as tracked by the lease index, and it sets
+ * the valid lifetime between two bounds:
+ *
+ *   - at or below low_percent utilization, max_valid;
+ *   - at or above high_percent, min_valid;
+ *   - in between, linearly from one to the other.
+ *
+ * A bound left at 0 is the lifetime Kea chose for the lease. The preferred
+ * lifetime of an IPv6 lease is scaled with the valid lifetime. Infinite
+ * lifetimes are left alone.
+ *
+ * Kea independent and lock-free.
+ */
+
+#ifndef NNOE_ADAPTIVE_LIFETIME_H
+#define NNOE_ADAPTIVE_LIFETIME_H
+
+#include <atomic>
+#include <cstdint>
+
+namespace nnoe {
+
+struct AdaptiveLifetimeConfig {
+    uint32_t min_valid = 0;       // seconds near exhaustion; 0: as configured
+    uint32_t max_valid = 0;       // seconds with headroom; 0: as configured
+    uint32_t low_percent = 50;
+    uint32_t high_percent = 90;
+};
+
+struct AdaptiveLifetimeStats {
+    uint64_t lengthened = 0;
+    uint64_t shortened = 0;
+    uint64_t unchanged = 0;
+    uint64_t untracked = 0;       // no pool known for the lease
+};
+
+class AdaptiveLifetime {
+public:
+    explicit AdaptiveLifetime(const AdaptiveLifetimeConfig& config);
+
+    // Set valid (and a non-zero preferred) for a lease in a pool with
+    // assigned of total addresses or prefixes; true if changed
+    bool adapt(uint32_t& valid, uint32_t& preferred, uint64_t assigned, uint64_t total);
+
+    // A lease outside every tracked pool keeps its lifetimes
+    void untracked() { untracked_.fetch_add(1, std::memory_order_relaxed); }
+
+    AdaptiveLifetimeStats stats() const;
+
+    const AdaptiveLifetimeConfig& config() const { return config_; }
+
+private:
+    AdaptiveLifetimeConfig config_;
+
+    std::atomic<uint64_t> lengthened_;
+    std::atomic<uint64_t> shortened_;
+    std::atomic<uint64_t> unchanged_;
+    std::atomic<uint64_t> untracked_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_ADAPTIVE_LIFETIME_H
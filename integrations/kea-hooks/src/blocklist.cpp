@@ -0,0 +1,204 @@
+/**
+ * Client blocklist for the NNOE Kea hook
+ */
+
+#include "blocklist.h"
+#include "hash.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace nnoe {
+
+namespace {
+
+// Bloom filter sizing: ~16 bits per entry, 4 probes (<0.3% false positives)
+const size_t BLOOM_BITS_PER_ENTRY = 16;
+const unsigned BLOOM_PROBES = 4;
+
+inline int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Accepts "aa:bb:cc", "aa-bb-cc" and "aabbcc"
+bool parse_hex_bytes(const std::string& text, std::vector<uint8_t>& out) {
+    out.clear();
+    int high = -1;
+    for (char c : text) {
+        if (c == ':' || c == '-') {
+            continue;
+        }
+        int v = hex_value(c);
+        if (v < 0) {
+            return false;
+        }
+        if (high < 0) {
+            high = v;
+        } else {
+            out.push_back(static_cast<uint8_t>((high << 4) | v));
+            high = -1;
+        }
+    }
+    return high < 0 && !out.empty();
+}
+
+} // namespace
+
+ClientBlocklist::ClientBlocklist(const std::shared_ptr<WatchManager>& watches,
+                                 const std::string& prefix)
+    : watches_(watches), prefix_(prefix), subscription_(0),
+      snapshot_(std::make_shared<Snapshot>()) {
+    // Normalise so that "<prefix>/" is the watched range
+    while (!prefix_.empty() && prefix_.back() == '/') {
+        prefix_.pop_back();
+    }
+    prefix_ += "/";
+}
+
+ClientBlocklist::~ClientBlocklist() {
+    stop();
+}
+
+void ClientBlocklist::start() {
+    if (!subscription_) {
+        subscription_ = watches_->subscribe(prefix_, this);
+    }
+}
+
+void ClientBlocklist::stop() {
+    if (subscription_) {
+        watches_->unsubscribe(subscription_);
+        subscription_ = 0;
+    }
+}
+
+uint64_t ClientBlocklist::fingerprint(IdentifierKind kind, const uint8_t* data, size_t len) {
+    return client_fingerprint(static_cast<uint8_t>(kind), data, len);
+}
+
+bool ClientBlocklist::contains(IdentifierKind kind, const uint8_t* data, size_t len) const {
+    // Copied under a pooled lock, shared with other lookups and publish()
+    std::shared_ptr<const Snapshot> snap = std::atomic_load(&snapshot_);
+    if (snap->fingerprints_.empty() || len == 0) {
+        return false;
+    }
+
+    const uint64_t fp = fingerprint(kind, data, len);
+    const uint64_t step = ((fp >> 32) | (fp << 32)) | 1;
+    uint64_t probe = fp;
+    for (unsigned i = 0; i < BLOOM_PROBES; ++i, probe += step) {
+        const uint64_t bit = probe & snap->bloom_mask_;
+        if (!(snap->bloom_[bit >> 6] & (1ULL << (bit & 63)))) {
+            return false;
+        }
+    }
+
+    return std::binary_search(snap->fingerprints_.begin(), snap->fingerprints_.end(), fp);
+}
+
+size_t ClientBlocklist::size() const {
+    return std::atomic_load(&snapshot_)->fingerprints_.size();
+}
+
+bool ClientBlocklist::parse_key(const std::string& key, uint64_t& fp) const {
+    if (key.compare(0, prefix_.size(), prefix_) != 0) {
+        return false;
+    }
+
+    const size_t slash = key.find('/', prefix_.size());
+    if (slash == std::string::npos) {
+        return false;
+    }
+
+    const std::string kind_text = key.substr(prefix_.size(), slash - prefix_.size());
+    IdentifierKind kind;
+    if (kind_text == "hwaddr") {
+        kind = HWADDR;
+    } else if (kind_text == "client-id") {
+        kind = CLIENT_ID;
+    } else if (kind_text == "duid") {
+        kind = DUID;
+    } else {
+        return false;
+    }
+
+    std::vector<uint8_t> bytes;
+    if (!parse_hex_bytes(key.substr(slash + 1), bytes)) {
+        return false;
+    }
+
+    fp = fingerprint(kind, bytes.data(), bytes.size());
+    return true;
+}
+
+void ClientBlocklist::publish() {
+    std::shared_ptr<Snapshot> snap = std::make_shared<Snapshot>();
+
+    snap->fingerprints_.reserve(entries_.size());
+    for (const auto& entry : entries_) {
+        snap->fingerprints_.push_back(entry.second);
+    }
+    std::sort(snap->fingerprints_.begin(), snap->fingerprints_.end());
+    snap->fingerprints_.erase(std::unique(snap->fingerprints_.begin(), snap->fingerprints_.end()),
+                              snap->fingerprints_.end());
+
+    // Power-of-two bit count so probes reduce with a mask
+    size_t bits = 64;
+    while (bits < snap->fingerprints_.size() * BLOOM_BITS_PER_ENTRY) {
+        bits <<= 1;
+    }
+    snap->bloom_.assign(bits / 64, 0);
+    snap->bloom_mask_ = bits - 1;
+
+    for (uint64_t fp : snap->fingerprints_) {
+        const uint64_t step = ((fp >> 32) | (fp << 32)) | 1;
+        uint64_t probe = fp;
+        for (unsigned i = 0; i < BLOOM_PROBES; ++i, probe += step) {
+            const uint64_t bit = probe & snap->bloom_mask_;
+            snap->bloom_[bit >> 6] |= 1ULL << (bit & 63);
+        }
+    }
+
+    // The only step lookups can wait on; the old snapshot is freed by its
+    // last reader
+    std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>(snap));
+}
+
+bool ClientBlocklist::reload(const EtcdClient& client, int64_t& revision) {
+    std::vector<EtcdKeyValue> kvs;
+    if (!client.range_prefix(prefix_, kvs, revision)) {
+        return false;
+    }
+
+    entries_.clear();
+    for (const auto& kv : kvs) {
+        uint64_t fp;
+        if (parse_key(kv.key, fp)) {
+            entries_[kv.key] = fp;
+        }
+    }
+    publish();
+
+    std::cerr << "Kea etcd hook: loaded " << entries_.size()
+              << " blocklist entries from " << prefix_ << std::endl;
+    return true;
+}
+
+void ClientBlocklist::apply(const std::vector<EtcdWatchEvent>& events) {
+    for (const auto& event : events) {
+        if (event.type == EtcdWatchEvent::DELETE) {
+            entries_.erase(event.kv.key);
+        } else {
+            uint64_t fp;
+            if (parse_key(event.kv.key, fp)) {
+                entries_[event.kv.key] = fp;
+            }
+        }
+    }
+    publish();
+}
+
+} // namespace nnoe
@@ -0,0 +1,85 @@
+/**
+ * Client blocklist for the NNOE Kea hook
+ *
+ * Mirrors a blocklist prefix in etcd (hardware addresses, DHCPv4 client
+ * identifiers and DHCPv6 DUIDs) into an immutable in-memory snapshot that
+ * the packet callouts query without any network lookup. The prefix is
+ * followed through the shared watch manager, which delivers every change on
+ * the blocklist's dispatch thread; a fresh snapshot is built after each
+ * and published with an atomic shared_ptr store, which readers pick up with
+ * an atomic load (RCU style). Lookups never wait for a snapshot to be
+ * built, but the atomic shared_ptr functions are not lock-free in
+ * libstdc++: every load and store takes a lock from a small shared pool
+ * for the pointer copy or swap, so lookups briefly serialize on it with
+ * each other and with the store.
+ *
+ * Key layout under the prefix:
+ *   <prefix>/hwaddr/<aa:bb:cc:dd:ee:ff>
+ *   <prefix>/client-id/<01:aa:bb:...>
+ *   <prefix>/duid/<00:01:00:01:...>
+ */
+
+#ifndef NNOE_BLOCKLIST_H
+#define NNOE_BLOCKLIST_H
+
+#include "etcd_client.h"
+#include "watch_manager.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nnoe {
+
+class ClientBlocklist : public WatchSubscriber {
+public:
+    enum IdentifierKind : uint8_t {
+        HWADDR = 1,
+        CLIENT_ID = 2,
+        DUID = 3
+    };
+
+    ClientBlocklist(const std::shared_ptr<WatchManager>& watches, const std::string& prefix);
+    ~ClientBlocklist();
+
+    void start();
+    void stop();
+
+    // Packet path lookup: bloom filter first, then binary search
+    bool contains(IdentifierKind kind, const uint8_t* data, size_t len) const;
+
+    size_t size() const;
+
+    // WatchSubscriber
+    bool reload(const EtcdClient& client, int64_t& revision) override;
+    void apply(const std::vector<EtcdWatchEvent>& events) override;
+
+private:
+    // Immutable once published
+    struct Snapshot {
+        std::vector<uint64_t> bloom_;
+        uint64_t bloom_mask_ = 0;
+        std::vector<uint64_t> fingerprints_; // sorted
+    };
+
+    static uint64_t fingerprint(IdentifierKind kind, const uint8_t* data, size_t len);
+    bool parse_key(const std::string& key, uint64_t& fp) const;
+
+    void publish();
+
+    std::shared_ptr<WatchManager> watches_;
+    std::string prefix_;
+    uint64_t subscription_;
+
+    // Owned by the dispatch thread
+    std::unordered_map<std::string, uint64_t> entries_;
+
+    std::shared_ptr<const Snapshot> snapshot_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_BLOCKLIST_H
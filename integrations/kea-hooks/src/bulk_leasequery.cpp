@@ -0,0 +1,801 @@
+/**
+ * Bulk leasequery service for the NNOE Kea hook
+ */
+
+#include "bulk_leasequery.h"
+#include "text_format.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+namespace nnoe {
+
+namespace {
+
+// DHCPv4 leasequery messages (RFC 4388, RFC 6926)
+const uint8_t DHCPLEASEQUERY = 10;
+const uint8_t DHCPLEASEUNKNOWN = 12;
+const uint8_t DHCPLEASEACTIVE = 13;
+const uint8_t DHCPBULKLEASEQUERY = 14;
+const uint8_t DHCPLEASEQUERYDONE = 15;
+const uint8_t DHCPLEASEQUERYSTATUS = 17;
+
+// DHCPv4 options
+const uint8_t DHO_PAD = 0;
+const uint8_t DHO_LEASE_TIME = 51;
+const uint8_t DHO_MESSAGE_TYPE = 53;
+const uint8_t DHO_CLIENT_ID = 61;
+const uint8_t DHO_RELAY_AGENT_INFO = 82;
+const uint8_t DHO_CLIENT_LAST_TRANSACTION_TIME = 91;
+const uint8_t DHO_ASSOCIATED_IP = 92;
+const uint8_t DHO_STATUS_CODE = 151;
+const uint8_t DHO_BASE_TIME = 152;
+const uint8_t DHO_START_TIME_OF_STATE = 153;
+const uint8_t DHO_DHCP_STATE = 156;
+const uint8_t DHO_DATA_SOURCE = 157;
+const uint8_t DHO_END = 255;
+
+const uint8_t RAI_REMOTE_ID = 2;
+const uint8_t RAI_RELAY_ID = 12;
+
+// RFC 6926 status codes, dhcp-state values and data-source flags
+const uint8_t STATUS4_MALFORMED_QUERY = 3;
+const uint8_t STATUS4_NOT_ALLOWED = 4;
+const uint8_t STATE4_ACTIVE = 2;
+const uint8_t STATE4_ABANDONED = 5;
+const uint8_t DATA_SOURCE_REMOTE = 0x01;
+
+// Fixed BOOTP header, then the magic cookie
+const size_t DHCP4_HEADER = 236;
+const uint8_t DHCP4_COOKIE[4] = {99, 130, 83, 99};
+
+// DHCPv6 leasequery messages (RFC 5007, RFC 5460)
+const uint8_t LEASEQUERY = 14;
+const uint8_t LEASEQUERY_REPLY = 15;
+const uint8_t LEASEQUERY_DONE = 16;
+const uint8_t LEASEQUERY_DATA = 17;
+
+// DHCPv6 options
+const uint16_t D6O_CLIENTID = 1;
+const uint16_t D6O_SERVERID = 2;
+const uint16_t D6O_IAADDR = 5;
+const uint16_t D6O_STATUS_CODE = 13;
+const uint16_t D6O_IAPREFIX = 26;
+const uint16_t D6O_REMOTE_ID = 37;
+const uint16_t D6O_LQ_QUERY = 44;
+const uint16_t D6O_CLIENT_DATA = 45;
+const uint16_t D6O_CLT_TIME = 46;
+const uint16_t D6O_RELAY_ID = 53;
+
+const uint8_t QUERY_BY_ADDRESS = 1;
+const uint8_t QUERY_BY_CLIENTID = 2;
+const uint8_t QUERY_BY_RELAY_ID = 3;
+const uint8_t QUERY_BY_REMOTE_ID = 5;
+
+const uint16_t STATUS6_UNKNOWN_QUERY_TYPE = 7;
+const uint16_t STATUS6_MALFORMED_QUERY = 8;
+
+// Bindings per client data option, well within its 16-bit length
+const size_t MAX_CLIENT_BINDINGS = 1024;
+
+// Replies go out whenever this much is encoded, and at the end of a query
+const size_t CHUNK_BYTES = 64 * 1024;
+
+void put16(std::string& out, uint16_t value) {
+    out.push_back(static_cast<char>(value >> 8));
+    out.push_back(static_cast<char>(value));
+}
+
+void put32(std::string& out, uint32_t value) {
+    put16(out, static_cast<uint16_t>(value >> 16));
+    put16(out, static_cast<uint16_t>(value));
+}
+
+uint32_t seconds(int64_t value) {
+    return value <= 0 ? 0 : value >= 0xffffffffLL ? 0xffffffffU : static_cast<uint32_t>(value);
+}
+
+uint16_t get16(const std::string& data, size_t offset) {
+    return static_cast<uint16_t>(static_cast<uint8_t>(data[offset]) << 8 |
+                                 static_cast<uint8_t>(data[offset + 1]));
+}
+
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+// Bytes of a colon-separated hex identifier as the records write it; empty
+// if it is not one
+std::string id_bytes(const std::string& text) {
+    std::string out;
+    for (size_t i = 0; i + 1 < text.size(); i += 3) {
+        const int high = hex_digit(text[i]);
+        const int low = hex_digit(text[i + 1]);
+        if (high < 0 || low < 0) {
+            return std::string();
+        }
+        out.push_back(static_cast<char>(high << 4 | low));
+    }
+    return out;
+}
+
+std::string id_text(const std::string& bytes) {
+    return hex_colon_text(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size());
+}
+
+void option4(std::string& out, uint8_t code, const std::string& data) {
+    out.push_back(static_cast<char>(code));
+    out.push_back(static_cast<char>(std::min<size_t>(data.size(), 255)));
+    out.append(data, 0, 255);
+}
+
+void option4_u32(std::string& out, uint8_t code, uint32_t value) {
+    std::string data;
+    put32(data, value);
+    option4(out, code, data);
+}
+
+void option6(std::string& out, uint16_t code, const std::string& data) {
+    put16(out, code);
+    put16(out, static_cast<uint16_t>(data.size()));
+    out += data;
+}
+
+// Options of a DHCPv6 message or option body, in order
+std::vector<std::pair<uint16_t, std::string>> options6(const std::string& data, size_t offset) {
+    std::vector<std::pair<uint16_t, std::string>> out;
+    while (offset + 4 <= data.size()) {
+        const uint16_t code = get16(data, offset);
+        const size_t length = get16(data, offset + 2);
+        if (offset + 4 + length > data.size()) {
+            break;
+        }
+        out.emplace_back(code, data.substr(offset + 4, length));
+        offset += 4 + length;
+    }
+    return out;
+}
+
+const std::string* find6(const std::vector<std::pair<uint16_t, std::string>>& options,
+                         uint16_t code) {
+    for (const auto& option : options) {
+        if (option.first == code) {
+            return &option.second;
+        }
+    }
+    return nullptr;
+}
+
+struct Query4 {
+    uint8_t type = 0;
+    std::string header;         // the query's BOOTP header
+    std::string client_id;
+    std::string relay_id;
+    std::string remote_id;
+};
+
+bool parse_query4(const std::string& data, Query4& query) {
+    if (data.size() < DHCP4_HEADER + 4 || data[0] != 1 ||
+        std::memcmp(data.data() + DHCP4_HEADER, DHCP4_COOKIE, 4) != 0) {
+        return false;
+    }
+    query.header = data.substr(0, DHCP4_HEADER);
+    size_t i = DHCP4_HEADER + 4;
+    while (i < data.size()) {
+        const uint8_t code = static_cast<uint8_t>(data[i]);
+        if (code == DHO_END) {
+            break;
+        }
+        if (code == DHO_PAD) {
+            ++i;
+            continue;
+        }
+        if (i + 2 > data.size() || i + 2 + static_cast<uint8_t>(data[i + 1]) > data.size()) {
+            return false;
+        }
+        const std::string value = data.substr(i + 2, static_cast<uint8_t>(data[i + 1]));
+        if (code == DHO_MESSAGE_TYPE && !value.empty()) {
+            query.type = static_cast<uint8_t>(value[0]);
+        } else if (code == DHO_CLIENT_ID) {
+            query.client_id = value;
+        } else if (code == DHO_RELAY_AGENT_INFO) {
+            size_t j = 0;
+            while (j + 2 <= value.size()) {
+                const size_t length = static_cast<uint8_t>(value[j + 1]);
+                if (j + 2 + length > value.size()) {
+                    break;
+                }
+                const std::string sub = value.substr(j + 2, length);
+                if (value[j] == RAI_RELAY_ID) {
+                    query.relay_id = sub;
+                } else if (value[j] == RAI_REMOTE_ID) {
+                    query.remote_id = sub;
+                }
+                j += 2 + sub.size();
+            }
+        }
+        i += 2 + value.size();
+    }
+    return query.type != 0;
+}
+
+} // namespace
+
+// Framed messages for one connection, sent in chunks
+class BulkLeaseQuery::FrameWriter {
+public:
+    explicit FrameWriter(int fd) : fd_(fd), start_(0), ok_(true) {}
+
+    // Start a message; append its bytes to the returned buffer until end()
+    std::string& begin() {
+        start_ = buffer_.size();
+        buffer_.append(2, '\0');
+        return buffer_;
+    }
+
+    void end() {
+        const size_t length = buffer_.size() - start_ - 2;
+        buffer_[start_] = static_cast<char>(length >> 8);
+        buffer_[start_ + 1] = static_cast<char>(length);
+        if (buffer_.size() >= CHUNK_BYTES) {
+            flush();
+        }
+    }
+
+    bool flush() {
+        size_t sent = 0;
+        while (ok_ && sent < buffer_.size()) {
+            const ssize_t n = send(fd_, buffer_.data() + sent, buffer_.size() - sent,
+                                   MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                ok_ = false;
+            } else {
+                sent += static_cast<size_t>(n);
+            }
+        }
+        buffer_.clear();
+        return ok_;
+    }
+
+private:
+    int fd_;
+    std::string buffer_;
+    size_t start_;
+    bool ok_;
+};
+
+BulkLeaseQuery::BulkLeaseQuery(const LeaseQueryConfig& config, const LeaseQueryIndex& index)
+    : config_(config), index_(index), server_id_(id_bytes(config.server_id)), listen_fd_(-1),
+      wake_fds_{-1, -1}, port_(0), running_(false), stop_(false), accepted_(0), refused_(0),
+      queries_(0), malformed_(0), leases_(0) {
+}
+
+BulkLeaseQuery::~BulkLeaseQuery() {
+    stop();
+}
+
+bool BulkLeaseQuery::start() {
+    if (thread_.joinable()) {
+        return true;
+    }
+
+    sockaddr_storage address;
+    std::memset(&address, 0, sizeof(address));
+    socklen_t length = 0;
+    auto* v4 = reinterpret_cast<sockaddr_in*>(&address);
+    auto* v6 = reinterpret_cast<sockaddr_in6*>(&address);
+    if (inet_pton(AF_INET, config_.address.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(config_.port);
+        length = sizeof(sockaddr_in);
+    } else if (inet_pton(AF_INET6, config_.address.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(config_.port);
+        length = sizeof(sockaddr_in6);
+    } else {
+        std::cerr << "Kea etcd hook: invalid leasequery address '" << config_.address << "'"
+                  << std::endl;
+        return false;
+    }
+
+    listen_fd_ = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const int on = 1;
+    if (listen_fd_ < 0 || pipe2(wake_fds_, O_CLOEXEC | O_NONBLOCK) != 0 ||
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        (address.ss_family == AF_INET6 &&
+         setsockopt(listen_fd_, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) != 0) ||
+        bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), length) != 0 ||
+        listen(listen_fd_, 16) != 0 ||
+        getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        std::cerr << "Kea etcd hook: leasequery cannot listen on " << config_.address
+                  << " port " << config_.port << ": " << std::strerror(errno) << std::endl;
+        for (int* fd : {&listen_fd_, &wake_fds_[0], &wake_fds_[1]}) {
+            if (*fd >= 0) {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+        return false;
+    }
+    port_ = ntohs(address.ss_family == AF_INET ? v4->sin_port : v6->sin6_port);
+
+    stop_ = false;
+    running_ = true;
+    thread_ = std::thread(&BulkLeaseQuery::run, this);
+    std::cerr << "Kea etcd hook: bulk leasequery (DHCPv" << config_.family << ") on "
+              << config_.address << " port " << port_ << std::endl;
+    return true;
+}
+
+void BulkLeaseQuery::stop() {
+    if (!thread_.joinable()) {
+        return;
+    }
+    stop_ = true;
+    const char wake = 1;
+    if (write(wake_fds_[1], &wake, 1) < 0) {
+        // The acceptor polls with a timeout anyway
+    }
+    thread_.join();
+    running_ = false;
+
+    for (int* fd : {&listen_fd_, &wake_fds_[0], &wake_fds_[1]}) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+void BulkLeaseQuery::run() {
+    while (!stop_) {
+        pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {wake_fds_[0], POLLIN, 0}};
+        const int ready = poll(fds, 2, 1000);
+        reap(false);
+        if (ready > 0 && (fds[0].revents & POLLIN) && !stop_) {
+            accept_one();
+        }
+    }
+    reap(true);
+}
+
+void BulkLeaseQuery::accept_one() {
+    sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+    const int fd = accept4(listen_fd_, reinterpret_cast<sockaddr*>(&peer), &length, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    char text[INET6_ADDRSTRLEN] = "";
+    if (peer.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(&peer)->sin_addr, text, sizeof(text));
+    } else {
+        inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(&peer)->sin6_addr, text,
+                  sizeof(text));
+    }
+    if (!allowed(text)) {
+        refused_++;
+        std::cerr << "Kea etcd hook: leasequery from " << text << " not allowed" << std::endl;
+        close(fd);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (connections_.size() >= config_.max_connections) {
+        refused_++;
+        close(fd);
+        return;
+    }
+    accepted_++;
+
+    // A requestor that stops reading cannot hold a connection forever
+    timeval timeout;
+    timeout.tv_sec = config_.idle_timeout_s;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::unique_ptr<Connection> connection(new Connection());
+    connection->fd = fd;
+    connection->thread = std::thread(&BulkLeaseQuery::serve, this, connection.get());
+    connections_.push_back(std::move(connection));
+}
+
+// Join finished connections, or all of them
+void BulkLeaseQuery::reap(bool all) {
+    std::vector<std::unique_ptr<Connection>> finished;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = connections_.begin(); it != connections_.end();) {
+            if (all) {
+                shutdown((*it)->fd, SHUT_RDWR);
+            }
+            if (all || (*it)->done) {
+                finished.push_back(std::move(*it));
+                it = connections_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (auto& connection : finished) {
+        connection->thread.join();
+        close(connection->fd);
+    }
+}
+
+bool BulkLeaseQuery::allowed(const std::string& peer) const {
+    return config_.requestors.empty() ||
+           std::find(config_.requestors.begin(), config_.requestors.end(), peer) !=
+               config_.requestors.end();
+}
+
+void BulkLeaseQuery::serve(Connection* connection) {
+    FrameWriter writer(connection->fd);
+    std::string frame;
+    while (!stop_ && read_frame(connection->fd, frame)) {
+        if (frame.empty()) {
+            continue;
+        }
+        queries_++;
+        const bool ok = config_.family == 6 ? answer6(frame, writer) : answer4(frame, writer);
+        if (!ok) {
+            break;
+        }
+    }
+    connection->done = true;
+}
+
+// Next length-prefixed message; false on close, error, idle timeout or stop
+bool BulkLeaseQuery::read_frame(int fd, std::string& frame) {
+    auto read_exact = [this, fd](char* out, size_t length) {
+        size_t got = 0;
+        uint32_t idle_ms = 0;
+        while (got < length) {
+            if (stop_) {
+                return false;
+            }
+            pollfd pfd = {fd, POLLIN, 0};
+            const int ready = poll(&pfd, 1, 1000);
+            if (ready < 0 && errno != EINTR) {
+                return false;
+            }
+            if (ready <= 0) {
+                idle_ms += ready == 0 ? 1000 : 0;
+                if (idle_ms >= config_.idle_timeout_s * 1000) {
+                    return false;
+                }
+                continue;
+            }
+            const ssize_t n = recv(fd, out + got, length - got, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            got += static_cast<size_t>(n);
+            idle_ms = 0;
+        }
+        return true;
+    };
+
+    char prefix[2];
+    if (!read_exact(prefix, 2)) {
+        return false;
+    }
+    frame.assign(static_cast<size_t>(static_cast<uint8_t>(prefix[0]) << 8 |
+                                     static_cast<uint8_t>(prefix[1])), '\0');
+    return frame.empty() || read_exact(&frame[0], frame.size());
+}
+
+bool BulkLeaseQuery::answer4(const std::string& data, FrameWriter& writer) {
+    Query4 query;
+    if (!parse_query4(data, query)) {
+        // Without a transaction to answer to, only the count is left
+        malformed_++;
+        return true;
+    }
+
+    // Message of type for the query, about lease if there is one
+    auto begin = [&writer, &query](uint8_t type, const QueriedLease* lease) -> std::string& {
+        std::string& out = writer.begin();
+        const size_t start = out.size();
+        out += query.header;
+        out[start] = 2;                      // BOOTREPLY
+        out[start + 3] = 0;                  // hops
+        std::memset(&out[start + 8], 0, 4);  // secs, flags
+        std::memset(&out[start + 16], 0, 8); // yiaddr, siaddr
+        std::memset(&out[start + 44], 0, DHCP4_HEADER - 44);
+        if (lease) {
+            in_addr address;
+            inet_pton(AF_INET, lease->address.c_str(), &address);
+            std::memcpy(&out[start + 12], &address, 4);
+            const std::string hwaddr = id_bytes(lease->hwaddr);
+            out[start + 1] = 1;              // Ethernet
+            out[start + 2] = static_cast<char>(std::min<size_t>(hwaddr.size(), 16));
+            std::memset(&out[start + 28], 0, 16);
+            std::memcpy(&out[start + 28], hwaddr.data(), std::min<size_t>(hwaddr.size(), 16));
+        }
+        out.append(reinterpret_cast<const char*>(DHCP4_COOKIE), 4);
+        option4(out, DHO_MESSAGE_TYPE, std::string(1, static_cast<char>(type)));
+        return out;
+    };
+    auto end = [&writer](std::string& out) {
+        out.push_back(static_cast<char>(DHO_END));
+        writer.end();
+    };
+    auto status = [&](uint8_t code, const std::string& message) {
+        std::string& out = begin(DHCPLEASEQUERYSTATUS, nullptr);
+        option4(out, DHO_STATUS_CODE, std::string(1, static_cast<char>(code)) + message);
+        end(out);
+        return writer.flush();
+    };
+
+    if (query.type != DHCPLEASEQUERY && query.type != DHCPBULKLEASEQUERY) {
+        malformed_++;
+        return status(STATUS4_MALFORMED_QUERY, "not a leasequery");
+    }
+
+    LeaseQueryKey key;
+    std::string value;
+    uint32_t ciaddr;
+    std::memcpy(&ciaddr, query.header.data() + 12, 4);
+    const uint8_t hlen = static_cast<uint8_t>(query.header[2]);
+    if (ciaddr != 0) {
+        key = LeaseQueryKey::ADDRESS;
+        value = ipv4_text(ntohl(ciaddr));
+    } else if (hlen > 0 && hlen <= 16 &&
+               query.header.compare(28, hlen, std::string(hlen, '\0')) != 0) {
+        key = LeaseQueryKey::HWADDR;
+        value = id_text(query.header.substr(28, hlen));
+    } else if (!query.client_id.empty()) {
+        key = LeaseQueryKey::CLIENT_ID;
+        value = id_text(query.client_id);
+    } else if (!query.relay_id.empty()) {
+        key = LeaseQueryKey::RELAY_ID;
+        value = id_text(query.relay_id);
+    } else if (!query.remote_id.empty()) {
+        key = LeaseQueryKey::REMOTE_ID;
+        value = id_text(query.remote_id);
+    } else {
+        return status(STATUS4_NOT_ALLOWED, "query for all configured addresses not supported");
+    }
+
+    const int64_t now = time(nullptr);
+    std::vector<QueriedLease> leases = index_.find(key, value, now);
+    leases.erase(std::remove_if(leases.begin(), leases.end(),
+                                [](const QueriedLease& lease) { return lease.v6; }),
+                 leases.end());
+
+    auto active = [&](const QueriedLease& lease, const std::vector<QueriedLease>* associated) {
+        std::string& out = begin(DHCPLEASEACTIVE, &lease);
+        option4_u32(out, DHO_LEASE_TIME, seconds(lease.expires_at - now));
+        option4_u32(out, DHO_CLIENT_LAST_TRANSACTION_TIME, seconds(now - lease.cltt));
+        if (!lease.client_id.empty()) {
+            option4(out, DHO_CLIENT_ID, id_bytes(lease.client_id));
+        }
+        if (!lease.relay_id.empty() || !lease.remote_id.empty()) {
+            std::string info;
+            if (!lease.remote_id.empty()) {
+                option4(info, RAI_REMOTE_ID, id_bytes(lease.remote_id));
+            }
+            if (!lease.relay_id.empty()) {
+                option4(info, RAI_RELAY_ID, id_bytes(lease.relay_id));
+            }
+            option4(out, DHO_RELAY_AGENT_INFO, info);
+        }
+        if (associated && associated->size() > 1) {
+            std::string addresses;
+            for (const auto& other : *associated) {
+                in_addr address;
+                if (addresses.size() + 4 <= 252 &&
+                    inet_pton(AF_INET, other.address.c_str(), &address) == 1) {
+                    addresses.append(reinterpret_cast<const char*>(&address), 4);
+                }
+            }
+            option4(out, DHO_ASSOCIATED_IP, addresses);
+        }
+        option4_u32(out, DHO_BASE_TIME, seconds(now));
+        option4_u32(out, DHO_START_TIME_OF_STATE, seconds(now - lease.cltt));
+        option4(out, DHO_DHCP_STATE,
+                std::string(1, static_cast<char>(lease.state == 1 ? STATE4_ABANDONED
+                                                                  : STATE4_ACTIVE)));
+        if (lease.remote) {
+            option4(out, DHO_DATA_SOURCE, std::string(1, static_cast<char>(DATA_SOURCE_REMOTE)));
+        }
+        end(out);
+        leases_++;
+    };
+
+    if (query.type == DHCPLEASEQUERY) {
+        // RFC 4388: the most recent lease, the others as associated addresses
+        if (leases.empty()) {
+            end(begin(DHCPLEASEUNKNOWN, nullptr));
+        } else {
+            auto latest = std::max_element(leases.begin(), leases.end(),
+                [](const QueriedLease& a, const QueriedLease& b) { return a.cltt < b.cltt; });
+            active(*latest, &leases);
+        }
+        return writer.flush();
+    }
+
+    for (const auto& lease : leases) {
+        active(lease, nullptr);
+    }
+    end(begin(DHCPLEASEQUERYDONE, nullptr));
+    return writer.flush();
+}
+
+bool BulkLeaseQuery::answer6(const std::string& data, FrameWriter& writer) {
+    if (data.size() < 4) {
+        malformed_++;
+        return true;
+    }
+    const std::string transaction = data.substr(1, 3);
+    const auto options = options6(data, 4);
+    const std::string* requestor = find6(options, D6O_CLIENTID);
+
+    auto begin = [&](uint8_t type) -> std::string& {
+        std::string& out = writer.begin();
+        out.push_back(static_cast<char>(type));
+        out += transaction;
+        if (type == LEASEQUERY_REPLY) {
+            if (!server_id_.empty()) {
+                option6(out, D6O_SERVERID, server_id_);
+            }
+            if (requestor) {
+                option6(out, D6O_CLIENTID, *requestor);
+            }
+        }
+        return out;
+    };
+    auto status = [&](uint16_t code, const std::string& message) {
+        std::string body;
+        put16(body, code);
+        body += message;
+        option6(begin(LEASEQUERY_REPLY), D6O_STATUS_CODE, body);
+        writer.end();
+        return writer.flush();
+    };
+
+    const std::string* lq = find6(options, D6O_LQ_QUERY);
+    if (static_cast<uint8_t>(data[0]) != LEASEQUERY || !lq || lq->size() < 17) {
+        malformed_++;
+        return status(STATUS6_MALFORMED_QUERY, "not a leasequery");
+    }
+
+    const uint8_t type = static_cast<uint8_t>((*lq)[0]);
+    const auto query_options = options6(*lq, 17);
+    LeaseQueryKey key;
+    const std::string* option = nullptr;
+    std::string value;
+    switch (type) {
+    case QUERY_BY_ADDRESS:
+        key = LeaseQueryKey::ADDRESS;
+        option = find6(query_options, D6O_IAADDR);
+        if (option && option->size() >= 16) {
+            value = ipv6_text(reinterpret_cast<const uint8_t*>(option->data()));
+        }
+        break;
+    case QUERY_BY_CLIENTID:
+        key = LeaseQueryKey::DUID;
+        option = find6(query_options, D6O_CLIENTID);
+        break;
+    case QUERY_BY_RELAY_ID:
+        key = LeaseQueryKey::RELAY_ID;
+        option = find6(query_options, D6O_RELAY_ID);
+        break;
+    case QUERY_BY_REMOTE_ID:
+        key = LeaseQueryKey::REMOTE_ID;
+        option = find6(query_options, D6O_REMOTE_ID);
+        break;
+    default:
+        return status(STATUS6_UNKNOWN_QUERY_TYPE, "query type not supported");
+    }
+    if (option && value.empty() && key != LeaseQueryKey::ADDRESS) {
+        value = id_text(*option);
+    }
+    if (value.empty()) {
+        malformed_++;
+        return status(STATUS6_MALFORMED_QUERY, "query option missing");
+    }
+
+    const int64_t now = time(nullptr);
+    std::vector<QueriedLease> leases = index_.find(key, value, now);
+    leases.erase(std::remove_if(leases.begin(), leases.end(),
+                                [](const QueriedLease& lease) { return !lease.v6; }),
+                 leases.end());
+    // One client data option per client
+    std::stable_sort(leases.begin(), leases.end(),
+        [](const QueriedLease& a, const QueriedLease& b) { return a.duid < b.duid; });
+
+    size_t messages = 0;
+    for (size_t first = 0; first < leases.size();) {
+        size_t last = first + 1;
+        while (last < leases.size() && last - first < MAX_CLIENT_BINDINGS &&
+               leases[last].duid == leases[first].duid) {
+            ++last;
+        }
+
+        std::string client;
+        option6(client, D6O_CLIENTID, id_bytes(leases[first].duid));
+        int64_t cltt = 0;
+        for (size_t i = first; i < last; ++i) {
+            const QueriedLease& lease = leases[i];
+            uint8_t address[16];
+            if (inet_pton(AF_INET6, lease.address.c_str(), address) != 1) {
+                continue;
+            }
+            const uint32_t valid = seconds(lease.expires_at - now);
+            const uint32_t preferred =
+                std::min(valid, seconds(lease.cltt + lease.preferred_lft - now));
+            std::string binding;
+            if (lease.type == 2) {
+                put32(binding, preferred);
+                put32(binding, valid);
+                binding.push_back(static_cast<char>(lease.prefix_len));
+                binding.append(reinterpret_cast<const char*>(address), 16);
+                option6(client, D6O_IAPREFIX, binding);
+            } else {
+                binding.append(reinterpret_cast<const char*>(address), 16);
+                put32(binding, preferred);
+                put32(binding, valid);
+                option6(client, D6O_IAADDR, binding);
+            }
+            cltt = std::max(cltt, lease.cltt);
+            leases_++;
+        }
+        std::string clt_time;
+        put32(clt_time, seconds(now - cltt));
+        option6(client, D6O_CLT_TIME, clt_time);
+
+        option6(begin(messages == 0 ? LEASEQUERY_REPLY : LEASEQUERY_DATA), D6O_CLIENT_DATA,
+                client);
+        writer.end();
+        messages++;
+        first = last;
+    }
+
+    if (messages == 0) {
+        begin(LEASEQUERY_REPLY);
+        writer.end();
+    } else if (messages > 1) {
+        begin(LEASEQUERY_DONE);
+        writer.end();
+    }
+    return writer.flush();
+}
+
+LeaseQueryStats BulkLeaseQuery::stats() const {
+    LeaseQueryStats stats;
+    stats.running = running_;
+    stats.connections = accepted_.load();
+    stats.refused = refused_.load();
+    stats.queries = queries_.load();
+    stats.malformed = malformed_.load();
+    stats.leases = leases_.load();
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats.active = connections_.size();
+    return stats;
+}
+
+} // namespace nnoe
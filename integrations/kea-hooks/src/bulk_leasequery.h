@@ -0,0 +1,125 @@
+/**
+ * Bulk leasequery service for the NNOE Kea hook
+ *
+ * Answers leasequery over TCP from the multi-node lease index
+ * (lease_query_index.h), so relays and operators find the holder of an
+ * address whichever server leased it, without a lease backend lookup or an
+ * etcd read per query. One listener serves the family of the server the
+ * hook is loaded into; every message in either direction is preceded by its
+ * length in two bytes:
+ *
+ *   - DHCPv4 (RFC 6926): DHCPBULKLEASEQUERY by address (ciaddr), hardware
+ *     address (chaddr), client identifier (option 61), relay-id or remote-id
+ *     (sub-options 12 and 2 of option 82) is answered with a
+ *     DHCPLEASEACTIVE per lease and a closing DHCPLEASEQUERYDONE. A
+ *     DHCPLEASEQUERY (RFC 4388) on the connection gets its single
+ *     DHCPLEASEACTIVE (the latest lease, with associated-ip for the others)
+ *     or DHCPLEASEUNKNOWN. Leases of other servers carry the REMOTE flag of
+ *     the data-source option.
+ *   - DHCPv6 (RFC 5460): LEASEQUERY by address, client-id, relay-id or
+ *     remote-id is answered with a LEASEQUERY-REPLY holding the first
+ *     client's data, a LEASEQUERY-DATA per further client and, if there
+ *     was any, a closing LEASEQUERY-DONE.
+ *
+ * Replies are written in chunks as they are encoded. Queries for all
+ * configured addresses, by link address, and the query-start/end-time
+ * filters are not supported and get a status reply.
+ *
+ * Kea independent. One acceptor thread, and a thread per connection up to
+ * max_connections; connections idle for idle_timeout_s are closed.
+ */
+
+#ifndef NNOE_BULK_LEASEQUERY_H
+#define NNOE_BULK_LEASEQUERY_H
+
+#include "lease_query_index.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nnoe {
+
+struct LeaseQueryConfig {
+    int family = 4;                        // 4: RFC 6926, 6: RFC 5460
+    std::string address = "127.0.0.1";    // listening address
+    uint16_t port = 67;                    // 0: any free port
+    uint32_t max_connections = 8;
+    uint32_t idle_timeout_s = 300;
+    std::vector<std::string> requestors;   // peer addresses allowed; empty: any
+    std::string server_id;                 // DHCPv6 server DUID, colon hex
+};
+
+struct LeaseQueryStats {
+    bool running = false;
+    uint64_t connections = 0;    // accepted
+    uint64_t refused = 0;        // peer not allowed, or too many connections
+    uint64_t active = 0;
+    uint64_t queries = 0;
+    uint64_t malformed = 0;
+    uint64_t leases = 0;         // bindings sent
+};
+
+class BulkLeaseQuery {
+public:
+    BulkLeaseQuery(const LeaseQueryConfig& config, const LeaseQueryIndex& index);
+    ~BulkLeaseQuery();
+
+    // Bind and listen; false (logged) if the address cannot be used
+    bool start();
+
+    // Close the listener and every connection
+    void stop();
+
+    // Bound port, once started
+    uint16_t port() const { return port_; }
+
+    LeaseQueryStats stats() const;
+
+private:
+    struct Connection {
+        int fd = -1;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    class FrameWriter;
+
+    void run();
+    void accept_one();
+    void reap(bool all);
+    void serve(Connection* connection);
+    bool read_frame(int fd, std::string& frame);
+    bool allowed(const std::string& peer) const;
+
+    bool answer4(const std::string& query, FrameWriter& writer);
+    bool answer6(const std::string& query, FrameWriter& writer);
+
+    LeaseQueryConfig config_;
+    const LeaseQueryIndex& index_;
+    std::string server_id_;      // bytes
+
+    int listen_fd_;
+    int wake_fds_[2];
+    uint16_t port_;
+    std::thread thread_;
+    std::atomic<bool> running_;
+    std::atomic<bool> stop_;
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Connection>> connections_;
+
+    std::atomic<uint64_t> accepted_;
+    std::atomic<uint64_t> refused_;
+    std::atomic<uint64_t> queries_;
+    std::atomic<uint64_t> malformed_;
+    std::atomic<uint64_t> leases_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_BULK_LEASEQUERY_H
@@ -0,0 +1,272 @@
+/**
+ * Per-client packet rate limiter for the NNOE Kea hook
+ */
+
+#include "client_rate.h"
+#include "hash.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace nnoe {
+
+namespace {
+
+const uint32_t MIN_WIDTH = 64;
+const uint32_t MAX_DEPTH = 8;
+
+// Identifier bytes kept per offender without a heap allocation estimate
+const uint64_t OFFENDER_ID_BYTES = 32;
+
+uint32_t round_up_pow2(uint32_t value) {
+    uint32_t result = MIN_WIDTH;
+    while (result < value && result < (1u << 30)) {
+        result <<= 1;
+    }
+    return result;
+}
+
+} // namespace
+
+ClientRateLimiter::ClientRateLimiter(const ClientRateConfig& config)
+    : config_(config), memory_(nullptr), checked_(0), over_(0), shed_(0) {
+    config_.threshold = std::max<uint32_t>(config_.threshold, 1);
+    config_.interval_ms = std::max<uint32_t>(config_.interval_ms, 1);
+    config_.width = round_up_pow2(config_.width);
+    config_.depth = std::min(std::max<uint32_t>(config_.depth, 1), MAX_DEPTH);
+    config_.offenders = std::max<uint32_t>(config_.offenders, 1);
+    mask_ = config_.width - 1;
+
+    const size_t counters = static_cast<size_t>(config_.width) * config_.depth;
+    for (auto& sketch : sketches_) {
+        sketch.counters.reset(new std::atomic<uint32_t>[counters]);
+        for (size_t i = 0; i < counters; ++i) {
+            sketch.counters[i].store(0, std::memory_order_relaxed);
+        }
+    }
+    offenders_.reserve(config_.offenders);
+}
+
+ClientRateLimiter::~ClientRateLimiter() {
+    if (memory_) {
+        memory_->release(table_bytes());
+    }
+}
+
+uint64_t ClientRateLimiter::table_bytes() const {
+    return 2 * static_cast<uint64_t>(config_.width) * config_.depth * sizeof(uint32_t) +
+           static_cast<uint64_t>(config_.offenders) * (sizeof(Offender) + OFFENDER_ID_BYTES);
+}
+
+void ClientRateLimiter::set_memory(MemoryAccount* account) {
+    // Allocated up front and never resized
+    if (memory_) {
+        memory_->release(table_bytes());
+    }
+    memory_ = account;
+    if (memory_) {
+        memory_->charge(table_bytes());
+    }
+}
+
+uint64_t ClientRateLimiter::fingerprint(uint8_t kind, const uint8_t* data, size_t len) {
+    return client_fingerprint(static_cast<uint8_t>(kind), data, len);
+}
+
+uint32_t ClientRateLimiter::estimate(const Sketch* sketch, uint64_t fp) const {
+    if (!sketch) {
+        return 0;
+    }
+    const uint64_t step = ((fp >> 32) | (fp << 32)) | 1;
+    uint64_t probe = fp;
+    uint32_t count = std::numeric_limits<uint32_t>::max();
+    for (uint32_t row = 0; row < config_.depth; ++row, probe += step) {
+        const size_t slot = static_cast<size_t>(row) * config_.width + (probe & mask_);
+        count = std::min(count, sketch->counters[slot].load(std::memory_order_relaxed));
+    }
+    return count;
+}
+
+ClientRateLimiter::Sketch& ClientRateLimiter::current(int64_t interval) {
+    Sketch& sketch = sketches_[interval & 1];
+    if (sketch.interval.load(std::memory_order_acquire) >= interval) {
+        // Current, or a packet timed just before another thread rotated
+        return sketch;
+    }
+
+    std::lock_guard<std::mutex> lock(rotate_mutex_);
+    if (sketch.interval.load(std::memory_order_relaxed) < interval) {
+        // Counts from two intervals ago have left the window
+        const size_t counters = static_cast<size_t>(config_.width) * config_.depth;
+        for (size_t i = 0; i < counters; ++i) {
+            sketch.counters[i].store(0, std::memory_order_relaxed);
+        }
+        sketch.interval.store(interval, std::memory_order_release);
+    }
+    return sketch;
+}
+
+const ClientRateLimiter::Sketch* ClientRateLimiter::sketch_for(int64_t interval) const {
+    const Sketch& sketch = sketches_[interval & 1];
+    return sketch.interval.load(std::memory_order_acquire) == interval ? &sketch : nullptr;
+}
+
+// Sliding window: all of the current interval plus the part of the previous
+// one still inside the window
+uint32_t ClientRateLimiter::weigh(uint32_t previous, uint32_t current, int64_t now_ms) const {
+    const uint64_t elapsed = static_cast<uint64_t>(now_ms % config_.interval_ms);
+    const uint64_t carried = static_cast<uint64_t>(previous) *
+                             (config_.interval_ms - elapsed) / config_.interval_ms;
+    return static_cast<uint32_t>(std::min<uint64_t>(current + carried,
+                                                     std::numeric_limits<uint32_t>::max()));
+}
+
+bool ClientRateLimiter::admit(uint8_t kind, const uint8_t* data, size_t len, int64_t now_ms) {
+    checked_.fetch_add(1, std::memory_order_relaxed);
+    if (len == 0 || now_ms < 0) {
+        return true;
+    }
+
+    const uint64_t fp = fingerprint(kind, data, len);
+    const int64_t interval = now_ms / config_.interval_ms;
+    Sketch& sketch = current(interval);
+
+    const uint64_t step = ((fp >> 32) | (fp << 32)) | 1;
+    uint64_t probe = fp;
+    uint32_t count = std::numeric_limits<uint32_t>::max();
+    for (uint32_t row = 0; row < config_.depth; ++row, probe += step) {
+        const size_t slot = static_cast<size_t>(row) * config_.width + (probe & mask_);
+        count = std::min(count, sketch.counters[slot].fetch_add(1, std::memory_order_relaxed) + 1);
+    }
+
+    const uint32_t rate = weigh(estimate(sketch_for(interval - 1), fp), count, now_ms);
+    if (rate <= config_.threshold) {
+        return true;
+    }
+
+    over_.fetch_add(1, std::memory_order_relaxed);
+    if (!note_offender(fp, kind, data, len, rate, now_ms)) {
+        return true;
+    }
+    shed_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+// Records a packet of a client over the threshold; true if it is shed
+bool ClientRateLimiter::note_offender(uint64_t fp, uint8_t kind, const uint8_t* data,
+                                      size_t len, uint32_t rate, int64_t now_ms) {
+    std::lock_guard<std::mutex> lock(offenders_mutex_);
+
+    Offender* entry = nullptr;
+    for (auto& offender : offenders_) {
+        if (offender.fingerprint == fp) {
+            entry = &offender;
+            break;
+        }
+    }
+
+    if (!entry) {
+        // Take a free slot, else the one that left the window or has the
+        // smallest rate, if this client's is larger
+        const int64_t window_start = now_ms - 2 * static_cast<int64_t>(config_.interval_ms);
+        if (offenders_.size() < config_.offenders) {
+            offenders_.emplace_back();
+            entry = &offenders_.back();
+        } else {
+            Offender* victim = &offenders_.front();
+            for (auto& offender : offenders_) {
+                if (offender.info.last_seen_ms < window_start) {
+                    victim = &offender;
+                    break;
+                }
+                if (offender.info.rate < victim->info.rate) {
+                    victim = &offender;
+                }
+            }
+            if (victim->info.last_seen_ms >= window_start) {
+                if (victim->info.rate >= rate) {
+                    victim = nullptr;
+                } else {
+                    evicted_++;
+                }
+            }
+            entry = victim;
+        }
+        if (entry) {
+            entry->fingerprint = fp;
+            entry->info = ClientRateOffender();
+            entry->info.kind = kind;
+            entry->info.id.assign(data, data + std::min<size_t>(len, OFFENDER_ID_BYTES));
+            entry->info.first_seen_ms = now_ms;
+        }
+    }
+
+    uint64_t packets = over_.load(std::memory_order_relaxed);
+    if (entry) {
+        entry->info.rate = rate;
+        entry->info.last_seen_ms = now_ms;
+        packets = ++entry->info.packets;
+    }
+
+    bool shed = false;
+    switch (config_.action) {
+    case ClientRateConfig::DROP:
+        shed = true;
+        break;
+    case ClientRateConfig::THROTTLE: {
+        // Keep one packet in rate / threshold, so about threshold get through
+        const uint64_t ratio = (static_cast<uint64_t>(rate) + config_.threshold - 1) /
+                               config_.threshold;
+        shed = packets % ratio != 0;
+        break;
+    }
+    case ClientRateConfig::MONITOR:
+        break;
+    }
+
+    if (shed && entry) {
+        entry->info.shed++;
+    }
+    return shed;
+}
+
+uint32_t ClientRateLimiter::rate(uint8_t kind, const uint8_t* data, size_t len,
+                                 int64_t now_ms) const {
+    if (len == 0 || now_ms < 0) {
+        return 0;
+    }
+    const uint64_t fp = fingerprint(kind, data, len);
+    const int64_t interval = now_ms / config_.interval_ms;
+    return weigh(estimate(sketch_for(interval - 1), fp), estimate(sketch_for(interval), fp),
+                 now_ms);
+}
+
+ClientRateStats ClientRateLimiter::stats() const {
+    ClientRateStats stats;
+    stats.checked = checked_.load(std::memory_order_relaxed);
+    stats.over = over_.load(std::memory_order_relaxed);
+    stats.shed = shed_.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(offenders_mutex_);
+    stats.evicted = evicted_;
+    return stats;
+}
+
+std::vector<ClientRateOffender> ClientRateLimiter::offenders(int64_t now_ms) const {
+    const int64_t window_start = now_ms - 2 * static_cast<int64_t>(config_.interval_ms);
+    std::vector<ClientRateOffender> result;
+    {
+        std::lock_guard<std::mutex> lock(offenders_mutex_);
+        for (const auto& offender : offenders_) {
+            if (offender.info.last_seen_ms >= window_start) {
+                result.push_back(offender.info);
+            }
+        }
+    }
+    std::sort(result.begin(), result.end(),
+              [](const ClientRateOffender& a, const ClientRateOffender& b) {
+                  return a.rate > b.rate;
+              });
+    return result;
+}
+
+} // namespace nnoe
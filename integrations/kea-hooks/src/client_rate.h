@@ -0,0 +1,128 @@
+/**
+ * Per-client packet rate limiter for the NNOE Kea hook
+ *
+ * Floods of DISCOVER/SOLICIT from misbehaving or spoofing clients cost Kea
+ * an allocation attempt and, through this hook, etcd writes. The packet
+ * callouts ask the limiter about each query before allocation and shed the
+ * clients sending more than a configured number of packets per interval.
+ *
+ * Rates are estimated with a sliding window over two count-min sketches
+ * keyed by client identifier (hardware address, client identifier or
+ * DUID): one for the current interval and one for the previous, weighted by
+ * how much of it still lies within the window. The sketches have a fixed
+ * size, so memory does not grow with the number of clients; hash collisions
+ * can only overestimate a rate. Counting is lock-free.
+ *
+ * Clients over the threshold are tracked in a small table of offenders
+ * (smallest rate evicted first) for statistics. Depending on the action
+ * their packets are dropped, cut to the threshold rate, or only counted.
+ */
+
+#ifndef NNOE_CLIENT_RATE_H
+#define NNOE_CLIENT_RATE_H
+
+#include "memory_budget.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nnoe {
+
+struct ClientRateConfig {
+    enum Action : uint8_t {
+        DROP,       // every packet while over the threshold
+        THROTTLE,   // the packets above the threshold rate
+        MONITOR     // none; offenders are only reported
+    };
+
+    uint32_t threshold = 30;       // packets per interval
+    uint32_t interval_ms = 10000;
+    Action action = DROP;
+    uint32_t width = 16384;        // counters per sketch row, rounded to a power of two
+    uint32_t depth = 4;            // sketch rows
+    uint32_t offenders = 32;       // offender table entries
+};
+
+struct ClientRateOffender {
+    uint8_t kind = 0;              // ClientBlocklist::IdentifierKind values
+    std::vector<uint8_t> id;
+    uint32_t rate = 0;             // estimated packets per interval, last seen
+    uint64_t packets = 0;          // over the threshold
+    uint64_t shed = 0;             // dropped
+    int64_t first_seen_ms = 0;
+    int64_t last_seen_ms = 0;
+};
+
+struct ClientRateStats {
+    uint64_t checked = 0;
+    uint64_t over = 0;             // packets from clients over the threshold
+    uint64_t shed = 0;
+    uint64_t evicted = 0;          // offenders pushed out of the table
+};
+
+class ClientRateLimiter {
+public:
+    explicit ClientRateLimiter(const ClientRateConfig& config);
+    ~ClientRateLimiter();
+
+    // Charge the sketches and offender table to account
+    void set_memory(MemoryAccount* account);
+
+    // Count a packet from the client at now_ms (monotonic); false if it
+    // should be shed
+    bool admit(uint8_t kind, const uint8_t* data, size_t len, int64_t now_ms);
+
+    // Current estimate for the client, without counting a packet
+    uint32_t rate(uint8_t kind, const uint8_t* data, size_t len, int64_t now_ms) const;
+
+    ClientRateStats stats() const;
+
+    // Offenders seen within the last two intervals, highest rate first
+    std::vector<ClientRateOffender> offenders(int64_t now_ms) const;
+
+    const ClientRateConfig& config() const { return config_; }
+
+private:
+    struct Sketch {
+        std::atomic<int64_t> interval{-1};
+        std::unique_ptr<std::atomic<uint32_t>[]> counters;
+    };
+
+    struct Offender {
+        uint64_t fingerprint = 0;
+        ClientRateOffender info;
+    };
+
+    static uint64_t fingerprint(uint8_t kind, const uint8_t* data, size_t len);
+    uint32_t estimate(const Sketch* sketch, uint64_t fp) const;
+    Sketch& current(int64_t interval);
+    const Sketch* sketch_for(int64_t interval) const;
+    uint32_t weigh(uint32_t previous, uint32_t current, int64_t now_ms) const;
+    bool note_offender(uint64_t fp, uint8_t kind, const uint8_t* data, size_t len,
+                       uint32_t rate, int64_t now_ms);
+    uint64_t table_bytes() const;
+
+    ClientRateConfig config_;
+    uint32_t mask_;
+    Sketch sketches_[2];           // by interval parity
+    std::mutex rotate_mutex_;
+
+    mutable std::mutex offenders_mutex_;
+    std::vector<Offender> offenders_;
+
+    MemoryAccount* memory_;
+
+    std::atomic<uint64_t> checked_;
+    std::atomic<uint64_t> over_;
+    std::atomic<uint64_t> shed_;
+    uint64_t evicted_ = 0;         // under offenders_mutex_
+};
+
+} // namespace nnoe
+
+#endif // NNOE_CLIENT_RATE_H
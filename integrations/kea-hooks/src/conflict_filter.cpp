@@ -0,0 +1,458 @@
+/**
+ * Cross-node address conflict filter for the NNOE Kea hook
+ */
+
+#include "conflict_filter.h"
+
+#include <nnoe/lease_reader.h>
+
+#include <json/json.h>
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <ctime>
+#include <iostream>
+#include <memory>
+
+namespace nnoe {
+
+namespace {
+
+const int64_t SWEEP_INTERVAL_SECONDS = 60;
+
+bool parse_v4(const std::string& text, uint32_t& out) {
+    in_addr addr;
+    if (inet_pton(AF_INET, text.c_str(), &addr) != 1) {
+        return false;
+    }
+    out = ntohl(addr.s_addr);
+    return true;
+}
+
+std::string format_v4(uint32_t address) {
+    in_addr addr;
+    addr.s_addr = htonl(address);
+    char buf[INET_ADDRSTRLEN];
+    return inet_ntop(AF_INET, &addr, buf, sizeof(buf)) ? std::string(buf) : std::string();
+}
+
+} // namespace
+
+ConflictFilter::ConflictFilter(const std::shared_ptr<WatchManager>& watches,
+                               const std::string& prefix, const std::string& node_id,
+                               const std::string& delegation_prefix)
+    : watches_(watches), prefix_(prefix), node_id_(node_id), memory_(nullptr), pool_bytes_(0),
+      delegation_prefix_(delegation_prefix), last_sweep_(0), subscription_(0),
+      delegation_watch_(*this), delegation_subscription_(0), stop_(false), hints_dropped_(0),
+      refused_(0) {
+    while (!prefix_.empty() && prefix_.back() == '/') {
+        prefix_.pop_back();
+    }
+    prefix_ += "/";
+    while (!delegation_prefix_.empty() && delegation_prefix_.back() == '/') {
+        delegation_prefix_.pop_back();
+    }
+    if (!delegation_prefix.empty()) {
+        delegation_prefix_ += "/";
+    }
+}
+
+ConflictFilter::~ConflictFilter() {
+    stop();
+    clear_held();
+    clear_delegations();
+    if (memory_) {
+        memory_->release(pool_bytes_);
+    }
+}
+
+// The held_ node, plus an outside4_ node for IPv4 addresses outside the pools
+uint64_t ConflictFilter::held_bytes(const std::string& name) {
+    return sizeof(std::pair<const std::string, int64_t>) + 2 * CONTAINER_NODE_BYTES +
+           string_heap_bytes(name);
+}
+
+// Caller holds mutex_ exclusively
+void ConflictFilter::clear_held() {
+    if (memory_) {
+        for (const auto& entry : held_) {
+            memory_->release(held_bytes(entry.first));
+        }
+    }
+    held_.clear();
+    outside4_.clear();
+}
+
+void ConflictFilter::start() {
+    if (subscription_) {
+        return;
+    }
+    stop_ = false;
+    subscription_ = watches_->subscribe(prefix_, this);
+    if (!delegation_prefix_.empty()) {
+        delegation_subscription_ = watches_->subscribe(delegation_prefix_, &delegation_watch_);
+    }
+}
+
+void ConflictFilter::stop() {
+    // Ends a reload in progress
+    stop_ = true;
+    if (subscription_) {
+        watches_->unsubscribe(subscription_);
+        subscription_ = 0;
+    }
+    if (delegation_subscription_) {
+        watches_->unsubscribe(delegation_subscription_);
+        delegation_subscription_ = 0;
+    }
+}
+
+void ConflictFilter::set_pools4(const std::vector<Pool4>& pools) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    pools_.clear();
+    pool_starts_.clear();
+    outside4_.clear();
+    uint64_t pool_bytes = 0;
+    for (const auto& pool : pools) {
+        if (pool.last < pool.first) {
+            continue;
+        }
+        PoolBitmap bitmap;
+        bitmap.pool = pool;
+        bitmap.bits.assign((static_cast<uint64_t>(pool.last - pool.first) + 64) / 64, 0);
+        pool_bytes += sizeof(PoolBitmap) + CONTAINER_NODE_BYTES +
+                      bitmap.bits.size() * sizeof(uint64_t);
+        std::vector<PoolBitmap>& subnet = pools_[pool.subnet_id];
+        pool_starts_[pool.first] = std::make_pair(pool.subnet_id, subnet.size());
+        subnet.push_back(std::move(bitmap));
+    }
+    if (memory_) {
+        memory_->charge(pool_bytes);
+        memory_->release(pool_bytes_);
+    }
+    pool_bytes_ = pool_bytes;
+
+    for (const auto& entry : held_) {
+        uint32_t address;
+        if (parse_v4(entry.first, address)) {
+            mark4(address, true);
+        }
+    }
+}
+
+void ConflictFilter::mark4(uint32_t address, bool held) {
+    auto start = pool_starts_.upper_bound(address);
+    if (start != pool_starts_.begin()) {
+        --start;
+        PoolBitmap& bitmap = pools_[start->second.first][start->second.second];
+        if (address <= bitmap.pool.last) {
+            const uint64_t offset = address - bitmap.pool.first;
+            if (held) {
+                bitmap.bits[offset / 64] |= 1ULL << (offset % 64);
+            } else {
+                bitmap.bits[offset / 64] &= ~(1ULL << (offset % 64));
+            }
+            return;
+        }
+    }
+    if (held) {
+        outside4_.insert(address);
+    } else {
+        outside4_.erase(address);
+    }
+}
+
+bool ConflictFilter::held_elsewhere4(uint32_t subnet_id, uint32_t address, int64_t now) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    bool hit = false;
+    bool in_pool = false;
+    auto subnet = pools_.find(subnet_id);
+    if (subnet != pools_.end()) {
+        for (const auto& bitmap : subnet->second) {
+            if (address >= bitmap.pool.first && address <= bitmap.pool.last) {
+                const uint64_t offset = address - bitmap.pool.first;
+                hit = bitmap.bits[offset / 64] & (1ULL << (offset % 64));
+                in_pool = true;
+                break;
+            }
+        }
+    }
+    if (!in_pool) {
+        hit = outside4_.count(address) != 0;
+    }
+    if (!hit) {
+        return false;
+    }
+
+    // Rare path: confirm the other lease has not run out
+    auto entry = held_.find(format_v4(address));
+    return entry != held_.end() && entry->second > now;
+}
+
+bool ConflictFilter::held_elsewhere6(const std::string& name, int64_t now) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto entry = held_.find(name);
+    if (entry != held_.end() && entry->second > now) {
+        return true;
+    }
+    auto delegated = delegated_.find(name);
+    return delegated != delegated_.end() && delegated->second.expires_at > now;
+}
+
+size_t ConflictFilter::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return held_.size() + delegated_.size();
+}
+
+ConflictFilterStats ConflictFilter::stats() const {
+    ConflictFilterStats stats;
+    stats.tracked = size();
+    stats.hints_dropped = hints_dropped_.load(std::memory_order_relaxed);
+    stats.refused = refused_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void ConflictFilter::forget(const std::string& name) {
+    if (held_.erase(name) == 0) {
+        return;
+    }
+    if (memory_) {
+        memory_->release(held_bytes(name));
+    }
+    uint32_t address;
+    if (parse_v4(name, address)) {
+        mark4(address, false);
+    }
+}
+
+void ConflictFilter::update(const std::string& key, const std::string* value, int64_t now) {
+    if (key.compare(0, prefix_.size(), prefix_) != 0) {
+        return;
+    }
+    const std::string name = key.substr(prefix_.size());
+
+    LeaseView lease;
+    if (!value || parse_lease(*value, lease) != LEASE_OK || lease.node.empty() ||
+        lease.node == node_id_ || lease.state > 1 || lease.expires_at <= now) {
+        forget(name);
+        return;
+    }
+
+    const bool known = held_.count(name) != 0;
+    if (!known && memory_ && !memory_->try_charge(held_bytes(name))) {
+        return;
+    }
+    held_[name] = lease.expires_at;
+    uint32_t address;
+    if (!known && parse_v4(name, address)) {
+        mark4(address, true);
+    }
+}
+
+void ConflictFilter::sweep(int64_t now) {
+    for (auto it = held_.begin(); it != held_.end();) {
+        if (it->second > now) {
+            ++it;
+            continue;
+        }
+        uint32_t address;
+        if (parse_v4(it->first, address)) {
+            mark4(address, false);
+        }
+        if (memory_) {
+            memory_->release(held_bytes(it->first));
+        }
+        it = held_.erase(it);
+    }
+    last_sweep_ = now;
+}
+
+bool ConflictFilter::reload(const EtcdClient& client, int64_t& revision) {
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        clear_held();
+        for (auto& subnet : pools_) {
+            for (auto& bitmap : subnet.second) {
+                std::fill(bitmap.bits.begin(), bitmap.bits.end(), 0);
+            }
+        }
+    }
+
+    const int64_t now = time(nullptr);
+    const bool ok = client.range_pages(prefix_, prefix_range_end(prefix_),
+        [&](std::vector<EtcdKeyValue>& page) {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            for (const auto& kv : page) {
+                update(kv.key, &kv.value, now);
+            }
+            return !stop_;
+        },
+        revision);
+
+    if (!ok || stop_) {
+        return false;
+    }
+    last_sweep_ = now;
+
+    std::cerr << "Kea etcd hook: conflict filter tracks " << size()
+              << " leases of other servers" << std::endl;
+    return true;
+}
+
+void ConflictFilter::apply(const std::vector<EtcdWatchEvent>& events) {
+    const int64_t now = time(nullptr);
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    for (const auto& event : events) {
+        update(event.kv.key, event.type == EtcdWatchEvent::DELETE ? nullptr : &event.kv.value,
+               now);
+    }
+    if (now - last_sweep_ >= SWEEP_INTERVAL_SECONDS) {
+        sweep(now);
+    }
+}
+
+// Caller holds mutex_ exclusively
+void ConflictFilter::clear_delegations() {
+    if (memory_) {
+        for (const auto& entry : delegations_) {
+            memory_->release(held_bytes(entry.first));
+        }
+        for (const auto& entry : delegated_) {
+            memory_->release(held_bytes(entry.first));
+        }
+    }
+    delegations_.clear();
+    delegated_.clear();
+}
+
+void ConflictFilter::forget_delegation(const std::string& name) {
+    auto record = delegations_.find(name);
+    if (record == delegations_.end()) {
+        return;
+    }
+    const std::vector<std::pair<std::string, int64_t>> prefixes = std::move(record->second);
+    delegations_.erase(record);
+    if (memory_) {
+        memory_->release(held_bytes(name));
+    }
+
+    for (const auto& prefix : prefixes) {
+        auto held = delegated_.find(prefix.first);
+        if (held == delegated_.end()) {
+            continue;
+        }
+        if (--held->second.records == 0) {
+            delegated_.erase(held);
+            if (memory_) {
+                memory_->release(held_bytes(prefix.first));
+            }
+            continue;
+        }
+        // Another record still lists the prefix; keep the latest expiry of
+        // the records left. Prefixes listed twice are conflicts, so rare.
+        if (held->second.expires_at == prefix.second) {
+            held->second.expires_at = 0;
+            for (const auto& other : delegations_) {
+                for (const auto& entry : other.second) {
+                    if (entry.first == prefix.first) {
+                        held->second.expires_at = std::max(held->second.expires_at, entry.second);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void ConflictFilter::update_delegation(const std::string& key, const std::string* value,
+                                       int64_t now) {
+    if (key.compare(0, delegation_prefix_.size(), delegation_prefix_) != 0) {
+        return;
+    }
+    const std::string name = key.substr(delegation_prefix_.size());
+    forget_delegation(name);
+
+    if (!value) {
+        return;
+    }
+
+    // Aggregate records are rare next to lease events; jsoncpp will do
+    Json::Value record;
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    if (!reader->parse(value->data(), value->data() + value->size(), &record, nullptr) ||
+        !record.isObject() || !record["node"].isString() || !record["prefixes"].isArray()) {
+        return;
+    }
+    const std::string node = record["node"].asString();
+    if (node.empty() || node == node_id_) {
+        return;
+    }
+
+    std::vector<std::pair<std::string, int64_t>> prefixes;
+    for (const auto& prefix : record["prefixes"]) {
+        const int64_t expires_at = prefix.get("expires_at", 0).asInt64();
+        if (!prefix["prefix"].isString() || prefix.get("state", 0).asInt() > 1 ||
+            expires_at <= now) {
+            continue;
+        }
+        const std::string held_name = prefix["prefix"].asString() + "/" +
+                                      std::to_string(prefix.get("prefix_len", 0).asInt());
+        if (std::any_of(prefixes.begin(), prefixes.end(),
+                        [&](const std::pair<std::string, int64_t>& listed) {
+                            return listed.first == held_name;
+                        })) {
+            continue;
+        }
+        auto held = delegated_.find(held_name);
+        if (held == delegated_.end()) {
+            if (memory_ && !memory_->try_charge(held_bytes(held_name))) {
+                continue;
+            }
+            held = delegated_.emplace(held_name, DelegatedPrefix()).first;
+        }
+        held->second.expires_at = std::max(held->second.expires_at, expires_at);
+        ++held->second.records;
+        prefixes.emplace_back(held_name, expires_at);
+    }
+    if (prefixes.empty()) {
+        return;
+    }
+    if (memory_) {
+        memory_->charge(held_bytes(name));
+    }
+    delegations_[name] = std::move(prefixes);
+}
+
+bool ConflictFilter::reload_delegations(const EtcdClient& client, int64_t& revision) {
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        clear_delegations();
+    }
+
+    const int64_t now = time(nullptr);
+    const bool ok = client.range_pages(delegation_prefix_, prefix_range_end(delegation_prefix_),
+        [&](std::vector<EtcdKeyValue>& page) {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            for (const auto& kv : page) {
+                update_delegation(kv.key, &kv.value, now);
+            }
+            return !stop_;
+        },
+        revision);
+    return ok && !stop_;
+}
+
+void ConflictFilter::apply_delegations(const std::vector<EtcdWatchEvent>& events) {
+    const int64_t now = time(nullptr);
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    for (const auto& event : events) {
+        update_delegation(event.kv.key,
+                          event.type == EtcdWatchEvent::DELETE ? nullptr : &event.kv.value, now);
+    }
+}
+
+} // namespace nnoe
@@ -0,0 +1,173 @@
+/**
+ * Cross-node address conflict filter for the NNOE Kea hook
+ *
+ * Servers of several sites may share address space. The filter follows the
+ * lease prefix through the shared watch manager and keeps the addresses currently leased
+ * by other servers (records whose "node" differs from this server's) so
+ * lease selection can refuse them without a network lookup:
+ *
+ *   - one bitmap per configured IPv4 pool, checked by subnet id and offset,
+ *     and a hash set for IPv4 addresses outside the pools;
+ *   - a hash map of key names (address, or prefix/length for a delegated
+ *     prefix) to expiry, which also serves IPv6 lookups.
+ *
+ * The subnet selection callouts drop a requested address (the hint) held
+ * elsewhere before Kea allocates, so Kea picks another free address; a
+ * refusal at lease selection instead ends that allocation, and the client
+ * has to retry. Both are counted.
+ *
+ * With a delegation prefix (pd_aggregate) the filter follows it too, through
+ * a second subscription: each record lists the prefixes delegated to one
+ * DUID/IAID, and its prefixes are held by prefix/length like the others,
+ * for as long as any record still lists them.
+ *
+ * A hit is confirmed against the recorded expiry, so leases that ran out
+ * without a delete do not block their address. Records without a node
+ * (older writers) are never treated as conflicts. With a memory account
+ * attached, leases that do not fit are not tracked, so the filter fails
+ * open while the budget is exhausted.
+ */
+
+#ifndef NNOE_CONFLICT_FILTER_H
+#define NNOE_CONFLICT_FILTER_H
+
+#include "etcd_client.h"
+#include "lease_index.h"
+#include "memory_budget.h"
+#include "watch_manager.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace nnoe {
+
+struct ConflictFilterStats {
+    uint64_t tracked = 0;         // leases of other servers
+    uint64_t hints_dropped = 0;   // requested addresses removed before allocation
+    uint64_t refused = 0;         // selections skipped, ending that allocation
+};
+
+class ConflictFilter : public WatchSubscriber {
+public:
+    // delegation_prefix: per-DUID/IAID prefix records to follow as well,
+    // empty for none
+    ConflictFilter(const std::shared_ptr<WatchManager>& watches, const std::string& prefix,
+                   const std::string& node_id,
+                   const std::string& delegation_prefix = std::string());
+    ~ConflictFilter();
+
+    // Charge tracked leases and pool bitmaps to account (before start())
+    void set_memory(MemoryAccount* account) { memory_ = account; }
+
+    void start();
+    void stop();
+
+    // Replace the IPv4 pools (after a reconfiguration)
+    void set_pools4(const std::vector<Pool4>& pools);
+
+    // Packet path: is the address (host order) leased by another server?
+    bool held_elsewhere4(uint32_t subnet_id, uint32_t address, int64_t now) const;
+
+    // Packet path for IPv6: name is the lease key name (address, or
+    // prefix/length for a delegated prefix)
+    bool held_elsewhere6(const std::string& name, int64_t now) const;
+
+    size_t size() const;
+
+    // Outcomes of a hit, counted by the callouts
+    void hint_dropped() { hints_dropped_.fetch_add(1, std::memory_order_relaxed); }
+    void refused() { refused_.fetch_add(1, std::memory_order_relaxed); }
+
+    ConflictFilterStats stats() const;
+
+    // WatchSubscriber
+    bool reload(const EtcdClient& client, int64_t& revision) override;
+    void apply(const std::vector<EtcdWatchEvent>& events) override;
+
+    // The same for the delegation prefix, fed by its own subscription
+    bool reload_delegations(const EtcdClient& client, int64_t& revision);
+    void apply_delegations(const std::vector<EtcdWatchEvent>& events);
+
+private:
+    // Forwards the delegation subscription to the filter
+    class DelegationWatch : public WatchSubscriber {
+    public:
+        explicit DelegationWatch(ConflictFilter& filter) : filter_(filter) {}
+        bool reload(const EtcdClient& client, int64_t& revision) override {
+            return filter_.reload_delegations(client, revision);
+        }
+        void apply(const std::vector<EtcdWatchEvent>& events) override {
+            filter_.apply_delegations(events);
+        }
+
+    private:
+        ConflictFilter& filter_;
+    };
+
+    struct PoolBitmap {
+        Pool4 pool;
+        std::vector<uint64_t> bits;
+    };
+
+    // Caller holds mutex_ exclusively
+    void update(const std::string& key, const std::string* value, int64_t now);
+    void forget(const std::string& name);
+    void mark4(uint32_t address, bool held);
+    void sweep(int64_t now);
+    void clear_held();
+    static uint64_t held_bytes(const std::string& name);
+
+    // Caller holds mutex_ exclusively
+    void update_delegation(const std::string& key, const std::string* value, int64_t now);
+    void forget_delegation(const std::string& name);
+    void clear_delegations();
+
+    std::shared_ptr<WatchManager> watches_;
+    std::string prefix_;
+    std::string node_id_;
+    MemoryAccount* memory_;
+    uint64_t pool_bytes_;
+
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<std::string, int64_t> held_;      // key name -> expires_at
+    std::unordered_map<uint32_t, std::vector<PoolBitmap>> pools_;
+    std::map<uint32_t, std::pair<uint32_t, size_t>> pool_starts_;  // first -> (subnet, index)
+    std::unordered_set<uint32_t> outside4_;
+
+    // A prefix stays held while any record lists it, until the latest
+    // expiry among them
+    struct DelegatedPrefix {
+        int64_t expires_at = 0;
+        uint32_t records = 0;
+    };
+
+    // Delegation record name -> (prefix name, expires_at) it lists, and
+    // prefix name -> the prefix as held through all those records
+    std::string delegation_prefix_;
+    std::unordered_map<std::string, std::vector<std::pair<std::string, int64_t>>> delegations_;
+    std::unordered_map<std::string, DelegatedPrefix> delegated_;
+
+    // Owned by the lease prefix's dispatch thread
+    int64_t last_sweep_;
+
+    uint64_t subscription_;
+    DelegationWatch delegation_watch_;
+    uint64_t delegation_subscription_;
+    std::atomic<bool> stop_;
+
+    std::atomic<uint64_t> hints_dropped_;
+    std::atomic<uint64_t> refused_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_CONFLICT_FILTER_H
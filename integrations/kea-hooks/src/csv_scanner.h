@@ -0,0 +1,124 @@
+/**
+ * Zero-copy scanner for Kea memfile lease CSV rows
+ *
+ * Kea escapes commas inside field values ("&#x2c"), so a row splits exactly
+ * on ',' and every field can be returned as a view into the read buffer.
+ * Columns are located by name from the header row, which keeps the scanner
+ * working across the column additions between Kea versions.
+ */
+
+#ifndef NNOE_CSV_SCANNER_H
+#define NNOE_CSV_SCANNER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace nnoe {
+
+// Split a row into at most max_fields views; returns the field count
+inline size_t split_csv_row(std::string_view line, std::string_view* fields, size_t max_fields) {
+    size_t count = 0;
+    const char* p = line.data();
+    const char* end = p + line.size();
+
+    while (count < max_fields) {
+        const char* comma = static_cast<const char*>(std::memchr(p, ',', end - p));
+        if (!comma) {
+            fields[count++] = std::string_view(p, end - p);
+            break;
+        }
+        fields[count++] = std::string_view(p, comma - p);
+        p = comma + 1;
+    }
+    return count;
+}
+
+inline bool parse_csv_uint(std::string_view text, uint64_t& value) {
+    if (text.empty()) {
+        return false;
+    }
+    value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        const uint64_t digit = static_cast<uint64_t>(c - '0');
+        if (value > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        value = value * 10 + digit;
+    }
+    return true;
+}
+
+// Undo Kea's CSV escaping; only allocates when the field is escaped
+inline std::string unescape_csv_field(std::string_view text) {
+    if (text.find('&') == std::string_view::npos) {
+        return std::string(text);
+    }
+    std::string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text.compare(i, 5, "&#x2c") == 0) {
+            out.push_back(',');
+            i += 4;
+        } else {
+            out.push_back(text[i]);
+        }
+    }
+    return out;
+}
+
+// Column positions of a memfile lease file, resolved from its header row
+struct MemfileColumns {
+    static const size_t MAX_FIELDS = 32;
+
+    int address = -1;
+    int hwaddr = -1;
+    int client_id = -1;
+    int duid = -1;
+    int valid_lifetime = -1;
+    int expire = -1;
+    int subnet_id = -1;
+    int pref_lifetime = -1;
+    int lease_type = -1;
+    int iaid = -1;
+    int prefix_len = -1;
+    int hostname = -1;
+    int state = -1;
+
+    bool parse_header(std::string_view line) {
+        std::string_view fields[MAX_FIELDS];
+        const size_t count = split_csv_row(line, fields, MAX_FIELDS);
+        for (size_t i = 0; i < count; ++i) {
+            const int idx = static_cast<int>(i);
+            const std::string_view name = fields[i];
+            if (name == "address") address = idx;
+            else if (name == "hwaddr") hwaddr = idx;
+            else if (name == "client_id") client_id = idx;
+            else if (name == "duid") duid = idx;
+            else if (name == "valid_lifetime") valid_lifetime = idx;
+            else if (name == "expire") expire = idx;
+            else if (name == "subnet_id") subnet_id = idx;
+            else if (name == "pref_lifetime") pref_lifetime = idx;
+            else if (name == "lease_type") lease_type = idx;
+            else if (name == "iaid") iaid = idx;
+            else if (name == "prefix_len") prefix_len = idx;
+            else if (name == "hostname") hostname = idx;
+            else if (name == "state") state = idx;
+        }
+        return address >= 0 && valid_lifetime >= 0 && expire >= 0;
+    }
+
+    // Field at column idx, empty when the column or field is absent
+    static std::string_view field(const std::string_view* fields, size_t count, int idx) {
+        return (idx >= 0 && static_cast<size_t>(idx) < count) ? fields[idx] : std::string_view();
+    }
+};
+
+} // namespace nnoe
+
+#endif // NNOE_CSV_SCANNER_H
@@ -0,0 +1,233 @@
+/**
+ * DHCP-driven DNS records for the NNOE zone keyspace
+ */
+
+#include "dns_records.h"
+
+#include <arpa/inet.h>
+#include <cctype>
+
+namespace nnoe {
+
+namespace {
+
+const char HEX_DIGITS[] = "0123456789abcdef";
+
+// Lower-case and strip the trailing root dot; empty when the name carries
+// characters that do not belong in a host name (or in an etcd key segment)
+std::string normalize_name(const std::string& name) {
+    std::string out;
+    out.reserve(name.size());
+    for (char c : name) {
+        if (std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '.') {
+            out.push_back(static_cast<char>(std::tolower(static_cast<unsigned char>(c))));
+        } else {
+            return std::string();
+        }
+    }
+    while (!out.empty() && out.back() == '.') {
+        out.pop_back();
+    }
+    return out;
+}
+
+} // namespace
+
+DnsRecordBuilder::DnsRecordBuilder(const DnsRecordsConfig& config)
+    : config_(config) {
+    config_.forward_zone = normalize_name(config_.forward_zone);
+}
+
+std::vector<DnsRecordBuilder::Record>
+DnsRecordBuilder::records_for(const std::string& hostname, const std::string& address) const {
+    std::vector<Record> records;
+
+    const std::string host = normalize_name(hostname);
+    if (host.empty()) {
+        return records;
+    }
+
+    // Name relative to the forward zone, and the FQDN the PTR points at
+    std::string relative;
+    std::string fqdn = host;
+    const std::string& zone = config_.forward_zone;
+    if (!zone.empty()) {
+        if (host == zone) {
+            relative = "@";
+        } else if (host.size() > zone.size() &&
+                   host.compare(host.size() - zone.size(), zone.size(), zone) == 0 &&
+                   host[host.size() - zone.size() - 1] == '.') {
+            relative = host.substr(0, host.size() - zone.size() - 1);
+        } else if (host.find('.') == std::string::npos) {
+            relative = host;
+            fqdn = host + "." + zone;
+        }
+    }
+
+    uint8_t bytes[16];
+    bool v6;
+    if (inet_pton(AF_INET, address.c_str(), bytes) == 1) {
+        v6 = false;
+    } else if (inet_pton(AF_INET6, address.c_str(), bytes) == 1) {
+        v6 = true;
+    } else {
+        return records;
+    }
+
+    if (!relative.empty()) {
+        Record forward;
+        forward.type = v6 ? "AAAA" : "A";
+        forward.name = relative;
+        forward.value = address;
+        forward.key = config_.zones_prefix + "/" + zone + "/dhcp/" + relative + "/" + forward.type;
+        records.push_back(forward);
+    }
+
+    // Unqualified name with no forward zone: nothing to point a PTR at
+    if (config_.reverse && fqdn.find('.') != std::string::npos) {
+        Record ptr;
+        ptr.type = "PTR";
+        ptr.value = fqdn + ".";
+
+        std::string reverse_zone;
+        if (!v6) {
+            ptr.name = std::to_string(bytes[3]);
+            reverse_zone = std::to_string(bytes[2]) + "." + std::to_string(bytes[1]) + "." +
+                std::to_string(bytes[0]) + ".in-addr.arpa";
+        } else {
+            // Host part: low 64 bits as nibbles, least significant first
+            for (int i = 15; i >= 8; --i) {
+                ptr.name.push_back(HEX_DIGITS[bytes[i] & 0x0f]);
+                ptr.name.push_back('.');
+                ptr.name.push_back(HEX_DIGITS[bytes[i] >> 4]);
+                if (i > 8) {
+                    ptr.name.push_back('.');
+                }
+            }
+            for (int i = 7; i >= 0; --i) {
+                reverse_zone.push_back(HEX_DIGITS[bytes[i] & 0x0f]);
+                reverse_zone.push_back('.');
+                reverse_zone.push_back(HEX_DIGITS[bytes[i] >> 4]);
+                reverse_zone.push_back('.');
+            }
+            reverse_zone += "ip6.arpa";
+        }
+
+        ptr.key = config_.zones_prefix + "/" + reverse_zone + "/dhcp/" + ptr.name + "/PTR";
+        records.push_back(ptr);
+    }
+
+    return records;
+}
+
+std::string DnsRecordBuilder::render(const Record& record) const {
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+
+    // Same shape as the records array of a zone document
+    Json::Value value;
+    value["name"] = record.name;
+    value["type"] = record.type;
+    value["value"] = record.value;
+    value["ttl"] = config_.ttl;
+    return Json::writeString(builder, value);
+}
+
+void DnsRecordBuilder::add_publish_ops(const std::string& hostname, const std::string& address,
+                                       std::vector<EtcdOp>& ops) const {
+    for (const auto& record : records_for(hostname, address)) {
+        ops.push_back(EtcdOp::put(record.key, render(record)));
+    }
+}
+
+void DnsRecordBuilder::add_remove_ops(const std::string& hostname, const std::string& address,
+                                      std::vector<EtcdOp>& ops) const {
+    // A record written under another dns_ttl no longer matches and stays
+    // until the name is published again
+    const size_t existing = ops.size();
+    for (const auto& record : records_for(hostname, address)) {
+        bool held = false;
+        for (size_t i = 0; i < existing && !held; ++i) {
+            held = ops[i].key == record.key;
+        }
+        if (!held) {
+            ops.push_back(EtcdOp::del_if(record.key, render(record)));
+        }
+    }
+}
+
+DnsNameTable::DnsNameTable()
+    : memory_(nullptr) {
+}
+
+DnsNameTable::~DnsNameTable() {
+    if (memory_) {
+        for (const auto& entry : names_) {
+            memory_->release(entry_bytes(entry.first, entry.second));
+        }
+    }
+}
+
+uint64_t DnsNameTable::entry_bytes(const std::string& address, const Names& names) {
+    return sizeof(std::pair<const std::string, Names>) + string_heap_bytes(address) +
+           string_heap_bytes(names.hostname) + string_heap_bytes(names.previous) +
+           CONTAINER_NODE_BYTES;
+}
+
+std::string DnsNameTable::publish(const std::string& address, const std::string& hostname) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = names_.find(address);
+    if (it == names_.end()) {
+        Names names;
+        names.hostname = hostname;
+        // Over the memory budget the name is not remembered; a later rename
+        // of this address then leaves the old records behind
+        if (hostname.empty() ||
+            (memory_ && !memory_->try_charge(entry_bytes(address, names)))) {
+            return std::string();
+        }
+        names_.emplace(address, std::move(names));
+        return std::string();
+    }
+
+    Names& names = it->second;
+    if (names.hostname != hostname) {
+        if (memory_) {
+            memory_->release(entry_bytes(address, names));
+        }
+        if (!names.hostname.empty()) {
+            names.previous = names.hostname;
+        }
+        names.hostname = hostname;
+        if (memory_) {
+            memory_->charge(entry_bytes(address, names));
+        }
+    }
+    return names.previous;
+}
+
+std::vector<std::string> DnsNameTable::forget(const std::string& address) {
+    std::vector<std::string> published;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = names_.find(address);
+    if (it == names_.end()) {
+        return published;
+    }
+    for (const std::string* name : {&it->second.hostname, &it->second.previous}) {
+        if (!name->empty()) {
+            published.push_back(*name);
+        }
+    }
+    if (memory_) {
+        memory_->release(entry_bytes(address, it->second));
+    }
+    names_.erase(it);
+    return published;
+}
+
+size_t DnsNameTable::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return names_.size();
+}
+
+} // namespace nnoe
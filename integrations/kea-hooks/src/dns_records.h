@@ -0,0 +1,116 @@
+/**
+ * DHCP-driven DNS records for the NNOE zone keyspace
+ *
+ * Derives A/AAAA and PTR records from a lease hostname and renders them as
+ * etcd operations, so the hook can write them in the same transaction as the
+ * lease record. Records land next to the zone documents the agent already
+ * consumes (agent/src/services/knot.rs):
+ *
+ *   <zones_prefix>/<forward-zone>/dhcp/<name>/A|AAAA
+ *   <zones_prefix>/<reverse-zone>/dhcp/<label>/PTR
+ *
+ * Reverse zones are the /24 in-addr.arpa zone for IPv4 and the /64
+ * ip6.arpa zone for IPv6.
+ *
+ * A client may renew under a new hostname, and removal only knows the
+ * lease's current one, so DnsNameTable remembers the name each address was
+ * published under and the old name's records are taken down with the new
+ * ones' publication.
+ */
+
+#ifndef NNOE_DNS_RECORDS_H
+#define NNOE_DNS_RECORDS_H
+
+#include "etcd_client.h"
+#include "memory_budget.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nnoe {
+
+struct DnsRecordsConfig {
+    std::string zones_prefix = "/nnoe/dns/zones";
+    std::string forward_zone;
+    uint32_t ttl = 300;
+    bool reverse = true;
+};
+
+class DnsRecordBuilder {
+public:
+    explicit DnsRecordBuilder(const DnsRecordsConfig& config);
+
+    // Append puts for the records of hostname -> address
+    void add_publish_ops(const std::string& hostname, const std::string& address,
+                         std::vector<EtcdOp>& ops) const;
+
+    // Append deletes for the same records, each conditional on the record
+    // still holding what add_publish_ops wrote for this address: a name
+    // that has moved to another lease (or an address to another name)
+    // keeps the newer record. Keys ops already holds are left to those ops,
+    // since etcd rejects a transaction naming a key twice; publishing a new
+    // name first and then removing the old one replaces the shared PTR.
+    void add_remove_ops(const std::string& hostname, const std::string& address,
+                        std::vector<EtcdOp>& ops) const;
+
+private:
+    struct Record {
+        std::string key;
+        std::string name;
+        std::string type;
+        std::string value;
+    };
+
+    // Empty result when the hostname is unusable or the address unparsable
+    std::vector<Record> records_for(const std::string& hostname,
+                                    const std::string& address) const;
+
+    // Stored value of a record
+    std::string render(const Record& record) const;
+
+    DnsRecordsConfig config_;
+};
+
+// Name each address was last published under, and the one before it.
+// The sync engine coalesces pending writes of a lease, so the removal of an
+// old name is repeated with each publication of the address until the name
+// changes again or the address is forgotten; the removal is conditional, so
+// a repeat is harmless.
+class DnsNameTable {
+public:
+    DnsNameTable();
+    ~DnsNameTable();
+
+    // Charge remembered names to account (before the first publish)
+    void set_memory(MemoryAccount* account) { memory_ = account; }
+
+    // Remember hostname for address; the name the address was published
+    // under before another one, or empty
+    std::string publish(const std::string& address, const std::string& hostname);
+
+    // Forget address; the names it was published under (current first),
+    // without empty ones
+    std::vector<std::string> forget(const std::string& address);
+
+    size_t size() const;
+
+private:
+    struct Names {
+        std::string hostname;
+        std::string previous;
+    };
+
+    static uint64_t entry_bytes(const std::string& address, const Names& names);
+
+    MemoryAccount* memory_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Names> names_;    // by address
+};
+
+} // namespace nnoe
+
+#endif // NNOE_DNS_RECORDS_H
@@ -0,0 +1,136 @@
+/**
+ * etcd authentication token cache for the NNOE Kea hooks
+ */
+
+#include "etcd_auth.h"
+
+#include <json/json.h>
+#include <algorithm>
+#include <ctime>
+#include <iostream>
+#include <memory>
+
+namespace nnoe {
+
+namespace {
+
+const int64_t AUTH_RETRY_SECONDS = 5;
+
+} // namespace
+
+EtcdAuth::EtcdAuth(const std::string& endpoint, const std::string& user,
+                   const std::string& password, uint32_t token_ttl)
+    : client_(endpoint), user_(user), password_(password),
+      token_ttl_(token_ttl ? token_ttl : 1) {
+}
+
+int64_t EtcdAuth::jwt_lifetime(const std::string& token) {
+    // header.payload.signature; simple tokens have a single dot
+    const size_t first = token.find('.');
+    const size_t second = first == std::string::npos ? first : token.find('.', first + 1);
+    if (second == std::string::npos || token.find('.', second + 1) != std::string::npos) {
+        return 0;
+    }
+
+    // base64url without padding to standard base64
+    std::string payload = token.substr(first + 1, second - first - 1);
+    std::replace(payload.begin(), payload.end(), '-', '+');
+    std::replace(payload.begin(), payload.end(), '_', '/');
+    payload.append((4 - payload.size() % 4) % 4, '=');
+
+    const std::string claims = base64_decode(payload);
+    Json::Value value;
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    std::string errors;
+    if (!reader->parse(claims.data(), claims.data() + claims.size(), &value, &errors) ||
+        !value.isObject() || !value["exp"].isNumeric()) {
+        return 0;
+    }
+    return std::max<int64_t>(value["exp"].asInt64() - time(nullptr), 0);
+}
+
+bool EtcdAuth::authenticate(std::string& token, Clock::duration& lifetime) const {
+    Json::Value request;
+    request["name"] = user_;
+    request["password"] = password_;
+
+    Json::Value response;
+    if (!client_.post("/v3/auth/authenticate", request, &response) ||
+        !response["token"].isString() || response["token"].asString().empty()) {
+        return false;
+    }
+
+    token = response["token"].asString();
+    const int64_t jwt = jwt_lifetime(token);
+    lifetime = jwt > 0 ? Clock::duration(std::chrono::seconds(jwt)) : Clock::duration(token_ttl_);
+    return true;
+}
+
+std::string EtcdAuth::token() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    const Clock::time_point now = Clock::now();
+    const bool valid = !token_.empty() && now < expires_at_;
+    if (valid && now < refresh_at_) {
+        return token_;
+    }
+    if (renewing_) {
+        // Another thread is renewing: the current token is still good, or
+        // there is nothing better to send until the renewal finishes
+        if (!valid) {
+            renewed_.wait(lock, [this] { return !renewing_; });
+        }
+        return token_;
+    }
+    if (now < retry_at_) {
+        return token_;
+    }
+
+    renewing_ = true;
+    lock.unlock();
+
+    std::string fresh;
+    Clock::duration lifetime;
+    const bool ok = authenticate(fresh, lifetime);
+
+    lock.lock();
+    renewing_ = false;
+    const Clock::time_point done = Clock::now();
+    if (ok) {
+        token_ = fresh;
+        expires_at_ = done + lifetime;
+        refresh_at_ = done + lifetime * 4 / 5;
+        authentications_++;
+    } else {
+        // Keep a token that has not expired yet; requests keep using it
+        retry_at_ = done + std::chrono::seconds(AUTH_RETRY_SECONDS);
+        failures_++;
+        std::cerr << "Kea etcd hook: etcd authentication as " << user_ << " failed" << std::endl;
+    }
+    renewed_.notify_all();
+    return token_;
+}
+
+std::string EtcdAuth::renew(const std::string& rejected) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rejected_++;
+        if (token_ == rejected) {
+            // Revoked or expired early; a newer token means someone renewed
+            refresh_at_ = expires_at_ = Clock::time_point();
+        }
+    }
+    return token();
+}
+
+EtcdAuthStats EtcdAuth::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    EtcdAuthStats stats;
+    stats.authentications = authentications_;
+    stats.failures = failures_;
+    stats.rejected = rejected_;
+    return stats;
+}
+
+} // namespace nnoe
@@ -0,0 +1,85 @@
+/**
+ * etcd authentication token cache for the NNOE Kea hooks
+ *
+ * etcd checks a password with bcrypt, so authenticating per request would
+ * double the request count and load etcd's slowest path. One EtcdAuth is
+ * shared by every client of the process (sender threads, watchers, warm-up):
+ *
+ *   - the token is obtained once with /v3/auth/authenticate and cached;
+ *   - it is renewed proactively at 80% of its lifetime (the "exp" claim of
+ *     a JWT token, otherwise the configured etcd --auth-token-ttl); one
+ *     caller renews while the others keep using the current token;
+ *   - a request rejected with "invalid auth token" renews at most once per
+ *     rejected token, however many threads saw the rejection, and is then
+ *     retried once (asynchronous requests fail instead, and the caller's
+ *     next request renews);
+ *   - failed authentications are not retried for AUTH_RETRY_SECONDS.
+ */
+
+#ifndef NNOE_ETCD_AUTH_H
+#define NNOE_ETCD_AUTH_H
+
+#include "etcd_client.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace nnoe {
+
+struct EtcdAuthStats {
+    uint64_t authentications = 0;
+    uint64_t failures = 0;
+    uint64_t rejected = 0;      // requests answered with an invalid token error
+};
+
+class EtcdAuth {
+public:
+    // token_ttl: etcd's --auth-token-ttl, used when the token carries no expiry
+    EtcdAuth(const std::string& endpoint, const std::string& user, const std::string& password,
+             uint32_t token_ttl = 300);
+
+    // CA and client certificate for https endpoints (before the first token)
+    void set_tls(const EtcdTls& tls) { client_.set_tls(tls); }
+
+    // Current token, authenticating first when there is none or it is due
+    // for renewal; empty if etcd could not be authenticated against
+    std::string token();
+
+    // A request was rejected with token: renew unless another thread already
+    // has, and return the token to retry with
+    std::string renew(const std::string& rejected);
+
+    EtcdAuthStats stats() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    bool authenticate(std::string& token, Clock::duration& lifetime) const;
+
+    // Seconds until the "exp" claim of a JWT token, 0 for other tokens
+    static int64_t jwt_lifetime(const std::string& token);
+
+    EtcdClient client_;    // unauthenticated, for /v3/auth/authenticate only
+    std::string user_;
+    std::string password_;
+    std::chrono::seconds token_ttl_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable renewed_;
+    std::string token_;
+    Clock::time_point refresh_at_;
+    Clock::time_point expires_at_;
+    Clock::time_point retry_at_;
+    bool renewing_ = false;
+
+    uint64_t authentications_ = 0;
+    uint64_t failures_ = 0;
+    uint64_t rejected_ = 0;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_ETCD_AUTH_H
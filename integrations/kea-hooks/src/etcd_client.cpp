@@ -0,0 +1,911 @@
+/**
+ * Minimal etcd v3 client for the NNOE Kea hooks
+ */
+
+#include "etcd_client.h"
+#include "etcd_auth.h"
+#include "probes.h"
+
+#include <nnoe/lease_reader.h>
+
+#include <curl/curl.h>
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/buffer.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace nnoe {
+
+// Smallest page a range read shrinks to under memory pressure
+static const int64_t MIN_PAGE_SIZE = 50;
+
+struct ResponseBuffer {
+    std::string* body;
+    MemoryAccount* memory;
+    uint64_t charged;
+};
+
+// CURL write callback for HTTP responses
+static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    ResponseBuffer* buffer = static_cast<ResponseBuffer*>(userp);
+    buffer->body->append((char*)contents, size * nmemb);
+    if (buffer->memory) {
+        buffer->memory->charge(size * nmemb);
+        buffer->charged += size * nmemb;
+    }
+    return size * nmemb;
+}
+
+// Base64 encode using OpenSSL
+std::string base64_encode(const std::string& input) {
+    BIO *bio, *b64;
+    BUF_MEM *bufferPtr;
+
+    b64 = BIO_new(BIO_f_base64());
+    bio = BIO_new(BIO_s_mem());
+    bio = BIO_push(b64, bio);
+
+    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+    BIO_write(bio, input.c_str(), static_cast<int>(input.length()));
+    BIO_flush(bio);
+
+    BIO_get_mem_ptr(bio, &bufferPtr);
+    std::string encoded(bufferPtr->data, bufferPtr->length);
+
+    BIO_free_all(bio);
+
+    return encoded;
+}
+
+// Base64 decode using OpenSSL
+std::string base64_decode(const std::string& input) {
+    if (input.empty()) {
+        return std::string();
+    }
+
+    BIO *bio, *b64;
+
+    b64 = BIO_new(BIO_f_base64());
+    bio = BIO_new_mem_buf(input.data(), static_cast<int>(input.length()));
+    bio = BIO_push(b64, bio);
+
+    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+
+    std::string decoded(input.length(), '\0');
+    int len = BIO_read(bio, &decoded[0], static_cast<int>(decoded.length()));
+    decoded.resize(len > 0 ? len : 0);
+
+    BIO_free_all(bio);
+
+    return decoded;
+}
+
+std::string prefix_range_end(const std::string& prefix) {
+    std::string end = prefix;
+    while (!end.empty()) {
+        unsigned char last = static_cast<unsigned char>(end.back());
+        if (last < 0xff) {
+            end.back() = static_cast<char>(last + 1);
+            return end;
+        }
+        end.pop_back();
+    }
+    // Prefix of all 0xff bytes: range to the end of the keyspace
+    return std::string(1, '\0');
+}
+
+int64_t json_int64(const Json::Value& value) {
+    if (value.isString()) {
+        try {
+            return std::stoll(value.asString());
+        } catch (const std::exception&) {
+            return 0;
+        }
+    }
+    if (value.isNumeric()) {
+        return value.asInt64();
+    }
+    return 0;
+}
+
+static bool parse_json(const std::string& text, Json::Value& out) {
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    std::string errors;
+    return reader->parse(text.data(), text.data() + text.size(), &out, &errors);
+}
+
+static EtcdKeyValue decode_kv(const Json::Value& kv) {
+    EtcdKeyValue out;
+    out.key = base64_decode(kv["key"].asString());
+    out.value = base64_decode(kv["value"].asString());
+    out.mod_revision = json_int64(kv["mod_revision"]);
+    return out;
+}
+
+std::string format_sequence(uint64_t sequence) {
+    char buf[21];
+    snprintf(buf, sizeof(buf), "%020llu", static_cast<unsigned long long>(sequence));
+    return buf;
+}
+
+static Json::Value encode_op(const EtcdOp& op) {
+    Json::Value request_op;
+    if (op.type == EtcdOp::PUT) {
+        request_op["request_put"]["key"] = base64_encode(op.key);
+        request_op["request_put"]["value"] = base64_encode(op.value);
+        if (op.lease) {
+            request_op["request_put"]["lease"] = std::to_string(op.lease);
+        }
+    } else if (op.value.empty()) {
+        request_op["request_delete_range"]["key"] = base64_encode(op.key);
+    } else {
+        // Nested txn: a missing key or another value leaves it alone
+        Json::Value held;
+        held["key"] = base64_encode(op.key);
+        held["target"] = "VALUE";
+        held["result"] = "EQUAL";
+        held["value"] = base64_encode(op.value);
+
+        Json::Value& txn = request_op["request_txn"];
+        txn["compare"].append(held);
+        txn["success"][0]["request_delete_range"]["key"] = base64_encode(op.key);
+    }
+    return request_op;
+}
+
+EtcdClient::EtcdClient(const std::string& endpoint)
+    : endpoint_(endpoint), memory_(nullptr) {
+}
+
+bool EtcdClient::post(const std::string& path, const Json::Value& request,
+                      Json::Value* response) const {
+    std::string body;
+    if (!post_raw(path, request, body)) {
+        return false;
+    }
+
+    if (response && !parse_json(body, *response)) {
+        std::cerr << "Kea etcd hook: unparsable etcd response on " << path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void EtcdClient::apply_tls(void* handle) const {
+    CURL* curl = static_cast<CURL*>(handle);
+    if (!tls_.ca_file.empty()) {
+        curl_easy_setopt(curl, CURLOPT_CAINFO, tls_.ca_file.c_str());
+    }
+    if (!tls_.cert_file.empty()) {
+        curl_easy_setopt(curl, CURLOPT_SSLCERT, tls_.cert_file.c_str());
+        curl_easy_setopt(curl, CURLOPT_SSLKEY, tls_.key_file.c_str());
+    }
+}
+
+bool EtcdClient::perform(const std::string& path, const std::string& body,
+                         const std::string& token, std::string& readBuffer,
+                         long& response_code) const {
+    if (!transport_ || !transport_->available(true)) {
+        return perform_curl(path, body, token, readBuffer, response_code);
+    }
+
+    // Wait for the transport's completion
+    struct Wait {
+        std::mutex mutex;
+        std::condition_variable done_cv;
+        bool done = false;
+        bool ok = false;
+        long status = 0;
+        std::string body;
+    };
+    auto wait = std::make_shared<Wait>();
+
+    if (memory_) {
+        memory_->charge(body.size());
+    }
+    NNOE_PROBE2(request_start, path.c_str(), body.size());
+    const uint64_t started = NNOE_PROBE_ENABLED(request_done) ? probe_clock_ns() : 0;
+
+    transport_->post(path, body, token, [wait](bool ok, long status, std::string& response) {
+        std::lock_guard<std::mutex> lock(wait->mutex);
+        wait->ok = ok;
+        wait->status = status;
+        wait->body.swap(response);
+        wait->done = true;
+        wait->done_cv.notify_one();
+    });
+    {
+        std::unique_lock<std::mutex> lock(wait->mutex);
+        wait->done_cv.wait(lock, [&wait] { return wait->done; });
+    }
+
+    if (started) {
+        NNOE_PROBE3(request_done, path.c_str(), wait->status, probe_clock_ns() - started);
+    }
+    if (memory_) {
+        memory_->release(body.size());
+    }
+    readBuffer.swap(wait->body);
+    response_code = wait->status;
+    return wait->ok;
+}
+
+bool EtcdClient::perform_curl(const std::string& path, const std::string& body,
+                              const std::string& token, std::string& readBuffer,
+                              long& response_code) const {
+    CURL *curl;
+    CURLcode res;
+    readBuffer.clear();
+    response_code = 0;
+
+    curl = curl_easy_init();
+    if (!curl) {
+        return false;
+    }
+
+    std::string url = endpoint_ + path;
+
+    ResponseBuffer buffer{&readBuffer, memory_, body.size()};
+    if (memory_) {
+        memory_->charge(buffer.charged);
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+    apply_tls(curl);
+
+    struct curl_slist *headers = NULL;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+    if (!token.empty()) {
+        headers = curl_slist_append(headers, ("Authorization: " + token).c_str());
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    NNOE_PROBE2(request_start, path.c_str(), body.size());
+    const uint64_t started = NNOE_PROBE_ENABLED(request_done) ? probe_clock_ns() : 0;
+
+    res = curl_easy_perform(curl);
+
+    if (res == CURLE_OK) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    }
+    if (started) {
+        NNOE_PROBE3(request_done, path.c_str(), response_code, probe_clock_ns() - started);
+    }
+
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
+    if (memory_) {
+        memory_->release(buffer.charged);
+    }
+
+    if (res != CURLE_OK) {
+        std::cerr << "Kea etcd hook: curl error: " << curl_easy_strerror(res) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void EtcdClient::perform_async(const std::string& path, const std::string& body,
+                               const std::string& token,
+                               const EtcdTransport::Completion& completion) const {
+    if (!transport_ || !transport_->available(false)) {
+        std::string response;
+        long response_code = 0;
+        const bool ok = perform_curl(path, body, token, response, response_code);
+        completion(ok, response_code, response);
+        return;
+    }
+
+    // The request body stays charged until the response is handled
+    MemoryAccount* memory = memory_;
+    const uint64_t charged = body.size();
+    if (memory) {
+        memory->charge(charged);
+    }
+    NNOE_PROBE2(request_start, path.c_str(), body.size());
+    const uint64_t started = NNOE_PROBE_ENABLED(request_done) ? probe_clock_ns() : 0;
+
+    transport_->post(path, body, token,
+        [path, memory, charged, started, completion](bool ok, long status, std::string& response) {
+            if (started) {
+                NNOE_PROBE3(request_done, path.c_str(), status, probe_clock_ns() - started);
+            }
+            if (memory) {
+                memory->charge(response.size());
+            }
+            completion(ok, status, response);
+            if (memory) {
+                memory->release(charged + response.size());
+            }
+        });
+}
+
+bool EtcdClient::rejected(long response_code, const std::string& body) const {
+    return auth_ && (response_code == 401 ||
+                     body.find("invalid auth token") != std::string::npos);
+}
+
+bool EtcdClient::check_response(const std::string& path, long response_code,
+                                const std::string& body) const {
+    if (response_code != 200 && response_code != 201) {
+        std::cerr << "Kea etcd hook: etcd API error on " << path
+                  << ", response code: " << response_code << std::endl;
+        std::cerr << "Response: " << body << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool EtcdClient::post_raw(const std::string& path, const Json::Value& request,
+                          std::string& readBuffer) const {
+    Json::StreamWriterBuilder builder;
+    std::string etcd_json = Json::writeString(builder, request);
+
+    std::string token = auth_ ? auth_->token() : std::string();
+    long response_code = 0;
+    if (!perform(path, etcd_json, token, readBuffer, response_code)) {
+        return false;
+    }
+
+    // Token expired or revoked: renew (once for all threads) and retry once
+    if (rejected(response_code, readBuffer)) {
+        token = auth_->renew(token);
+        if (!perform(path, etcd_json, token, readBuffer, response_code)) {
+            return false;
+        }
+    }
+
+    return check_response(path, response_code, readBuffer);
+}
+
+void EtcdClient::post_raw_async(const std::string& path, const Json::Value& request,
+                                const RawCompletion& done) const {
+    Json::StreamWriterBuilder builder;
+    const std::string etcd_json = Json::writeString(builder, request);
+
+    std::string token;
+    if (auth_) {
+        std::string stale;
+        bool renew;
+        {
+            std::lock_guard<std::mutex> lock(rejected_mutex_);
+            renew = renew_pending_;
+            renew_pending_ = false;
+            stale.swap(rejected_token_);
+        }
+        token = renew ? auth_->renew(stale) : auth_->token();
+    }
+
+    perform_async(path, etcd_json, token,
+        [this, path, token, done](bool ok, long response_code, std::string& body) {
+            if (!ok) {
+                done(false, 0, body);
+                return;
+            }
+            if (!rejected(response_code, body)) {
+                done(check_response(path, response_code, body), response_code, body);
+                return;
+            }
+
+            // Possibly on Kea's IO thread: leave the renewal (a blocking
+            // authentication) to the caller, which retries the request
+            {
+                std::lock_guard<std::mutex> lock(rejected_mutex_);
+                rejected_token_ = token;
+                renew_pending_ = true;
+            }
+            done(false, 0, body);
+        });
+}
+
+bool EtcdClient::put(const std::string& key, const std::string& value) const {
+    Json::Value etcd_request;
+    etcd_request["key"] = base64_encode(key);
+    etcd_request["value"] = base64_encode(value);
+    return post("/v3/kv/put", etcd_request);
+}
+
+bool EtcdClient::lease_grant(int64_t ttl, int64_t& id) const {
+    Json::Value etcd_request;
+    etcd_request["TTL"] = std::to_string(ttl);
+
+    Json::Value response;
+    if (!post("/v3/lease/grant", etcd_request, &response)) {
+        return false;
+    }
+    id = json_int64(response["ID"]);
+    return id != 0;
+}
+
+bool EtcdClient::delete_key(const std::string& key) const {
+    Json::Value etcd_request;
+    etcd_request["key"] = base64_encode(key);
+    return post("/v3/kv/deleterange", etcd_request);
+}
+
+bool EtcdClient::txn(const std::vector<EtcdOp>& ops) const {
+    if (ops.empty()) {
+        return true;
+    }
+
+    Json::Value etcd_request;
+    Json::Value& success = etcd_request["success"];
+    for (const auto& op : ops) {
+        success.append(encode_op(op));
+    }
+
+    return post("/v3/kv/txn", etcd_request);
+}
+
+bool EtcdClient::txn_create(const std::string& key, const std::vector<EtcdOp>& ops,
+                            bool& created, std::string* current) const {
+    Json::Value absent;
+    absent["key"] = base64_encode(key);
+    absent["target"] = "CREATE";
+    absent["result"] = "EQUAL";
+    absent["create_revision"] = "0";
+
+    Json::Value etcd_request;
+    etcd_request["compare"].append(absent);
+    for (const auto& op : ops) {
+        etcd_request["success"].append(encode_op(op));
+    }
+    etcd_request["failure"][0]["request_range"]["key"] = base64_encode(key);
+
+    Json::Value response;
+    if (!post("/v3/kv/txn", etcd_request, &response)) {
+        return false;
+    }
+    // proto3 JSON omits false booleans
+    created = response["succeeded"].asBool();
+    if (!created && current) {
+        const Json::Value& kvs = response["responses"][0]["response_range"]["kvs"];
+        *current = kvs.empty() ? std::string() : decode_kv(kvs[0]).value;
+    }
+    return true;
+}
+
+// Nested txn applying each group under its guard; txn_index receives, per
+// group, its position in success (-1 for unguarded groups)
+static Json::Value encode_guarded(const std::vector<EtcdGuardedOps>& groups,
+                                  std::vector<int>& txn_index) {
+    Json::Value etcd_request;
+    Json::Value& success = etcd_request["success"];
+    txn_index.assign(groups.size(), -1);
+
+    for (size_t g = 0; g < groups.size(); ++g) {
+        const EtcdGuardedOps& group = groups[g];
+        if (!group.guard.active()) {
+            for (const auto& op : group.ops) {
+                success.append(encode_op(op));
+            }
+            continue;
+        }
+
+        const std::string guard_key = base64_encode(group.guard.key);
+        const std::string sequence = base64_encode(format_sequence(group.guard.sequence));
+
+        Json::Value ops(Json::arrayValue);
+        for (const auto& op : group.ops) {
+            ops.append(encode_op(op));
+        }
+        Json::Value stamp;
+        stamp["request_put"]["key"] = guard_key;
+        stamp["request_put"]["value"] = sequence;
+        if (group.guard.lease) {
+            stamp["request_put"]["lease"] = std::to_string(group.guard.lease);
+        }
+        ops.append(stamp);
+
+        // A VALUE compare always fails on a missing key, so the first write
+        // is told apart by create_revision == 0 and the ordered case nests
+        // in the failure branch
+        Json::Value missing;
+        missing["key"] = guard_key;
+        missing["target"] = "CREATE";
+        missing["result"] = "EQUAL";
+        missing["create_revision"] = "0";
+
+        Json::Value older;
+        older["key"] = guard_key;
+        older["target"] = "VALUE";
+        older["result"] = "LESS";
+        older["value"] = sequence;
+
+        Json::Value ordered;
+        ordered["compare"].append(older);
+        ordered["success"] = ops;
+
+        Json::Value first;
+        first["compare"].append(missing);
+        first["success"] = ops;
+        first["failure"].append(Json::Value());
+        first["failure"][0]["request_txn"] = ordered;
+
+        txn_index[g] = static_cast<int>(success.size());
+        success.append(Json::Value());
+        success[success.size() - 1]["request_txn"] = first;
+    }
+
+    return etcd_request;
+}
+
+static void decode_guarded(const Json::Value& response, const std::vector<int>& txn_index,
+                           std::vector<bool>& applied) {
+    // proto3 JSON omits false booleans: a missing "succeeded" is false
+    applied.assign(txn_index.size(), true);
+    const Json::Value& responses = response["responses"];
+    for (size_t g = 0; g < txn_index.size(); ++g) {
+        if (txn_index[g] < 0) {
+            continue;
+        }
+        const Json::Value& outer = responses[txn_index[g]]["response_txn"];
+        applied[g] = outer["succeeded"].asBool() ||
+            outer["responses"][0]["response_txn"]["succeeded"].asBool();
+    }
+}
+
+bool EtcdClient::txn_guarded(const std::vector<EtcdGuardedOps>& groups,
+                             std::vector<bool>* applied) const {
+    if (applied) {
+        applied->assign(groups.size(), true);
+    }
+    if (groups.empty()) {
+        return true;
+    }
+
+    std::vector<int> txn_index;
+    const Json::Value etcd_request = encode_guarded(groups, txn_index);
+
+    Json::Value response;
+    if (!post("/v3/kv/txn", etcd_request, applied ? &response : nullptr)) {
+        return false;
+    }
+    if (applied) {
+        decode_guarded(response, txn_index, *applied);
+    }
+    return true;
+}
+
+void EtcdClient::txn_guarded_async(const std::vector<EtcdGuardedOps>& groups,
+                                   const TxnCompletion& done) const {
+    if (groups.empty()) {
+        done(true, 200, std::vector<bool>());
+        return;
+    }
+
+    auto txn_index = std::make_shared<std::vector<int>>();
+    const Json::Value etcd_request = encode_guarded(groups, *txn_index);
+
+    post_raw_async("/v3/kv/txn", etcd_request,
+        [txn_index, done](bool ok, long status, std::string& body) {
+            std::vector<bool> applied;
+            Json::Value response;
+            if (ok && !parse_json(body, response)) {
+                std::cerr << "Kea etcd hook: unparsable etcd response on /v3/kv/txn"
+                          << std::endl;
+                ok = false;
+            }
+            if (ok) {
+                decode_guarded(response, *txn_index, applied);
+            }
+            done(ok, status, applied);
+        });
+}
+
+bool EtcdClient::range_prefix(const std::string& prefix, std::vector<EtcdKeyValue>& out,
+                              int64_t& revision, int64_t page_size) const {
+    revision = 0;
+    return range_pages(prefix, prefix_range_end(prefix),
+                       [&out](std::vector<EtcdKeyValue>& page) {
+                           for (auto& kv : page) {
+                               out.push_back(std::move(kv));
+                           }
+                           return true;
+                       },
+                       revision, page_size);
+}
+
+bool EtcdClient::range_pages(const std::string& key, const std::string& range_end,
+                             const PageHandler& handler, int64_t& revision,
+                             int64_t page_size, bool keys_only) const {
+    const std::string range_end_b64 = base64_encode(range_end);
+    std::string start = key;
+
+    for (;;) {
+        Json::Value etcd_request;
+        etcd_request["key"] = base64_encode(start);
+        etcd_request["range_end"] = range_end_b64;
+        etcd_request["limit"] = static_cast<Json::Int64>(page_size);
+        if (keys_only) {
+            etcd_request["keys_only"] = true;
+        }
+        if (revision > 0) {
+            // Pin later pages to the revision of the first one
+            etcd_request["revision"] = static_cast<Json::Int64>(revision);
+        }
+
+        std::string body;
+        if (!post_raw("/v3/kv/range", etcd_request, body)) {
+            return false;
+        }
+
+        // The body and its decoded page are held until the handler returns
+        uint64_t held = 0;
+        if (memory_) {
+            held = 2 * body.size();
+            memory_->charge(held);
+        }
+        struct Release {
+            MemoryAccount* memory;
+            uint64_t bytes;
+            ~Release() {
+                if (memory) {
+                    memory->release(bytes);
+                }
+            }
+        } release{memory_, held};
+
+        // Large scans are bound by decoding, so skip the generic JSON parser
+        RangeResponseReader response(&body[0], body.size());
+        if (!response.valid()) {
+            std::cerr << "Kea etcd hook: unparsable etcd response on /v3/kv/range" << std::endl;
+            return false;
+        }
+        if (revision == 0) {
+            revision = response.revision();
+        }
+
+        std::vector<EtcdKeyValue> page;
+        KeyValueView kv;
+        while (response.next(kv)) {
+            EtcdKeyValue decoded;
+            decoded.key.assign(kv.key.data(), kv.key.size());
+            decoded.value.assign(kv.value.data(), kv.value.size());
+            decoded.mod_revision = kv.mod_revision;
+            page.push_back(std::move(decoded));
+        }
+        if (!response.valid()) {
+            std::cerr << "Kea etcd hook: unparsable etcd response on /v3/kv/range" << std::endl;
+            return false;
+        }
+        if (page.empty()) {
+            return true;
+        }
+
+        // Continue right after the last key returned
+        start = page.back().key;
+        start.push_back('\0');
+
+        if (!handler(page)) {
+            return true;
+        }
+        if (!response.more()) {
+            return true;
+        }
+
+        // Under memory pressure continue with smaller pages
+        if (memory_ && memory_->exhausted() && page_size > MIN_PAGE_SIZE) {
+            page_size = std::max(page_size / 2, MIN_PAGE_SIZE);
+        }
+    }
+}
+
+namespace {
+
+struct WatchStream {
+    const EtcdClient::WatchStreamHandler* handler;
+    const std::atomic<bool>* stop;
+    size_t targets = 0;
+    size_t created = 0;                    // create requests acknowledged so far
+    std::map<int64_t, size_t> watch_ids;   // etcd watch id -> target
+    std::string buffer;
+    bool ended = false;                    // the handler ended the stream
+    bool failed = false;
+    bool unauthenticated = false;
+};
+
+// Handle one WatchResponse line from the gateway stream
+void handle_watch_line(WatchStream& stream, const std::string& line) {
+    Json::Value message;
+    if (!parse_json(line, message)) {
+        return;
+    }
+
+    if (message.isMember("error")) {
+        const std::string error = message["error"].get("message", "").asString();
+        std::cerr << "Kea etcd hook: watch error: " << error << std::endl;
+        stream.failed = true;
+        stream.unauthenticated = error.find("invalid auth token") != std::string::npos;
+        return;
+    }
+
+    const Json::Value& result = message["result"];
+    const int64_t watch_id = json_int64(result["watch_id"]);
+    if (result["created"].asBool()) {
+        // etcd acknowledges create requests in the order they were sent
+        if (stream.created < stream.targets) {
+            stream.watch_ids[watch_id] = stream.created++;
+        }
+        return;
+    }
+
+    auto target = stream.watch_ids.find(watch_id);
+    if (target == stream.watch_ids.end()) {
+        return;
+    }
+
+    EtcdWatchResponse response;
+    response.target = target->second;
+    response.revision = json_int64(result["header"]["revision"]);
+
+    const int64_t compact_revision = json_int64(result["compact_revision"]);
+    if (compact_revision > 0) {
+        stream.watch_ids.erase(target);
+        response.type = EtcdWatchResponse::COMPACTED;
+        response.revision = compact_revision;
+    } else if (result["canceled"].asBool()) {
+        stream.failed = true;
+        return;
+    } else {
+        const Json::Value& events = result["events"];
+        response.type = events.size() ? EtcdWatchResponse::EVENTS : EtcdWatchResponse::PROGRESS;
+        response.events.reserve(events.size());
+        for (Json::ArrayIndex i = 0; i < events.size(); ++i) {
+            EtcdWatchEvent event;
+            event.type = events[i]["type"].asString() == "DELETE" ?
+                EtcdWatchEvent::DELETE : EtcdWatchEvent::PUT;
+            event.kv = decode_kv(events[i]["kv"]);
+            response.events.push_back(std::move(event));
+        }
+    }
+
+    if (!(*stream.handler)(response)) {
+        stream.ended = true;
+    }
+}
+
+size_t WatchWriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    WatchStream* stream = static_cast<WatchStream*>(userp);
+    stream->buffer.append(static_cast<char*>(contents), size * nmemb);
+
+    // The gateway delimits streamed messages with newlines
+    size_t pos;
+    while ((pos = stream->buffer.find('\n')) != std::string::npos) {
+        std::string line = stream->buffer.substr(0, pos);
+        stream->buffer.erase(0, pos + 1);
+        if (!line.empty()) {
+            handle_watch_line(*stream, line);
+        }
+        if (stream->ended || stream->failed) {
+            return 0; // abort transfer
+        }
+    }
+    return size * nmemb;
+}
+
+int WatchProgressCallback(void *userp, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    WatchStream* stream = static_cast<WatchStream*>(userp);
+    return stream->stop->load() ? 1 : 0;
+}
+
+} // namespace
+
+EtcdClient::WatchResult
+EtcdClient::watch_prefix(const std::string& prefix, int64_t start_revision,
+                         const WatchHandler& handler,
+                         const std::atomic<bool>& stop) const {
+    EtcdWatchTarget target;
+    target.prefix = prefix;
+    target.start_revision = start_revision;
+
+    bool compacted = false;
+    const WatchResult result = watch_stream({target},
+        [&](EtcdWatchResponse& response) {
+            if (response.type == EtcdWatchResponse::COMPACTED) {
+                compacted = true;
+                return false;
+            }
+            if (response.type == EtcdWatchResponse::EVENTS) {
+                handler(response.events, response.revision);
+            }
+            return true;
+        },
+        stop);
+
+    if (compacted && !stop.load()) {
+        return WATCH_COMPACTED;
+    }
+    return result;
+}
+
+EtcdClient::WatchResult
+EtcdClient::watch_stream(const std::vector<EtcdWatchTarget>& targets,
+                         const WatchStreamHandler& handler,
+                         const std::atomic<bool>& stop) const {
+    if (targets.empty()) {
+        return WATCH_STOPPED;
+    }
+
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        return WATCH_ERROR;
+    }
+
+    // The gateway reads the request body as a sequence of WatchRequests, so
+    // one POST carries a create request per target
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    std::string etcd_json;
+    for (const auto& target : targets) {
+        Json::Value create_request;
+        create_request["key"] = base64_encode(target.prefix);
+        create_request["range_end"] = base64_encode(prefix_range_end(target.prefix));
+        if (target.start_revision > 0) {
+            create_request["start_revision"] = static_cast<Json::Int64>(target.start_revision);
+        }
+        create_request["progress_notify"] = true;
+        Json::Value etcd_request;
+        etcd_request["create_request"] = create_request;
+        etcd_json += Json::writeString(builder, etcd_request);
+        etcd_json += "\n";
+    }
+    std::string url = endpoint_ + "/v3/watch";
+
+    WatchStream stream;
+    stream.handler = &handler;
+    stream.stop = &stop;
+    stream.targets = targets.size();
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, etcd_json.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WatchWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &stream);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, WatchProgressCallback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &stream);
+    apply_tls(curl);
+
+    const std::string token = auth_ ? auth_->token() : std::string();
+    struct curl_slist *headers = NULL;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+    if (!token.empty()) {
+        headers = curl_slist_append(headers, ("Authorization: " + token).c_str());
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    CURLcode res = curl_easy_perform(curl);
+
+    long response_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
+
+    if (stop.load() || stream.ended) {
+        return WATCH_STOPPED;
+    }
+    if (auth_ && (stream.unauthenticated || response_code == 401)) {
+        // The caller reconnects after its backoff with the renewed token
+        auth_->renew(token);
+        return WATCH_ERROR;
+    }
+    if (res != CURLE_OK && !stream.failed) {
+        std::cerr << "Kea etcd hook: watch on " << targets.front().prefix
+                  << (targets.size() > 1 ? " and others" : "") << " failed: "
+                  << curl_easy_strerror(res) << std::endl;
+    }
+    return WATCH_ERROR;
+}
+
+} // namespace nnoe
@@ -0,0 +1,311 @@
+/**
+ * Minimal etcd v3 client for the NNOE Kea hooks
+ *
+ * Talks to etcd through its JSON gRPC gateway (/v3/...) using libcurl and
+ * jsoncpp. Keys and values are base64 encoded on the wire as the gateway
+ * requires; callers always see decoded strings.
+ *
+ * With a memory account attached, request and response buffers are charged
+ * while a request is in flight, and paged range reads shrink their pages
+ * while the account or the budget is exhausted. With an EtcdAuth attached,
+ * requests carry its token (see etcd_auth.h).
+ *
+ * Requests other than watches can instead go through an EtcdTransport
+ * (inside Kea, Kea's own HTTP client, see kea_transport.h). Callers that
+ * can take a completion handler use the *_async calls, which return at once
+ * with such a transport; without one, or while it is unavailable, they run
+ * the request with libcurl on the calling thread.
+ */
+
+#ifndef NNOE_ETCD_CLIENT_H
+#define NNOE_ETCD_CLIENT_H
+
+#include "memory_budget.h"
+
+#include <json/json.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nnoe {
+
+class EtcdAuth;
+
+// Base64 helpers (etcd v3 gateway encodes all keys and values)
+std::string base64_encode(const std::string& input);
+std::string base64_decode(const std::string& input);
+
+// Smallest key greater than every key that starts with prefix (etcd range_end)
+std::string prefix_range_end(const std::string& prefix);
+
+// The gateway renders int64 fields as JSON strings
+int64_t json_int64(const Json::Value& value);
+
+struct EtcdKeyValue {
+    std::string key;
+    std::string value;
+    int64_t mod_revision = 0;
+};
+
+// One operation inside a transaction
+struct EtcdOp {
+    enum Type { PUT, DELETE };
+
+    Type type = PUT;
+    std::string key;
+    std::string value;    // DELETE: if set, only while the key holds exactly this
+    int64_t lease = 0;    // etcd lease the put is attached to, 0 for none
+
+    static EtcdOp put(const std::string& key, const std::string& value, int64_t lease = 0) {
+        EtcdOp op;
+        op.type = PUT;
+        op.key = key;
+        op.value = value;
+        op.lease = lease;
+        return op;
+    }
+
+    static EtcdOp del(const std::string& key) {
+        EtcdOp op;
+        op.type = DELETE;
+        op.key = key;
+        return op;
+    }
+
+    // Delete key unless something else has been stored there since value
+    static EtcdOp del_if(const std::string& key, const std::string& value) {
+        EtcdOp op = del(key);
+        op.value = value;
+        return op;
+    }
+};
+
+// Per-key ordering guard: a group of ops applies only while the sequence
+// stored at key is older than sequence (or key does not exist yet), and the
+// group then stores sequence at key. Sequences are compared as fixed-width
+// decimal strings, so etcd's byte-wise VALUE compare orders them numerically.
+// A non-zero lease attaches the stored sequence to that etcd lease, so the
+// guard of a deleted key expires with it; a later stamp without one detaches it.
+struct EtcdGuard {
+    std::string key;
+    uint64_t sequence = 0;
+    int64_t lease = 0;
+
+    bool active() const { return !key.empty(); }
+};
+
+struct EtcdGuardedOps {
+    EtcdGuard guard;
+    std::vector<EtcdOp> ops;
+};
+
+// Zero-padded decimal form of a sequence as stored in etcd
+std::string format_sequence(uint64_t sequence);
+
+struct EtcdWatchEvent {
+    enum Type { PUT, DELETE };
+
+    Type type = PUT;
+    EtcdKeyValue kv;
+};
+
+// One prefix of a multiplexed watch stream
+struct EtcdWatchTarget {
+    std::string prefix;
+    int64_t start_revision = 0;   // 0: from the current revision
+};
+
+// What a multiplexed watch stream delivered for one of its targets
+struct EtcdWatchResponse {
+    enum Type {
+        EVENTS,      // changes, in revision order
+        PROGRESS,    // no changes up to revision (progress notification)
+        COMPACTED    // start revision compacted away; the target's watch is gone
+    };
+
+    Type type = EVENTS;
+    size_t target = 0;            // index into the targets
+    int64_t revision = 0;         // header revision, or the compaction revision
+    std::vector<EtcdWatchEvent> events;
+};
+
+// TLS files for https endpoints; empty: the system trust store, no
+// client certificate
+struct EtcdTls {
+    std::string ca_file;
+    std::string cert_file;
+    std::string key_file;
+};
+
+// Alternative HTTP transport for the client's requests
+class EtcdTransport {
+public:
+    // ok is false on transport errors (status is then 0)
+    typedef std::function<void(bool ok, long status, std::string& body)> Completion;
+
+    virtual ~EtcdTransport() {}
+
+    // Whether a request can be issued now. A blocking caller waits for the
+    // completion, which must then run on a thread of the transport's own.
+    virtual bool available(bool blocking) const = 0;
+
+    // POST body to path, with token as Authorization unless empty.
+    // completion runs exactly once, usually on a transport thread.
+    virtual void post(const std::string& path, const std::string& body,
+                      const std::string& token, const Completion& completion) = 0;
+};
+
+class EtcdClient {
+public:
+    enum WatchResult {
+        WATCH_STOPPED,    // stop flag was raised
+        WATCH_ERROR,      // connection failed or stream ended
+        WATCH_COMPACTED   // start revision was compacted, caller must re-read
+    };
+
+    typedef std::function<void(const std::vector<EtcdWatchEvent>& events,
+                               int64_t revision)> WatchHandler;
+
+    // Receives each response of a multiplexed stream; returning false ends it
+    typedef std::function<bool(EtcdWatchResponse& response)> WatchStreamHandler;
+
+    // Receives one page of a range read; returning false stops the read
+    typedef std::function<bool(std::vector<EtcdKeyValue>& page)> PageHandler;
+
+    // Completions of the asynchronous calls. status is the HTTP status of
+    // the response, 0 when none arrived or the request is worth repeating
+    // as it is (a rejected token, renewed by the next request).
+    typedef std::function<void(bool ok, long status, std::string& body)> RawCompletion;
+    typedef std::function<void(bool ok, long status, const std::vector<bool>& applied)>
+        TxnCompletion;
+
+    explicit EtcdClient(const std::string& endpoint);
+
+    // Charge HTTP buffers to account (before the first request)
+    void set_memory(MemoryAccount* account) { memory_ = account; }
+
+    // Authenticate requests with tokens from auth, usually shared by every
+    // client of the process (before the first request)
+    void set_auth(const std::shared_ptr<EtcdAuth>& auth) { auth_ = auth; }
+
+    // CA and client certificate for https endpoints (before the first request)
+    void set_tls(const EtcdTls& tls) { tls_ = tls; }
+
+    // Send requests other than watches through transport while it is
+    // available (before the first request)
+    void set_transport(const std::shared_ptr<EtcdTransport>& transport) {
+        transport_ = transport;
+    }
+
+    // Whether the asynchronous calls currently complete on transport threads
+    // rather than on the calling one
+    bool asynchronous() const { return transport_ && transport_->available(false); }
+
+    // POST a JSON request to a gateway path such as "/v3/kv/put".
+    // The parsed response body is stored in response when provided.
+    bool post(const std::string& path, const Json::Value& request,
+              Json::Value* response = nullptr) const;
+
+    // As post(), but hands back the unparsed response body, for callers
+    // that read it with nnoe/lease_reader.h
+    bool post_raw(const std::string& path, const Json::Value& request,
+                  std::string& body) const;
+
+    // As post_raw(), completing through done. The client must outlive the
+    // request. A request rejected for its token is not retried: renewing
+    // would block the transport thread on authentication, so it fails and
+    // the next asynchronous request renews the token on its calling thread.
+    void post_raw_async(const std::string& path, const Json::Value& request,
+                        const RawCompletion& done) const;
+
+    bool put(const std::string& key, const std::string& value) const;
+    bool delete_key(const std::string& key) const;
+
+    // Grant an etcd lease of ttl seconds; keys put with it go when it expires
+    bool lease_grant(int64_t ttl, int64_t& id) const;
+
+    // Apply all ops atomically in a single /v3/kv/txn (etcd rejects
+    // transactions that touch the same key twice)
+    bool txn(const std::vector<EtcdOp>& ops) const;
+
+    // Apply ops only while key does not exist, in one /v3/kv/txn. created
+    // tells whether they were; if not, current receives the value at key.
+    bool txn_create(const std::string& key, const std::vector<EtcdOp>& ops, bool& created,
+                    std::string* current = nullptr) const;
+
+    // Apply each group under its guard, all in one request (nested txns,
+    // etcd 3.3+). Groups without an active guard apply unconditionally.
+    // applied receives, per group, whether its guard let it through.
+    bool txn_guarded(const std::vector<EtcdGuardedOps>& groups,
+                     std::vector<bool>* applied = nullptr) const;
+
+    // As txn_guarded(), completing through done
+    void txn_guarded_async(const std::vector<EtcdGuardedOps>& groups,
+                           const TxnCompletion& done) const;
+
+    // Read every key under prefix in pages of page_size keys, all from the
+    // same revision. revision receives the store revision of the snapshot.
+    bool range_prefix(const std::string& prefix, std::vector<EtcdKeyValue>& out,
+                      int64_t& revision, int64_t page_size = 1000) const;
+
+    // Stream [key, range_end) to handler in pages of page_size keys. A
+    // revision > 0 pins the read to it, otherwise revision receives the one
+    // the first page was served at. keys_only leaves values empty, which
+    // keeps pages small when only key names and mod revisions are needed.
+    bool range_pages(const std::string& key, const std::string& range_end,
+                     const PageHandler& handler, int64_t& revision,
+                     int64_t page_size = 1000, bool keys_only = false) const;
+
+    // Stream changes under prefix starting at start_revision until the stream
+    // breaks or stop becomes true. Blocks the calling thread.
+    WatchResult watch_prefix(const std::string& prefix, int64_t start_revision,
+                             const WatchHandler& handler,
+                             const std::atomic<bool>& stop) const;
+
+    // Watch every target over one connection (one create request each, with
+    // progress notifications) until the stream breaks, stop becomes true or
+    // handler returns false (WATCH_STOPPED). A compacted target is reported
+    // to handler; the others keep streaming. Blocks the calling thread.
+    WatchResult watch_stream(const std::vector<EtcdWatchTarget>& targets,
+                             const WatchStreamHandler& handler,
+                             const std::atomic<bool>& stop) const;
+
+    const std::string& endpoint() const { return endpoint_; }
+
+private:
+    // One POST of body with token (empty: none); false on transport errors
+    bool perform(const std::string& path, const std::string& body, const std::string& token,
+                 std::string& response, long& response_code) const;
+    bool perform_curl(const std::string& path, const std::string& body,
+                      const std::string& token, std::string& response,
+                      long& response_code) const;
+    void perform_async(const std::string& path, const std::string& body,
+                       const std::string& token,
+                       const EtcdTransport::Completion& completion) const;
+
+    // Token renewal after a rejected request
+    bool rejected(long response_code, const std::string& body) const;
+    bool check_response(const std::string& path, long response_code,
+                        const std::string& body) const;
+
+    void apply_tls(void* curl) const;
+
+    std::string endpoint_;
+    MemoryAccount* memory_;
+    std::shared_ptr<EtcdAuth> auth_;
+    EtcdTls tls_;
+    std::shared_ptr<EtcdTransport> transport_;
+
+    // Token an asynchronous request saw rejected, for the next one to renew
+    mutable std::mutex rejected_mutex_;
+    mutable std::string rejected_token_;
+    mutable bool renew_pending_ = false;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_ETCD_CLIENT_H
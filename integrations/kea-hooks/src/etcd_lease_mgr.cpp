@@ -0,0 +1,1020 @@
+/**
+ * etcd lease database backend for Kea
+ */
+
+#include "etcd_lease_mgr.h"
+#include "lease_values.h"
+
+#include <nnoe/lease_reader.h>
+
+#include <asiolink/addr_utilities.h>
+#include <asiolink/io_address.h>
+#include <database/db_exceptions.h>
+#include <exceptions/exceptions.h>
+
+#include <algorithm>
+#include <ctime>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+using namespace isc::asiolink;
+using namespace isc::dhcp;
+
+namespace nnoe {
+
+namespace {
+
+// Cache key: the address bytes in network order
+std::string address_key(const IOAddress& addr) {
+    const std::vector<uint8_t> bytes = addr.toBytes();
+    return std::string(bytes.begin(), bytes.end());
+}
+
+std::string bytes_key(const char* kind, const std::vector<uint8_t>& bytes) {
+    return std::string(kind) + std::string(bytes.begin(), bytes.end());
+}
+
+std::string ia_key(Lease::Type type, const DUID& duid, uint32_t iaid) {
+    std::string key = bytes_key("ia:", duid.getDuid());
+    key += static_cast<char>(type);
+    key.append(reinterpret_cast<const char*>(&iaid), sizeof(iaid));
+    return key;
+}
+
+// Client identities a lease is looked up by
+std::vector<std::string> client_keys(const Lease4& lease) {
+    std::vector<std::string> keys;
+    if (lease.hwaddr_ && !lease.hwaddr_->hwaddr_.empty()) {
+        keys.push_back(bytes_key("hw:", lease.hwaddr_->hwaddr_));
+    }
+    if (lease.client_id_) {
+        keys.push_back(bytes_key("cid:", lease.client_id_->getClientId()));
+    }
+    return keys;
+}
+
+std::vector<std::string> client_keys(const Lease6& lease) {
+    std::vector<std::string> keys;
+    if (lease.duid_) {
+        keys.push_back(bytes_key("duid:", lease.duid_->getDuid()));
+        keys.push_back(ia_key(lease.type_, *lease.duid_, lease.iaid_));
+    }
+    return keys;
+}
+
+int64_t expires_at(const Lease& lease) {
+    if (lease.valid_lft_ == Lease::INFINITY_LFT) {
+        return std::numeric_limits<int64_t>::max();
+    }
+    return static_cast<int64_t>(lease.cltt_) + lease.valid_lft_;
+}
+
+// Record operation for a write of lease; live names writes of leases in
+// the default state
+const char* operation_for(const Lease& lease, const char* live) {
+    switch (lease.state_) {
+    case Lease::STATE_DECLINED:
+        return "decline";
+    case Lease::STATE_EXPIRED_RECLAIMED:
+        return "expire";
+    case Lease::STATE_RELEASED:
+        return "release";
+    default:
+        return live;
+    }
+}
+
+// Rows counted from the cache when the query was started
+class CachedLeaseStatsQuery : public LeaseStatsQuery {
+public:
+    CachedLeaseStatsQuery(const LeaseStateCounts& counts, bool v6) {
+        rows_.reserve(counts.size());
+        for (const auto& count : counts) {
+            const uint32_t subnet_id = std::get<0>(count.first);
+            const uint32_t state = std::get<2>(count.first);
+            if (v6) {
+                rows_.push_back(LeaseStatsRow(subnet_id,
+                                              static_cast<Lease::Type>(std::get<1>(count.first)),
+                                              state, count.second));
+            } else {
+                rows_.push_back(LeaseStatsRow(subnet_id, state, count.second));
+            }
+        }
+    }
+
+    bool getNextRow(LeaseStatsRow& row) override {
+        if (next_ == rows_.size()) {
+            return false;
+        }
+        row = rows_[next_++];
+        return true;
+    }
+
+private:
+    std::vector<LeaseStatsRow> rows_;
+    size_t next_ = 0;
+};
+
+template <typename Collection>
+void append_if(Collection& out, const Collection& in, uint32_t subnet_id) {
+    for (const auto& lease : in) {
+        if (lease->subnet_id_ == subnet_id) {
+            out.push_back(lease);
+        }
+    }
+}
+
+} // namespace
+
+template <typename LeaseT>
+void LeaseCache<LeaseT>::link(const std::string& key, const LeaseT& lease) {
+    for (const auto& client : client_keys(lease)) {
+        clients_[client].insert(key);
+    }
+    if (!lease.hostname_.empty()) {
+        hostnames_[lease.hostname_].insert(key);
+    }
+    subnets_[lease.subnet_id_].insert(key);
+    const int64_t expiry = expires_at(lease);
+    if (lease.state_ == Lease::STATE_EXPIRED_RECLAIMED) {
+        reclaimed_.insert(std::make_pair(expiry, key));
+    } else if (expiry != std::numeric_limits<int64_t>::max()) {
+        expiring_.insert(std::make_pair(expiry, key));
+    }
+}
+
+template <typename LeaseT>
+void LeaseCache<LeaseT>::unlink(const std::string& key, const LeaseT& lease) {
+    auto unindex = [&key](KeyIndex& index, const std::string& value) {
+        auto it = index.find(value);
+        if (it != index.end()) {
+            it->second.erase(key);
+            if (it->second.empty()) {
+                index.erase(it);
+            }
+        }
+    };
+    for (const auto& client : client_keys(lease)) {
+        unindex(clients_, client);
+    }
+    if (!lease.hostname_.empty()) {
+        unindex(hostnames_, lease.hostname_);
+    }
+    auto subnet = subnets_.find(lease.subnet_id_);
+    if (subnet != subnets_.end()) {
+        subnet->second.erase(key);
+        if (subnet->second.empty()) {
+            subnets_.erase(subnet);
+        }
+    }
+    const std::pair<int64_t, std::string> slot(expires_at(lease), key);
+    expiring_.erase(slot);
+    reclaimed_.erase(slot);
+}
+
+template <typename LeaseT>
+void LeaseCache<LeaseT>::put(const LeaseT& lease, bool foreign) {
+    const std::string key = address_key(lease.addr_);
+    auto it = leases_.find(key);
+    if (it != leases_.end()) {
+        unlink(key, *it->second.lease);
+        foreign_ -= it->second.foreign ? 1 : 0;
+        it->second.lease.reset(new LeaseT(lease));
+        it->second.foreign = foreign;
+    } else {
+        Entry entry;
+        entry.lease.reset(new LeaseT(lease));
+        entry.foreign = foreign;
+        it = leases_.emplace(key, std::move(entry)).first;
+    }
+    foreign_ += foreign ? 1 : 0;
+    link(key, *it->second.lease);
+}
+
+template <typename LeaseT>
+bool LeaseCache<LeaseT>::erase(const std::string& key) {
+    auto it = leases_.find(key);
+    if (it == leases_.end()) {
+        return false;
+    }
+    unlink(key, *it->second.lease);
+    foreign_ -= it->second.foreign ? 1 : 0;
+    leases_.erase(it);
+    return true;
+}
+
+template <typename LeaseT>
+typename LeaseCache<LeaseT>::Ptr LeaseCache<LeaseT>::get(const std::string& key) const {
+    auto it = leases_.find(key);
+    return it == leases_.end() ? Ptr() : Ptr(new LeaseT(*it->second.lease));
+}
+
+template <typename LeaseT>
+std::string LeaseCache<LeaseT>::hostname(const std::string& key) const {
+    auto it = leases_.find(key);
+    return it == leases_.end() ? std::string() : it->second.lease->hostname_;
+}
+
+template <typename LeaseT>
+bool LeaseCache<LeaseT>::foreign(const std::string& key) const {
+    auto it = leases_.find(key);
+    return it != leases_.end() && it->second.foreign;
+}
+
+template <typename LeaseT>
+typename LeaseCache<LeaseT>::Collection
+LeaseCache<LeaseT>::copies(const std::set<std::string>* keys) const {
+    Collection out;
+    if (keys) {
+        out.reserve(keys->size());
+        for (const auto& key : *keys) {
+            out.push_back(Ptr(new LeaseT(*leases_.at(key).lease)));
+        }
+    }
+    return out;
+}
+
+template <typename LeaseT>
+typename LeaseCache<LeaseT>::Collection LeaseCache<LeaseT>::all() const {
+    Collection out;
+    out.reserve(leases_.size());
+    for (const auto& entry : leases_) {
+        out.push_back(Ptr(new LeaseT(*entry.second.lease)));
+    }
+    return out;
+}
+
+template <typename LeaseT>
+typename LeaseCache<LeaseT>::Collection
+LeaseCache<LeaseT>::by_client(const std::string& client_key) const {
+    auto it = clients_.find(client_key);
+    return copies(it == clients_.end() ? nullptr : &it->second);
+}
+
+template <typename LeaseT>
+typename LeaseCache<LeaseT>::Collection LeaseCache<LeaseT>::by_subnet(uint32_t subnet_id) const {
+    auto it = subnets_.find(subnet_id);
+    return copies(it == subnets_.end() ? nullptr : &it->second);
+}
+
+template <typename LeaseT>
+typename LeaseCache<LeaseT>::Collection
+LeaseCache<LeaseT>::by_hostname(const std::string& hostname) const {
+    auto it = hostnames_.find(hostname);
+    return copies(it == hostnames_.end() ? nullptr : &it->second);
+}
+
+template <typename LeaseT>
+typename LeaseCache<LeaseT>::Collection
+LeaseCache<LeaseT>::page(const std::string& after, size_t count) const {
+    Collection out;
+    for (auto it = leases_.upper_bound(after); it != leases_.end() && out.size() < count; ++it) {
+        out.push_back(Ptr(new LeaseT(*it->second.lease)));
+    }
+    return out;
+}
+
+template <typename LeaseT>
+typename LeaseCache<LeaseT>::Collection
+LeaseCache<LeaseT>::range(const std::string& after, const std::string& first,
+                          const std::string& last, size_t count) const {
+    Collection out;
+    auto it = after < first ? leases_.lower_bound(first) : leases_.upper_bound(after);
+    for (; it != leases_.end() && it->first <= last && out.size() < count; ++it) {
+        out.push_back(Ptr(new LeaseT(*it->second.lease)));
+    }
+    return out;
+}
+
+template <typename LeaseT>
+void LeaseCache<LeaseT>::count_states(uint32_t first, uint32_t last,
+                                      LeaseStateCounts& counts) const {
+    for (const auto& subnet : subnets_) {
+        if (subnet.first < first || subnet.first > last) {
+            continue;
+        }
+        for (const auto& key : subnet.second) {
+            const LeaseT& lease = *leases_.at(key).lease;
+            if (lease.state_ == Lease::STATE_DEFAULT || lease.state_ == Lease::STATE_DECLINED) {
+                counts[std::make_tuple(subnet.first, static_cast<int>(lease.getType()),
+                                       lease.state_)]++;
+            }
+        }
+    }
+}
+
+template <typename LeaseT>
+typename LeaseCache<LeaseT>::Collection LeaseCache<LeaseT>::expired(int64_t now,
+                                                                   size_t max) const {
+    // Leases of other servers are theirs to reclaim
+    Collection out;
+    for (const auto& slot : expiring_) {
+        if (slot.first >= now || (max && out.size() >= max)) {
+            break;
+        }
+        const Entry& entry = leases_.at(slot.second);
+        if (!entry.foreign) {
+            out.push_back(Ptr(new LeaseT(*entry.lease)));
+        }
+    }
+    return out;
+}
+
+template <typename LeaseT>
+typename LeaseCache<LeaseT>::Collection LeaseCache<LeaseT>::reclaimed_before(int64_t time) const {
+    Collection out;
+    for (const auto& slot : reclaimed_) {
+        if (slot.first >= time) {
+            break;
+        }
+        const Entry& entry = leases_.at(slot.second);
+        if (!entry.foreign) {
+            out.push_back(Ptr(new LeaseT(*entry.lease)));
+        }
+    }
+    return out;
+}
+
+template <typename LeaseT>
+std::vector<std::string>
+LeaseCache<LeaseT>::foreign_except(const std::unordered_set<std::string>& keep) const {
+    std::vector<std::string> out;
+    for (const auto& entry : leases_) {
+        if (entry.second.foreign && !keep.count(entry.first)) {
+            out.push_back(entry.first);
+        }
+    }
+    return out;
+}
+
+template class LeaseCache<Lease4>;
+template class LeaseCache<Lease6>;
+
+EtcdLeaseMgr::EtcdLeaseMgr(const EtcdLeaseMgrConfig& config)
+    : client_(config.endpoint), prefix_(config.prefix),
+      sequence_prefix_(config.sequence_prefix), node_id_(config.node_id), watch_events_(0),
+      reloads_(0), watches_(config.watches), subscription_(0), stop_(false) {
+    while (!prefix_.empty() && prefix_.back() == '/') {
+        prefix_.pop_back();
+    }
+    prefix_ += "/";
+
+    client_.set_auth(config.auth);
+    client_.set_tls(config.tls);
+    client_.set_transport(config.transport);
+    if (config.dns_enabled) {
+        dns_.reset(new DnsRecordBuilder(config.dns));
+    }
+
+    int64_t revision = 0;
+    if (!read_prefix(client_, true, revision)) {
+        throw std::runtime_error("cannot read leases under " + prefix_ + " from " +
+                                 config.endpoint);
+    }
+
+    engine_.reset(new SyncEngine(client_, config.sync));
+    engine_->start();
+    if (watches_) {
+        subscription_ = watches_->subscribe(prefix_, this, revision);
+    }
+}
+
+EtcdLeaseMgr::~EtcdLeaseMgr() {
+    // Ends a reload in progress
+    stop_ = true;
+    if (subscription_) {
+        watches_->unsubscribe(subscription_);
+    }
+    // Flushes what is still queued
+    engine_->stop();
+}
+
+EtcdLeaseMgrStats EtcdLeaseMgr::stats() const {
+    EtcdLeaseMgrStats stats;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        stats.leases4 = leases4_.size();
+        stats.leases6 = leases6_.size();
+        stats.foreign = leases4_.foreign_count() + leases6_.foreign_count();
+        stats.watch_events = watch_events_;
+        stats.reloads = reloads_;
+    }
+    stats.sync = engine_->stats();
+    return stats;
+}
+
+std::string EtcdLeaseMgr::getDescription() const {
+    return "etcd lease database with a write-back cache";
+}
+
+std::pair<uint32_t, uint32_t> EtcdLeaseMgr::getVersion(const std::string&) const {
+    return std::make_pair(LEASE_SCHEMA_VERSION, 0);
+}
+
+void EtcdLeaseMgr::submit(const std::string& name, uint32_t subnet_id, std::vector<EtcdOp> ops,
+                          uint64_t sequence) {
+    EtcdGuard guard;
+    guard.key = sequence_prefix_ + "/" + name;
+    guard.sequence = sequence;
+    if (!engine_->submit(prefix_ + name, std::move(ops), guard, subnet_id)) {
+        std::cerr << "Kea etcd hook: lease backend queue full, " << name
+                  << " not written to etcd" << std::endl;
+    }
+}
+
+// Live leases publish their records. Reclaimed (held for
+// hold-reclaimed-time) and declined leases arrive as updates too and take
+// theirs down; Kea clears the hostname on reclamation, so the records are
+// found under the previous one. A renamed client loses the old name's.
+void EtcdLeaseMgr::add_dns_ops(const Lease& lease, const std::string& address,
+                               const std::string& previous_hostname,
+                               std::vector<EtcdOp>& ops) const {
+    const bool renamed = !previous_hostname.empty() && previous_hostname != lease.hostname_;
+    if (lease.state_ == Lease::STATE_DEFAULT) {
+        dns_->add_publish_ops(lease.hostname_, address, ops);
+        if (renamed) {
+            dns_->add_remove_ops(previous_hostname, address, ops);
+        }
+        return;
+    }
+    // The PTR holds the name published last
+    if (renamed) {
+        dns_->add_remove_ops(previous_hostname, address, ops);
+    }
+    dns_->add_remove_ops(lease.hostname_, address, ops);
+}
+
+std::vector<EtcdOp> EtcdLeaseMgr::records4(const Lease4& lease, const char* operation,
+                                           uint64_t sequence,
+                                           const std::string& previous_hostname) const {
+    const std::string name = lease.addr_.toText();
+    std::vector<EtcdOp> ops;
+    ops.push_back(EtcdOp::put(prefix_ + name,
+                              write_value(lease4_value(lease, operation, node_id_, sequence))));
+    if (dns_) {
+        add_dns_ops(lease, name, previous_hostname, ops);
+    }
+    return ops;
+}
+
+std::vector<EtcdOp> EtcdLeaseMgr::records6(const Lease6& lease, const char* operation,
+                                           uint64_t sequence,
+                                           const std::string& previous_hostname) const {
+    std::vector<EtcdOp> ops;
+    ops.push_back(EtcdOp::put(prefix_ + lease6_name(lease),
+                              write_value(lease6_value(lease, operation, node_id_, sequence))));
+    if (dns_ && lease.type_ != Lease::TYPE_PD) {
+        add_dns_ops(lease, lease.addr_.toText(), previous_hostname, ops);
+    }
+    return ops;
+}
+
+void EtcdLeaseMgr::write4(const Lease4& lease, const char* operation, uint64_t sequence,
+                          const std::string& previous_hostname) {
+    submit(lease.addr_.toText(), lease.subnet_id_,
+           records4(lease, operation, sequence, previous_hostname), sequence);
+}
+
+void EtcdLeaseMgr::write6(const Lease6& lease, const char* operation, uint64_t sequence,
+                          const std::string& previous_hostname) {
+    submit(lease6_name(lease), lease.subnet_id_,
+           records6(lease, operation, sequence, previous_hostname), sequence);
+}
+
+void EtcdLeaseMgr::remove4(const Lease4& lease, uint64_t sequence) {
+    const std::string name = lease.addr_.toText();
+    std::vector<EtcdOp> ops;
+    ops.push_back(EtcdOp::del(prefix_ + name));
+    if (dns_) {
+        dns_->add_remove_ops(lease.hostname_, name, ops);
+    }
+    submit(name, lease.subnet_id_, std::move(ops), sequence);
+}
+
+void EtcdLeaseMgr::remove6(const Lease6& lease, uint64_t sequence) {
+    const std::string name = lease6_name(lease);
+    std::vector<EtcdOp> ops;
+    ops.push_back(EtcdOp::del(prefix_ + name));
+    if (dns_ && lease.type_ != Lease::TYPE_PD) {
+        dns_->add_remove_ops(lease.hostname_, lease.addr_.toText(), ops);
+    }
+    submit(name, lease.subnet_id_, std::move(ops), sequence);
+}
+
+// The cache holds the new lease while the claim is out, so a concurrent
+// add of the same address on this server is refused locally
+template <typename LeaseT>
+bool EtcdLeaseMgr::claim(LeaseCache<LeaseT>& cache, const std::string& cache_key,
+                         const std::string& name, uint32_t subnet_id, std::vector<EtcdOp> ops,
+                         uint64_t sequence) {
+    // The sequence stamp goes with the records, so write-backs of an older
+    // lease on this key that are still queued anywhere cannot follow them
+    std::vector<EtcdOp> claim_ops = ops;
+    claim_ops.push_back(EtcdOp::put(sequence_prefix_ + "/" + name, format_sequence(sequence)));
+
+    bool created = false;
+    std::string current;
+    if (!client_.txn_create(prefix_ + name, claim_ops, created, &current)) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        if (!cache.foreign(cache_key)) {
+            cache.erase(cache_key);
+        }
+        isc_throw(isc::db::DbOperationError, "etcd lease database unreachable, lease "
+                  << name << " not claimed");
+    }
+    if (created) {
+        return true;
+    }
+
+    Json::Value record;
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    if (reader->parse(current.data(), current.data() + current.size(), &record, nullptr) &&
+        record.isObject() && record.get("node", "").asString() == node_id_) {
+        // This server's record, whose delete is still queued: the put
+        // coalesces with it
+        submit(name, subnet_id, std::move(ops), sequence);
+        return true;
+    }
+
+    // Another server holds it: take its lease into the cache instead
+    std::cerr << "Kea etcd hook: " << name << " is leased by another server, not assigning it"
+              << std::endl;
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (!cache.foreign(cache_key)) {
+        cache.erase(cache_key);
+    }
+    apply_record(prefix_ + name, &current, false, nullptr, nullptr);
+    return false;
+}
+
+bool EtcdLeaseMgr::addLease(const Lease4Ptr& lease) {
+    const std::string key = address_key(lease->addr_);
+    uint64_t sequence;
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        if (leases4_.contains(key)) {
+            return false;
+        }
+        leases4_.put(*lease, false);
+        sequence = sequence_clock_.next();
+    }
+    if (!claim(leases4_, key, lease->addr_.toText(), lease->subnet_id_,
+               records4(*lease, operation_for(*lease, "ack"), sequence), sequence)) {
+        return false;
+    }
+    lease->updateCurrentExpirationTime();
+    trackAddLease(lease);
+    return true;
+}
+
+bool EtcdLeaseMgr::addLease(const Lease6Ptr& lease) {
+    const std::string key = address_key(lease->addr_);
+    uint64_t sequence;
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        if (leases6_.contains(key)) {
+            return false;
+        }
+        leases6_.put(*lease, false);
+        sequence = sequence_clock_.next();
+    }
+    if (!claim(leases6_, key, lease6_name(*lease), lease->subnet_id_,
+               records6(*lease, operation_for(*lease, "ack"), sequence), sequence)) {
+        return false;
+    }
+    lease->updateCurrentExpirationTime();
+    trackAddLease(lease);
+    return true;
+}
+
+void EtcdLeaseMgr::updateLease4(const Lease4Ptr& lease) {
+    uint64_t sequence;
+    std::string previous_hostname;
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        const std::string key = address_key(lease->addr_);
+        if (!leases4_.contains(key)) {
+            isc_throw(NoSuchLease, "failed to update the lease with address "
+                      << lease->addr_.toText() << " - no such lease");
+        }
+        previous_hostname = leases4_.hostname(key);
+        leases4_.put(*lease, false);
+        sequence = sequence_clock_.next();
+    }
+    write4(*lease, operation_for(*lease, "renew"), sequence, previous_hostname);
+    lease->updateCurrentExpirationTime();
+    trackUpdateLease(lease);
+}
+
+void EtcdLeaseMgr::updateLease6(const Lease6Ptr& lease) {
+    uint64_t sequence;
+    std::string previous_hostname;
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        const std::string key = address_key(lease->addr_);
+        if (!leases6_.contains(key)) {
+            isc_throw(NoSuchLease, "failed to update the lease with address "
+                      << lease->addr_.toText() << " - no such lease");
+        }
+        previous_hostname = leases6_.hostname(key);
+        leases6_.put(*lease, false);
+        sequence = sequence_clock_.next();
+    }
+    write6(*lease, operation_for(*lease, "renew"), sequence, previous_hostname);
+    lease->updateCurrentExpirationTime();
+    trackUpdateLease(lease);
+}
+
+bool EtcdLeaseMgr::deleteLease(const Lease4Ptr& lease) {
+    uint64_t sequence;
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        if (!leases4_.erase(address_key(lease->addr_))) {
+            return false;
+        }
+        sequence = sequence_clock_.next();
+    }
+    remove4(*lease, sequence);
+    trackDeleteLease(lease);
+    return true;
+}
+
+bool EtcdLeaseMgr::deleteLease(const Lease6Ptr& lease) {
+    uint64_t sequence;
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        if (!leases6_.erase(address_key(lease->addr_))) {
+            return false;
+        }
+        sequence = sequence_clock_.next();
+    }
+    remove6(*lease, sequence);
+    trackDeleteLease(lease);
+    return true;
+}
+
+Lease4Ptr EtcdLeaseMgr::getLease4(const IOAddress& addr) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases4_.get(address_key(addr));
+}
+
+Lease4Collection EtcdLeaseMgr::getLease4(const HWAddr& hwaddr) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases4_.by_client(bytes_key("hw:", hwaddr.hwaddr_));
+}
+
+Lease4Ptr EtcdLeaseMgr::getLease4(const HWAddr& hwaddr, SubnetID subnet_id) const {
+    for (const auto& lease : getLease4(hwaddr)) {
+        if (lease->subnet_id_ == subnet_id) {
+            return lease;
+        }
+    }
+    return Lease4Ptr();
+}
+
+Lease4Collection EtcdLeaseMgr::getLease4(const ClientId& client_id) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases4_.by_client(bytes_key("cid:", client_id.getClientId()));
+}
+
+Lease4Ptr EtcdLeaseMgr::getLease4(const ClientId& client_id, SubnetID subnet_id) const {
+    for (const auto& lease : getLease4(client_id)) {
+        if (lease->subnet_id_ == subnet_id) {
+            return lease;
+        }
+    }
+    return Lease4Ptr();
+}
+
+Lease4Collection EtcdLeaseMgr::getLeases4(SubnetID subnet_id) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases4_.by_subnet(subnet_id);
+}
+
+Lease4Collection EtcdLeaseMgr::getLeases4(const std::string& hostname) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases4_.by_hostname(hostname);
+}
+
+Lease4Collection EtcdLeaseMgr::getLeases4() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases4_.all();
+}
+
+Lease4Collection EtcdLeaseMgr::getLeases4(const IOAddress& lower_bound_address,
+                                          const LeasePageSize& page_size) const {
+    if (!lower_bound_address.isV4()) {
+        isc_throw(isc::BadValue, "expected IPv4 address while retrieving leases from the "
+                  "lease database, got " << lower_bound_address.toText());
+    }
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases4_.page(address_key(lower_bound_address), page_size.page_size_);
+}
+
+Lease6Ptr EtcdLeaseMgr::getLease6(Lease::Type type, const IOAddress& addr) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    Lease6Ptr lease = leases6_.get(address_key(addr));
+    return lease && lease->type_ == type ? lease : Lease6Ptr();
+}
+
+Lease6Collection EtcdLeaseMgr::getLeases6(Lease::Type type, const DUID& duid,
+                                          uint32_t iaid) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases6_.by_client(ia_key(type, duid, iaid));
+}
+
+Lease6Collection EtcdLeaseMgr::getLeases6(Lease::Type type, const DUID& duid, uint32_t iaid,
+                                          SubnetID subnet_id) const {
+    Lease6Collection out;
+    append_if(out, getLeases6(type, duid, iaid), subnet_id);
+    return out;
+}
+
+Lease6Collection EtcdLeaseMgr::getLeases6(SubnetID subnet_id) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases6_.by_subnet(subnet_id);
+}
+
+Lease6Collection EtcdLeaseMgr::getLeases6(const std::string& hostname) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases6_.by_hostname(hostname);
+}
+
+Lease6Collection EtcdLeaseMgr::getLeases6() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases6_.all();
+}
+
+Lease6Collection EtcdLeaseMgr::getLeases6(const DUID& duid) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases6_.by_client(bytes_key("duid:", duid.getDuid()));
+}
+
+Lease6Collection EtcdLeaseMgr::getLeases6(const IOAddress& lower_bound_address,
+                                          const LeasePageSize& page_size) const {
+    if (!lower_bound_address.isV6()) {
+        isc_throw(isc::BadValue, "expected IPv6 address while retrieving leases from the "
+                  "lease database, got " << lower_bound_address.toText());
+    }
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases6_.page(address_key(lower_bound_address), page_size.page_size_);
+}
+
+void EtcdLeaseMgr::getExpiredLeases4(Lease4Collection& expired_leases,
+                                     const size_t max_leases) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    Lease4Collection expired = leases4_.expired(time(nullptr), max_leases);
+    expired_leases.insert(expired_leases.end(), expired.begin(), expired.end());
+}
+
+void EtcdLeaseMgr::getExpiredLeases6(Lease6Collection& expired_leases,
+                                     const size_t max_leases) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    Lease6Collection expired = leases6_.expired(time(nullptr), max_leases);
+    expired_leases.insert(expired_leases.end(), expired.begin(), expired.end());
+}
+
+uint64_t EtcdLeaseMgr::deleteExpiredReclaimedLeases4(const uint32_t secs) {
+    Lease4Collection reclaimed;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        reclaimed = leases4_.reclaimed_before(static_cast<int64_t>(time(nullptr)) - secs);
+    }
+    uint64_t deleted = 0;
+    for (const auto& lease : reclaimed) {
+        deleted += deleteLease(lease) ? 1 : 0;
+    }
+    return deleted;
+}
+
+uint64_t EtcdLeaseMgr::deleteExpiredReclaimedLeases6(const uint32_t secs) {
+    Lease6Collection reclaimed;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        reclaimed = leases6_.reclaimed_before(static_cast<int64_t>(time(nullptr)) - secs);
+    }
+    uint64_t deleted = 0;
+    for (const auto& lease : reclaimed) {
+        deleted += deleteLease(lease) ? 1 : 0;
+    }
+    return deleted;
+}
+
+size_t EtcdLeaseMgr::wipeLeases4(const SubnetID& subnet_id) {
+    size_t deleted = 0;
+    for (const auto& lease : getLeases4(subnet_id)) {
+        deleted += deleteLease(lease) ? 1 : 0;
+    }
+    return deleted;
+}
+
+size_t EtcdLeaseMgr::wipeLeases6(const SubnetID& subnet_id) {
+    size_t deleted = 0;
+    for (const auto& lease : getLeases6(subnet_id)) {
+        deleted += deleteLease(lease) ? 1 : 0;
+    }
+    return deleted;
+}
+
+LeaseStatsQueryPtr EtcdLeaseMgr::startLeaseStatsQuery4() {
+    return startSubnetRangeLeaseStatsQuery4(0, std::numeric_limits<uint32_t>::max());
+}
+
+LeaseStatsQueryPtr EtcdLeaseMgr::startSubnetLeaseStatsQuery4(const SubnetID& subnet_id) {
+    return startSubnetRangeLeaseStatsQuery4(subnet_id, subnet_id);
+}
+
+LeaseStatsQueryPtr EtcdLeaseMgr::startSubnetRangeLeaseStatsQuery4(const SubnetID& first_subnet_id,
+                                                                  const SubnetID& last_subnet_id) {
+    LeaseStateCounts counts;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        leases4_.count_states(first_subnet_id, last_subnet_id, counts);
+    }
+    return LeaseStatsQueryPtr(new CachedLeaseStatsQuery(counts, false));
+}
+
+LeaseStatsQueryPtr EtcdLeaseMgr::startLeaseStatsQuery6() {
+    return startSubnetRangeLeaseStatsQuery6(0, std::numeric_limits<uint32_t>::max());
+}
+
+LeaseStatsQueryPtr EtcdLeaseMgr::startSubnetLeaseStatsQuery6(const SubnetID& subnet_id) {
+    return startSubnetRangeLeaseStatsQuery6(subnet_id, subnet_id);
+}
+
+LeaseStatsQueryPtr EtcdLeaseMgr::startSubnetRangeLeaseStatsQuery6(const SubnetID& first_subnet_id,
+                                                                  const SubnetID& last_subnet_id) {
+    LeaseStateCounts counts;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        leases6_.count_states(first_subnet_id, last_subnet_id, counts);
+    }
+    return LeaseStatsQueryPtr(new CachedLeaseStatsQuery(counts, true));
+}
+
+size_t EtcdLeaseMgr::getClassLeaseCount(const ClientClass&, const Lease::Type&) const {
+    isc_throw(isc::NotImplemented, "the etcd lease database does not count leases per class");
+}
+
+std::string EtcdLeaseMgr::checkLimits4(isc::data::ConstElementPtr const&) const {
+    isc_throw(isc::NotImplemented, "the etcd lease database does not support lease limits");
+}
+
+std::string EtcdLeaseMgr::checkLimits6(isc::data::ConstElementPtr const&) const {
+    isc_throw(isc::NotImplemented, "the etcd lease database does not support lease limits");
+}
+
+Lease4Collection EtcdLeaseMgr::getLeases4ByRelayId(const OptionBuffer&, const IOAddress&,
+                                                   const LeasePageSize&, const time_t&,
+                                                   const time_t&) {
+    isc_throw(isc::NotImplemented, "the etcd lease database keeps no relay id index");
+}
+
+Lease4Collection EtcdLeaseMgr::getLeases4ByRemoteId(const OptionBuffer&, const IOAddress&,
+                                                    const LeasePageSize&, const time_t&,
+                                                    const time_t&) {
+    isc_throw(isc::NotImplemented, "the etcd lease database keeps no remote id index");
+}
+
+Lease6Collection EtcdLeaseMgr::getLeases6ByRelayId(const DUID&, const IOAddress&,
+                                                   const LeasePageSize&) {
+    isc_throw(isc::NotImplemented, "the etcd lease database keeps no relay id index");
+}
+
+Lease6Collection EtcdLeaseMgr::getLeases6ByRemoteId(const OptionBuffer&, const IOAddress&,
+                                                    const LeasePageSize&) {
+    isc_throw(isc::NotImplemented, "the etcd lease database keeps no remote id index");
+}
+
+Lease6Collection EtcdLeaseMgr::getLeases6ByLink(const IOAddress& link_addr, uint8_t link_len,
+                                                const IOAddress& lower_bound_address,
+                                                const LeasePageSize& page_size) {
+    if (!lower_bound_address.isV6()) {
+        isc_throw(isc::BadValue, "expected IPv6 address while retrieving leases from the "
+                  "lease database, got " << lower_bound_address.toText());
+    }
+    const std::string first = address_key(firstAddrInPrefix(link_addr, link_len));
+    const std::string last = address_key(lastAddrInPrefix(link_addr, link_len));
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases6_.range(address_key(lower_bound_address), first, last,
+                          page_size.page_size_);
+}
+
+void EtcdLeaseMgr::writeLeases4(const std::string&) {
+    isc_throw(isc::NotImplemented, "the etcd lease database has no lease file to write");
+}
+
+void EtcdLeaseMgr::writeLeases6(const std::string&) {
+    isc_throw(isc::NotImplemented, "the etcd lease database has no lease file to write");
+}
+
+// Caller holds mutex_ exclusively
+void EtcdLeaseMgr::apply_record(const std::string& key, const std::string* value, bool initial,
+                                std::unordered_set<std::string>* seen4,
+                                std::unordered_set<std::string>* seen6) {
+    if (key.compare(0, prefix_.size(), prefix_) != 0) {
+        return;
+    }
+    const std::string name = key.substr(prefix_.size());
+
+    std::string cache_key;
+    bool v4;
+    try {
+        IOAddress addr(name.substr(0, name.find('/')));
+        cache_key = address_key(addr);
+        v4 = addr.isV4();
+    } catch (const std::exception&) {
+        return;
+    }
+
+    if (!value) {
+        // Only the writer of a lease or etcd-side tooling deletes it; a
+        // lease this server wrote stays until this server deletes it
+        if (v4 && leases4_.foreign(cache_key)) {
+            leases4_.erase(cache_key);
+        } else if (!v4 && leases6_.foreign(cache_key)) {
+            leases6_.erase(cache_key);
+        }
+        return;
+    }
+
+    Json::Value record;
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    if (!reader->parse(value->data(), value->data() + value->size(), &record, nullptr) ||
+        !record.isObject()) {
+        return;
+    }
+    const bool own = record.get("node", "").asString() == node_id_;
+    if (own && !initial) {
+        // Our own write coming back, or a record the cache already leads
+        return;
+    }
+
+    if (v4) {
+        Lease4Ptr lease = lease4_from_value(record);
+        if (lease) {
+            leases4_.put(*lease, !own);
+            if (seen4) {
+                seen4->insert(cache_key);
+            }
+        }
+    } else {
+        Lease6Ptr lease = lease6_from_value(record);
+        if (lease) {
+            leases6_.put(*lease, !own);
+            if (seen6) {
+                seen6->insert(cache_key);
+            }
+        }
+    }
+}
+
+bool EtcdLeaseMgr::read_prefix(const EtcdClient& client, bool initial, int64_t& revision) {
+    std::unordered_set<std::string> seen4;
+    std::unordered_set<std::string> seen6;
+    const bool ok = client.range_pages(prefix_, prefix_range_end(prefix_),
+        [&](std::vector<EtcdKeyValue>& page) {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            for (const auto& kv : page) {
+                apply_record(kv.key, &kv.value, initial, &seen4, &seen6);
+            }
+            return !stop_;
+        },
+        revision);
+    if (!ok || stop_) {
+        return false;
+    }
+
+    // Leases of other servers deleted while the watch was behind
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    for (const auto& key : leases4_.foreign_except(seen4)) {
+        leases4_.erase(key);
+    }
+    for (const auto& key : leases6_.foreign_except(seen6)) {
+        leases6_.erase(key);
+    }
+    reloads_++;
+
+    std::cerr << "Kea etcd hook: lease backend holds " << leases4_.size() << " IPv4 and "
+              << leases6_.size() << " IPv6 leases from " << prefix_ << std::endl;
+    return true;
+}
+
+void EtcdLeaseMgr::apply(const std::vector<EtcdWatchEvent>& events) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    for (const auto& event : events) {
+        apply_record(event.kv.key,
+                     event.type == EtcdWatchEvent::DELETE ? nullptr : &event.kv.value, false,
+                     nullptr, nullptr);
+    }
+    watch_events_ += events.size();
+}
+
+bool EtcdLeaseMgr::reload(const EtcdClient& client, int64_t& revision) {
+    return read_prefix(client, false, revision);
+}
+
+} // namespace nnoe
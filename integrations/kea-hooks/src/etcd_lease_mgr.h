@@ -0,0 +1,340 @@
+/**
+ * etcd lease database backend for Kea
+ *
+ * With lease-database type "etcd", Kea keeps its leases under the hook's
+ * lease prefix instead of a memfile or SQL database, so the callout mirror
+ * no longer writes every lease twice and there is no lease file to clean
+ * up. The backend registers with LeaseMgrFactory when the hook loads.
+ *
+ *   - All leases of the prefix are held in memory, like memfile, indexed
+ *     by address (ordered, for paging), client (hardware address, client
+ *     id, DUID, DUID/IAID), subnet, hostname and expiry. Lookups never
+ *     leave the process and return copies.
+ *   - A new lease is claimed in etcd before addLease returns: its records
+ *     are created only while the lease key does not exist, so of two
+ *     servers taking one free address the second is refused and Kea picks
+ *     another. New leases therefore need etcd to be reachable.
+ *   - Other writes update the cache and return; records go to etcd
+ *     write-back through a SyncEngine, coalesced per lease and flushed in
+ *     batched transactions under the same sequence guards as the mirror.
+ *   - The cache is loaded from etcd when Kea opens the database and then
+ *     follows the prefix through the hook's shared watch manager, taking in
+ *     leases written by other servers. Deletes from other servers only
+ *     remove their own leases.
+ *
+ * Records have the lease prefix schema (docs/api/etcd-schema.md), so the
+ * backend also loads what the mirror wrote and every other reader of the
+ * prefix keeps working.
+ */
+
+#ifndef NNOE_ETCD_LEASE_MGR_H
+#define NNOE_ETCD_LEASE_MGR_H
+
+#include "dns_records.h"
+#include "etcd_auth.h"
+#include "etcd_client.h"
+#include "sync_engine.h"
+#include "watch_manager.h"
+
+#include <dhcpsrv/tracking_lease_mgr.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace nnoe {
+
+struct EtcdLeaseMgrConfig {
+    std::string endpoint;
+    std::string prefix;              // lease prefix
+    std::string sequence_prefix;
+    std::string node_id;
+    std::shared_ptr<EtcdAuth> auth;  // null: etcd auth disabled
+    EtcdTls tls;
+    std::shared_ptr<EtcdTransport> transport;   // null: libcurl only
+    std::shared_ptr<WatchManager> watches;
+    bool dns_enabled = false;        // write DNS records with the leases
+    DnsRecordsConfig dns;
+    SyncEngineConfig sync;
+};
+
+struct EtcdLeaseMgrStats {
+    uint64_t leases4 = 0;
+    uint64_t leases6 = 0;
+    uint64_t foreign = 0;         // cached leases last written by other servers
+    uint64_t watch_events = 0;    // changes of other servers applied
+    uint64_t reloads = 0;
+    SyncEngineStats sync;
+};
+
+// Leases in the default and declined states per (subnet id, lease type,
+// state), ordered by subnet id like Kea's statistics queries
+typedef std::map<std::tuple<uint32_t, int, uint32_t>, int64_t> LeaseStateCounts;
+
+// Leases of one family with the secondary indexes Kea looks them up by.
+// Keys are address bytes, so the map orders like the addresses. Not
+// synchronized; EtcdLeaseMgr guards it.
+template <typename LeaseT>
+class LeaseCache {
+public:
+    typedef std::shared_ptr<LeaseT> Ptr;
+    typedef std::vector<Ptr> Collection;
+
+    // Insert or replace a copy of lease; foreign marks a lease last
+    // written by another server
+    void put(const LeaseT& lease, bool foreign);
+    bool erase(const std::string& key);
+
+    bool contains(const std::string& key) const { return leases_.count(key) != 0; }
+    Ptr get(const std::string& key) const;
+    // Hostname of the cached lease, empty if none
+    std::string hostname(const std::string& key) const;
+    bool foreign(const std::string& key) const;
+
+    Collection all() const;
+    Collection by_client(const std::string& client_key) const;
+    Collection by_subnet(uint32_t subnet_id) const;
+    Collection by_hostname(const std::string& hostname) const;
+
+    // Up to count leases with keys above after
+    Collection page(const std::string& after, size_t count) const;
+    // As page(), limited to keys in [first, last]
+    Collection range(const std::string& after, const std::string& first,
+                     const std::string& last, size_t count) const;
+
+    // Adds the leases of subnets in [first, last] to counts
+    void count_states(uint32_t first, uint32_t last, LeaseStateCounts& counts) const;
+
+    // Unreclaimed leases of this server expired before now, oldest first;
+    // 0: no limit
+    Collection expired(int64_t now, size_t max) const;
+
+    // Reclaimed leases of this server expired before time
+    Collection reclaimed_before(int64_t time) const;
+
+    // Keys of foreign leases not in keep (after a full re-read)
+    std::vector<std::string> foreign_except(const std::unordered_set<std::string>& keep) const;
+
+    size_t size() const { return leases_.size(); }
+    size_t foreign_count() const { return foreign_; }
+
+private:
+    struct Entry {
+        Ptr lease;
+        bool foreign;
+    };
+
+    typedef std::unordered_map<std::string, std::set<std::string>> KeyIndex;
+
+    void link(const std::string& key, const LeaseT& lease);
+    void unlink(const std::string& key, const LeaseT& lease);
+    Collection copies(const std::set<std::string>* keys) const;
+
+    std::map<std::string, Entry> leases_;
+    KeyIndex clients_;
+    KeyIndex hostnames_;
+    std::unordered_map<uint32_t, std::set<std::string>> subnets_;
+    std::set<std::pair<int64_t, std::string>> expiring_;   // unreclaimed, by expiry
+    std::set<std::pair<int64_t, std::string>> reclaimed_;
+    size_t foreign_ = 0;
+};
+
+class EtcdLeaseMgr : public isc::dhcp::TrackingLeaseMgr, public WatchSubscriber {
+public:
+    // Loads the prefix; throws std::runtime_error if etcd cannot be read
+    explicit EtcdLeaseMgr(const EtcdLeaseMgrConfig& config);
+    virtual ~EtcdLeaseMgr();
+
+    EtcdLeaseMgrStats stats() const;
+
+    virtual bool addLease(const isc::dhcp::Lease4Ptr& lease);
+    virtual bool addLease(const isc::dhcp::Lease6Ptr& lease);
+
+    virtual isc::dhcp::Lease4Ptr getLease4(const isc::asiolink::IOAddress& addr) const;
+    virtual isc::dhcp::Lease4Collection getLease4(const isc::dhcp::HWAddr& hwaddr) const;
+    virtual isc::dhcp::Lease4Ptr getLease4(const isc::dhcp::HWAddr& hwaddr,
+                                           isc::dhcp::SubnetID subnet_id) const;
+    virtual isc::dhcp::Lease4Collection getLease4(const isc::dhcp::ClientId& client_id) const;
+    virtual isc::dhcp::Lease4Ptr getLease4(const isc::dhcp::ClientId& client_id,
+                                           isc::dhcp::SubnetID subnet_id) const;
+    virtual isc::dhcp::Lease4Collection getLeases4(isc::dhcp::SubnetID subnet_id) const;
+    virtual isc::dhcp::Lease4Collection getLeases4(const std::string& hostname) const;
+    virtual isc::dhcp::Lease4Collection getLeases4() const;
+    virtual isc::dhcp::Lease4Collection getLeases4(
+        const isc::asiolink::IOAddress& lower_bound_address,
+        const isc::dhcp::LeasePageSize& page_size) const;
+
+    virtual isc::dhcp::Lease6Ptr getLease6(isc::dhcp::Lease::Type type,
+                                           const isc::asiolink::IOAddress& addr) const;
+    virtual isc::dhcp::Lease6Collection getLeases6(isc::dhcp::Lease::Type type,
+                                                   const isc::dhcp::DUID& duid,
+                                                   uint32_t iaid) const;
+    virtual isc::dhcp::Lease6Collection getLeases6(isc::dhcp::Lease::Type type,
+                                                   const isc::dhcp::DUID& duid, uint32_t iaid,
+                                                   isc::dhcp::SubnetID subnet_id) const;
+    virtual isc::dhcp::Lease6Collection getLeases6(isc::dhcp::SubnetID subnet_id) const;
+    virtual isc::dhcp::Lease6Collection getLeases6(const std::string& hostname) const;
+    virtual isc::dhcp::Lease6Collection getLeases6() const;
+    virtual isc::dhcp::Lease6Collection getLeases6(const isc::dhcp::DUID& duid) const;
+    virtual isc::dhcp::Lease6Collection getLeases6(
+        const isc::asiolink::IOAddress& lower_bound_address,
+        const isc::dhcp::LeasePageSize& page_size) const;
+
+    virtual void getExpiredLeases4(isc::dhcp::Lease4Collection& expired_leases,
+                                   const size_t max_leases) const;
+    virtual void getExpiredLeases6(isc::dhcp::Lease6Collection& expired_leases,
+                                   const size_t max_leases) const;
+
+    virtual void updateLease4(const isc::dhcp::Lease4Ptr& lease);
+    virtual void updateLease6(const isc::dhcp::Lease6Ptr& lease);
+    virtual bool deleteLease(const isc::dhcp::Lease4Ptr& lease);
+    virtual bool deleteLease(const isc::dhcp::Lease6Ptr& lease);
+
+    virtual uint64_t deleteExpiredReclaimedLeases4(const uint32_t secs);
+    virtual uint64_t deleteExpiredReclaimedLeases6(const uint32_t secs);
+    virtual size_t wipeLeases4(const isc::dhcp::SubnetID& subnet_id);
+    virtual size_t wipeLeases6(const isc::dhcp::SubnetID& subnet_id);
+
+    // Statistics counted from the cache when the query starts
+    virtual isc::dhcp::LeaseStatsQueryPtr startLeaseStatsQuery4();
+    virtual isc::dhcp::LeaseStatsQueryPtr startSubnetLeaseStatsQuery4(
+        const isc::dhcp::SubnetID& subnet_id);
+    virtual isc::dhcp::LeaseStatsQueryPtr startSubnetRangeLeaseStatsQuery4(
+        const isc::dhcp::SubnetID& first_subnet_id, const isc::dhcp::SubnetID& last_subnet_id);
+    virtual isc::dhcp::LeaseStatsQueryPtr startLeaseStatsQuery6();
+    virtual isc::dhcp::LeaseStatsQueryPtr startSubnetLeaseStatsQuery6(
+        const isc::dhcp::SubnetID& subnet_id);
+    virtual isc::dhcp::LeaseStatsQueryPtr startSubnetRangeLeaseStatsQuery6(
+        const isc::dhcp::SubnetID& first_subnet_id, const isc::dhcp::SubnetID& last_subnet_id);
+
+    // Class lease limits are not tracked: the counts and limit checks throw
+    // isc::NotImplemented, and the hook refuses to open the database when
+    // lease limits are configured
+    virtual bool isJsonSupported() const { return false; }
+    virtual size_t getClassLeaseCount(const isc::dhcp::ClientClass& client_class,
+                                      const isc::dhcp::Lease::Type& ltype =
+                                          isc::dhcp::Lease::TYPE_V4) const;
+    virtual void recountClassLeases4() {}
+    virtual void recountClassLeases6() {}
+    virtual void clearClassLeaseCounts() {}
+    virtual std::string checkLimits4(isc::data::ConstElementPtr const& user_context) const;
+    virtual std::string checkLimits6(isc::data::ConstElementPtr const& user_context) const;
+
+    // Relay and remote id tables (bulk leasequery) are not kept: the
+    // extended info stays in the lease context and lookups by id throw
+    // isc::NotImplemented. Lookups by link page through the cache.
+    virtual void deleteExtendedInfo6(const isc::asiolink::IOAddress&) {}
+    virtual void addRelayId6(const isc::asiolink::IOAddress&, const std::vector<uint8_t>&) {}
+    virtual void addRemoteId6(const isc::asiolink::IOAddress&, const std::vector<uint8_t>&) {}
+    virtual void wipeExtendedInfoTables6() {}
+    virtual isc::dhcp::Lease4Collection getLeases4ByRelayId(
+        const isc::dhcp::OptionBuffer& relay_id,
+        const isc::asiolink::IOAddress& lower_bound_address,
+        const isc::dhcp::LeasePageSize& page_size,
+        const time_t& qry_start_time = 0, const time_t& qry_end_time = 0);
+    virtual isc::dhcp::Lease4Collection getLeases4ByRemoteId(
+        const isc::dhcp::OptionBuffer& remote_id,
+        const isc::asiolink::IOAddress& lower_bound_address,
+        const isc::dhcp::LeasePageSize& page_size,
+        const time_t& qry_start_time = 0, const time_t& qry_end_time = 0);
+    virtual isc::dhcp::Lease6Collection getLeases6ByRelayId(
+        const isc::dhcp::DUID& relay_id,
+        const isc::asiolink::IOAddress& lower_bound_address,
+        const isc::dhcp::LeasePageSize& page_size);
+    virtual isc::dhcp::Lease6Collection getLeases6ByRemoteId(
+        const isc::dhcp::OptionBuffer& remote_id,
+        const isc::asiolink::IOAddress& lower_bound_address,
+        const isc::dhcp::LeasePageSize& page_size);
+    virtual isc::dhcp::Lease6Collection getLeases6ByLink(
+        const isc::asiolink::IOAddress& link_addr, uint8_t link_len,
+        const isc::asiolink::IOAddress& lower_bound_address,
+        const isc::dhcp::LeasePageSize& page_size);
+
+    // Lease files are a memfile feature; read the prefix instead
+    virtual void writeLeases4(const std::string& filename);
+    virtual void writeLeases6(const std::string& filename);
+
+    virtual std::string getType() const { return "etcd"; }
+    virtual std::string getName() const { return prefix_; }
+    virtual std::string getDescription() const;
+    virtual std::pair<uint32_t, uint32_t> getVersion(const std::string& timer_name =
+                                                         std::string()) const;
+
+    // Writes are queued as they happen; there is no transaction to end
+    virtual void commit() {}
+    virtual void rollback() {}
+
+private:
+    // Queue the records of a change; sequence was drawn with the cache
+    // updated, so etcd applies changes of one lease in cache order.
+    // previous_hostname is the cached lease's before an update.
+    std::vector<EtcdOp> records4(const isc::dhcp::Lease4& lease, const char* operation,
+                                 uint64_t sequence,
+                                 const std::string& previous_hostname = std::string()) const;
+    std::vector<EtcdOp> records6(const isc::dhcp::Lease6& lease, const char* operation,
+                                 uint64_t sequence,
+                                 const std::string& previous_hostname = std::string()) const;
+    void write4(const isc::dhcp::Lease4& lease, const char* operation, uint64_t sequence,
+                const std::string& previous_hostname = std::string());
+    void write6(const isc::dhcp::Lease6& lease, const char* operation, uint64_t sequence,
+                const std::string& previous_hostname = std::string());
+    void add_dns_ops(const isc::dhcp::Lease& lease, const std::string& address,
+                     const std::string& previous_hostname, std::vector<EtcdOp>& ops) const;
+    void remove4(const isc::dhcp::Lease4& lease, uint64_t sequence);
+    void remove6(const isc::dhcp::Lease6& lease, uint64_t sequence);
+    void submit(const std::string& name, uint32_t subnet_id, std::vector<EtcdOp> ops,
+                uint64_t sequence);
+    // Create the records of a lease just added to cache in etcd, only if no
+    // server holds its key. False if another server does (its lease
+    // replaces ours in the cache); throws DbOperationError if etcd cannot
+    // be reached.
+    template <typename LeaseT>
+    bool claim(LeaseCache<LeaseT>& cache, const std::string& cache_key,
+               const std::string& name, uint32_t subnet_id, std::vector<EtcdOp> ops,
+               uint64_t sequence);
+
+    // Full read of the prefix; the first load also takes this server's
+    // own records, later ones only those of other servers
+    bool read_prefix(const EtcdClient& client, bool initial, int64_t& revision);
+    // Caller holds mutex_ exclusively
+    void apply_record(const std::string& key, const std::string* value, bool initial,
+                      std::unordered_set<std::string>* seen4,
+                      std::unordered_set<std::string>* seen6);
+
+    // WatchSubscriber: re-reads after a compaction and changes of other servers
+    bool reload(const EtcdClient& client, int64_t& revision) override;
+    void apply(const std::vector<EtcdWatchEvent>& events) override;
+
+    EtcdClient client_;
+    std::unique_ptr<SyncEngine> engine_;
+    std::unique_ptr<DnsRecordBuilder> dns_;
+    std::string prefix_;           // with trailing slash
+    std::string sequence_prefix_;
+    std::string node_id_;
+    SequenceClock sequence_clock_;
+
+    mutable std::shared_mutex mutex_;
+    LeaseCache<isc::dhcp::Lease4> leases4_;
+    LeaseCache<isc::dhcp::Lease6> leases6_;
+    uint64_t watch_events_;
+    uint64_t reloads_;
+
+    std::shared_ptr<WatchManager> watches_;
+    uint64_t subscription_;
+    std::atomic<bool> stop_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_ETCD_LEASE_MGR_H
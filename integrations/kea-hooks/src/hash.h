@@ -0,0 +1,43 @@
+/**
+ * Client identifier hashing shared by the hook's per-client tables
+ *
+ * FNV-1a over the identifier bytes, finalised with the splitmix64 mixer so
+ * every output bit depends on every input byte. The blocklist filter, the
+ * rate sketch and the renewal jitter band all index by these bits.
+ */
+
+#ifndef NNOE_HASH_H
+#define NNOE_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nnoe {
+
+const uint64_t FNV1A_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+const uint64_t FNV1A_PRIME = 0x100000001b3ULL;
+
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+inline uint64_t fnv1a(const uint8_t* data, size_t len, uint64_t h = FNV1A_OFFSET_BASIS) {
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ data[i]) * FNV1A_PRIME;
+    }
+    return h;
+}
+
+// FNV-1a over the identifier kind and bytes, finalised with mix64
+inline uint64_t client_fingerprint(uint8_t kind, const uint8_t* data, size_t len) {
+    return mix64(fnv1a(data, len, (FNV1A_OFFSET_BASIS ^ kind) * FNV1A_PRIME));
+}
+
+} // namespace nnoe
+
+#endif // NNOE_HASH_H
@@ -0,0 +1,240 @@
+/**
+ * etcd transport over Kea's own HTTP client
+ */
+
+#include "kea_transport.h"
+
+#include <http/post_request.h>
+#include <http/response.h>
+#include <util/multi_threading_mgr.h>
+
+#include <boost/make_shared.hpp>
+
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+using namespace isc::asiolink;
+using namespace isc::http;
+using isc::util::MultiThreadingMgr;
+
+namespace nnoe {
+
+namespace {
+
+const char* CS_CALLBACKS = "NNOE_ETCD_TRANSPORT";
+
+} // namespace
+
+KeaHttpTransport::KeaHttpTransport(const KeaTransportConfig& config)
+    : config_(config), url_(config.endpoint), running_(false), paused_(false), requests_(0),
+      failures_(0) {
+    if (!url_.isValid()) {
+        throw std::invalid_argument("invalid etcd endpoint " + config.endpoint + ": " +
+                                    url_.getErrorMessage());
+    }
+    if (url_.getScheme() == Url::HTTPS) {
+        if (config_.tls.ca_file.empty()) {
+            throw std::invalid_argument("an https endpoint needs etcd_ca_file");
+        }
+        // Throws on unreadable files or a key not matching the certificate
+        TlsContext::configure(tls_context_, TlsRole::CLIENT, config_.tls.ca_file,
+                              config_.tls.cert_file, config_.tls.key_file, true);
+    }
+}
+
+KeaHttpTransport::~KeaHttpTransport() {
+    stop();
+}
+
+uint32_t KeaHttpTransport::pool_size() const {
+    if (config_.threads) {
+        return config_.threads;
+    }
+    const MultiThreadingMgr& mt = MultiThreadingMgr::instance();
+    return mt.getMode() && mt.getThreadPoolSize() ? mt.getThreadPoolSize() : 1;
+}
+
+void KeaHttpTransport::start(const IOServicePtr& io_service) {
+    const uint32_t threads = pool_size();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (client_ && threads == threads_) {
+            return;
+        }
+    }
+    // A reconfiguration changed Kea's thread pool
+    stop();
+
+    // The client always runs its own thread pool (and IOService), so its
+    // completions never wait for Kea's main loop
+    HttpClientPtr client(new HttpClient(io_service ? io_service : IOServicePtr(new IOService()),
+                                        true, threads, true));
+    MultiThreadingMgr::instance().addCriticalSectionCallbacks(CS_CALLBACKS,
+        [this]() { check_permissions(); },
+        [this]() { pause(); },
+        [this]() { resume(); });
+    client->start();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        client_ = client;
+        threads_ = threads;
+    }
+    paused_ = false;
+    running_ = true;
+}
+
+void KeaHttpTransport::stop() {
+    HttpClientPtr client;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        client.swap(client_);
+        threads_ = 0;
+    }
+    running_ = false;
+    if (!client) {
+        return;
+    }
+    MultiThreadingMgr::instance().removeCriticalSectionCallbacks(CS_CALLBACKS);
+
+    // Not under mutex_: handlers of requests completing meanwhile take it
+    client->stop();
+    fail_outstanding();
+}
+
+// The client is called outside mutex_: pausing waits for its threads,
+// which may be about to take it in finish()
+HttpClientPtr KeaHttpTransport::client() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return client_;
+}
+
+void KeaHttpTransport::check_permissions() {
+    if (HttpClientPtr current = client()) {
+        // Throws when called from one of the client's threads
+        current->checkPermissions();
+    }
+}
+
+void KeaHttpTransport::pause() {
+    paused_ = true;
+    if (HttpClientPtr current = client()) {
+        current->pause();
+    }
+}
+
+void KeaHttpTransport::resume() {
+    if (HttpClientPtr current = client()) {
+        current->resume();
+    }
+    paused_ = false;
+}
+
+bool KeaHttpTransport::available(bool /* blocking */) const {
+    // Completions run on the client's threads, never on the caller's, so a
+    // blocking caller only needs the client to be running
+    return running_ && !paused_;
+}
+
+void KeaHttpTransport::post(const std::string& path, const std::string& body,
+                            const std::string& token, const Completion& completion) {
+    requests_++;
+    HttpClientPtr client;
+    uint64_t id = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        client = client_;
+        if (client) {
+            id = ++next_id_;
+            outstanding_.emplace(id, completion);
+        }
+    }
+    if (!client) {
+        std::string none;
+        failures_++;
+        completion(false, 0, none);
+        return;
+    }
+
+    try {
+        PostHttpRequestPtr request = boost::make_shared<PostHttpRequest>(
+            HttpRequest::Method::HTTP_POST, path, HttpVersion::HTTP_11(),
+            HostHttpHeader(url_.getStrippedHostname()));
+        auto& context = request->context();
+        context->headers_.push_back(HttpHeaderContext("Content-Type", "application/json"));
+        context->headers_.push_back(HttpHeaderContext("Content-Length",
+                                                      static_cast<int64_t>(body.size())));
+        if (!token.empty()) {
+            context->headers_.push_back(HttpHeaderContext("Authorization", token));
+        }
+        context->body_ = body;
+        request->finalize();
+
+        HttpResponsePtr response = boost::make_shared<HttpResponse>();
+        client->asyncSendRequest(url_, tls_context_, request, response,
+            [this, id](const boost::system::error_code& ec, const HttpResponsePtr& response,
+                       const std::string& error) {
+                std::string body;
+                if (ec || !response) {
+                    std::cerr << "Kea etcd hook: etcd request failed: "
+                              << (ec ? ec.message() : error) << std::endl;
+                    finish(id, false, 0, body);
+                    return;
+                }
+                body = response->getBody();
+                finish(id, true, HttpResponse::statusCodeToNumber(response->getStatusCode()),
+                       body);
+            },
+            HttpClient::RequestTimeout(config_.timeout_ms));
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook: etcd request on " << path << " not sent: " << e.what()
+                  << std::endl;
+        std::string none;
+        finish(id, false, 0, none);
+    }
+}
+
+// Runs the completion of request id unless stop() already failed it
+void KeaHttpTransport::finish(uint64_t id, bool ok, long status, std::string& body) {
+    Completion completion;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = outstanding_.find(id);
+        if (it == outstanding_.end()) {
+            return;
+        }
+        completion = std::move(it->second);
+        outstanding_.erase(it);
+    }
+    if (!ok) {
+        failures_++;
+    }
+    completion(ok, status, body);
+}
+
+void KeaHttpTransport::fail_outstanding() {
+    std::unordered_map<uint64_t, Completion> outstanding;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        outstanding.swap(outstanding_);
+    }
+    for (auto& entry : outstanding) {
+        std::string none;
+        failures_++;
+        entry.second(false, 0, none);
+    }
+}
+
+KeaTransportStats KeaHttpTransport::stats() const {
+    KeaTransportStats stats;
+    stats.running = running_ && !paused_;
+    stats.requests = requests_.load();
+    stats.failures = failures_.load();
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats.threads = threads_;
+    stats.outstanding = outstanding_.size();
+    return stats;
+}
+
+} // namespace nnoe
@@ -0,0 +1,106 @@
+/**
+ * etcd transport over Kea's own HTTP client
+ *
+ * By default every etcd request runs libcurl on the calling thread. With
+ * etcd_transport "kea", the hook's requests other than watch streams go
+ * through isc::http::HttpClient instead: persistent connections, TLS from
+ * Kea's crypto backend, and a thread pool sized like Kea's packet thread
+ * pool (one thread without multi-threading). The client is paused and
+ * resumed with Kea's critical sections and stopped when the hook unloads,
+ * so its threads and sockets follow the server's reconfiguration and
+ * shutdown.
+ *
+ * The sync engine hands its transactions over with a completion handler and
+ * never waits for them. Callers that block (reloads, warm-up) wait for the
+ * completion on their own thread. Until the server is configured, while it
+ * is in a critical section and after stop(), available() is false and the
+ * etcd client falls back to libcurl, so nothing waits on a paused client.
+ *
+ * Watch streams stay on libcurl: HttpClient only hands over complete
+ * responses.
+ */
+
+#ifndef NNOE_KEA_TRANSPORT_H
+#define NNOE_KEA_TRANSPORT_H
+
+#include "etcd_client.h"
+
+#include <asiolink/crypto_tls.h>
+#include <asiolink/io_service.h>
+#include <http/client.h>
+#include <http/url.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace nnoe {
+
+struct KeaTransportConfig {
+    std::string endpoint;
+    EtcdTls tls;                   // https endpoints need tls.ca_file
+    uint32_t threads = 0;          // 0: as many as Kea's packet threads
+    uint32_t timeout_ms = 10000;   // per request
+};
+
+struct KeaTransportStats {
+    bool running = false;
+    uint32_t threads = 0;
+    uint64_t requests = 0;
+    uint64_t failures = 0;         // transport errors and timeouts
+    uint64_t outstanding = 0;
+};
+
+class KeaHttpTransport : public EtcdTransport {
+public:
+    // Throws std::invalid_argument on an unusable endpoint or TLS setup
+    explicit KeaHttpTransport(const KeaTransportConfig& config);
+    ~KeaHttpTransport();
+
+    // (Re)create the client with the current thread pool size; from the
+    // srv_configured callouts, on Kea's main thread
+    void start(const isc::asiolink::IOServicePtr& io_service);
+
+    // Stop the client and fail what is still outstanding
+    void stop();
+
+    bool available(bool blocking) const override;
+
+    void post(const std::string& path, const std::string& body, const std::string& token,
+              const Completion& completion) override;
+
+    KeaTransportStats stats() const;
+
+private:
+    uint32_t pool_size() const;
+    isc::http::HttpClientPtr client() const;
+    void finish(uint64_t id, bool ok, long status, std::string& body);
+    void fail_outstanding();
+
+    // Critical section callbacks
+    void check_permissions();
+    void pause();
+    void resume();
+
+    KeaTransportConfig config_;
+    isc::http::Url url_;
+    isc::asiolink::TlsContextPtr tls_context_;
+
+    mutable std::mutex mutex_;
+    isc::http::HttpClientPtr client_;
+    uint32_t threads_ = 0;
+    uint64_t next_id_ = 0;
+    std::unordered_map<uint64_t, Completion> outstanding_;
+
+    std::atomic<bool> running_;
+    std::atomic<bool> paused_;
+    std::atomic<uint64_t> requests_;
+    std::atomic<uint64_t> failures_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_KEA_TRANSPORT_H
@@ -0,0 +1,780 @@
+/**
+ * Local lease history archive for the NNOE Kea hook
+ */
+
+#include "lease_history.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <utility>
+
+namespace nnoe {
+
+namespace {
+
+// Segment layout, little-endian:
+//
+//   magic[8] events:u32 sections:u32 min_time:i64 max_time:i64
+//   sections x { kind:u32 flags:u32 offset:u64 size:u64 raw_size:u64 }
+//   section data
+//
+// Dictionaries are { count:u32 offsets:u32[count + 1] blob }, sorted and
+// uncompressed; columns are varints, zlib-compressed.
+const char SEGMENT_MAGIC[8] = {'N', 'N', 'O', 'E', 'L', 'H', '0', '1'};
+const size_t HEADER_SIZE = 32;
+const size_t SECTION_ENTRY_SIZE = 32;
+const uint32_t FLAG_ZLIB = 1;
+
+enum SectionKind {
+    DICT_OPERATION = 1,
+    DICT_ADDRESS = 2,
+    DICT_CLIENT = 3,
+    DICT_HOSTNAME = 4,
+    COL_TIME = 16,
+    COL_OPERATION = 17,
+    COL_ADDRESS = 18,
+    COL_CLIENT = 19,
+    COL_HOSTNAME = 20,
+    COL_SUBNET = 21,
+    COL_VALID_LFT = 22,
+};
+
+const char SEGMENT_SUFFIX[] = ".seg";
+
+void put_u32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+void put_u64(std::string& out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+void put_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+uint32_t get_u32(const uint8_t* data) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; --i) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+uint64_t get_u64(const uint8_t* data) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+bool get_varint(const std::string& in, size_t& pos, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+        const uint8_t byte = static_cast<uint8_t>(in[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sorted distinct values of one string field and each event's id into them
+struct DictionaryBuilder {
+    std::map<std::string, uint32_t> ids;
+
+    void add(const std::string& value) { ids.emplace(value, 0); }
+
+    std::string encode() {
+        std::string out;
+        put_u32(out, static_cast<uint32_t>(ids.size()));
+        uint32_t offset = 0;
+        uint32_t id = 0;
+        for (auto& entry : ids) {
+            entry.second = id++;
+            put_u32(out, offset);
+            offset += static_cast<uint32_t>(entry.first.size());
+        }
+        put_u32(out, offset);
+        for (const auto& entry : ids) {
+            out += entry.first;
+        }
+        return out;
+    }
+
+    uint32_t id(const std::string& value) const { return ids.at(value); }
+};
+
+struct SectionData {
+    uint32_t kind;
+    uint32_t flags;
+    std::string data;
+    uint64_t raw_size;
+};
+
+SectionData compressed_section(uint32_t kind, const std::string& raw) {
+    SectionData section{kind, FLAG_ZLIB, std::string(), raw.size()};
+    uLongf size = compressBound(raw.size());
+    section.data.resize(size);
+    if (compress2(reinterpret_cast<Bytef*>(&section.data[0]), &size,
+                  reinterpret_cast<const Bytef*>(raw.data()), raw.size(),
+                  Z_DEFAULT_COMPRESSION) != Z_OK) {
+        // Keep it raw rather than lose the column
+        section.flags = 0;
+        section.data = raw;
+        return section;
+    }
+    section.data.resize(size);
+    return section;
+}
+
+uint64_t event_bytes(const HistoryEvent& event) {
+    return sizeof(HistoryEvent) + string_heap_bytes(event.operation) +
+           string_heap_bytes(event.address) + string_heap_bytes(event.client) +
+           string_heap_bytes(event.hostname);
+}
+
+int64_t partition_start(int64_t time, uint32_t partition_seconds) {
+    const int64_t length = partition_seconds ? partition_seconds : 86400;
+    int64_t start = time - time % length;
+    if (time < 0 && time % length) {
+        start -= length;
+    }
+    return start;
+}
+
+bool overlaps(int64_t min_time, int64_t max_time, int64_t from, int64_t to) {
+    return min_time <= to && max_time >= from;
+}
+
+} // namespace
+
+std::string history_segment_name(int64_t min_time, int64_t max_time, uint32_t serial) {
+    return "history-" + std::to_string(min_time) + "-" + std::to_string(max_time) + "-" +
+           std::to_string(serial) + SEGMENT_SUFFIX;
+}
+
+bool parse_history_segment_name(const std::string& name, int64_t& min_time, int64_t& max_time) {
+    long long first = 0;
+    long long last = 0;
+    unsigned serial = 0;
+    int consumed = 0;
+    if (sscanf(name.c_str(), "history-%lld-%lld-%u.seg%n", &first, &last, &serial,
+               &consumed) != 3 ||
+        static_cast<size_t>(consumed) != name.size()) {
+        return false;
+    }
+    min_time = first;
+    max_time = last;
+    return min_time <= max_time;
+}
+
+std::string encode_history_segment(std::vector<HistoryEvent> events) {
+    std::stable_sort(events.begin(), events.end(),
+                     [](const HistoryEvent& a, const HistoryEvent& b) { return a.time < b.time; });
+
+    DictionaryBuilder operations, addresses, clients, hostnames;
+    for (const auto& event : events) {
+        operations.add(event.operation);
+        addresses.add(event.address);
+        clients.add(event.client);
+        hostnames.add(event.hostname);
+    }
+
+    std::vector<SectionData> sections;
+    sections.push_back({DICT_OPERATION, 0, operations.encode(), 0});
+    sections.push_back({DICT_ADDRESS, 0, addresses.encode(), 0});
+    sections.push_back({DICT_CLIENT, 0, clients.encode(), 0});
+    sections.push_back({DICT_HOSTNAME, 0, hostnames.encode(), 0});
+
+    const int64_t min_time = events.empty() ? 0 : events.front().time;
+    const int64_t max_time = events.empty() ? 0 : events.back().time;
+
+    std::string times, ops, addrs, clis, hosts, subnets, lifetimes;
+    int64_t previous = min_time;
+    for (const auto& event : events) {
+        put_varint(times, static_cast<uint64_t>(event.time - previous));
+        previous = event.time;
+        put_varint(ops, operations.id(event.operation));
+        put_varint(addrs, addresses.id(event.address));
+        put_varint(clis, clients.id(event.client));
+        put_varint(hosts, hostnames.id(event.hostname));
+        put_varint(subnets, event.subnet_id);
+        put_varint(lifetimes, event.valid_lft);
+    }
+    sections.push_back(compressed_section(COL_TIME, times));
+    sections.push_back(compressed_section(COL_OPERATION, ops));
+    sections.push_back(compressed_section(COL_ADDRESS, addrs));
+    sections.push_back(compressed_section(COL_CLIENT, clis));
+    sections.push_back(compressed_section(COL_HOSTNAME, hosts));
+    sections.push_back(compressed_section(COL_SUBNET, subnets));
+    sections.push_back(compressed_section(COL_VALID_LFT, lifetimes));
+
+    std::string out(SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    put_u32(out, static_cast<uint32_t>(events.size()));
+    put_u32(out, static_cast<uint32_t>(sections.size()));
+    put_u64(out, static_cast<uint64_t>(min_time));
+    put_u64(out, static_cast<uint64_t>(max_time));
+
+    uint64_t offset = HEADER_SIZE + sections.size() * SECTION_ENTRY_SIZE;
+    for (auto& section : sections) {
+        if (!section.flags) {
+            section.raw_size = section.data.size();
+        }
+        put_u32(out, section.kind);
+        put_u32(out, section.flags);
+        put_u64(out, offset);
+        put_u64(out, section.data.size());
+        put_u64(out, section.raw_size);
+        offset += section.data.size();
+    }
+    for (const auto& section : sections) {
+        out += section.data;
+    }
+    return out;
+}
+
+LeaseHistoryWriter::LeaseHistoryWriter(const LeaseHistoryConfig& config)
+    : config_(config), stop_(false) {
+    while (config_.directory.size() > 1 && config_.directory.back() == '/') {
+        config_.directory.pop_back();
+    }
+    if (!config_.partition_seconds) {
+        config_.partition_seconds = 86400;
+    }
+    if (!config_.segment_events) {
+        config_.segment_events = 65536;
+    }
+}
+
+LeaseHistoryWriter::~LeaseHistoryWriter() {
+    stop();
+}
+
+bool LeaseHistoryWriter::start() {
+    if (thread_.joinable()) {
+        return true;
+    }
+    if (mkdir(config_.directory.c_str(), 0750) != 0 && errno != EEXIST) {
+        std::cerr << "Kea etcd hook: cannot create lease history directory "
+                  << config_.directory << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (access(config_.directory.c_str(), W_OK) != 0) {
+        std::cerr << "Kea etcd hook: lease history directory " << config_.directory
+                  << " is not writable" << std::endl;
+        return false;
+    }
+    stop_ = false;
+    thread_ = std::thread(&LeaseHistoryWriter::run, this);
+    return true;
+}
+
+void LeaseHistoryWriter::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void LeaseHistoryWriter::append(HistoryEvent event) {
+    const uint64_t bytes = event_bytes(event);
+    if (memory_ && !memory_->try_charge(bytes)) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.dropped;
+        return;
+    }
+
+    bool wake = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const int64_t start = partition_start(event.time, config_.partition_seconds);
+        if (!current_.events.empty() && start != current_.start) {
+            full_.push_back(std::move(current_));
+            current_ = Partition();
+            wake = true;
+        }
+        if (current_.events.empty()) {
+            current_.start = start;
+            current_.oldest = time(nullptr);
+        }
+        current_.events.push_back(std::move(event));
+        current_.charged += bytes;
+        ++stats_.appended;
+        ++stats_.buffered;
+        if (current_.events.size() >= config_.segment_events) {
+            full_.push_back(std::move(current_));
+            current_ = Partition();
+            wake = true;
+        }
+    }
+    if (wake) {
+        cv_.notify_one();
+    }
+}
+
+LeaseHistoryStats LeaseHistoryWriter::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void LeaseHistoryWriter::write(Partition& partition) {
+    const size_t count = partition.events.size();
+    int64_t min_time = partition.events.front().time;
+    int64_t max_time = min_time;
+    for (const auto& event : partition.events) {
+        min_time = std::min(min_time, event.time);
+        max_time = std::max(max_time, event.time);
+    }
+    const std::string image = encode_history_segment(std::move(partition.events));
+    partition.events = std::vector<HistoryEvent>();
+    if (memory_) {
+        memory_->release(partition.charged);
+    }
+
+    uint32_t serial = 0;
+    std::string path;
+    struct stat st;
+    do {
+        path = config_.directory + "/" + history_segment_name(min_time, max_time, serial++);
+    } while (stat(path.c_str(), &st) == 0);
+    const std::string temp = config_.directory + "/.partial-" + std::to_string(getpid()) +
+                             SEGMENT_SUFFIX;
+
+    bool ok = false;
+    const int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd >= 0) {
+        size_t written = 0;
+        while (written < image.size()) {
+            const ssize_t n = ::write(fd, image.data() + written, image.size() - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            written += static_cast<size_t>(n);
+        }
+        ok = written == image.size() && fdatasync(fd) == 0;
+        ::close(fd);
+        ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+        if (!ok) {
+            unlink(temp.c_str());
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.buffered -= count;
+    if (!ok) {
+        ++stats_.write_errors;
+        std::cerr << "Kea etcd hook: cannot write lease history segment " << path << ": "
+                  << strerror(errno) << ", " << count << " events lost" << std::endl;
+        return;
+    }
+    ++stats_.segments;
+    stats_.bytes += image.size();
+}
+
+void LeaseHistoryWriter::expire_segments(int64_t now) {
+    if (!config_.retention_days) {
+        return;
+    }
+    const int64_t cutoff = now - static_cast<int64_t>(config_.retention_days) * 86400;
+    DIR* dir = opendir(config_.directory.c_str());
+    if (!dir) {
+        return;
+    }
+    uint64_t removed = 0;
+    while (struct dirent* entry = readdir(dir)) {
+        int64_t min_time, max_time;
+        if (parse_history_segment_name(entry->d_name, min_time, max_time) && max_time < cutoff &&
+            unlink((config_.directory + "/" + entry->d_name).c_str()) == 0) {
+            ++removed;
+        }
+    }
+    closedir(dir);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.removed += removed;
+}
+
+void LeaseHistoryWriter::run() {
+    int64_t last_expiry = 0;
+
+    while (true) {
+        std::vector<Partition> ready;
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait_for(lock, std::chrono::seconds(1),
+                         [this] { return stop_.load() || !full_.empty(); });
+            stopping = stop_;
+            const int64_t now = time(nullptr);
+            if (!current_.events.empty() &&
+                (stopping || now - current_.oldest >= static_cast<int64_t>(config_.flush_interval_s))) {
+                full_.push_back(std::move(current_));
+                current_ = Partition();
+            }
+            ready.swap(full_);
+        }
+
+        for (auto& partition : ready) {
+            write(partition);
+        }
+
+        const int64_t now = time(nullptr);
+        if (now - last_expiry >= 3600) {
+            last_expiry = now;
+            expire_segments(now);
+        }
+        if (stopping) {
+            break;
+        }
+    }
+}
+
+std::string HistorySegment::Dictionary::at(uint32_t id) const {
+    const uint32_t begin = get_u32(offsets + 4 * id);
+    const uint32_t end = get_u32(offsets + 4 * (id + 1));
+    return std::string(reinterpret_cast<const char*>(blob) + begin, end - begin);
+}
+
+int64_t HistorySegment::Dictionary::find(const std::string& value) const {
+    uint32_t low = 0;
+    uint32_t high = count;
+    while (low < high) {
+        const uint32_t mid = low + (high - low) / 2;
+        const uint32_t begin = get_u32(offsets + 4 * mid);
+        const uint32_t end = get_u32(offsets + 4 * (mid + 1));
+        const size_t length = end - begin;
+        int cmp = memcmp(blob + begin, value.data(), std::min(length, value.size()));
+        if (cmp == 0) {
+            cmp = length < value.size() ? -1 : (length > value.size() ? 1 : 0);
+        }
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return -1;
+}
+
+HistorySegment::HistorySegment() {}
+
+HistorySegment::~HistorySegment() {
+    if (map_) {
+        munmap(map_, size_);
+    }
+}
+
+bool HistorySegment::open(const std::string& path, std::string& error) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(HEADER_SIZE)) {
+        ::close(fd);
+        error = path + ": not a lease history segment";
+        return false;
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    map_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map_ == MAP_FAILED) {
+        map_ = nullptr;
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+
+    const uint8_t* data = static_cast<const uint8_t*>(map_);
+    if (memcmp(data, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0) {
+        error = path + ": not a lease history segment";
+        return false;
+    }
+    events_ = get_u32(data + 8);
+    const uint32_t sections = get_u32(data + 12);
+    min_time_ = static_cast<int64_t>(get_u64(data + 16));
+    max_time_ = static_cast<int64_t>(get_u64(data + 24));
+    if (HEADER_SIZE + static_cast<uint64_t>(sections) * SECTION_ENTRY_SIZE > size_) {
+        error = path + ": truncated segment";
+        return false;
+    }
+
+    sections_.assign(COL_VALID_LFT + 1, Section());
+    for (uint32_t i = 0; i < sections; ++i) {
+        const uint8_t* entry = data + HEADER_SIZE + i * SECTION_ENTRY_SIZE;
+        const uint32_t kind = get_u32(entry);
+        const uint64_t offset = get_u64(entry + 8);
+        const uint64_t size = get_u64(entry + 16);
+        if (offset > size_ || size > size_ - offset) {
+            error = path + ": truncated segment";
+            return false;
+        }
+        if (kind >= sections_.size()) {
+            continue;   // written by a newer version
+        }
+        Section& section = sections_[kind];
+        section.data = data + offset;
+        section.size = size;
+        section.raw_size = get_u64(entry + 24);
+        section.compressed = get_u32(entry + 4) & FLAG_ZLIB;
+    }
+    return true;
+}
+
+bool HistorySegment::dictionary(int kind, Dictionary& dict) const {
+    const Section& section = sections_[kind];
+    if (!section.data || section.size < 4) {
+        return false;
+    }
+    dict.count = get_u32(section.data);
+    const uint64_t table = 4 + 4 * (static_cast<uint64_t>(dict.count) + 1);
+    if (table > section.size) {
+        return false;
+    }
+    dict.offsets = section.data + 4;
+    dict.blob = section.data + table;
+    dict.blob_size = section.size - table;
+
+    // at() and find() trust the offsets, so a corrupt or truncated table
+    // rejects the segment here
+    uint32_t previous = 0;
+    for (uint32_t i = 0; i <= dict.count; ++i) {
+        const uint32_t offset = get_u32(dict.offsets + 4 * i);
+        if (offset < previous || offset > dict.blob_size) {
+            return false;
+        }
+        previous = offset;
+    }
+    return true;
+}
+
+bool HistorySegment::column(int kind, std::string& raw) const {
+    const Section& section = sections_[kind];
+    if (!section.data) {
+        return false;
+    }
+    if (!section.compressed) {
+        raw.assign(reinterpret_cast<const char*>(section.data), section.size);
+        return true;
+    }
+    raw.resize(section.raw_size);
+    uLongf size = section.raw_size;
+    if (uncompress(reinterpret_cast<Bytef*>(&raw[0]), &size, section.data, section.size) != Z_OK ||
+        size != section.raw_size) {
+        return false;
+    }
+    return true;
+}
+
+bool HistorySegment::scan(const HistoryQuery& query, std::vector<HistoryEvent>& out,
+                          std::string& error) const {
+    if (!events_ || !overlaps(min_time_, max_time_, query.from, query.to)) {
+        return true;
+    }
+
+    Dictionary operations, addresses, clients, hostnames;
+    if (!dictionary(DICT_OPERATION, operations) || !dictionary(DICT_ADDRESS, addresses) ||
+        !dictionary(DICT_CLIENT, clients) || !dictionary(DICT_HOSTNAME, hostnames)) {
+        error = "corrupt dictionary";
+        return false;
+    }
+
+    // The dictionaries are the index: an absent value means no event here
+    int64_t address_id = -1;
+    int64_t client_id = -1;
+    if (!query.address.empty() && (address_id = addresses.find(query.address)) < 0) {
+        return true;
+    }
+    if (!query.client.empty() && (client_id = clients.find(query.client)) < 0) {
+        return true;
+    }
+
+    // Find the matching rows from the time and filter columns first
+    std::string times, address_column, client_column;
+    if (!column(COL_TIME, times) ||
+        (address_id >= 0 && !column(COL_ADDRESS, address_column)) ||
+        (client_id >= 0 && !column(COL_CLIENT, client_column))) {
+        error = "corrupt column";
+        return false;
+    }
+
+    std::vector<std::pair<uint32_t, int64_t>> rows;   // row, time
+    size_t time_pos = 0, address_pos = 0, client_pos = 0;
+    int64_t current = min_time_;
+    for (uint32_t row = 0; row < events_; ++row) {
+        uint64_t delta, address, client;
+        if (!get_varint(times, time_pos, delta) ||
+            (address_id >= 0 && !get_varint(address_column, address_pos, address)) ||
+            (client_id >= 0 && !get_varint(client_column, client_pos, client))) {
+            error = "corrupt column";
+            return false;
+        }
+        current += static_cast<int64_t>(delta);
+        if (current < query.from || current > query.to ||
+            (address_id >= 0 && address != static_cast<uint64_t>(address_id)) ||
+            (client_id >= 0 && client != static_cast<uint64_t>(client_id))) {
+            continue;
+        }
+        rows.emplace_back(row, current);
+    }
+    if (rows.empty()) {
+        return true;
+    }
+
+    // Then decode the rest of the row for the matches only
+    std::string ops, hosts, subnets, lifetimes;
+    if ((address_id < 0 && !column(COL_ADDRESS, address_column)) ||
+        (client_id < 0 && !column(COL_CLIENT, client_column)) ||
+        !column(COL_OPERATION, ops) || !column(COL_HOSTNAME, hosts) ||
+        !column(COL_SUBNET, subnets) || !column(COL_VALID_LFT, lifetimes)) {
+        error = "corrupt column";
+        return false;
+    }
+
+    size_t op_pos = 0, host_pos = 0, subnet_pos = 0, lifetime_pos = 0;
+    address_pos = client_pos = 0;
+    size_t next = 0;
+    for (uint32_t row = 0; row < events_ && next < rows.size(); ++row) {
+        uint64_t op, address, client, host, subnet, lifetime;
+        if (!get_varint(ops, op_pos, op) || !get_varint(address_column, address_pos, address) ||
+            !get_varint(client_column, client_pos, client) || !get_varint(hosts, host_pos, host) ||
+            !get_varint(subnets, subnet_pos, subnet) ||
+            !get_varint(lifetimes, lifetime_pos, lifetime) || op >= operations.count ||
+            address >= addresses.count || client >= clients.count || host >= hostnames.count) {
+            error = "corrupt column";
+            return false;
+        }
+        if (rows[next].first != row) {
+            continue;
+        }
+        HistoryEvent event;
+        event.time = rows[next].second;
+        event.operation = operations.at(static_cast<uint32_t>(op));
+        event.address = addresses.at(static_cast<uint32_t>(address));
+        event.client = clients.at(static_cast<uint32_t>(client));
+        event.hostname = hostnames.at(static_cast<uint32_t>(host));
+        event.subnet_id = static_cast<uint32_t>(subnet);
+        event.valid_lft = static_cast<uint32_t>(lifetime);
+        out.push_back(std::move(event));
+        ++next;
+    }
+    return true;
+}
+
+LeaseHistoryReader::LeaseHistoryReader(const std::string& directory) : directory_(directory) {}
+
+std::vector<LeaseHistoryReader::SegmentFile> LeaseHistoryReader::segments(int64_t from,
+                                                                          int64_t to) const {
+    std::vector<SegmentFile> files;
+    DIR* dir = opendir(directory_.c_str());
+    if (!dir) {
+        return files;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        SegmentFile file;
+        if (parse_history_segment_name(entry->d_name, file.min_time, file.max_time) &&
+            overlaps(file.min_time, file.max_time, from, to)) {
+            file.path = directory_ + "/" + entry->d_name;
+            files.push_back(file);
+        }
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end(), [](const SegmentFile& a, const SegmentFile& b) {
+        return a.min_time != b.min_time ? a.min_time < b.min_time : a.path < b.path;
+    });
+    return files;
+}
+
+bool LeaseHistoryReader::query(const HistoryQuery& query, std::vector<HistoryEvent>& out,
+                               std::string& error) const {
+    for (const auto& file : segments(query.from, query.to)) {
+        HistorySegment segment;
+        if (!segment.open(file.path, error)) {
+            return false;
+        }
+        if (!segment.scan(query, out, error)) {
+            error = file.path + ": " + error;
+            return false;
+        }
+    }
+    // Segments of one partition may interleave when events arrive late
+    std::stable_sort(out.begin(), out.end(),
+                     [](const HistoryEvent& a, const HistoryEvent& b) { return a.time < b.time; });
+    return true;
+}
+
+bool LeaseHistoryReader::last_event(const std::string& address, int64_t at, HistoryEvent& event,
+                                    std::string& error) const {
+    std::vector<SegmentFile> files = segments(std::numeric_limits<int64_t>::min(), at);
+    std::sort(files.begin(), files.end(), [](const SegmentFile& a, const SegmentFile& b) {
+        return a.max_time > b.max_time;
+    });
+
+    HistoryQuery query;
+    query.address = address;
+    query.to = at;
+    bool found = false;
+    for (const auto& file : files) {
+        // Nothing in this or any later file can be newer than what we have
+        if (found && event.time >= file.max_time) {
+            break;
+        }
+        HistorySegment segment;
+        std::vector<HistoryEvent> events;
+        if (!segment.open(file.path, error)) {
+            return false;
+        }
+        if (!segment.scan(query, events, error)) {
+            error = file.path + ": " + error;
+            return false;
+        }
+        if (!events.empty() && (!found || events.back().time >= event.time)) {
+            event = events.back();
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool LeaseHistoryReader::holds(const HistoryEvent& event, int64_t at) {
+    if (event.operation != "ack" && event.operation != "renew" && event.operation != "offer") {
+        return false;
+    }
+    return at >= event.time && at < event.time + static_cast<int64_t>(event.valid_lft);
+}
+
+} // namespace nnoe
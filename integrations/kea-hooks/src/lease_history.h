@@ -0,0 +1,215 @@
+/**
+ * Local lease history archive for the NNOE Kea hook
+ *
+ * etcd only holds the current lease of each address; once a lease is
+ * released or expires its record is gone. For "who held address X at time
+ * T" months back, every lease event is also appended to a local archive of
+ * immutable segment files, one directory per server:
+ *
+ *   - events are buffered in memory and written out as a segment when the
+ *     time partition ends, the buffer is full or it gets old, so a segment
+ *     never spans two partitions;
+ *   - a segment is columnar: time, operation, address, client, hostname,
+ *     subnet id and lifetime each in their own zlib-compressed column,
+ *     events sorted by time and times stored as deltas;
+ *   - strings are dictionary-encoded; the sorted dictionaries stay
+ *     uncompressed and double as the segment's index, so a lookup by
+ *     address or client skips a segment with one binary search over the
+ *     mapped file, without inflating any column;
+ *   - file names carry the first and last event time, so a time-bounded
+ *     query opens only the segments that overlap it.
+ *
+ * Segments are written to a temporary name and renamed into place, so a
+ * reader never sees a partial one. Events still buffered when the process
+ * dies are lost. Kea independent; nnoe-lease-history reads the archive.
+ */
+
+#ifndef NNOE_LEASE_HISTORY_H
+#define NNOE_LEASE_HISTORY_H
+
+#include "memory_budget.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nnoe {
+
+struct HistoryEvent {
+    int64_t time = 0;            // seconds since the epoch
+    std::string operation;       // offer, ack, renew, release, expire, ...
+    std::string address;         // address, or prefix/length for delegations
+    std::string client;          // hardware address (IPv4) or DUID (IPv6)
+    std::string hostname;
+    uint32_t subnet_id = 0;
+    uint32_t valid_lft = 0;
+};
+
+struct LeaseHistoryConfig {
+    std::string directory;
+    uint32_t partition_seconds = 86400;   // segments never span a partition
+    uint32_t segment_events = 65536;      // write a segment at this many events
+    uint32_t flush_interval_s = 300;      // ... or once the oldest buffered event is this old
+    uint32_t retention_days = 0;          // 0 keeps segments forever
+};
+
+struct LeaseHistoryStats {
+    uint64_t appended = 0;
+    uint64_t dropped = 0;          // refused by the memory budget
+    uint64_t segments = 0;         // written by this process
+    uint64_t bytes = 0;
+    uint64_t write_errors = 0;
+    uint64_t removed = 0;          // segments past retention
+    uint64_t buffered = 0;
+};
+
+class LeaseHistoryWriter {
+public:
+    explicit LeaseHistoryWriter(const LeaseHistoryConfig& config);
+    ~LeaseHistoryWriter();
+
+    // Charge buffered events to account (before start())
+    void set_memory(MemoryAccount* account) { memory_ = account; }
+
+    // Creates the directory and starts the writer thread; false if the
+    // directory is unusable
+    bool start();
+
+    // Writes out whatever is buffered and joins the thread
+    void stop();
+
+    // Buffer an event; never blocks on disk
+    void append(HistoryEvent event);
+
+    LeaseHistoryStats stats() const;
+
+private:
+    struct Partition {
+        int64_t start = 0;
+        int64_t oldest = 0;        // when the first buffered event arrived
+        std::vector<HistoryEvent> events;
+        uint64_t charged = 0;
+    };
+
+    void run();
+    void write(Partition& partition);
+    void expire_segments(int64_t now);
+
+    LeaseHistoryConfig config_;
+    MemoryAccount* memory_ = nullptr;
+
+    mutable std::mutex mutex_;
+    Partition current_;
+    std::vector<Partition> full_;   // waiting for the writer thread
+    LeaseHistoryStats stats_;
+
+    std::thread thread_;
+    std::atomic<bool> stop_;
+    std::condition_variable cv_;
+};
+
+// Serialise events as one segment image (events are sorted by time)
+std::string encode_history_segment(std::vector<HistoryEvent> events);
+
+struct HistoryQuery {
+    std::string address;   // empty: any
+    std::string client;    // empty: any
+    int64_t from = std::numeric_limits<int64_t>::min();
+    int64_t to = std::numeric_limits<int64_t>::max();
+};
+
+// One memory-mapped segment file
+class HistorySegment {
+public:
+    HistorySegment();
+    ~HistorySegment();
+    HistorySegment(const HistorySegment&) = delete;
+    HistorySegment& operator=(const HistorySegment&) = delete;
+
+    // Maps and validates the file; false with error set otherwise
+    bool open(const std::string& path, std::string& error);
+
+    int64_t min_time() const { return min_time_; }
+    int64_t max_time() const { return max_time_; }
+    uint32_t events() const { return events_; }
+
+    // Appends the matching events, oldest first; false if the segment is
+    // corrupt
+    bool scan(const HistoryQuery& query, std::vector<HistoryEvent>& out,
+              std::string& error) const;
+
+private:
+    struct Section {
+        const uint8_t* data = nullptr;
+        uint64_t size = 0;
+        uint64_t raw_size = 0;
+        bool compressed = false;
+    };
+
+    struct Dictionary {
+        const uint8_t* offsets = nullptr;
+        const uint8_t* blob = nullptr;
+        uint32_t count = 0;
+        uint64_t blob_size = 0;
+
+        std::string at(uint32_t id) const;
+        // Id of value, or -1
+        int64_t find(const std::string& value) const;
+    };
+
+    bool dictionary(int kind, Dictionary& dict) const;
+    bool column(int kind, std::string& raw) const;
+
+    void* map_ = nullptr;
+    size_t size_ = 0;
+    uint32_t events_ = 0;
+    int64_t min_time_ = 0;
+    int64_t max_time_ = 0;
+    std::vector<Section> sections_;
+};
+
+class LeaseHistoryReader {
+public:
+    explicit LeaseHistoryReader(const std::string& directory);
+
+    // Events matching the query across the segments overlapping its time
+    // range, oldest first
+    bool query(const HistoryQuery& query, std::vector<HistoryEvent>& out,
+               std::string& error) const;
+
+    // Latest event for address at or before at; false if there is none.
+    // Segments are searched newest first and the search stops at the first
+    // one holding an event for the address.
+    bool last_event(const std::string& address, int64_t at, HistoryEvent& event,
+                    std::string& error) const;
+
+    // Whether event left its client holding the address at time at
+    static bool holds(const HistoryEvent& event, int64_t at);
+
+private:
+    struct SegmentFile {
+        std::string path;
+        int64_t min_time;
+        int64_t max_time;
+    };
+
+    // Segment files overlapping [from, to], by first event time
+    std::vector<SegmentFile> segments(int64_t from, int64_t to) const;
+
+    std::string directory_;
+};
+
+// Segment file name for events between min_time and max_time: the times
+// let readers skip segments without opening them
+std::string history_segment_name(int64_t min_time, int64_t max_time, uint32_t serial);
+bool parse_history_segment_name(const std::string& name, int64_t& min_time, int64_t& max_time);
+
+} // namespace nnoe
+
+#endif // NNOE_LEASE_HISTORY_H
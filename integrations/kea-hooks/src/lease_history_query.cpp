@@ -0,0 +1,179 @@
+/**
+ * NNOE lease history query tool
+ *
+ * Answers forensic questions from the archive the hook writes with
+ * history_enabled (see lease_history.h), without Kea or etcd:
+ *
+ *   nnoe-lease-history --dir DIR --ip 10.0.0.7 --at 2026-03-02T14:05:00Z
+ *       who held the address at that time (the latest event at or before it)
+ *   nnoe-lease-history --dir DIR --ip 10.0.0.7 --from ... --to ...
+ *   nnoe-lease-history --dir DIR --client aa:bb:cc:dd:ee:ff --from ... --to ...
+ *       every event for the address or client in the range
+ *
+ * Only segments whose time range overlaps the query are opened, and a
+ * segment whose dictionary lacks the address or client is skipped without
+ * reading its columns. Events are printed as JSON lines.
+ */
+
+#include "lease_history.h"
+
+#include <json/json.h>
+#include <getopt.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace {
+
+void usage() {
+    std::cerr <<
+        "Usage: nnoe-lease-history --dir DIR (--ip ADDR | --client ID) [options]\n"
+        "  --dir DIR                history directory (hook parameter history_dir)\n"
+        "  --ip ADDR                address, or prefix/length of a delegation\n"
+        "  --client ID              hardware address (IPv4) or DUID (IPv6)\n"
+        "  --from TIME              earliest event (epoch seconds or YYYY-MM-DDTHH:MM:SSZ)\n"
+        "  --to TIME                latest event\n"
+        "  --at TIME                with --ip: the client holding the address at TIME\n";
+}
+
+// Epoch seconds, or an ISO 8601 UTC time
+bool parse_time(const char* text, int64_t& value) {
+    char* end = nullptr;
+    errno = 0;
+    const long long seconds = strtoll(text, &end, 10);
+    if (end != text && *end == '\0' && errno == 0) {
+        value = seconds;
+        return true;
+    }
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(text, "%Y-%m-%dT%H:%M:%S", &tm);
+    if (!end || (*end != '\0' && strcmp(end, "Z") != 0)) {
+        return false;
+    }
+    value = timegm(&tm);
+    return true;
+}
+
+std::string format_time(int64_t value) {
+    const time_t seconds = static_cast<time_t>(value);
+    struct tm tm;
+    char text[32];
+    if (!gmtime_r(&seconds, &tm) || !strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &tm)) {
+        return std::to_string(value);
+    }
+    return text;
+}
+
+Json::Value event_value(const nnoe::HistoryEvent& event) {
+    Json::Value value;
+    value["time"] = format_time(event.time);
+    value["timestamp"] = static_cast<Json::Int64>(event.time);
+    value["operation"] = event.operation;
+    value["ip"] = event.address;
+    if (!event.client.empty()) {
+        value["client"] = event.client;
+    }
+    if (!event.hostname.empty()) {
+        value["hostname"] = event.hostname;
+    }
+    value["subnet_id"] = event.subnet_id;
+    value["valid_lft"] = event.valid_lft;
+    return value;
+}
+
+void print(const Json::Value& value) {
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    std::cout << Json::writeString(builder, value) << "\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string directory;
+    nnoe::HistoryQuery query;
+    int64_t at = 0;
+    bool have_at = false;
+
+    static const struct option long_options[] = {
+        {"dir", required_argument, nullptr, 'd'},
+        {"ip", required_argument, nullptr, 'i'},
+        {"client", required_argument, nullptr, 'c'},
+        {"from", required_argument, nullptr, 'f'},
+        {"to", required_argument, nullptr, 't'},
+        {"at", required_argument, nullptr, 'a'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'd': directory = optarg; break;
+        case 'i': query.address = optarg; break;
+        case 'c': query.client = optarg; break;
+        case 'f':
+        case 't':
+        case 'a': {
+            int64_t value;
+            if (!parse_time(optarg, value)) {
+                std::cerr << "nnoe-lease-history: invalid time " << optarg << std::endl;
+                return 2;
+            }
+            if (opt == 'f') {
+                query.from = value;
+            } else if (opt == 't') {
+                query.to = value;
+            } else {
+                at = value;
+                have_at = true;
+            }
+            break;
+        }
+        default:
+            usage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if (directory.empty() || (query.address.empty() && query.client.empty()) ||
+        (have_at && query.address.empty())) {
+        usage();
+        return 2;
+    }
+
+    nnoe::LeaseHistoryReader reader(directory);
+    std::string error;
+
+    if (have_at) {
+        nnoe::HistoryEvent event;
+        if (!reader.last_event(query.address, at, event, error)) {
+            if (!error.empty()) {
+                std::cerr << "nnoe-lease-history: " << error << std::endl;
+                return 2;
+            }
+            return 1;
+        }
+        Json::Value value = event_value(event);
+        value["held"] = nnoe::LeaseHistoryReader::holds(event, at);
+        print(value);
+        return 0;
+    }
+
+    std::vector<nnoe::HistoryEvent> events;
+    if (!reader.query(query, events, error)) {
+        std::cerr << "nnoe-lease-history: " << error << std::endl;
+        return 2;
+    }
+    for (const auto& event : events) {
+        print(event_value(event));
+    }
+    return events.empty() ? 1 : 0;
+}
@@ -0,0 +1,493 @@
+/**
+ * In-memory lease index for the NNOE Kea hook
+ */
+
+#include "lease_index.h"
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <array>
+#include <ctime>
+#include <mutex>
+
+namespace nnoe {
+
+namespace {
+
+// Host-order IPv4 address, false for anything else
+bool parse_v4(const std::string& text, uint32_t& out) {
+    in_addr addr;
+    if (inet_pton(AF_INET, text.c_str(), &addr) != 1) {
+        return false;
+    }
+    out = ntohl(addr.s_addr);
+    return true;
+}
+
+bool parse_v6(const std::string& text, std::array<uint8_t, 16>& out) {
+    return inet_pton(AF_INET6, text.c_str(), out.data()) == 1;
+}
+
+std::string format_v4(uint32_t addr) {
+    in_addr in;
+    in.s_addr = htonl(addr);
+    char buf[INET_ADDRSTRLEN];
+    return inet_ntop(AF_INET, &in, buf, sizeof(buf)) ? std::string(buf) : std::string();
+}
+
+std::string format_v6(const std::array<uint8_t, 16>& addr) {
+    char buf[INET6_ADDRSTRLEN];
+    return inet_ntop(AF_INET6, addr.data(), buf, sizeof(buf)) ? std::string(buf) : std::string();
+}
+
+// Declined addresses are as unavailable as leased ones
+bool occupies_address(uint32_t state) {
+    return state == 0 || state == 1;
+}
+
+} // namespace
+
+LeaseIndex::LeaseIndex(uint32_t wheel_seconds)
+    : wheel_seconds_(wheel_seconds ? wheel_seconds : 1), memory_(nullptr), pool_bytes_(0),
+      wheel_(wheel_seconds_) {
+}
+
+LeaseIndex::~LeaseIndex() {
+    release_all();
+    if (memory_) {
+        memory_->release(pool_bytes_);
+    }
+}
+
+uint64_t LeaseIndex::entry_bytes(const IndexedLease& lease) {
+    // The address map node plus the subnet, client and expiry index nodes
+    return sizeof(Entry) + 4 * CONTAINER_NODE_BYTES + 2 * string_heap_bytes(lease.address) +
+           2 * string_heap_bytes(lease.hwaddr) + 2 * string_heap_bytes(lease.duid) +
+           string_heap_bytes(lease.hostname);
+}
+
+void LeaseIndex::release_all() {
+    if (!memory_) {
+        return;
+    }
+    for (const auto& entry : leases_) {
+        memory_->release(entry.second.bytes);
+    }
+}
+
+void LeaseIndex::mark(const IndexedLease& lease, bool assigned) {
+    if (lease.address.find(':') == std::string::npos) {
+        mark4(lease, assigned);
+    } else {
+        mark6(lease, assigned);
+    }
+}
+
+void LeaseIndex::mark4(const IndexedLease& lease, bool assigned) {
+    uint32_t addr;
+    if (!occupies_address(lease.state) || !parse_v4(lease.address, addr)) {
+        return;
+    }
+    auto it = pools_.find(lease.subnet_id);
+    if (it == pools_.end()) {
+        return;
+    }
+    for (auto& bitmap : it->second) {
+        if (addr < bitmap.pool.first || addr > bitmap.pool.last) {
+            continue;
+        }
+        const uint64_t offset = addr - bitmap.pool.first;
+        uint64_t& word = bitmap.bits[offset / 64];
+        const uint64_t bit = 1ULL << (offset % 64);
+        if (assigned && !(word & bit)) {
+            word |= bit;
+            bitmap.assigned++;
+        } else if (!assigned && (word & bit)) {
+            word &= ~bit;
+            bitmap.assigned--;
+        }
+        return;
+    }
+}
+
+// Counted rather than mapped: link and unlink come in pairs
+void LeaseIndex::mark6(const IndexedLease& lease, bool assigned) {
+    std::array<uint8_t, 16> addr;
+    if (!occupies_address(lease.state) || !parse_v6(lease.address, addr)) {
+        return;
+    }
+    auto it = pools6_.find(lease.subnet_id);
+    if (it == pools6_.end()) {
+        return;
+    }
+    for (auto& count : it->second) {
+        if (addr < count.pool.first || addr > count.pool.last) {
+            continue;
+        }
+        if (assigned) {
+            count.assigned++;
+        } else if (count.assigned) {
+            count.assigned--;
+        }
+        return;
+    }
+}
+
+void LeaseIndex::charge_pools() {
+    uint64_t pool_bytes = 0;
+    for (const auto& subnet : pools_) {
+        for (const auto& bitmap : subnet.second) {
+            pool_bytes += sizeof(PoolBitmap) + bitmap.bits.size() * sizeof(uint64_t);
+        }
+    }
+    for (const auto& subnet : pools6_) {
+        pool_bytes += subnet.second.size() * sizeof(PoolCount6);
+    }
+
+    // Pools follow the configuration and are never refused
+    if (memory_) {
+        memory_->charge(pool_bytes);
+        memory_->release(pool_bytes_);
+    }
+    pool_bytes_ = pool_bytes;
+}
+
+void LeaseIndex::link(Entry* entry) {
+    const IndexedLease& lease = entry->lease;
+
+    subnets_[lease.subnet_id].insert(entry);
+    if (!lease.hwaddr.empty()) {
+        hwaddrs_.emplace(lease.hwaddr, entry);
+    }
+    if (!lease.duid.empty()) {
+        duids_.emplace(lease.duid, entry);
+    }
+    mark(lease, true);
+
+    const int64_t now = time(nullptr);
+    entry->in_wheel = lease.expires_at < now + wheel_seconds_;
+    if (entry->in_wheel) {
+        const int64_t slot = ((lease.expires_at % wheel_seconds_) + wheel_seconds_) % wheel_seconds_;
+        wheel_[slot].insert(entry);
+    } else {
+        far_.emplace(lease.expires_at, entry);
+    }
+}
+
+void LeaseIndex::unlink(Entry* entry) {
+    const IndexedLease& lease = entry->lease;
+
+    auto subnet = subnets_.find(lease.subnet_id);
+    if (subnet != subnets_.end()) {
+        subnet->second.erase(entry);
+        if (subnet->second.empty()) {
+            subnets_.erase(subnet);
+        }
+    }
+
+    auto erase_from = [entry](std::unordered_multimap<std::string, const Entry*>& map,
+                              const std::string& id) {
+        auto range = map.equal_range(id);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == entry) {
+                map.erase(it);
+                return;
+            }
+        }
+    };
+    if (!lease.hwaddr.empty()) {
+        erase_from(hwaddrs_, lease.hwaddr);
+    }
+    if (!lease.duid.empty()) {
+        erase_from(duids_, lease.duid);
+    }
+    mark(lease, false);
+
+    if (entry->in_wheel) {
+        const int64_t slot = ((lease.expires_at % wheel_seconds_) + wheel_seconds_) % wheel_seconds_;
+        wheel_[slot].erase(entry);
+    } else {
+        auto range = far_.equal_range(lease.expires_at);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == entry) {
+                far_.erase(it);
+                break;
+            }
+        }
+    }
+}
+
+void LeaseIndex::upsert(const IndexedLease& lease) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    const uint64_t bytes = entry_bytes(lease);
+    auto it = leases_.find(lease.address);
+    if (it != leases_.end()) {
+        unlink(&it->second);
+        if (memory_) {
+            memory_->charge(bytes);
+            memory_->release(it->second.bytes);
+        }
+        it->second.lease = lease;
+        it->second.bytes = bytes;
+    } else {
+        if (memory_ && !memory_->try_charge(bytes)) {
+            return;
+        }
+        it = leases_.emplace(lease.address, Entry{lease, false, bytes}).first;
+    }
+    link(&it->second);
+}
+
+void LeaseIndex::remove(const std::string& address) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    auto it = leases_.find(address);
+    if (it == leases_.end()) {
+        return;
+    }
+    unlink(&it->second);
+    if (memory_) {
+        memory_->release(it->second.bytes);
+    }
+    leases_.erase(it);
+}
+
+void LeaseIndex::clear() {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    release_all();
+    leases_.clear();
+    subnets_.clear();
+    hwaddrs_.clear();
+    duids_.clear();
+    for (auto& subnet : pools_) {
+        for (auto& bitmap : subnet.second) {
+            std::fill(bitmap.bits.begin(), bitmap.bits.end(), 0);
+            bitmap.assigned = 0;
+        }
+    }
+    for (auto& subnet : pools6_) {
+        for (auto& count : subnet.second) {
+            count.assigned = 0;
+        }
+    }
+    for (auto& slot : wheel_) {
+        slot.clear();
+    }
+    far_.clear();
+}
+
+void LeaseIndex::set_pools4(const std::vector<Pool4>& pools) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    pools_.clear();
+    for (const auto& pool : pools) {
+        if (pool.last < pool.first) {
+            continue;
+        }
+        PoolBitmap bitmap;
+        bitmap.pool = pool;
+        bitmap.bits.assign((static_cast<uint64_t>(pool.last - pool.first) + 64) / 64, 0);
+        pools_[pool.subnet_id].push_back(std::move(bitmap));
+    }
+    charge_pools();
+
+    for (const auto& entry : leases_) {
+        mark4(entry.second.lease, true);
+    }
+}
+
+void LeaseIndex::set_pools6(const std::vector<Pool6>& pools) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    pools6_.clear();
+    for (const auto& pool : pools) {
+        if (pool.last < pool.first) {
+            continue;
+        }
+        PoolCount6 count;
+        count.pool = pool;
+        pools6_[pool.subnet_id].push_back(count);
+    }
+    charge_pools();
+
+    for (const auto& entry : leases_) {
+        mark6(entry.second.lease, true);
+    }
+}
+
+std::vector<IndexedLease> LeaseIndex::by_subnet(uint32_t subnet_id, int64_t state,
+                                                size_t limit) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    std::vector<IndexedLease> out;
+    auto subnet = subnets_.find(subnet_id);
+    if (subnet == subnets_.end()) {
+        return out;
+    }
+    for (const Entry* entry : subnet->second) {
+        if (out.size() >= limit) {
+            break;
+        }
+        if (state < 0 || entry->lease.state == static_cast<uint32_t>(state)) {
+            out.push_back(entry->lease);
+        }
+    }
+    return out;
+}
+
+std::vector<IndexedLease> LeaseIndex::expiring(int64_t now, uint32_t seconds, size_t limit) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    const int64_t end = now + seconds;
+
+    // A wheel slot holds leases due at exactly that second plus leases
+    // already expired, so walking the slots in time order yields leases
+    // soonest first
+    std::vector<const Entry*> near;
+    const uint32_t slots = std::min(seconds, wheel_seconds_);
+    for (uint32_t k = 0; k < slots && near.size() < limit; ++k) {
+        const int64_t due = now + k;
+        const auto& slot = wheel_[((due % wheel_seconds_) + wheel_seconds_) % wheel_seconds_];
+        for (const Entry* entry : slot) {
+            if (entry->lease.expires_at == due) {
+                near.push_back(entry);
+            }
+        }
+    }
+
+    std::vector<const Entry*> later;
+    for (auto it = far_.lower_bound(now); it != far_.end() && it->first < end &&
+         later.size() < limit; ++it) {
+        later.push_back(it->second);
+    }
+
+    std::vector<const Entry*> merged(near.size() + later.size());
+    std::merge(near.begin(), near.end(), later.begin(), later.end(), merged.begin(),
+               [](const Entry* a, const Entry* b) {
+                   return a->lease.expires_at < b->lease.expires_at;
+               });
+
+    std::vector<IndexedLease> out;
+    for (size_t i = 0; i < merged.size() && i < limit; ++i) {
+        out.push_back(merged[i]->lease);
+    }
+    return out;
+}
+
+std::vector<IndexedLease> LeaseIndex::by_hwaddr(const std::string& hwaddr) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    std::vector<IndexedLease> out;
+    auto range = hwaddrs_.equal_range(hwaddr);
+    for (auto it = range.first; it != range.second; ++it) {
+        out.push_back(it->second->lease);
+    }
+    return out;
+}
+
+std::vector<IndexedLease> LeaseIndex::by_duid(const std::string& duid) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    std::vector<IndexedLease> out;
+    auto range = duids_.equal_range(duid);
+    for (auto it = range.first; it != range.second; ++it) {
+        out.push_back(it->second->lease);
+    }
+    return out;
+}
+
+std::vector<PoolUtilization> LeaseIndex::utilization(uint32_t subnet_id) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    std::vector<PoolUtilization> out;
+    for (const auto& subnet : pools_) {
+        if (subnet_id != 0 && subnet.first != subnet_id) {
+            continue;
+        }
+        for (const auto& bitmap : subnet.second) {
+            PoolUtilization pool;
+            pool.subnet_id = subnet.first;
+            pool.first = format_v4(bitmap.pool.first);
+            pool.last = format_v4(bitmap.pool.last);
+            pool.total = static_cast<uint64_t>(bitmap.pool.last - bitmap.pool.first) + 1;
+            pool.assigned = bitmap.assigned;
+            out.push_back(pool);
+        }
+    }
+    for (const auto& subnet : pools6_) {
+        if (subnet_id != 0 && subnet.first != subnet_id) {
+            continue;
+        }
+        for (const auto& count : subnet.second) {
+            PoolUtilization pool;
+            pool.subnet_id = subnet.first;
+            pool.first = format_v6(count.pool.first);
+            pool.last = format_v6(count.pool.last);
+            pool.total = count.pool.capacity;
+            pool.assigned = count.assigned;
+            out.push_back(pool);
+        }
+    }
+    std::sort(out.begin(), out.end(), [](const PoolUtilization& a, const PoolUtilization& b) {
+        return a.subnet_id != b.subnet_id ? a.subnet_id < b.subnet_id : a.first < b.first;
+    });
+    return out;
+}
+
+bool LeaseIndex::pool_usage(uint32_t subnet_id, const std::string& address, uint64_t& assigned,
+                            uint64_t& total) const {
+    uint32_t addr4;
+    std::array<uint8_t, 16> addr6;
+    if (parse_v4(address, addr4)) {
+        return pool_usage(subnet_id, addr4, assigned, total);
+    }
+    if (parse_v6(address, addr6)) {
+        return pool_usage(subnet_id, addr6, assigned, total);
+    }
+    return false;
+}
+
+bool LeaseIndex::pool_usage(uint32_t subnet_id, uint32_t address, uint64_t& assigned,
+                            uint64_t& total) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    auto it = pools_.find(subnet_id);
+    if (it == pools_.end()) {
+        return false;
+    }
+    for (const auto& bitmap : it->second) {
+        if (address >= bitmap.pool.first && address <= bitmap.pool.last) {
+            assigned = bitmap.assigned;
+            total = static_cast<uint64_t>(bitmap.pool.last - bitmap.pool.first) + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LeaseIndex::pool_usage(uint32_t subnet_id, const std::array<uint8_t, 16>& address,
+                            uint64_t& assigned, uint64_t& total) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    auto it = pools6_.find(subnet_id);
+    if (it == pools6_.end()) {
+        return false;
+    }
+    for (const auto& count : it->second) {
+        if (address >= count.pool.first && address <= count.pool.last) {
+            assigned = count.assigned;
+            total = count.pool.capacity;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t LeaseIndex::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases_.size();
+}
+
+} // namespace nnoe
@@ -0,0 +1,165 @@
+/**
+ * In-memory lease index for the NNOE Kea hook
+ *
+ * Maintained from the lease callouts as events flow through, so queries
+ * that would otherwise walk the whole lease backend (or scan the etcd lease
+ * prefix) are answered from compact structures:
+ *
+ *   - leases by address, by subnet, by hardware address and by DUID;
+ *   - one allocation bitmap per IPv4 pool, with a running count, and a
+ *     count per IPv6 address or prefix pool, for utilization;
+ *   - a timer wheel of one-second slots for expiry queries, with a sorted
+ *     overflow map for expiries beyond the wheel horizon.
+ *
+ * With a memory account attached, a new lease that does not fit is left
+ * out of the index (updates of indexed leases are always applied), so
+ * queries may miss leases while the budget is exhausted.
+ *
+ * Kea independent. Writers (callouts) and readers (hook commands) share a
+ * reader/writer lock.
+ */
+
+#ifndef NNOE_LEASE_INDEX_H
+#define NNOE_LEASE_INDEX_H
+
+#include "memory_budget.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace nnoe {
+
+struct IndexedLease {
+    std::string address;
+    std::string hwaddr;     // IPv4 leases
+    std::string duid;       // IPv6 leases
+    std::string hostname;
+    uint32_t subnet_id = 0;
+    uint32_t state = 0;
+    int64_t expires_at = 0;
+};
+
+// Inclusive IPv4 pool range, host byte order
+struct Pool4 {
+    uint32_t subnet_id = 0;
+    uint32_t first = 0;
+    uint32_t last = 0;
+};
+
+// Inclusive IPv6 pool range: addresses, or the prefix delegated prefixes
+// are taken from
+struct Pool6 {
+    uint32_t subnet_id = 0;
+    std::array<uint8_t, 16> first{};
+    std::array<uint8_t, 16> last{};
+    uint64_t capacity = 0;  // addresses or delegated prefixes
+};
+
+struct PoolUtilization {
+    uint32_t subnet_id = 0;
+    std::string first;
+    std::string last;
+    uint64_t total = 0;
+    uint64_t assigned = 0;
+};
+
+class LeaseIndex {
+public:
+    explicit LeaseIndex(uint32_t wheel_seconds = 3600);
+    ~LeaseIndex();
+
+    // Charge entries and pool bitmaps to account (before the first upsert)
+    void set_memory(MemoryAccount* account) { memory_ = account; }
+
+    void upsert(const IndexedLease& lease);
+    void remove(const std::string& address);
+    void clear();
+
+    // Replace all IPv4 pools (after a reconfiguration); bitmaps are rebuilt
+    // from the indexed leases
+    void set_pools4(const std::vector<Pool4>& pools);
+
+    // As above, for the IPv6 pools
+    void set_pools6(const std::vector<Pool6>& pools);
+
+    // Leases of a subnet, optionally only those in one state (state < 0: any)
+    std::vector<IndexedLease> by_subnet(uint32_t subnet_id, int64_t state, size_t limit) const;
+
+    // Leases expiring in [now, now + seconds), soonest first
+    std::vector<IndexedLease> expiring(int64_t now, uint32_t seconds, size_t limit) const;
+
+    std::vector<IndexedLease> by_hwaddr(const std::string& hwaddr) const;
+    std::vector<IndexedLease> by_duid(const std::string& duid) const;
+
+    // Per-pool utilization of one subnet, or of all subnets for subnet_id 0
+    std::vector<PoolUtilization> utilization(uint32_t subnet_id) const;
+
+    // Assigned and total of the pool of the subnet holding address; false
+    // if no pool holds it
+    bool pool_usage(uint32_t subnet_id, const std::string& address, uint64_t& assigned,
+                    uint64_t& total) const;
+
+    // As above, for an address already in binary (host order for IPv4)
+    bool pool_usage(uint32_t subnet_id, uint32_t address, uint64_t& assigned,
+                    uint64_t& total) const;
+    bool pool_usage(uint32_t subnet_id, const std::array<uint8_t, 16>& address,
+                    uint64_t& assigned, uint64_t& total) const;
+
+    size_t size() const;
+
+private:
+    struct Entry {
+        IndexedLease lease;
+        bool in_wheel = false;
+        uint64_t bytes = 0;       // charged to memory_
+    };
+
+    struct PoolBitmap {
+        Pool4 pool;
+        std::vector<uint64_t> bits;
+        uint64_t assigned = 0;
+    };
+
+    struct PoolCount6 {
+        Pool6 pool;
+        uint64_t assigned = 0;
+    };
+
+    void link(Entry* entry);
+    void unlink(Entry* entry);
+    void mark(const IndexedLease& lease, bool assigned);
+    void mark4(const IndexedLease& lease, bool assigned);
+    void mark6(const IndexedLease& lease, bool assigned);
+    void charge_pools();
+    static uint64_t entry_bytes(const IndexedLease& lease);
+    void release_all();
+
+    uint32_t wheel_seconds_;
+    MemoryAccount* memory_;
+    uint64_t pool_bytes_;
+
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<std::string, Entry> leases_;  // node-based: entries never move
+    std::unordered_map<uint32_t, std::unordered_set<const Entry*>> subnets_;
+    std::unordered_multimap<std::string, const Entry*> hwaddrs_;
+    std::unordered_multimap<std::string, const Entry*> duids_;
+    std::unordered_map<uint32_t, std::vector<PoolBitmap>> pools_;
+    std::unordered_map<uint32_t, std::vector<PoolCount6>> pools6_;
+
+    // A lease expiring within the horizon when indexed goes to slot
+    // expires_at % wheel_seconds_, anything later to far_. Slots can hold
+    // already expired leases, so queries check expires_at exactly.
+    std::vector<std::unordered_set<const Entry*>> wheel_;
+    std::multimap<int64_t, const Entry*> far_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_LEASE_INDEX_H
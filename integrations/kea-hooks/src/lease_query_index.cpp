@@ -0,0 +1,525 @@
+/**
+ * Multi-node lease query index for the NNOE Kea hook
+ */
+
+#include "lease_query_index.h"
+#include "text_format.h"
+
+#include <nnoe/lease_reader.h>
+
+#include <arpa/inet.h>
+#include <cctype>
+#include <ctime>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+
+namespace nnoe {
+
+namespace {
+
+const int64_t SWEEP_INTERVAL_SECONDS = 60;
+
+// DHCPv4 relay agent sub-options (RFC 3046, RFC 6925)
+const uint8_t RAI_REMOTE_ID = 2;
+const uint8_t RAI_RELAY_ID = 12;
+
+// DHCPv6 relay options (RFC 4649, RFC 5460)
+const uint16_t D6O_REMOTE_ID = 37;
+const uint16_t D6O_RELAY_ID = 53;
+
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Bytes of "0x0a0b", "0a0b" or "0a:0b"; false on anything else
+bool hex_bytes(const std::string& text, std::string& out) {
+    size_t i = text.compare(0, 2, "0x") == 0 || text.compare(0, 2, "0X") == 0 ? 2 : 0;
+    out.clear();
+    while (i < text.size()) {
+        if (text[i] == ':') {
+            ++i;
+            continue;
+        }
+        if (i + 1 >= text.size()) {
+            return false;
+        }
+        const int high = hex_digit(text[i]);
+        const int low = hex_digit(text[i + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        out.push_back(static_cast<char>(high << 4 | low));
+        i += 2;
+    }
+    return true;
+}
+
+std::string colon_hex(const std::string& bytes) {
+    return hex_colon_text(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size());
+}
+
+// Identifier as the records write them, from any of Kea's hex forms
+std::string normalize_id(const Json::Value& value) {
+    std::string bytes;
+    if (!value.isString() || !hex_bytes(value.asString(), bytes)) {
+        return std::string();
+    }
+    return colon_hex(bytes);
+}
+
+// remote-id and relay-id sub-options of a raw option 82
+void read_sub_options4(const std::string& hex, QueriedLease& lease) {
+    std::string data;
+    if (!hex_bytes(hex, data)) {
+        return;
+    }
+    size_t i = 0;
+    while (i + 2 <= data.size()) {
+        const uint8_t code = static_cast<uint8_t>(data[i]);
+        const size_t length = static_cast<uint8_t>(data[i + 1]);
+        if (i + 2 + length > data.size()) {
+            return;
+        }
+        if (code == RAI_REMOTE_ID && lease.remote_id.empty()) {
+            lease.remote_id = colon_hex(data.substr(i + 2, length));
+        } else if (code == RAI_RELAY_ID && lease.relay_id.empty()) {
+            lease.relay_id = colon_hex(data.substr(i + 2, length));
+        }
+        i += 2 + length;
+    }
+}
+
+// Remote-ID and Relay-ID options among the options of a relay message
+void read_relay_options6(const std::string& hex, QueriedLease& lease) {
+    std::string data;
+    if (!hex_bytes(hex, data)) {
+        return;
+    }
+    size_t i = 0;
+    while (i + 4 <= data.size()) {
+        const uint16_t code = static_cast<uint16_t>(static_cast<uint8_t>(data[i]) << 8 |
+                                                    static_cast<uint8_t>(data[i + 1]));
+        const size_t length = static_cast<size_t>(static_cast<uint8_t>(data[i + 2]) << 8 |
+                                                  static_cast<uint8_t>(data[i + 3]));
+        if (i + 4 + length > data.size()) {
+            return;
+        }
+        if (code == D6O_REMOTE_ID && lease.remote_id.empty()) {
+            lease.remote_id = colon_hex(data.substr(i + 4, length));
+        } else if (code == D6O_RELAY_ID && lease.relay_id.empty()) {
+            lease.relay_id = colon_hex(data.substr(i + 4, length));
+        }
+        i += 4 + length;
+    }
+}
+
+// Network-order bytes of an IPv6 address
+bool parse_v6(const std::string& text, uint8_t* out) {
+    return inet_pton(AF_INET6, text.c_str(), out) == 1;
+}
+
+// Delegated prefix of length bits holding address, as a key name
+std::string prefix_name(const uint8_t* address, uint8_t length) {
+    uint8_t masked[16];
+    for (int i = 0; i < 16; ++i) {
+        const int bits = length - i * 8;
+        masked[i] = bits >= 8 ? address[i] :
+                    bits <= 0 ? 0 : static_cast<uint8_t>(address[i] & (0xff << (8 - bits)));
+    }
+    return ipv6_text(masked) + "/" + std::to_string(length);
+}
+
+} // namespace
+
+LeaseQueryIndex::LeaseQueryIndex(const std::shared_ptr<WatchManager>& watches,
+                                 const std::string& prefix, const std::string& node_id)
+    : watches_(watches), prefix_(prefix), node_id_(node_id), memory_(nullptr), remote_(0),
+      last_sweep_(0), subscription_(0), stop_(false) {
+    while (!prefix_.empty() && prefix_.back() == '/') {
+        prefix_.pop_back();
+    }
+    prefix_ += "/";
+}
+
+LeaseQueryIndex::~LeaseQueryIndex() {
+    stop();
+    if (memory_) {
+        for (const auto& entry : leases_) {
+            memory_->release(entry.second.bytes);
+        }
+    }
+}
+
+// The name map node, a node per identifier index, and the strings of both
+uint64_t LeaseQueryIndex::entry_bytes(const QueriedLease& lease) {
+    return sizeof(std::pair<const std::string, Entry>) + 6 * CONTAINER_NODE_BYTES +
+           2 * string_heap_bytes(lease.name) + string_heap_bytes(lease.address) +
+           2 * string_heap_bytes(lease.hwaddr) + 2 * string_heap_bytes(lease.client_id) +
+           2 * string_heap_bytes(lease.duid) + 2 * string_heap_bytes(lease.relay_id) +
+           2 * string_heap_bytes(lease.remote_id);
+}
+
+void LeaseQueryIndex::start() {
+    if (subscription_) {
+        return;
+    }
+    stop_ = false;
+    subscription_ = watches_->subscribe(prefix_, this);
+}
+
+void LeaseQueryIndex::stop() {
+    // Ends a reload in progress
+    stop_ = true;
+    if (subscription_) {
+        watches_->unsubscribe(subscription_);
+        subscription_ = 0;
+    }
+}
+
+void LeaseQueryIndex::read_relay_ids(const Json::Value& context, QueriedLease& lease) {
+    if (!context.isObject()) {
+        return;
+    }
+    const Json::Value& isc = context["ISC"];
+    if (!isc.isObject()) {
+        return;
+    }
+
+    // IPv4: {"relay-agent-info": {"sub-options": "0x...", "remote-id": "0x...",
+    // "relay-id": "0x..."}}, or the sub-options alone as a string (Kea < 2.1)
+    const Json::Value& info4 = isc["relay-agent-info"];
+    if (info4.isObject()) {
+        lease.remote_id = normalize_id(info4["remote-id"]);
+        lease.relay_id = normalize_id(info4["relay-id"]);
+        if (info4["sub-options"].isString()) {
+            read_sub_options4(info4["sub-options"].asString(), lease);
+        }
+    } else if (info4.isString()) {
+        read_sub_options4(info4.asString(), lease);
+    }
+
+    // IPv6: {"relay-info": [{"hop": 0, "options": "0x...", "remote-id": "0x...",
+    // "relay-id": "0x..."}, ...]}; the relay closest to the client first
+    const Json::Value& info6 = isc["relay-info"];
+    if (info6.isArray()) {
+        for (Json::ArrayIndex i = 0; i < info6.size(); ++i) {
+            const Json::Value& relay = info6[i];
+            if (!relay.isObject()) {
+                continue;
+            }
+            if (lease.remote_id.empty()) {
+                lease.remote_id = normalize_id(relay["remote-id"]);
+            }
+            if (lease.relay_id.empty()) {
+                lease.relay_id = normalize_id(relay["relay-id"]);
+            }
+            if (relay["options"].isString()) {
+                read_relay_options6(relay["options"].asString(), lease);
+            }
+        }
+    }
+}
+
+bool LeaseQueryIndex::from_record(const std::string& name, const Json::Value& record,
+                                  QueriedLease& lease) {
+    if (!record.isObject() || !record["ip"].isString() ||
+        record.get("v", 0).asUInt() > LEASE_SCHEMA_VERSION) {
+        return false;
+    }
+    lease = QueriedLease();
+    lease.name = name;
+    lease.address = record["ip"].asString();
+    lease.v6 = lease.address.find(':') != std::string::npos;
+    lease.hwaddr = record.get("hwaddr", "").asString();
+    lease.client_id = record.get("client_id", "").asString();
+    lease.duid = record.get("duid", "").asString();
+    lease.subnet_id = record.get("subnet_id", 0).asUInt();
+    lease.iaid = record.get("iaid", 0).asUInt();
+    lease.state = record.get("state", 0).asUInt();
+    lease.valid_lft = static_cast<uint32_t>(record.get("valid_lft", 0).asInt64());
+    lease.preferred_lft = static_cast<uint32_t>(record.get("preferred_lft", 0).asInt64());
+    lease.cltt = record.get("cltt", 0).asInt64();
+    lease.expires_at = record.get("expires_at", lease.cltt + lease.valid_lft).asInt64();
+    lease.type = static_cast<uint8_t>(record.get("type", 0).asUInt());
+    lease.prefix_len = static_cast<uint8_t>(record.get("prefix_len", lease.v6 ? 128 : 32).asUInt());
+    read_relay_ids(record["context"], lease);
+    return true;
+}
+
+void LeaseQueryIndex::link(const Entry* entry) {
+    const QueriedLease& lease = entry->lease;
+    if (!lease.hwaddr.empty()) {
+        hwaddrs_.emplace(lease.hwaddr, entry);
+    }
+    if (!lease.client_id.empty()) {
+        client_ids_.emplace(lease.client_id, entry);
+    }
+    if (!lease.duid.empty()) {
+        duids_.emplace(lease.duid, entry);
+    }
+    if (!lease.relay_id.empty()) {
+        relay_ids_.emplace(lease.relay_id, entry);
+    }
+    if (!lease.remote_id.empty()) {
+        remote_ids_.emplace(lease.remote_id, entry);
+    }
+    if (lease.v6 && lease.type == 2) {
+        pd_lengths_[lease.prefix_len]++;
+    }
+    if (lease.remote) {
+        remote_++;
+    }
+}
+
+void LeaseQueryIndex::unlink(const Entry* entry) {
+    auto erase_from = [entry](IdMap& map, const std::string& id) {
+        if (id.empty()) {
+            return;
+        }
+        auto range = map.equal_range(id);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == entry) {
+                map.erase(it);
+                return;
+            }
+        }
+    };
+    const QueriedLease& lease = entry->lease;
+    erase_from(hwaddrs_, lease.hwaddr);
+    erase_from(client_ids_, lease.client_id);
+    erase_from(duids_, lease.duid);
+    erase_from(relay_ids_, lease.relay_id);
+    erase_from(remote_ids_, lease.remote_id);
+    if (lease.v6 && lease.type == 2) {
+        auto length = pd_lengths_.find(lease.prefix_len);
+        if (length != pd_lengths_.end() && --length->second == 0) {
+            pd_lengths_.erase(length);
+        }
+    }
+    if (lease.remote) {
+        remote_--;
+    }
+}
+
+// Caller holds mutex_ exclusively
+void LeaseQueryIndex::put(const QueriedLease& lease) {
+    auto it = leases_.find(lease.name);
+    if (lease.state > 1) {
+        if (it != leases_.end()) {
+            erase(it);
+        }
+        return;
+    }
+
+    const uint64_t bytes = entry_bytes(lease);
+    if (it != leases_.end()) {
+        unlink(&it->second);
+        if (memory_) {
+            memory_->charge(bytes);
+            memory_->release(it->second.bytes);
+        }
+        it->second.lease = lease;
+        it->second.bytes = bytes;
+    } else {
+        if (memory_ && !memory_->try_charge(bytes)) {
+            return;
+        }
+        it = leases_.emplace(lease.name, Entry{lease, bytes}).first;
+    }
+    link(&it->second);
+}
+
+void LeaseQueryIndex::erase(std::unordered_map<std::string, Entry>::iterator it) {
+    unlink(&it->second);
+    if (memory_) {
+        memory_->release(it->second.bytes);
+    }
+    leases_.erase(it);
+}
+
+void LeaseQueryIndex::upsert(const QueriedLease& lease) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    QueriedLease local = lease;
+    local.remote = false;
+    put(local);
+}
+
+void LeaseQueryIndex::remove(const std::string& name) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    auto it = leases_.find(name);
+    // Another server may have taken the address over since
+    if (it != leases_.end() && !it->second.lease.remote) {
+        erase(it);
+    }
+}
+
+// Caller holds mutex_ exclusively
+void LeaseQueryIndex::update(const std::string& key, const std::string* value, bool reloading) {
+    if (key.compare(0, prefix_.size(), prefix_) != 0) {
+        return;
+    }
+    const std::string name = key.substr(prefix_.size());
+
+    auto it = leases_.find(name);
+    if (!value) {
+        // A delete of this server's lease is the callouts' to apply
+        if (it != leases_.end() && it->second.lease.remote) {
+            erase(it);
+        }
+        return;
+    }
+
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    Json::Value record;
+    QueriedLease lease;
+    if (!reader->parse(value->data(), value->data() + value->size(), &record, nullptr) ||
+        !from_record(name, record, lease)) {
+        return;
+    }
+    if (!node_id_.empty() && record.get("node", "").asString() == node_id_) {
+        // Seeds this server's leases after a restart
+        if (reloading && it == leases_.end()) {
+            put(lease);
+        }
+        return;
+    }
+    lease.remote = true;
+    put(lease);
+}
+
+void LeaseQueryIndex::sweep(int64_t now) {
+    for (auto it = leases_.begin(); it != leases_.end();) {
+        auto next = std::next(it);
+        if (it->second.lease.expires_at <= now) {
+            erase(it);
+        }
+        it = next;
+    }
+    last_sweep_ = now;
+}
+
+// Caller holds mutex_ exclusively
+void LeaseQueryIndex::clear_remote() {
+    for (auto it = leases_.begin(); it != leases_.end();) {
+        auto next = std::next(it);
+        if (it->second.lease.remote) {
+            erase(it);
+        }
+        it = next;
+    }
+}
+
+std::vector<QueriedLease> LeaseQueryIndex::find(LeaseQueryKey key, const std::string& value,
+                                                int64_t now) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    std::vector<QueriedLease> out;
+    auto add = [&out, now](const Entry& entry) {
+        if (entry.lease.expires_at > now) {
+            out.push_back(entry.lease);
+        }
+    };
+
+    if (key == LeaseQueryKey::ADDRESS) {
+        auto it = leases_.find(value);
+        if (it != leases_.end()) {
+            add(it->second);
+            return out;
+        }
+        // An address inside a delegated prefix
+        uint8_t address[16];
+        if (pd_lengths_.empty() || !parse_v6(value, address)) {
+            return out;
+        }
+        for (const auto& length : pd_lengths_) {
+            it = leases_.find(prefix_name(address, length.first));
+            if (it != leases_.end()) {
+                add(it->second);
+                return out;
+            }
+        }
+        return out;
+    }
+
+    const IdMap* map = nullptr;
+    switch (key) {
+    case LeaseQueryKey::HWADDR:
+        map = &hwaddrs_;
+        break;
+    case LeaseQueryKey::CLIENT_ID:
+        map = &client_ids_;
+        break;
+    case LeaseQueryKey::DUID:
+        map = &duids_;
+        break;
+    case LeaseQueryKey::RELAY_ID:
+        map = &relay_ids_;
+        break;
+    default:
+        map = &remote_ids_;
+        break;
+    }
+    auto range = map->equal_range(value);
+    for (auto it = range.first; it != range.second; ++it) {
+        add(*it->second);
+    }
+    return out;
+}
+
+size_t LeaseQueryIndex::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return leases_.size();
+}
+
+size_t LeaseQueryIndex::remote_size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return remote_;
+}
+
+bool LeaseQueryIndex::reload(const EtcdClient& client, int64_t& revision) {
+    // This server's leases stay: the callouts keep them current
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        clear_remote();
+    }
+
+    const bool ok = client.range_pages(prefix_, prefix_range_end(prefix_),
+        [&](std::vector<EtcdKeyValue>& page) {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            for (const auto& kv : page) {
+                update(kv.key, &kv.value, true);
+            }
+            return !stop_;
+        },
+        revision);
+
+    if (!ok || stop_) {
+        return false;
+    }
+    last_sweep_ = time(nullptr);
+
+    std::cerr << "Kea etcd hook: lease query index tracks " << remote_size()
+              << " leases of other servers" << std::endl;
+    return true;
+}
+
+void LeaseQueryIndex::apply(const std::vector<EtcdWatchEvent>& events) {
+    const int64_t now = time(nullptr);
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    for (const auto& event : events) {
+        update(event.kv.key, event.type == EtcdWatchEvent::DELETE ? nullptr : &event.kv.value,
+               false);
+    }
+    if (now - last_sweep_ >= SWEEP_INTERVAL_SECONDS) {
+        sweep(now);
+    }
+}
+
+} // namespace nnoe
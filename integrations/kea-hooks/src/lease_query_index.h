@@ -0,0 +1,149 @@
+/**
+ * Multi-node lease query index for the NNOE Kea hook
+ *
+ * Bulk leasequery (bulk_leasequery.h) has to answer for every server
+ * sharing the lease prefix, not only for the leases in Kea's own backend.
+ * The index keeps all of them in memory:
+ *
+ *   - this server's leases, fed by the lease callouts as events happen;
+ *   - the other servers' leases, mirrored from the lease prefix through the
+ *     shared watch manager. Records whose "node" is this server's are left
+ *     to the callouts, which are ahead of etcd, except that a full read
+ *     seeds the ones the callouts have not seen since a restart;
+ *
+ * and finds them by key name (address, or prefix/length), hardware address,
+ * client identifier, DUID, and the relay-id and remote-id of the relay
+ * information Kea keeps in the lease's user context. IPv6 address lookups
+ * also find the delegated prefix holding the address.
+ *
+ * Only leases in the default or declined state are kept, and lookups skip
+ * expired ones; expired entries are swept every minute. With a memory
+ * account attached, new leases that do not fit are left out.
+ *
+ * Kea independent. The callouts, the watch dispatch thread and the query
+ * connections share a reader/writer lock.
+ */
+
+#ifndef NNOE_LEASE_QUERY_INDEX_H
+#define NNOE_LEASE_QUERY_INDEX_H
+
+#include "etcd_client.h"
+#include "memory_budget.h"
+#include "watch_manager.h"
+
+#include <json/json.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nnoe {
+
+// Identifiers are colon-separated lowercase hex, as in the lease records
+struct QueriedLease {
+    std::string name;          // key name: address, or prefix/length
+    std::string address;       // address, or the delegated prefix
+    std::string hwaddr;        // IPv4
+    std::string client_id;     // IPv4
+    std::string duid;          // IPv6
+    std::string relay_id;      // from the relay information, if Kea kept it
+    std::string remote_id;     // IPv6: enterprise number and remote-id
+    uint32_t subnet_id = 0;
+    uint32_t iaid = 0;
+    uint32_t state = 0;
+    uint32_t valid_lft = 0;
+    uint32_t preferred_lft = 0;
+    int64_t cltt = 0;
+    int64_t expires_at = 0;
+    uint8_t type = 0;          // IPv6: 0 address, 1 temporary, 2 delegated prefix
+    uint8_t prefix_len = 128;
+    bool v6 = false;
+    bool remote = false;       // leased by another server
+};
+
+enum class LeaseQueryKey { ADDRESS, HWADDR, CLIENT_ID, DUID, RELAY_ID, REMOTE_ID };
+
+class LeaseQueryIndex : public WatchSubscriber {
+public:
+    LeaseQueryIndex(const std::shared_ptr<WatchManager>& watches, const std::string& prefix,
+                    const std::string& node_id);
+    ~LeaseQueryIndex();
+
+    // Charge entries to account (before start())
+    void set_memory(MemoryAccount* account) { memory_ = account; }
+
+    void start();
+    void stop();
+
+    // Lease callouts: a lease of this server changed or went away
+    void upsert(const QueriedLease& lease);
+    void remove(const std::string& name);
+
+    // Unexpired leases matching value; ADDRESS takes an address
+    std::vector<QueriedLease> find(LeaseQueryKey key, const std::string& value,
+                                   int64_t now) const;
+
+    size_t size() const;
+    size_t remote_size() const;
+
+    // Lease described by the record stored under name; false if it is not
+    // a lease record
+    static bool from_record(const std::string& name, const Json::Value& record,
+                            QueriedLease& lease);
+
+    // relay_id and remote_id from Kea's extended info in a user context
+    static void read_relay_ids(const Json::Value& context, QueriedLease& lease);
+
+    // WatchSubscriber
+    bool reload(const EtcdClient& client, int64_t& revision) override;
+    void apply(const std::vector<EtcdWatchEvent>& events) override;
+
+private:
+    struct Entry {
+        QueriedLease lease;
+        uint64_t bytes = 0;       // charged to memory_
+    };
+
+    typedef std::unordered_multimap<std::string, const Entry*> IdMap;
+
+    // Caller holds mutex_ exclusively
+    void put(const QueriedLease& lease);
+    void erase(std::unordered_map<std::string, Entry>::iterator it);
+    void update(const std::string& key, const std::string* value, bool reloading);
+    void link(const Entry* entry);
+    void unlink(const Entry* entry);
+    void sweep(int64_t now);
+    void clear_remote();
+    static uint64_t entry_bytes(const QueriedLease& lease);
+
+    std::shared_ptr<WatchManager> watches_;
+    std::string prefix_;
+    std::string node_id_;
+    MemoryAccount* memory_;
+
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<std::string, Entry> leases_;   // key name; entries never move
+    IdMap hwaddrs_;
+    IdMap client_ids_;
+    IdMap duids_;
+    IdMap relay_ids_;
+    IdMap remote_ids_;
+    std::map<uint8_t, size_t> pd_lengths_;           // delegated prefixes per length
+    size_t remote_;
+
+    // Owned by the dispatch thread
+    int64_t last_sweep_;
+
+    uint64_t subscription_;
+    std::atomic<bool> stop_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_LEASE_QUERY_INDEX_H
@@ -0,0 +1,407 @@
+/**
+ * NNOE memfile lease tailer
+ */
+
+#include "lease_tailer.h"
+
+#include <nnoe/lease_reader.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace nnoe {
+
+namespace {
+
+// Kea's lease_type column value for IA_PD
+const uint64_t PD_LEASE_TYPE = 2;
+
+// Latest cltt whose microseconds fit a sequence
+const uint64_t MAX_CLTT = UINT64_MAX / 1000000 - 1;
+
+std::string dir_name(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+} // namespace
+
+LeaseTailer::LeaseTailer(const TailerConfig& config, SyncEngine& engine)
+    : config_(config), engine_(engine), rows_(0), last_state_save_(0) {
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    writer_.reset(builder.newStreamWriter());
+}
+
+void LeaseTailer::add_file(const std::string& path, bool v6) {
+    TailedFile file;
+    file.path = path;
+    file.v6 = v6;
+    files_.push_back(file);
+}
+
+void LeaseTailer::load_state() {
+    if (config_.state_file.empty()) {
+        return;
+    }
+    std::ifstream in(config_.state_file);
+    std::string path;
+    unsigned long long inode;
+    long long offset;
+    while (in >> path >> inode >> offset) {
+        for (auto& file : files_) {
+            if (file.path == path) {
+                file.inode = static_cast<ino_t>(inode);
+                file.offset = static_cast<off_t>(offset);
+            }
+        }
+    }
+}
+
+void LeaseTailer::save_state() {
+    if (config_.state_file.empty()) {
+        return;
+    }
+    const std::string tmp = config_.state_file + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        for (const auto& file : files_) {
+            // Resume at the start of an incomplete trailing line
+            const off_t offset = file.offset - static_cast<off_t>(file.partial.size());
+            out << file.path << " " << static_cast<unsigned long long>(file.inode)
+                << " " << static_cast<long long>(offset) << "\n";
+        }
+    }
+    std::rename(tmp.c_str(), config_.state_file.c_str());
+    last_state_save_ = time(nullptr);
+}
+
+bool LeaseTailer::read_header(TailedFile& file) {
+    // The header is the first line; read it even when resuming mid-file
+    char buf[4096];
+    ssize_t n = pread(file.fd, buf, sizeof(buf), 0);
+    if (n <= 0) {
+        return false;
+    }
+    const char* nl = static_cast<const char*>(std::memchr(buf, '\n', n));
+    if (!nl) {
+        return false;
+    }
+    std::string_view line(buf, nl - buf);
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    file.have_header = file.columns.parse_header(line);
+    if (file.offset < nl - buf + 1) {
+        file.offset = nl - buf + 1;
+    }
+    return file.have_header;
+}
+
+bool LeaseTailer::open_file(TailedFile& file, bool resume) {
+    int fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    if (!resume || st.st_ino != file.inode || st.st_size < file.offset) {
+        // New file (first start, LFC rotation or truncation)
+        file.offset = (resume || config_.from_start) ? 0 : st.st_size;
+    }
+
+    file.fd = fd;
+    file.inode = st.st_ino;
+    file.partial.clear();
+    file.columns = MemfileColumns();
+    file.have_header = false;
+    read_header(file);
+    return true;
+}
+
+void LeaseTailer::drain(TailedFile& file) {
+    static const size_t CHUNK = 1 << 16;
+    std::vector<char> buf(CHUNK);
+
+    for (;;) {
+        ssize_t n = pread(file.fd, buf.data(), buf.size(), file.offset);
+        if (n <= 0) {
+            break;
+        }
+        file.offset += n;
+
+        std::string_view data(buf.data(), static_cast<size_t>(n));
+        if (!file.partial.empty()) {
+            // Complete the line split across reads, then continue in place
+            size_t nl = data.find('\n');
+            if (nl == std::string_view::npos) {
+                file.partial.append(data.data(), data.size());
+                continue;
+            }
+            file.partial.append(data.data(), nl);
+            handle_line(file, file.partial);
+            file.partial.clear();
+            data.remove_prefix(nl + 1);
+        }
+
+        size_t nl;
+        while ((nl = data.find('\n')) != std::string_view::npos) {
+            handle_line(file, data.substr(0, nl));
+            data.remove_prefix(nl + 1);
+        }
+        file.partial.assign(data.data(), data.size());
+    }
+}
+
+void LeaseTailer::poll_file(TailedFile& file) {
+    if (file.fd < 0 && !open_file(file, true)) {
+        return;
+    }
+
+    if (!file.have_header) {
+        read_header(file);
+    }
+    drain(file);
+
+    // LFC moves the live file aside and recreates it: once the old
+    // descriptor is drained, continue with the new inode from the start
+    struct stat st;
+    if (stat(file.path.c_str(), &st) == 0 && st.st_ino != file.inode) {
+        close(file.fd);
+        file.fd = -1;
+        file.inode = 0;
+        file.offset = 0;
+        if (open_file(file, true)) {
+            drain(file);
+        }
+    }
+}
+
+void LeaseTailer::handle_line(TailedFile& file, std::string_view line) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    if (line.empty()) {
+        return;
+    }
+    if (!file.have_header) {
+        file.have_header = file.columns.parse_header(line);
+        return;
+    }
+    if (line.compare(0, 8, "address,") == 0) {
+        return; // header of a recreated file
+    }
+
+    std::string_view fields[MemfileColumns::MAX_FIELDS];
+    const size_t count = split_csv_row(line, fields, MemfileColumns::MAX_FIELDS);
+    submit_row(file, fields, count);
+}
+
+void LeaseTailer::submit_row(const TailedFile& file, const std::string_view* fields, size_t count) {
+    typedef MemfileColumns C;
+    const C& col = file.columns;
+
+    std::string_view address = C::field(fields, count, col.address);
+    uint64_t valid_lft = 0;
+    uint64_t expire = 0;
+    uint64_t state = 0;
+    if (address.empty() ||
+        !parse_csv_uint(C::field(fields, count, col.valid_lifetime), valid_lft) ||
+        !parse_csv_uint(C::field(fields, count, col.expire), expire)) {
+        return;
+    }
+
+    // A malformed row would otherwise yield a huge sequence and block the
+    // address for good
+    if (expire < valid_lft || expire - valid_lft > MAX_CLTT) {
+        std::cerr << "nnoe-lease-tailer: skipping " << file.path << " row for " << address
+                  << ": expire " << expire << " does not fit valid_lifetime " << valid_lft
+                  << std::endl;
+        return;
+    }
+    parse_csv_uint(C::field(fields, count, col.state), state);
+    uint64_t subnet_id = 0;
+    const bool has_subnet = parse_csv_uint(C::field(fields, count, col.subnet_id), subnet_id);
+
+    // Delegated prefixes are keyed prefix/length, like the hook does
+    uint64_t type = 0, prefix_len = 128;
+    std::string name(address);
+    if (file.v6) {
+        parse_csv_uint(C::field(fields, count, col.lease_type), type);
+        parse_csv_uint(C::field(fields, count, col.prefix_len), prefix_len);
+        if (type == PD_LEASE_TYPE) {
+            name += "/" + std::to_string(prefix_len);
+        }
+    }
+
+    const std::string key = config_.prefix + "/" + name;
+    std::vector<EtcdOp> ops;
+
+    // Memfile records a deletion as a zero lifetime; state 2 is
+    // expired-reclaimed and 3 released
+    const bool ends = valid_lft == 0 || state == 2 || state == 3;
+
+    // Same ordering guard as the hook, sequenced by the row's own time, so
+    // replays cannot roll back what servers wrote after it
+    EtcdGuard guard;
+    guard.key = config_.sequence_prefix + "/" + name;
+    guard.sequence = row_sequence(name, expire - valid_lft, ends);
+
+    if (ends) {
+        ops.push_back(EtcdOp::del(key));
+    } else {
+        // Same value layout as the in-process hook
+        Json::Value lease_data;
+        lease_data["v"] = LEASE_SCHEMA_VERSION;
+        lease_data["ip"] = std::string(address);
+        if (file.v6) {
+            uint64_t iaid = 0, preferred = 0;
+            parse_csv_uint(C::field(fields, count, col.iaid), iaid);
+            parse_csv_uint(C::field(fields, count, col.pref_lifetime), preferred);
+            lease_data["type"] = static_cast<int>(type);
+            if (type == PD_LEASE_TYPE) {
+                lease_data["prefix_len"] = static_cast<int>(prefix_len);
+            }
+            lease_data["iaid"] = static_cast<Json::UInt64>(iaid);
+            lease_data["duid"] = std::string(C::field(fields, count, col.duid));
+            lease_data["preferred_lft"] = static_cast<Json::Int64>(preferred);
+        } else {
+            lease_data["hwaddr"] = std::string(C::field(fields, count, col.hwaddr));
+        }
+        if (has_subnet) {
+            lease_data["subnet_id"] = static_cast<Json::UInt64>(subnet_id);
+        }
+        lease_data["state"] = static_cast<int>(state);
+        lease_data["cltt"] = static_cast<Json::Int64>(expire - valid_lft);
+        lease_data["valid_lft"] = static_cast<Json::Int64>(valid_lft);
+        lease_data["operation"] = "renew";
+        lease_data["node"] = config_.node_id;
+        lease_data["timestamp"] = static_cast<Json::Int64>(time(nullptr));
+        lease_data["seq"] = static_cast<Json::UInt64>(guard.sequence);
+        lease_data["expires_at"] = static_cast<Json::Int64>(expire);
+
+        std::string hostname = unescape_csv_field(C::field(fields, count, col.hostname));
+        if (!hostname.empty()) {
+            lease_data["hostname"] = hostname;
+        }
+
+        std::ostringstream value;
+        writer_->write(lease_data, &value);
+        ops.push_back(EtcdOp::put(key, value.str()));
+    }
+
+    engine_.submit(key, std::move(ops), guard, static_cast<uint32_t>(subnet_id));
+    rows_++;
+}
+
+// The lease's cltt in microseconds, the unit of the hook's SequenceClock,
+// so a replayed row (--from-start, or a restart without state) is older than
+// later writes of any server to the address. A row ending a lease carries
+// that lease's cltt and sorts a microsecond after its last write; rows of
+// one name keep their file order within a run.
+uint64_t LeaseTailer::row_sequence(const std::string& name, uint64_t cltt, bool ends) {
+    uint64_t sequence = cltt * 1000000 + (ends ? 1 : 0);
+    uint64_t& last = sequences_[name];
+    if (sequence <= last) {
+        sequence = last + 1;
+    }
+    last = sequence;
+    return sequence;
+}
+
+void LeaseTailer::open_files() {
+    load_state();
+    for (auto& file : files_) {
+        // Resume only when the saved inode still matches
+        const ino_t saved_inode = file.inode;
+        if (open_file(file, saved_inode != 0)) {
+            std::cerr << "nnoe-lease-tailer: following " << file.path
+                      << " from offset " << file.offset << std::endl;
+        }
+    }
+}
+
+void LeaseTailer::poll_files() {
+    for (auto& file : files_) {
+        poll_file(file);
+    }
+    if (time(nullptr) != last_state_save_) {
+        save_state();
+    }
+}
+
+void LeaseTailer::close_files() {
+    for (auto& file : files_) {
+        if (file.fd >= 0) {
+            drain(file);
+            close(file.fd);
+            file.fd = -1;
+        }
+    }
+    save_state();
+}
+
+int LeaseTailer::run(const volatile sig_atomic_t& stop) {
+    int in_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (in_fd < 0) {
+        std::cerr << "nnoe-lease-tailer: inotify_init1: " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> watched_dirs;
+    for (const auto& file : files_) {
+        const std::string dir = dir_name(file.path);
+        bool seen = false;
+        for (const auto& d : watched_dirs) {
+            seen = seen || d == dir;
+        }
+        if (!seen) {
+            if (inotify_add_watch(in_fd, dir.c_str(),
+                                  IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM |
+                                  IN_CLOSE_WRITE) < 0) {
+                std::cerr << "nnoe-lease-tailer: cannot watch " << dir << ": "
+                          << strerror(errno) << std::endl;
+                close(in_fd);
+                return 1;
+            }
+            watched_dirs.push_back(dir);
+        }
+    }
+
+    open_files();
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (!stop) {
+        poll_files();
+
+        struct pollfd pfd;
+        pfd.fd = in_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) > 0) {
+            // Any event in the directory just triggers a re-poll of the files
+            while (read(in_fd, events, sizeof(events)) > 0) {
+            }
+        }
+    }
+
+    close_files();
+    close(in_fd);
+
+    std::cerr << "nnoe-lease-tailer: stopped after " << rows_ << " rows" << std::endl;
+    return 0;
+}
+
+} // namespace nnoe
@@ -0,0 +1,106 @@
+/**
+ * NNOE memfile lease tailer
+ *
+ * Out-of-process alternative to libdhcp_etcd.so: follows Kea's memfile lease
+ * files (kea-leases4.csv / kea-leases6.csv) and feeds appended rows to the
+ * same batching sync engine the hook uses. Kea never waits on etcd, so DHCP
+ * performance is independent of etcd health.
+ *
+ *   - inotify on the lease directory, plus a 1s poll as a safety net
+ *   - only bytes past the last offset are read; offsets (with the file
+ *     inode) are persisted in a state file for restarts
+ *   - LFC rotation (the live file renamed to .2 and recreated) is detected
+ *     by inode change: the old descriptor is drained before switching
+ *   - rows are split in place by the zero-copy scanner in csv_scanner.h
+ *
+ * The command line lives in lease_tailer_main.cpp.
+ */
+
+#ifndef NNOE_LEASE_TAILER_H
+#define NNOE_LEASE_TAILER_H
+
+#include "csv_scanner.h"
+#include "sync_engine.h"
+
+#include <json/json.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace nnoe {
+
+struct TailerConfig {
+    std::string endpoint = "http://127.0.0.1:2379";
+    std::string user;       // password from NNOE_ETCD_PASSWORD
+    EtcdTls tls;
+    std::string prefix = "/nnoe/dhcp/leases";
+    std::string sequence_prefix = "/nnoe/dhcp/lease-seq";
+    std::string lease_file4;
+    std::string lease_file6;
+    std::string state_file;
+    std::string node_id;    // written into lease values, defaults to the host name
+    bool from_start = false;
+    SyncEngineConfig engine;
+};
+
+class LeaseTailer {
+public:
+    LeaseTailer(const TailerConfig& config, SyncEngine& engine);
+
+    void add_file(const std::string& path, bool v6);
+
+    // Load the saved offsets and open the files
+    void open_files();
+
+    // Submit the rows appended since the last call, following rotations
+    void poll_files();
+
+    // Submit what is left, close the files and save the offsets
+    void close_files();
+
+    // open_files(), then poll_files() on every change in the files'
+    // directories (and once a second) until stop is set, then close_files()
+    int run(const volatile sig_atomic_t& stop);
+
+    uint64_t rows() const { return rows_; }
+
+private:
+    struct TailedFile {
+        std::string path;
+        bool v6 = false;
+        int fd = -1;
+        ino_t inode = 0;
+        off_t offset = 0;
+        std::string partial;
+        MemfileColumns columns;
+        bool have_header = false;
+    };
+
+    void load_state();
+    void save_state();
+    bool open_file(TailedFile& file, bool resume);
+    bool read_header(TailedFile& file);
+    void poll_file(TailedFile& file);
+    void drain(TailedFile& file);
+    void handle_line(TailedFile& file, std::string_view line);
+    void submit_row(const TailedFile& file, const std::string_view* fields, size_t count);
+    uint64_t row_sequence(const std::string& name, uint64_t cltt, bool ends);
+
+    TailerConfig config_;
+    SyncEngine& engine_;
+    std::unordered_map<std::string, uint64_t> sequences_;   // last guard sequence per name
+    std::vector<TailedFile> files_;
+    std::unique_ptr<Json::StreamWriter> writer_;
+    uint64_t rows_;
+    time_t last_state_save_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_LEASE_TAILER_H
@@ -0,0 +1,191 @@
+/**
+ * NNOE memfile lease tailer command line (see lease_tailer.h)
+ */
+
+#include "etcd_auth.h"
+#include "etcd_client.h"
+#include "lease_tailer.h"
+#include "sync_engine.h"
+
+#include <curl/curl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+
+namespace {
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_signal(int) {
+    stop_requested = 1;
+}
+
+// Positive integer option that fits value; false on anything else
+template <typename T>
+bool parse_count(const char* text, T& value) {
+    char* end = nullptr;
+    errno = 0;
+    const unsigned long long parsed = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || text[0] == '-' || parsed == 0 ||
+        parsed > std::numeric_limits<T>::max()) {
+        return false;
+    }
+    value = static_cast<T>(parsed);
+    return true;
+}
+
+// Subnet weight as ID=WEIGHT
+bool parse_weight(const char* text, nnoe::SyncEngineConfig& engine) {
+    const char* equals = strchr(text, '=');
+    if (!equals) {
+        return false;
+    }
+    const std::string id(text, equals - text);
+    uint32_t subnet_id = 0, weight = 0;
+    if (!parse_count(id.c_str(), subnet_id) || !parse_count(equals + 1, weight)) {
+        return false;
+    }
+    engine.weights[subnet_id] = weight;
+    return true;
+}
+
+void usage() {
+    std::cerr <<
+        "Usage: nnoe-lease-tailer [options]\n"
+        "  --leases4 PATH           kea-leases4.csv to follow\n"
+        "  --leases6 PATH           kea-leases6.csv to follow\n"
+        "  --etcd-endpoint URL      etcd endpoint (default http://127.0.0.1:2379)\n"
+        "  --etcd-user USER         authenticate as USER (password in NNOE_ETCD_PASSWORD)\n"
+        "  --etcd-ca-file PATH      CA bundle for an https endpoint (default: system store)\n"
+        "  --etcd-cert-file PATH    client certificate for an https endpoint\n"
+        "  --etcd-key-file PATH     key of the client certificate\n"
+        "  --prefix PREFIX          lease key prefix (default /nnoe/dhcp/leases)\n"
+        "  --sequence-prefix PREFIX per-address sequence keys (default /nnoe/dhcp/lease-seq)\n"
+        "  --state-file PATH        persist offsets for restarts\n"
+        "  --node-id ID             server name written into lease values (default host name)\n"
+        "  --from-start             replay existing rows when there is no saved state\n"
+        "  --batch-max-ops N        operations per etcd transaction (default 128)\n"
+        "  --flush-interval-ms N    max wait to fill a batch (default 20)\n"
+        "  --batch-senders N        transactions in flight at once (default 2)\n"
+        "  --subnet-weight ID=N     scheduling weight of a subnet (default 1, repeatable)\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    nnoe::TailerConfig config;
+
+    static const struct option long_options[] = {
+        {"leases4", required_argument, nullptr, '4'},
+        {"leases6", required_argument, nullptr, '6'},
+        {"etcd-endpoint", required_argument, nullptr, 'e'},
+        {"etcd-user", required_argument, nullptr, 'u'},
+        {"etcd-ca-file", required_argument, nullptr, 'A'},
+        {"etcd-cert-file", required_argument, nullptr, 'C'},
+        {"etcd-key-file", required_argument, nullptr, 'K'},
+        {"prefix", required_argument, nullptr, 'p'},
+        {"sequence-prefix", required_argument, nullptr, 'q'},
+        {"state-file", required_argument, nullptr, 's'},
+        {"node-id", required_argument, nullptr, 'n'},
+        {"from-start", no_argument, nullptr, 'f'},
+        {"batch-max-ops", required_argument, nullptr, 'b'},
+        {"flush-interval-ms", required_argument, nullptr, 'i'},
+        {"batch-senders", required_argument, nullptr, 'S'},
+        {"subnet-weight", required_argument, nullptr, 'w'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    int index = 0;
+    while ((opt = getopt_long(argc, argv, "h", long_options, &index)) != -1) {
+        bool valid = true;
+        switch (opt) {
+        case '4': config.lease_file4 = optarg; break;
+        case '6': config.lease_file6 = optarg; break;
+        case 'e': config.endpoint = optarg; break;
+        case 'u': config.user = optarg; break;
+        case 'A': config.tls.ca_file = optarg; break;
+        case 'C': config.tls.cert_file = optarg; break;
+        case 'K': config.tls.key_file = optarg; break;
+        case 'p': config.prefix = optarg; break;
+        case 'q': config.sequence_prefix = optarg; break;
+        case 's': config.state_file = optarg; break;
+        case 'n': config.node_id = optarg; break;
+        case 'f': config.from_start = true; break;
+        case 'b': valid = parse_count(optarg, config.engine.max_batch_ops); break;
+        case 'i': valid = parse_count(optarg, config.engine.flush_interval_ms); break;
+        case 'S': valid = parse_count(optarg, config.engine.senders); break;
+        case 'w': valid = parse_weight(optarg, config.engine); break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 2;
+        }
+        if (!valid) {
+            std::cerr << "nnoe-lease-tailer: invalid --" << long_options[index].name << " "
+                      << optarg << std::endl;
+            usage();
+            return 2;
+        }
+    }
+
+    if (config.tls.cert_file.empty() != config.tls.key_file.empty()) {
+        std::cerr << "nnoe-lease-tailer: --etcd-cert-file and --etcd-key-file go together"
+                  << std::endl;
+        usage();
+        return 2;
+    }
+
+    if (config.lease_file4.empty() && config.lease_file6.empty()) {
+        usage();
+        return 2;
+    }
+
+    if (config.node_id.empty()) {
+        char host[256] = {0};
+        if (gethostname(host, sizeof(host) - 1) == 0) {
+            config.node_id = host;
+        }
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    int rc;
+    {
+        nnoe::EtcdClient client(config.endpoint);
+        client.set_tls(config.tls);
+        if (!config.user.empty()) {
+            const char* password = getenv("NNOE_ETCD_PASSWORD");
+            auto auth = std::make_shared<nnoe::EtcdAuth>(config.endpoint, config.user,
+                                                         password ? password : "");
+            auth->set_tls(config.tls);
+            client.set_auth(auth);
+        }
+        nnoe::SyncEngine engine(client, config.engine);
+        engine.start();
+
+        nnoe::LeaseTailer tailer(config, engine);
+        if (!config.lease_file4.empty()) {
+            tailer.add_file(config.lease_file4, false);
+        }
+        if (!config.lease_file6.empty()) {
+            tailer.add_file(config.lease_file6, true);
+        }
+
+        rc = tailer.run(stop_requested);
+        engine.stop();
+    }
+
+    curl_global_cleanup();
+    return rc;
+}
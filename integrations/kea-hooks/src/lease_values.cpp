@@ -0,0 +1,252 @@
+/**
+ * Lease record values for the NNOE Kea hook
+ */
+
+#include "lease_values.h"
+#include "text_format.h"
+
+#include <nnoe/lease_reader.h>
+
+#include <cc/data.h>
+#include <dhcp/duid.h>
+#include <dhcp/hwaddr.h>
+
+#include <ctime>
+#include <exception>
+#include <memory>
+#include <vector>
+
+using namespace isc::asiolink;
+using namespace isc::data;
+using namespace isc::dhcp;
+
+namespace nnoe {
+
+namespace {
+
+// Fields common to both families
+void add_common(const Lease& lease, const std::string& operation, const std::string& node,
+                uint64_t sequence, Json::Value& value) {
+    value["subnet_id"] = static_cast<Json::UInt64>(lease.subnet_id_);
+    if (!lease.hostname_.empty()) {
+        value["hostname"] = lease.hostname_;
+    }
+    if (lease.fqdn_fwd_) {
+        value["fqdn_fwd"] = true;
+    }
+    if (lease.fqdn_rev_) {
+        value["fqdn_rev"] = true;
+    }
+    value["state"] = static_cast<int>(lease.state_);
+    value["cltt"] = static_cast<Json::Int64>(lease.cltt_);
+    value["valid_lft"] = static_cast<Json::Int64>(lease.valid_lft_);
+    value["operation"] = operation;
+    value["node"] = node;
+    value["timestamp"] = static_cast<Json::Int64>(time(nullptr));
+    value["seq"] = static_cast<Json::UInt64>(sequence);
+    value["expires_at"] = static_cast<Json::Int64>(lease.cltt_ + lease.valid_lft_);
+
+    // User context carries extended info (relay options) and limits
+    ConstElementPtr context = lease.getContext();
+    if (context) {
+        const std::string text = context->str();
+        Json::CharReaderBuilder builder;
+        std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+        Json::Value parsed;
+        if (reader->parse(text.data(), text.data() + text.size(), &parsed, nullptr)) {
+            value["context"] = parsed;
+        }
+    }
+}
+
+void read_common(const Json::Value& value, Lease& lease) {
+    lease.hostname_ = value.get("hostname", "").asString();
+    lease.fqdn_fwd_ = value.get("fqdn_fwd", false).asBool();
+    lease.fqdn_rev_ = value.get("fqdn_rev", false).asBool();
+    lease.state_ = value.get("state", 0).asUInt();
+    lease.cltt_ = static_cast<time_t>(value.get("cltt", 0).asInt64());
+    lease.current_cltt_ = lease.cltt_;
+    lease.valid_lft_ = static_cast<uint32_t>(value.get("valid_lft", 0).asInt64());
+    lease.current_valid_lft_ = lease.valid_lft_;
+    if (value["context"].isObject()) {
+        lease.setContext(Element::fromJSON(write_value(value["context"])));
+    }
+}
+
+std::string address_text(const IOAddress& address) {
+    if (address.isV4()) {
+        return ipv4_text(address.toUint32());
+    }
+    const std::vector<uint8_t> bytes = address.toBytes();
+    return bytes.size() == 16 ? ipv6_text(bytes.data()) : address.toText();
+}
+
+std::string bytes_text(const std::vector<uint8_t>& bytes) {
+    return hex_colon_text(bytes.data(), bytes.size());
+}
+
+} // namespace
+
+LeaseText::LeaseText(const Lease4& lease)
+    : address(address_text(lease.addr_)), name(address) {
+    if (lease.hwaddr_) {
+        client = bytes_text(lease.hwaddr_->hwaddr_);
+    }
+    if (lease.client_id_) {
+        client_id = bytes_text(lease.client_id_->getClientId());
+    }
+}
+
+LeaseText::LeaseText(const Lease6& lease)
+    : address(address_text(lease.addr_)), name(address) {
+    if (lease.type_ == Lease::TYPE_PD) {
+        name += "/" + std::to_string(lease.prefixlen_);
+    }
+    if (lease.duid_) {
+        client = bytes_text(lease.duid_->getDuid());
+    }
+}
+
+Json::Value lease4_value(const Lease4& lease, const std::string& operation,
+                         const std::string& node, uint64_t sequence) {
+    return lease4_value(lease, LeaseText(lease), operation, node, sequence);
+}
+
+Json::Value lease6_value(const Lease6& lease, const std::string& operation,
+                         const std::string& node, uint64_t sequence) {
+    return lease6_value(lease, LeaseText(lease), operation, node, sequence);
+}
+
+Json::Value lease4_value(const Lease4& lease, const LeaseText& text,
+                         const std::string& operation, const std::string& node,
+                         uint64_t sequence) {
+    Json::Value value;
+    value["v"] = LEASE_SCHEMA_VERSION;
+    value["ip"] = text.address;
+    if (lease.hwaddr_) {
+        value["hwaddr"] = text.client;
+    }
+    if (lease.client_id_) {
+        value["client_id"] = text.client_id;
+    }
+    add_common(lease, operation, node, sequence, value);
+    return value;
+}
+
+Json::Value lease6_value(const Lease6& lease, const LeaseText& text,
+                         const std::string& operation, const std::string& node,
+                         uint64_t sequence) {
+    Json::Value value;
+    value["v"] = LEASE_SCHEMA_VERSION;
+    value["ip"] = text.address;
+    value["type"] = static_cast<int>(lease.type_);  // IA_NA, IA_PD, etc.
+    if (lease.type_ == Lease::TYPE_PD) {
+        value["prefix_len"] = static_cast<int>(lease.prefixlen_);
+    }
+    value["iaid"] = static_cast<Json::UInt64>(lease.iaid_);
+    value["duid"] = text.client;
+    value["preferred_lft"] = static_cast<Json::Int64>(lease.preferred_lft_);
+    add_common(lease, operation, node, sequence, value);
+    return value;
+}
+
+Json::Value delegation_value(const std::string& duid, uint32_t iaid, uint32_t subnet_id,
+                             const Lease6Collection& prefixes, const std::string& operation,
+                             const std::string& node, uint64_t sequence) {
+    Json::Value value;
+    value["v"] = LEASE_SCHEMA_VERSION;
+    value["duid"] = duid;
+    value["iaid"] = static_cast<Json::UInt64>(iaid);
+    value["subnet_id"] = static_cast<Json::UInt64>(subnet_id);
+
+    Json::Value& list = value["prefixes"];
+    list = Json::Value(Json::arrayValue);
+    for (const auto& lease : prefixes) {
+        Json::Value prefix;
+        prefix["prefix"] = address_text(lease->addr_);
+        prefix["prefix_len"] = static_cast<int>(lease->prefixlen_);
+        prefix["state"] = static_cast<int>(lease->state_);
+        prefix["cltt"] = static_cast<Json::Int64>(lease->cltt_);
+        prefix["valid_lft"] = static_cast<Json::Int64>(lease->valid_lft_);
+        prefix["preferred_lft"] = static_cast<Json::Int64>(lease->preferred_lft_);
+        prefix["expires_at"] = static_cast<Json::Int64>(lease->cltt_ + lease->valid_lft_);
+        list.append(prefix);
+    }
+
+    value["operation"] = operation;
+    value["node"] = node;
+    value["timestamp"] = static_cast<Json::Int64>(time(nullptr));
+    value["seq"] = static_cast<Json::UInt64>(sequence);
+    return value;
+}
+
+std::string lease6_name(const Lease6& lease) {
+    const std::string address = address_text(lease.addr_);
+    if (lease.type_ == Lease::TYPE_PD) {
+        return address + "/" + std::to_string(lease.prefixlen_);
+    }
+    return address;
+}
+
+Lease4Ptr lease4_from_value(const Json::Value& value) {
+    if (!value.isObject() || !value["ip"].isString() || value.isMember("duid")) {
+        return Lease4Ptr();
+    }
+    try {
+        IOAddress addr(value["ip"].asString());
+        if (!addr.isV4()) {
+            return Lease4Ptr();
+        }
+        HWAddrPtr hwaddr;
+        if (value["hwaddr"].isString() && !value["hwaddr"].asString().empty()) {
+            hwaddr.reset(new HWAddr(HWAddr::fromText(value["hwaddr"].asString())));
+        }
+        ClientIdPtr client_id;
+        if (value["client_id"].isString() && !value["client_id"].asString().empty()) {
+            client_id = ClientId::fromText(value["client_id"].asString());
+        }
+
+        Lease4Ptr lease(new Lease4(addr, hwaddr, client_id, 0, 0,
+                                   value.get("subnet_id", 0).asUInt()));
+        read_common(value, *lease);
+        return lease;
+    } catch (const std::exception&) {
+        return Lease4Ptr();
+    }
+}
+
+Lease6Ptr lease6_from_value(const Json::Value& value) {
+    if (!value.isObject() || !value["ip"].isString() || !value["duid"].isString() ||
+        value["duid"].asString().empty()) {
+        return Lease6Ptr();
+    }
+    try {
+        IOAddress addr(value["ip"].asString());
+        if (!addr.isV6()) {
+            return Lease6Ptr();
+        }
+        DuidPtr duid(new DUID(DUID::fromText(value["duid"].asString())));
+        const int type = value.get("type", Lease::TYPE_NA).asInt();
+        if (type != Lease::TYPE_NA && type != Lease::TYPE_TA && type != Lease::TYPE_PD) {
+            return Lease6Ptr();
+        }
+
+        Lease6Ptr lease(new Lease6(static_cast<Lease::Type>(type), addr, duid,
+                                   value.get("iaid", 0).asUInt(),
+                                   static_cast<uint32_t>(value.get("preferred_lft", 0).asInt64()),
+                                   0, value.get("subnet_id", 0).asUInt(), HWAddrPtr(),
+                                   static_cast<uint8_t>(value.get("prefix_len", 128).asUInt())));
+        read_common(value, *lease);
+        return lease;
+    } catch (const std::exception&) {
+        return Lease6Ptr();
+    }
+}
+
+std::string write_value(const Json::Value& value) {
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, value);
+}
+
+} // namespace nnoe
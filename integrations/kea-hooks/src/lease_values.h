@@ -0,0 +1,70 @@
+/**
+ * Lease record values for the NNOE Kea hook
+ *
+ * Converts between Kea's Lease4/Lease6 and the compact JSON records under
+ * the lease prefix (see docs/api/etcd-schema.md). The callout mirror and
+ * the etcd lease backend both write through these functions, so a record
+ * looks the same whichever of them produced it, and the backend can load
+ * records the mirror wrote. Decoding uses jsoncpp; consumers without Kea
+ * should read records with nnoe/lease_reader.h instead.
+ */
+
+#ifndef NNOE_LEASE_VALUES_H
+#define NNOE_LEASE_VALUES_H
+
+#include <dhcpsrv/lease.h>
+#include <json/json.h>
+
+#include <cstdint>
+#include <string>
+
+namespace nnoe {
+
+// Text forms of a lease's identifiers, formatted once per event with the
+// formatters of text_format.h; the same text as Kea's toText()
+struct LeaseText {
+    explicit LeaseText(const isc::dhcp::Lease4& lease);
+    explicit LeaseText(const isc::dhcp::Lease6& lease);
+
+    std::string address;
+    std::string name;        // key name, see lease6_name()
+    std::string client;      // hardware address (IPv4) or DUID (IPv6); empty if none
+    std::string client_id;   // IPv4 client identifier; empty if none
+};
+
+// Record of lease written by node for operation, with event sequence
+Json::Value lease4_value(const isc::dhcp::Lease4& lease, const std::string& operation,
+                         const std::string& node, uint64_t sequence);
+Json::Value lease6_value(const isc::dhcp::Lease6& lease, const std::string& operation,
+                         const std::string& node, uint64_t sequence);
+
+// As above, with the lease's text already formatted
+Json::Value lease4_value(const isc::dhcp::Lease4& lease, const LeaseText& text,
+                         const std::string& operation, const std::string& node,
+                         uint64_t sequence);
+Json::Value lease6_value(const isc::dhcp::Lease6& lease, const LeaseText& text,
+                         const std::string& operation, const std::string& node,
+                         uint64_t sequence);
+
+// Record of the prefixes delegated to one DUID/IAID (pd_aggregate), as
+// written under the delegation prefix by node
+Json::Value delegation_value(const std::string& duid, uint32_t iaid, uint32_t subnet_id,
+                             const isc::dhcp::Lease6Collection& prefixes,
+                             const std::string& operation, const std::string& node,
+                             uint64_t sequence);
+
+// Key name of a lease under the prefix: the address, or prefix/length for
+// a delegated prefix
+std::string lease6_name(const isc::dhcp::Lease6& lease);
+
+// Lease described by a record; null if the record is not a lease of that
+// family or cannot be decoded
+isc::dhcp::Lease4Ptr lease4_from_value(const Json::Value& value);
+isc::dhcp::Lease6Ptr lease6_from_value(const Json::Value& value);
+
+// Compact serialization, as stored in etcd
+std::string write_value(const Json::Value& value);
+
+} // namespace nnoe
+
+#endif // NNOE_LEASE_VALUES_H
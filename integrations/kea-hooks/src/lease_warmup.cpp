@@ -0,0 +1,354 @@
+/**
+ * Warm-up of Kea's lease database from etcd lease state
+ */
+
+#include "lease_warmup.h"
+
+#include <nnoe/lease_reader.h>
+
+#include <asiolink/io_address.h>
+#include <dhcp/duid.h>
+#include <dhcp/hwaddr.h>
+#include <dhcpsrv/cfgmgr.h>
+#include <dhcpsrv/lease_mgr_factory.h>
+
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace isc::asiolink;
+using namespace isc::dhcp;
+
+namespace nnoe {
+
+namespace {
+
+const size_t MAX_WORKER_THREADS = 8;
+
+// Bounded hand-off between the pipeline stages. close() marks the end of
+// input; pop() keeps draining until the queue is empty.
+template <typename T>
+class WorkQueue {
+public:
+    explicit WorkQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty()) {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    bool closed_;
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
+
+// Adjacent keys missing locally, at most page_size of them; each run is
+// fetched with a single range request
+struct KeyRun {
+    std::string first;
+    std::string last;
+    int64_t count;
+};
+
+struct DecodedPage {
+    std::vector<Lease4Ptr> leases4;
+    std::vector<Lease6Ptr> leases6;
+    uint64_t expired = 0;
+    uint64_t invalid = 0;
+};
+
+enum KeyState { KEY_MISSING, KEY_EXISTING, KEY_OTHER_FAMILY };
+
+// Key names are addresses, or prefix/length for delegated prefixes
+KeyState key_state(const std::string& name, bool v4, const LeaseMgr& lease_mgr) {
+    try {
+        const size_t slash = name.find('/');
+        IOAddress addr(name.substr(0, slash));
+        if (addr.isV4() != v4) {
+            return KEY_OTHER_FAMILY;
+        }
+        if (v4) {
+            return lease_mgr.getLease4(addr) ? KEY_EXISTING : KEY_MISSING;
+        }
+        if (slash != std::string::npos) {
+            return lease_mgr.getLease6(Lease::TYPE_PD, addr) ? KEY_EXISTING : KEY_MISSING;
+        }
+        return (lease_mgr.getLease6(Lease::TYPE_NA, addr) ||
+                lease_mgr.getLease6(Lease::TYPE_PD, addr)) ? KEY_EXISTING : KEY_MISSING;
+    } catch (const std::exception&) {
+        // Not an address: fetch it and let the decoder account for it
+        return KEY_MISSING;
+    }
+}
+
+// Build a lease from one record; only live leases of the wanted family are kept
+void decode_lease(std::string_view value, bool v4, time_t now, DecodedPage& out) {
+    LeaseView record;
+    LeaseParseStatus status = parse_lease(value, record);
+
+    // Escaped strings (a hostname with a quote, say) are decoded into a copy
+    std::string unescaped;
+    if (status == LEASE_OK && record.escaped) {
+        unescaped.assign(value.data(), value.size());
+        status = parse_lease(unescaped, record, &unescaped[0]);
+    }
+    if (status != LEASE_OK) {
+        out.invalid++;
+        return;
+    }
+
+    if (record.state == Lease::STATE_EXPIRED_RECLAIMED || record.state == Lease::STATE_RELEASED ||
+        record.expires_at <= static_cast<int64_t>(now)) {
+        out.expired++;
+        return;
+    }
+
+    try {
+        IOAddress addr{std::string(record.ip)};
+        if (addr.isV4() != v4) {
+            out.invalid++;
+            return;
+        }
+
+        const uint32_t valid_lft = static_cast<uint32_t>(record.valid_lft);
+        const time_t cltt = static_cast<time_t>(record.cltt);
+        const std::string hostname(record.hostname);
+
+        if (v4) {
+            HWAddrPtr hwaddr;
+            if (!record.hwaddr.empty()) {
+                hwaddr.reset(new HWAddr(HWAddr::fromText(std::string(record.hwaddr))));
+            }
+            ClientIdPtr client_id;
+            if (!record.client_id.empty()) {
+                client_id = ClientId::fromText(std::string(record.client_id));
+            }
+
+            Lease4Ptr lease(new Lease4(addr, hwaddr, client_id, valid_lft, cltt,
+                                       record.subnet_id, false, false, hostname));
+            lease->state_ = record.state;
+            out.leases4.push_back(lease);
+        } else {
+            if (record.duid.empty()) {
+                out.invalid++;
+                return;
+            }
+            DuidPtr duid(new DUID(DUID::fromText(std::string(record.duid))));
+
+            Lease6Ptr lease(new Lease6(static_cast<Lease::Type>(std::max(record.type, 0)),
+                                       addr, duid, record.iaid,
+                                       static_cast<uint32_t>(record.preferred_lft), valid_lft,
+                                       record.subnet_id, HWAddrPtr(),
+                                       static_cast<uint8_t>(record.prefix_len)));
+            lease->cltt_ = cltt;
+            lease->current_cltt_ = cltt;
+            lease->hostname_ = hostname;
+            lease->state_ = record.state;
+            out.leases6.push_back(lease);
+        }
+    } catch (const std::exception&) {
+        out.invalid++;
+    }
+}
+
+} // namespace
+
+LeaseWarmup::LeaseWarmup(const EtcdClient& client, const std::string& prefix,
+                         const LeaseWarmupConfig& config)
+    : client_(client), prefix_(prefix), config_(config) {
+    if (config_.page_size <= 0) {
+        config_.page_size = 1000;
+    }
+    if (config_.threads == 0) {
+        config_.threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                           MAX_WORKER_THREADS);
+    }
+}
+
+LeaseWarmupResult LeaseWarmup::run(uint16_t family) const {
+    const auto started = std::chrono::steady_clock::now();
+    const bool v4 = family == AF_INET;
+    const std::string key_prefix = prefix_ + "/";
+
+    LeaseWarmupResult result;
+    LeaseMgr& lease_mgr = LeaseMgrFactory::instance();
+
+    // Pass 1: keys only, to skip what the local database already holds
+    std::vector<KeyRun> runs;
+    bool in_run = false;
+    uint64_t other_family = 0;
+    bool ok = client_.range_pages(key_prefix, prefix_range_end(key_prefix),
+        [&](std::vector<EtcdKeyValue>& page) {
+            for (const auto& kv : page) {
+                result.keys++;
+                switch (key_state(kv.key.substr(key_prefix.size()), v4, lease_mgr)) {
+                case KEY_MISSING:
+                    if (in_run && runs.back().count < config_.page_size) {
+                        runs.back().last = kv.key;
+                        runs.back().count++;
+                    } else {
+                        runs.push_back(KeyRun{kv.key, kv.key, 1});
+                        in_run = true;
+                    }
+                    continue;
+                case KEY_EXISTING:
+                    result.existing++;
+                    break;
+                case KEY_OTHER_FAMILY:
+                    other_family++;
+                    break;
+                }
+                in_run = false;
+            }
+            return true;
+        },
+        result.revision, config_.page_size, true);
+
+    if (!ok) {
+        return result;
+    }
+    result.keys -= other_family;
+
+    // Pass 2: runs are independent ranges at the same revision, so the
+    // workers fetch and decode them in parallel
+    std::atomic<bool> fetch_failed(false);
+    if (!runs.empty()) {
+        WorkQueue<DecodedPage> decoded(config_.threads * 2);
+        std::atomic<size_t> next_run(0);
+        std::atomic<size_t> workers_left(config_.threads);
+        const time_t now = time(nullptr);
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < config_.threads; ++i) {
+            workers.emplace_back([&] {
+                std::string body;
+                for (size_t r = next_run++; r < runs.size() && !fetch_failed; r = next_run++) {
+                    const KeyRun& run = runs[r];
+                    std::string range_end = run.last;
+                    range_end.push_back('\0');
+
+                    Json::Value request;
+                    request["key"] = base64_encode(run.first);
+                    request["range_end"] = base64_encode(range_end);
+                    request["revision"] = static_cast<Json::Int64>(result.revision);
+
+                    if (!client_.post_raw("/v3/kv/range", request, body)) {
+                        fetch_failed = true;
+                        break;
+                    }
+
+                    // Decoded in place; the views die with body
+                    RangeResponseReader range(&body[0], body.size());
+                    DecodedPage out;
+                    KeyValueView kv;
+                    while (range.next(kv)) {
+                        decode_lease(kv.value, v4, now, out);
+                    }
+                    if (!range.valid()) {
+                        fetch_failed = true;
+                        break;
+                    }
+                    decoded.push(std::move(out));
+                }
+                if (--workers_left == 0) {
+                    decoded.close();
+                }
+            });
+        }
+
+        // Insert on this thread; subnet lookups use the current configuration
+        SrvConfigPtr cfg = CfgMgr::instance().getCurrentCfg();
+        DecodedPage page;
+        while (decoded.pop(page)) {
+            result.expired += page.expired;
+            result.invalid += page.invalid;
+
+            for (const auto& lease : page.leases4) {
+                if (lease->subnet_id_ == 0) {
+                    Subnet4Ptr subnet = cfg->getCfgSubnets4()->selectSubnet(lease->addr_);
+                    lease->subnet_id_ = subnet ? subnet->getID() : 0;
+                }
+                if (lease->subnet_id_ == 0 ||
+                    !cfg->getCfgSubnets4()->getBySubnetId(lease->subnet_id_)) {
+                    result.no_subnet++;
+                    continue;
+                }
+                try {
+                    if (lease_mgr.addLease(lease)) {
+                        result.loaded++;
+                    } else {
+                        result.existing++;
+                    }
+                } catch (const std::exception&) {
+                    result.invalid++;
+                }
+            }
+
+            for (const auto& lease : page.leases6) {
+                if (lease->subnet_id_ == 0) {
+                    Subnet6Ptr subnet = cfg->getCfgSubnets6()->selectSubnet(lease->addr_);
+                    lease->subnet_id_ = subnet ? subnet->getID() : 0;
+                }
+                if (lease->subnet_id_ == 0 ||
+                    !cfg->getCfgSubnets6()->getBySubnetId(lease->subnet_id_)) {
+                    result.no_subnet++;
+                    continue;
+                }
+                try {
+                    if (lease_mgr.addLease(lease)) {
+                        result.loaded++;
+                    } else {
+                        result.existing++;
+                    }
+                } catch (const std::exception&) {
+                    result.invalid++;
+                }
+            }
+        }
+
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    result.ok = !fetch_failed;
+    result.elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started).count();
+    return result;
+}
+
+} // namespace nnoe
@@ -0,0 +1,63 @@
+/**
+ * Warm-up of Kea's lease database from etcd lease state
+ *
+ * A replacement server starts with an empty lease database and would hand
+ * out addresses other nodes still lease until every client has renewed.
+ * Warm-up reads the hook's lease prefix back from etcd and inserts the
+ * live leases through LeaseMgr:
+ *
+ *   1. a keys-only pass over the prefix finds the keys the local database
+ *      does not hold yet, cut into runs of at most page_size adjacent keys;
+ *   2. worker threads fetch the runs in parallel, each as one range pinned
+ *      to the revision of the keys pass, and decode them in place with
+ *      nnoe/lease_reader.h into Lease4/Lease6 objects;
+ *   3. the calling thread, the only one touching LeaseMgr and CfgMgr,
+ *      resolves subnets and inserts each decoded run.
+ */
+
+#ifndef NNOE_LEASE_WARMUP_H
+#define NNOE_LEASE_WARMUP_H
+
+#include "etcd_client.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace nnoe {
+
+struct LeaseWarmupConfig {
+    int64_t page_size = 2000;  // keys per range request
+    size_t threads = 0;        // fetch/decode workers, 0 = hardware concurrency (max 8)
+};
+
+struct LeaseWarmupResult {
+    bool ok = false;
+    int64_t revision = 0;        // etcd revision the leases were read at
+    uint64_t keys = 0;           // lease keys under the prefix
+    uint64_t existing = 0;       // already present locally, not fetched
+    uint64_t loaded = 0;
+    uint64_t expired = 0;        // lifetime over or released/reclaimed
+    uint64_t no_subnet = 0;      // subnet unknown to the current configuration
+    uint64_t invalid = 0;        // undecodable record or rejected by LeaseMgr
+    uint64_t elapsed_ms = 0;
+};
+
+class LeaseWarmup {
+public:
+    LeaseWarmup(const EtcdClient& client, const std::string& prefix,
+                const LeaseWarmupConfig& config);
+
+    // Load leases of the given address family (AF_INET or AF_INET6).
+    // Must run on a thread allowed to use LeaseMgr and CfgMgr.
+    LeaseWarmupResult run(uint16_t family) const;
+
+private:
+    const EtcdClient& client_;
+    std::string prefix_;
+    LeaseWarmupConfig config_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_LEASE_WARMUP_H
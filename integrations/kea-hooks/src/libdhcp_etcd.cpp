@@ -1,231 +1,2183 @@
 /**
  * Kea DHCP Hook for NNOE etcd Integration
  * 
- * This hook synchronizes DHCP lease information with etcd for centralized tracking.
+ * This hook synchronizes DHCP lease information with etcd for centralized tracking
+ * (unless lease_sync_enabled is false, which leaves the other features running).
  * Implements Kea hook API callouts: 
- *   IPv4: lease4_offer, lease4_renew, lease4_release
- *   IPv6: lease6_offer, lease6_renew, lease6_release
+ *   IPv4: lease4_offer, lease4_renew, lease4_release, leases4_committed
+ *   IPv6: lease6_offer, lease6_renew, lease6_release, leases6_committed
  *   Expiration: lease4_expire, lease6_expire
+ *   Prefix delegation: leases6_committed (per DUID/IAID records)
+ *   Packet filtering: pkt4_receive, pkt6_receive (client blocklist, per-client
+ *                     rate limiter, client_rate.h)
+ *   Renewal jitter: pkt4_send, pkt6_send (per-client T1/T2, renewal_jitter.h)
+ *   Adaptive lifetimes: lease4_select, lease4_renew, lease6_select, lease6_renew
+ *                       (by pool utilization, adaptive_lifetime.h)
+ *   Segment admission: subnet4_select, subnet6_select (Cerbos)
+ *   Conflict filter: subnet4_select, subnet6_select (requested addresses),
+ *                    lease4_select, lease6_select (addresses leased by other servers)
+ *   Lease warm-up: etcd-lease-warmup command, dhcp4_srv_configured, dhcp6_srv_configured
+ *   Lease database: lease-database type "etcd" (etcd_lease_mgr.h)
+ *   Incremental scopes: DHCPv4 subnets follow /nnoe/dhcp/scopes (scope_watcher.h)
+ *   Lease history: local archive of every lease event (lease_history.h)
+ *   etcd watches: the blocklist, conflict filter, scopes and lease backend
+ *                 share one resumable watch stream (watch_manager.h)
+ *   etcd transport: optionally Kea's HttpClient, started at
+ *                   dhcp4_srv_configured/dhcp6_srv_configured (kea_transport.h)
+ *   Bulk leasequery: RFC 6926/5460 over TCP from a lease index of every server
+ *                    sharing the prefix (lease_query_index.h, bulk_leasequery.h)
+ *
+ *   Sync statistics: etcd-sync-stats command
+ *   Lease index: lease-index-subnet, lease-index-expiring, lease-index-utilization,
+ *                lease-index-client commands
+ *
+ * Lease addresses and client identifiers are formatted once per event
+ * (LeaseText, text_format.h) and shared by the record, key, guard, DNS,
+ * index and history.
  */
 
+#include <asiolink/io_service.h>
+#include <cc/simple_parser.h>
+#include <config/command_interpreter.h>
+#include <dhcpsrv/cfg_duid.h>
+#include <dhcpsrv/cfgmgr.h>
+#include <dhcpsrv/client_class_def.h>
 #include <dhcpsrv/lease.h>
+#include <dhcpsrv/lease_mgr_factory.h>
+#include <dhcpsrv/parsers/dhcp_parsers.h>
+#include <dhcpsrv/parsers/simple_parser4.h>
+#include <dhcpsrv/subnet.h>
+#include <dhcp/dhcp4.h>
+#include <dhcp/dhcp6.h>
+#include <dhcp/option6_ia.h>
+#include <dhcp/option6_iaaddr.h>
+#include <dhcp/option6_iaprefix.h>
+#include <dhcp/option_custom.h>
+#include <dhcp/option_int.h>
+#include <dhcp/pkt4.h>
+#include <dhcp/pkt6.h>
+#include <exceptions/exceptions.h>
 #include <hooks/hooks.h>
 #include <log/message_initializer.h>
+#include <stats/stats_mgr.h>
+#include <util/multi_threading_mgr.h>
 #include <curl/curl.h>
 #include <json/json.h>
+#include <nnoe/lease_reader.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
 #include <string>
-#include <sstream>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <vector>
-#include <openssl/bio.h>
-#include <openssl/evp.h>
-#include <openssl/buffer.h>
 #include <ctime>
+#include <limits>
+#include <map>
+#include <mutex>
+
+#include "adaptive_lifetime.h"
+#include "blocklist.h"
+#include "bulk_leasequery.h"
+#include "client_rate.h"
+#include "conflict_filter.h"
+#include "dns_records.h"
+#include "etcd_auth.h"
+#include "etcd_client.h"
+#include "kea_transport.h"
+#include "etcd_lease_mgr.h"
+#include "lease_history.h"
+#include "lease_index.h"
+#include "lease_query_index.h"
+#include "lease_values.h"
+#include "lease_warmup.h"
+#include "memory_budget.h"
+#include "offer_table.h"
+#include "probes.h"
+#include "renewal_jitter.h"
+#include "scope_watcher.h"
+#include "segment_policy.h"
+#include "sync_engine.h"
+#include "text_format.h"
+#include "watch_manager.h"
 
 using namespace isc::hooks;
 using namespace isc::dhcp;
 using namespace isc::log;
+using namespace isc::data;
 
 // Hook configuration
 static std::string etcd_endpoints = "http://127.0.0.1:2379";
 static std::string etcd_prefix = "/nnoe/dhcp/leases";
+static std::string etcd_username;      // empty: etcd auth disabled
+static std::string etcd_password;
+static uint32_t etcd_token_ttl = 300;  // etcd --auth-token-ttl
+static nnoe::EtcdTls etcd_tls;
+static bool etcd_transport_kea = false;  // requests through Kea's HttpClient
+static nnoe::KeaTransportConfig kea_transport_config;
+static std::string sequence_prefix = "/nnoe/dhcp/lease-seq";
+static std::string pd_prefix = "/nnoe/dhcp/delegations";
+static bool pd_aggregate = false;
 static uint32_t lease_ttl = 3600;
 
-// CURL write callback for HTTP responses
-static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
-    ((std::string*)userp)->append((char*)contents, size * nmemb);
-    return size * nmemb;
+// full: offers are written like leases; local: offers stay in offer_table
+// until acknowledged; ttl: as local, plus a small etcd key per offer bound
+// to a short-lived etcd lease
+enum OfferMode { OFFER_FULL, OFFER_LOCAL, OFFER_TTL };
+static OfferMode offer_mode = OFFER_FULL;
+static uint32_t offer_ttl = 60;
+static std::string offer_prefix = "/nnoe/dhcp/offers";
+static bool blocklist_enabled = false;
+static std::string blocklist_prefix = "/nnoe/threats/clients";
+static bool rate_limit_enabled = false;
+static nnoe::ClientRateConfig rate_limit_config;
+static bool renewal_jitter_enabled = false;
+static nnoe::RenewalJitterConfig renewal_jitter_config;
+static bool cerbos_enabled = false;
+static nnoe::SegmentPolicyConfig cerbos_config;
+static bool dns_enabled = false;
+static nnoe::DnsRecordsConfig dns_config;
+static nnoe::SyncEngineConfig sync_config;
+static bool warmup_on_start = false;
+static bool warmup_done = false;
+static nnoe::LeaseWarmupConfig warmup_config;
+static bool lease_index_enabled = false;
+static bool adaptive_lifetime_enabled = false;
+static nnoe::AdaptiveLifetimeConfig adaptive_lifetime_config;
+static bool conflict_filter_enabled = false;
+static bool leasequery_enabled = false;
+static nnoe::LeaseQueryConfig leasequery_config;   // address and port follow the family if unset
+static bool leasequery_address_set = false;
+static bool leasequery_port_set = false;
+static bool scopes_enabled = false;
+static bool history_enabled = false;
+static nnoe::LeaseHistoryConfig history_config;
+static std::string scopes_prefix = "/nnoe/dhcp/scopes";
+static std::string node_id;   // written into lease values, defaults to the host name
+static uint64_t memory_budget_bytes = 0;                   // 0: account only
+static std::map<std::string, uint64_t> memory_limits;      // component -> bytes
+static bool lease_index_seeded = false;
+static bool lease_backend_active = false;  // Kea's lease database is the etcd backend
+static bool lease_sync_enabled = true;     // off: the hook only serves its other features
+
+static std::unique_ptr<nnoe::MemoryBudget> memory_budget;
+static std::shared_ptr<nnoe::EtcdAuth> etcd_auth;
+static std::shared_ptr<nnoe::KeaHttpTransport> kea_transport;
+static std::shared_ptr<nnoe::WatchManager> watch_manager;
+static std::unique_ptr<nnoe::EtcdClient> etcd_client;
+static std::unique_ptr<nnoe::SyncEngine> sync_engine;
+static std::unique_ptr<nnoe::ClientBlocklist> client_blocklist;
+static std::unique_ptr<nnoe::ClientRateLimiter> client_rate;
+static std::unique_ptr<nnoe::RenewalJitter> renewal_jitter;
+static std::unique_ptr<nnoe::SegmentPolicy> segment_policy;
+static std::unique_ptr<nnoe::DnsRecordBuilder> dns_records;
+static std::unique_ptr<nnoe::DnsNameTable> dns_names;
+static std::unique_ptr<nnoe::LeaseIndex> lease_index;
+static std::unique_ptr<nnoe::AdaptiveLifetime> adaptive_lifetime;
+static std::unique_ptr<nnoe::OfferTable> offer_table;
+static std::unique_ptr<nnoe::ConflictFilter> conflict_filter;
+static std::unique_ptr<nnoe::LeaseQueryIndex> lease_query_index;
+static std::unique_ptr<nnoe::BulkLeaseQuery> bulk_leasequery;
+static std::unique_ptr<nnoe::ScopeWatcher> scope_watcher;
+static std::unique_ptr<nnoe::LeaseHistoryWriter> lease_history;
+static std::mutex scope_io_mutex;
+static isc::asiolink::IOServicePtr scope_io_service;  // Kea's main loop, once configured
+static nnoe::SequenceClock sequence_clock;
+
+// Fires the callout_entry and callout_return probes around a callout; the
+// address and latency are only computed while callout_return is traced
+class CalloutTrace {
+public:
+    explicit CalloutTrace(const char* callout)
+        : callout_(callout),
+          started_(NNOE_PROBE_ENABLED(callout_return) ? nnoe::probe_clock_ns() : 0) {
+        NNOE_PROBE1(callout_entry, callout_);
+    }
+
+    ~CalloutTrace() {
+        if (started_) {
+            NNOE_PROBE3(callout_return, callout_, address_.c_str(),
+                        nnoe::probe_clock_ns() - started_);
+        }
+    }
+
+    template <typename LeasePtr>
+    void lease(const LeasePtr& lease) {
+        if (started_ && lease) {
+            address_ = lease->addr_.toText();
+        }
+    }
+
+private:
+    const char* callout_;
+    uint64_t started_;
+    std::string address_;
+};
+
+// Ordering guard for an event on the lease at ip_address: etcd applies it
+// only if no newer event for the address has been stored
+static nnoe::EtcdGuard lease_guard(const std::string& ip_address, uint64_t sequence) {
+    nnoe::EtcdGuard guard;
+    guard.key = sequence_prefix + "/" + ip_address;
+    guard.sequence = sequence;
+    return guard;
+}
+
+static void index_lease4(const Lease4Ptr& lease, const nnoe::LeaseText& text) {
+    nnoe::IndexedLease entry;
+    entry.address = text.address;
+    entry.hwaddr = text.client;
+    entry.hostname = lease->hostname_;
+    entry.subnet_id = lease->subnet_id_;
+    entry.state = lease->state_;
+    entry.expires_at = lease->cltt_ + lease->valid_lft_;
+    lease_index->upsert(entry);
+}
+
+static void index_lease6(const Lease6Ptr& lease, const nnoe::LeaseText& text) {
+    nnoe::IndexedLease entry;
+    entry.address = text.address;
+    entry.duid = text.client;
+    entry.hostname = lease->hostname_;
+    entry.subnet_id = lease->subnet_id_;
+    entry.state = lease->state_;
+    entry.expires_at = lease->cltt_ + lease->valid_lft_;
+    lease_index->upsert(entry);
+}
+
+// Relay ids from the extended info Kea keeps in the lease's user context
+static void query_relay_ids(const Lease& lease, nnoe::QueriedLease& entry) {
+    ConstElementPtr context = lease.getContext();
+    if (!context) {
+        return;
+    }
+    const std::string text = context->str();
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    Json::Value parsed;
+    if (reader->parse(text.data(), text.data() + text.size(), &parsed, nullptr)) {
+        nnoe::LeaseQueryIndex::read_relay_ids(parsed, entry);
+    }
+}
+
+static void query_index_lease4(const Lease4Ptr& lease, const nnoe::LeaseText& text) {
+    nnoe::QueriedLease entry;
+    entry.name = text.address;
+    entry.address = text.address;
+    entry.hwaddr = text.client;
+    entry.client_id = text.client_id;
+    entry.subnet_id = lease->subnet_id_;
+    entry.state = lease->state_;
+    entry.valid_lft = lease->valid_lft_;
+    entry.cltt = lease->cltt_;
+    entry.expires_at = lease->cltt_ + lease->valid_lft_;
+    entry.prefix_len = 32;
+    query_relay_ids(*lease, entry);
+    lease_query_index->upsert(entry);
+}
+
+static void query_index_lease6(const Lease6Ptr& lease, const nnoe::LeaseText& text) {
+    nnoe::QueriedLease entry;
+    entry.name = text.name;
+    entry.address = text.address;
+    entry.duid = text.client;
+    entry.subnet_id = lease->subnet_id_;
+    entry.iaid = lease->iaid_;
+    entry.state = lease->state_;
+    entry.valid_lft = lease->valid_lft_;
+    entry.preferred_lft = lease->preferred_lft_;
+    entry.cltt = lease->cltt_;
+    entry.expires_at = lease->cltt_ + lease->valid_lft_;
+    entry.type = static_cast<uint8_t>(lease->type_);
+    entry.prefix_len = lease->prefixlen_;
+    entry.v6 = true;
+    query_relay_ids(*lease, entry);
+    lease_query_index->upsert(entry);
+}
+
+// Append the event to the local history archive
+static void record_history(const Lease& lease, const nnoe::LeaseText& text,
+                           const std::string& operation) {
+    nnoe::HistoryEvent event;
+    event.time = time(nullptr);
+    event.operation = operation;
+    event.address = text.name;
+    event.client = text.client;
+    event.hostname = lease.hostname_;
+    event.subnet_id = lease.subnet_id_;
+    event.valid_lft = lease.valid_lft_;
+    lease_history->append(std::move(event));
+}
+
+// DNS records of a published lease, taking down those of the name the
+// address was published under before when the client renamed itself
+static void add_publish_dns_ops(const std::string& hostname, const std::string& address,
+                                std::vector<nnoe::EtcdOp>& ops) {
+    dns_records->add_publish_ops(hostname, address, ops);
+    const std::string previous = dns_names->publish(address, hostname);
+    if (!previous.empty()) {
+        dns_records->add_remove_ops(previous, address, ops);
+    }
+}
+
+// Removal of the DNS records of a lease under every name its address was
+// published with; the name published last goes first, as the PTR holds it
+static void add_remove_dns_ops(const std::string& hostname, const std::string& address,
+                               std::vector<nnoe::EtcdOp>& ops) {
+    std::vector<std::string> names = dns_names->forget(address);
+    names.insert(names.begin() + (names.empty() ? 0 : 1), hostname);
+    for (const auto& name : names) {
+        dns_records->add_remove_ops(name, address, ops);
+    }
+}
+
+// Whether lease events are written to etcd by this hook: not when lease sync
+// is turned off, nor while the etcd lease backend writes them itself
+static bool mirrors_leases() {
+    return lease_sync_enabled && !lease_backend_active;
+}
+
+// Delete lease (and any DNS records derived from it) from etcd
+static bool delete_lease_from_etcd(const std::string& ip_address, const std::string& hostname,
+                                   uint32_t subnet_id) {
+    // Build etcd key
+    std::string key = etcd_prefix + "/" + ip_address;
+    if (lease_index) {
+        lease_index->remove(ip_address);
+    }
+    if (lease_query_index) {
+        lease_query_index->remove(ip_address);
+    }
+    if (!mirrors_leases()) {
+        return true;
+    }
+
+    std::vector<nnoe::EtcdOp> ops;
+    ops.push_back(nnoe::EtcdOp::del(key));
+    if (dns_records) {
+        add_remove_dns_ops(hostname, ip_address, ops);
+    }
+
+    return sync_engine->submit(key, std::move(ops), lease_guard(ip_address, sequence_clock.next()),
+                               subnet_id);
+}
+
+// DNS records follow acknowledged leases only; an offer the client never
+// takes up would leave them behind
+static bool publishes_dns(const std::string& operation) {
+    return operation == "renew" || operation == "ack" || operation == "commit";
+}
+
+// Lease names of the current packet a renewal callout has already written,
+// so the commit callout does not write them again
+static const char* const WRITTEN_CONTEXT = "nnoe-written";
+
+static std::vector<std::string> written_leases(CalloutHandle& handle) {
+    std::vector<std::string> written;
+    try {
+        handle.getContext(WRITTEN_CONTEXT, written);
+    } catch (const NoSuchCalloutContext&) {
+    }
+    return written;
+}
+
+static void mark_written(CalloutHandle& handle, const std::string& name) {
+    std::vector<std::string> written = written_leases(handle);
+    written.push_back(name);
+    handle.setContext(WRITTEN_CONTEXT, written);
+}
+
+// Send lease to etcd; text is the lease's, formatted once by the callout
+static bool sync_lease_to_etcd(const Lease4Ptr& lease, const nnoe::LeaseText& text,
+                               const std::string& operation) {
+    if (lease_index) {
+        index_lease4(lease, text);
+    }
+    if (lease_query_index) {
+        query_index_lease4(lease, text);
+    }
+    if (lease_history) {
+        record_history(*lease, text, operation);
+    }
+    if (!mirrors_leases()) {
+        return true;
+    }
+
+    const uint64_t sequence = sequence_clock.next();
+    const std::string json_str =
+        nnoe::write_value(nnoe::lease4_value(*lease, text, operation, node_id, sequence));
+
+    // Build etcd key
+    std::string key = etcd_prefix + "/" + text.address;
+
+    // Lease record and DNS records go out in one transaction; the sync
+    // engine coalesces per lease key and batches across leases
+    std::vector<nnoe::EtcdOp> ops;
+    ops.push_back(nnoe::EtcdOp::put(key, json_str));
+    if (dns_records && publishes_dns(operation)) {
+        add_publish_dns_ops(lease->hostname_, text.address, ops);
+    }
+
+    return sync_engine->submit(key, std::move(ops), lease_guard(text.address, sequence),
+                               lease->subnet_id_);
+}
+
+// Deferred offer modes: remember the offer and, in ttl mode, publish a
+// small key that etcd drops together with the shared offer lease
+static void record_offer(const Lease4Ptr& lease, const nnoe::LeaseText& text) {
+    const int64_t now = time(nullptr);
+    const std::string& ip_address = text.address;
+    offer_table->offer(ip_address, now);
+
+    if (offer_mode != OFFER_TTL) {
+        return;
+    }
+    const int64_t etcd_lease = offer_table->etcd_lease();
+    if (!etcd_lease) {
+        return;
+    }
+
+    // Unguarded: the key carries no state a late write could roll back
+    const std::string key = offer_prefix + "/" + ip_address;
+    std::vector<nnoe::EtcdOp> ops;
+    ops.push_back(nnoe::EtcdOp::put(key, text.client, etcd_lease));
+    sync_engine->submit(key, std::move(ops), nnoe::EtcdGuard(), lease->subnet_id_);
+}
+
+// Load live leases from etcd into the lease database of this server
+static nnoe::LeaseWarmupResult run_lease_warmup(const nnoe::LeaseWarmupConfig& config) {
+    nnoe::LeaseWarmup warmup(*etcd_client, etcd_prefix, config);
+    nnoe::LeaseWarmupResult result = warmup.run(CfgMgr::instance().getFamily());
+
+    if (result.ok) {
+        std::cerr << "Kea etcd hook: lease warm-up loaded " << result.loaded << " of "
+                  << result.keys << " leases at revision " << result.revision << " in "
+                  << result.elapsed_ms << " ms (" << result.existing << " present, "
+                  << result.expired << " expired, " << result.no_subnet << " without subnet, "
+                  << result.invalid << " invalid)" << std::endl;
+    } else {
+        std::cerr << "Kea etcd hook: lease warm-up failed after loading "
+                  << result.loaded << " leases" << std::endl;
+    }
+    return result;
+}
+
+// etcd-lease-warmup command - optional arguments override page size and threads
+extern "C" int etcd_lease_warmup(CalloutHandle& handle) {
+    ConstElementPtr response;
+
+    try {
+        ConstElementPtr command;
+        handle.getArgument("command", command);
+        ConstElementPtr args;
+        isc::config::parseCommand(args, command);
+
+        nnoe::LeaseWarmupConfig config = warmup_config;
+        if (args && args->getType() == Element::map) {
+            ConstElementPtr page_size = args->get("page-size");
+            if (page_size && page_size->getType() == Element::integer) {
+                config.page_size = page_size->intValue();
+            }
+            ConstElementPtr threads = args->get("threads");
+            if (threads && threads->getType() == Element::integer) {
+                config.threads = threads->intValue();
+            }
+        }
+
+        nnoe::LeaseWarmupResult result = run_lease_warmup(config);
+
+        ElementPtr summary = Element::createMap();
+        summary->set("revision", Element::create(static_cast<long long int>(result.revision)));
+        summary->set("keys", Element::create(static_cast<long long int>(result.keys)));
+        summary->set("loaded", Element::create(static_cast<long long int>(result.loaded)));
+        summary->set("existing", Element::create(static_cast<long long int>(result.existing)));
+        summary->set("expired", Element::create(static_cast<long long int>(result.expired)));
+        summary->set("no-subnet", Element::create(static_cast<long long int>(result.no_subnet)));
+        summary->set("invalid", Element::create(static_cast<long long int>(result.invalid)));
+        summary->set("elapsed-ms", Element::create(static_cast<long long int>(result.elapsed_ms)));
+
+        response = isc::config::createAnswer(
+            result.ok ? isc::config::CONTROL_RESULT_SUCCESS : isc::config::CONTROL_RESULT_ERROR,
+            std::to_string(result.loaded) + " leases loaded from etcd", summary);
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in etcd-lease-warmup: " << e.what() << std::endl;
+        response = isc::config::createAnswer(isc::config::CONTROL_RESULT_ERROR, e.what());
+    }
+
+    handle.setArgument("response", response);
+    return 0;
+}
+
+// Monotonic milliseconds for the client rate limiter
+static int64_t monotonic_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const char* rate_identifier_kind(uint8_t kind) {
+    switch (kind) {
+    case nnoe::ClientBlocklist::HWADDR: return "hwaddr";
+    case nnoe::ClientBlocklist::CLIENT_ID: return "client-id";
+    case nnoe::ClientBlocklist::DUID: return "duid";
+    }
+    return "unknown";
+}
+
+// etcd-sync-stats command - sync engine counters and per-subnet scheduler lag
+extern "C" int etcd_sync_stats(CalloutHandle& handle) {
+    ConstElementPtr response;
+
+    try {
+        const nnoe::SyncEngineStats stats = sync_engine->stats();
+
+        ElementPtr result = Element::createMap();
+        result->set("submitted", Element::create(static_cast<long long int>(stats.submitted)));
+        result->set("coalesced", Element::create(static_cast<long long int>(stats.coalesced)));
+        result->set("dropped", Element::create(static_cast<long long int>(stats.dropped)));
+        result->set("batches", Element::create(static_cast<long long int>(stats.batches)));
+        result->set("failures", Element::create(static_cast<long long int>(stats.failures)));
+        result->set("stale", Element::create(static_cast<long long int>(stats.stale)));
+        result->set("rejected", Element::create(static_cast<long long int>(stats.rejected)));
+        result->set("pending", Element::create(static_cast<long long int>(stats.pending)));
+
+        ElementPtr subnets = Element::createList();
+        for (const auto& flow : sync_engine->flow_stats()) {
+            ElementPtr entry = Element::createMap();
+            entry->set("subnet-id", Element::create(static_cast<long long int>(flow.flow)));
+            entry->set("weight", Element::create(static_cast<long long int>(flow.weight)));
+            entry->set("pending", Element::create(static_cast<long long int>(flow.pending)));
+            entry->set("sent", Element::create(static_cast<long long int>(flow.sent)));
+            entry->set("dropped", Element::create(static_cast<long long int>(flow.dropped)));
+            entry->set("lag-ms", Element::create(static_cast<long long int>(flow.lag_ms)));
+            entry->set("max-lag-ms", Element::create(static_cast<long long int>(flow.max_lag_ms)));
+            subnets->add(entry);
+        }
+        result->set("subnets", subnets);
+
+        if (offer_table) {
+            const nnoe::OfferTableStats offer_stats = offer_table->stats();
+            ElementPtr offers = Element::createMap();
+            offers->set("offered", Element::create(static_cast<long long int>(offer_stats.offered)));
+            offers->set("accepted", Element::create(static_cast<long long int>(offer_stats.accepted)));
+            offers->set("aged", Element::create(static_cast<long long int>(offer_stats.aged)));
+            offers->set("pending", Element::create(static_cast<long long int>(offer_stats.pending)));
+            result->set("offers", offers);
+        }
+
+        if (etcd_auth) {
+            const nnoe::EtcdAuthStats auth_stats = etcd_auth->stats();
+            ElementPtr auth = Element::createMap();
+            auth->set("authentications",
+                      Element::create(static_cast<long long int>(auth_stats.authentications)));
+            auth->set("failures", Element::create(static_cast<long long int>(auth_stats.failures)));
+            auth->set("rejected", Element::create(static_cast<long long int>(auth_stats.rejected)));
+            result->set("auth", auth);
+        }
+
+        if (client_rate) {
+            const nnoe::ClientRateStats rate_stats = client_rate->stats();
+            ElementPtr entry = Element::createMap();
+            entry->set("checked", Element::create(static_cast<long long int>(rate_stats.checked)));
+            entry->set("over", Element::create(static_cast<long long int>(rate_stats.over)));
+            entry->set("shed", Element::create(static_cast<long long int>(rate_stats.shed)));
+            entry->set("evicted", Element::create(static_cast<long long int>(rate_stats.evicted)));
+            ElementPtr offenders = Element::createList();
+            for (const auto& offender : client_rate->offenders(monotonic_ms())) {
+                ElementPtr item = Element::createMap();
+                item->set("kind", Element::create(rate_identifier_kind(offender.kind)));
+                item->set("id", Element::create(nnoe::hex_colon_text(offender.id.data(),
+                                                                     offender.id.size())));
+                item->set("rate", Element::create(static_cast<long long int>(offender.rate)));
+                item->set("packets", Element::create(static_cast<long long int>(offender.packets)));
+                item->set("shed", Element::create(static_cast<long long int>(offender.shed)));
+                item->set("seconds",
+                          Element::create(static_cast<long long int>(
+                              (offender.last_seen_ms - offender.first_seen_ms) / 1000)));
+                offenders->add(item);
+            }
+            entry->set("offenders", offenders);
+            result->set("rate-limit", entry);
+        }
+
+        if (renewal_jitter) {
+            const nnoe::RenewalRateStats jitter_stats =
+                renewal_jitter->stats(monotonic_ms() / 1000);
+            ElementPtr entry = Element::createMap();
+            entry->set("jittered",
+                       Element::create(static_cast<long long int>(jitter_stats.jittered)));
+            entry->set("renewals",
+                       Element::create(static_cast<long long int>(jitter_stats.renewals)));
+            entry->set("window-seconds",
+                       Element::create(static_cast<long long int>(jitter_stats.window_s)));
+            entry->set("window-renewals",
+                       Element::create(static_cast<long long int>(jitter_stats.window_renewals)));
+            entry->set("peak", Element::create(static_cast<long long int>(jitter_stats.peak)));
+            ElementPtr histogram = Element::createList();
+            // Seconds by renewals in the second; the last bucket has no max
+            for (size_t i = 0; i < jitter_stats.histogram.size(); ++i) {
+                if (!jitter_stats.histogram[i]) {
+                    continue;
+                }
+                const long long int min = i ? 1LL << (i - 1) : 0;
+                ElementPtr item = Element::createMap();
+                item->set("min", Element::create(min));
+                if (i + 1 < jitter_stats.histogram.size()) {
+                    item->set("max", Element::create(i ? 2 * min - 1 : 0LL));
+                }
+                item->set("seconds",
+                          Element::create(static_cast<long long int>(jitter_stats.histogram[i])));
+                histogram->add(item);
+            }
+            entry->set("histogram", histogram);
+            result->set("renewal-jitter", entry);
+        }
+
+        if (adaptive_lifetime) {
+            const nnoe::AdaptiveLifetimeStats lifetime_stats = adaptive_lifetime->stats();
+            ElementPtr entry = Element::createMap();
+            entry->set("lengthened",
+                       Element::create(static_cast<long long int>(lifetime_stats.lengthened)));
+            entry->set("shortened",
+                       Element::create(static_cast<long long int>(lifetime_stats.shortened)));
+            entry->set("unchanged",
+                       Element::create(static_cast<long long int>(lifetime_stats.unchanged)));
+            entry->set("untracked",
+                       Element::create(static_cast<long long int>(lifetime_stats.untracked)));
+            result->set("adaptive-lifetime", entry);
+        }
+
+        if (conflict_filter) {
+            const nnoe::ConflictFilterStats conflict_stats = conflict_filter->stats();
+            ElementPtr entry = Element::createMap();
+            entry->set("tracked",
+                       Element::create(static_cast<long long int>(conflict_stats.tracked)));
+            entry->set("hints-dropped",
+                       Element::create(static_cast<long long int>(conflict_stats.hints_dropped)));
+            entry->set("refused",
+                       Element::create(static_cast<long long int>(conflict_stats.refused)));
+            result->set("conflict-filter", entry);
+        }
+
+        if (watch_manager) {
+            const nnoe::WatchManagerStats watch_stats = watch_manager->stats();
+            ElementPtr entry = Element::createMap();
+            entry->set("streams", Element::create(static_cast<long long int>(watch_stats.streams)));
+            entry->set("resumed", Element::create(static_cast<long long int>(watch_stats.resumed)));
+            entry->set("reloads", Element::create(static_cast<long long int>(watch_stats.reloads)));
+            entry->set("compactions",
+                       Element::create(static_cast<long long int>(watch_stats.compactions)));
+            entry->set("overflows",
+                       Element::create(static_cast<long long int>(watch_stats.overflows)));
+            entry->set("events", Element::create(static_cast<long long int>(watch_stats.events)));
+            ElementPtr prefixes = Element::createList();
+            for (const auto& sub : watch_stats.subscriptions) {
+                ElementPtr item = Element::createMap();
+                item->set("prefix", Element::create(sub.prefix));
+                item->set("revision", Element::create(static_cast<long long int>(sub.revision)));
+                item->set("events", Element::create(static_cast<long long int>(sub.events)));
+                item->set("reloads", Element::create(static_cast<long long int>(sub.reloads)));
+                item->set("queued", Element::create(static_cast<long long int>(sub.queued)));
+                prefixes->add(item);
+            }
+            entry->set("subscriptions", prefixes);
+            result->set("watches", entry);
+        }
+
+        if (kea_transport) {
+            const nnoe::KeaTransportStats transport_stats = kea_transport->stats();
+            ElementPtr entry = Element::createMap();
+            entry->set("running", Element::create(transport_stats.running));
+            entry->set("threads", Element::create(static_cast<long long int>(transport_stats.threads)));
+            entry->set("requests",
+                       Element::create(static_cast<long long int>(transport_stats.requests)));
+            entry->set("failures",
+                       Element::create(static_cast<long long int>(transport_stats.failures)));
+            entry->set("outstanding",
+                       Element::create(static_cast<long long int>(transport_stats.outstanding)));
+            result->set("transport", entry);
+        }
+
+        if (lease_query_index) {
+            ElementPtr entry = Element::createMap();
+            entry->set("indexed",
+                       Element::create(static_cast<long long int>(lease_query_index->size())));
+            entry->set("remote",
+                       Element::create(static_cast<long long int>(lease_query_index->remote_size())));
+            if (bulk_leasequery) {
+                const nnoe::LeaseQueryStats lq_stats = bulk_leasequery->stats();
+                entry->set("running", Element::create(lq_stats.running));
+                entry->set("connections",
+                           Element::create(static_cast<long long int>(lq_stats.connections)));
+                entry->set("refused", Element::create(static_cast<long long int>(lq_stats.refused)));
+                entry->set("active", Element::create(static_cast<long long int>(lq_stats.active)));
+                entry->set("queries", Element::create(static_cast<long long int>(lq_stats.queries)));
+                entry->set("malformed",
+                           Element::create(static_cast<long long int>(lq_stats.malformed)));
+                entry->set("leases", Element::create(static_cast<long long int>(lq_stats.leases)));
+            }
+            result->set("leasequery", entry);
+        }
+
+        if (lease_history) {
+            const nnoe::LeaseHistoryStats history_stats = lease_history->stats();
+            ElementPtr entry = Element::createMap();
+            entry->set("appended", Element::create(static_cast<long long int>(history_stats.appended)));
+            entry->set("dropped", Element::create(static_cast<long long int>(history_stats.dropped)));
+            entry->set("buffered", Element::create(static_cast<long long int>(history_stats.buffered)));
+            entry->set("segments", Element::create(static_cast<long long int>(history_stats.segments)));
+            entry->set("bytes", Element::create(static_cast<long long int>(history_stats.bytes)));
+            entry->set("write-errors",
+                       Element::create(static_cast<long long int>(history_stats.write_errors)));
+            entry->set("removed", Element::create(static_cast<long long int>(history_stats.removed)));
+            result->set("history", entry);
+        }
+
+        const nnoe::EtcdLeaseMgr* backend = lease_backend_active ?
+            dynamic_cast<const nnoe::EtcdLeaseMgr*>(&LeaseMgrFactory::instance()) : nullptr;
+        if (backend) {
+            const nnoe::EtcdLeaseMgrStats backend_stats = backend->stats();
+            ElementPtr entry = Element::createMap();
+            entry->set("leases4", Element::create(static_cast<long long int>(backend_stats.leases4)));
+            entry->set("leases6", Element::create(static_cast<long long int>(backend_stats.leases6)));
+            entry->set("foreign", Element::create(static_cast<long long int>(backend_stats.foreign)));
+            entry->set("watch-events",
+                       Element::create(static_cast<long long int>(backend_stats.watch_events)));
+            entry->set("reloads", Element::create(static_cast<long long int>(backend_stats.reloads)));
+            entry->set("submitted",
+                       Element::create(static_cast<long long int>(backend_stats.sync.submitted)));
+            entry->set("coalesced",
+                       Element::create(static_cast<long long int>(backend_stats.sync.coalesced)));
+            entry->set("dropped",
+                       Element::create(static_cast<long long int>(backend_stats.sync.dropped)));
+            entry->set("batches",
+                       Element::create(static_cast<long long int>(backend_stats.sync.batches)));
+            entry->set("failures",
+                       Element::create(static_cast<long long int>(backend_stats.sync.failures)));
+            entry->set("pending",
+                       Element::create(static_cast<long long int>(backend_stats.sync.pending)));
+            result->set("lease-backend", entry);
+        }
+
+        ElementPtr memory = Element::createMap();
+        memory->set("limit", Element::create(static_cast<long long int>(memory_budget->limit())));
+        memory->set("used", Element::create(static_cast<long long int>(memory_budget->used())));
+        ElementPtr components = Element::createList();
+        for (const auto& account : memory_budget->stats()) {
+            ElementPtr entry = Element::createMap();
+            entry->set("name", Element::create(account.name));
+            entry->set("used", Element::create(static_cast<long long int>(account.used)));
+            entry->set("peak", Element::create(static_cast<long long int>(account.peak)));
+            entry->set("limit", Element::create(static_cast<long long int>(account.limit)));
+            entry->set("refused", Element::create(static_cast<long long int>(account.refused)));
+            components->add(entry);
+        }
+        memory->set("components", components);
+        result->set("memory", memory);
+
+        response = isc::config::createAnswer(isc::config::CONTROL_RESULT_SUCCESS,
+                                             "etcd sync statistics", result);
+    } catch (const std::exception& e) {
+        response = isc::config::createAnswer(isc::config::CONTROL_RESULT_ERROR, e.what());
+    }
+
+    handle.setArgument("response", response);
+    return 0;
+}
+
+// Lease index commands. All take a map of arguments and answer from the
+// in-memory index without touching the lease backend or etcd.
+static const int64_t LEASE_INDEX_DEFAULT_LIMIT = 1000;
+
+static ConstElementPtr lease_index_arguments(CalloutHandle& handle) {
+    ConstElementPtr command;
+    handle.getArgument("command", command);
+    ConstElementPtr args;
+    isc::config::parseCommand(args, command);
+    if (!args || args->getType() != Element::map) {
+        return Element::createMap();
+    }
+    return args;
+}
+
+static int64_t integer_argument(const ConstElementPtr& args, const std::string& name,
+                                int64_t fallback) {
+    ConstElementPtr value = args->get(name);
+    if (!value) {
+        return fallback;
+    }
+    if (value->getType() != Element::integer || value->intValue() < 0) {
+        throw std::invalid_argument("'" + name + "' must be a non-negative integer");
+    }
+    return value->intValue();
+}
+
+static ElementPtr leases_to_element(const std::vector<nnoe::IndexedLease>& leases) {
+    ElementPtr list = Element::createList();
+    for (const auto& lease : leases) {
+        ElementPtr entry = Element::createMap();
+        entry->set("ip-address", Element::create(lease.address));
+        if (!lease.hwaddr.empty()) {
+            entry->set("hw-address", Element::create(lease.hwaddr));
+        }
+        if (!lease.duid.empty()) {
+            entry->set("duid", Element::create(lease.duid));
+        }
+        if (!lease.hostname.empty()) {
+            entry->set("hostname", Element::create(lease.hostname));
+        }
+        entry->set("subnet-id", Element::create(static_cast<long long int>(lease.subnet_id)));
+        entry->set("state", Element::create(static_cast<long long int>(lease.state)));
+        entry->set("expires-at", Element::create(static_cast<long long int>(lease.expires_at)));
+        list->add(entry);
+    }
+    return list;
+}
+
+static ConstElementPtr leases_answer(const std::vector<nnoe::IndexedLease>& leases) {
+    ElementPtr result = Element::createMap();
+    result->set("leases", leases_to_element(leases));
+    return isc::config::createAnswer(
+        leases.empty() ? isc::config::CONTROL_RESULT_EMPTY : isc::config::CONTROL_RESULT_SUCCESS,
+        std::to_string(leases.size()) + " leases found", result);
+}
+
+// lease-index-subnet command - {"subnet-id": N, "state": S?, "limit": L?}
+extern "C" int lease_index_subnet(CalloutHandle& handle) {
+    ConstElementPtr response;
+
+    try {
+        ConstElementPtr args = lease_index_arguments(handle);
+        if (!args->get("subnet-id")) {
+            throw std::invalid_argument("'subnet-id' is required");
+        }
+        const int64_t subnet_id = integer_argument(args, "subnet-id", 0);
+        const int64_t state = integer_argument(args, "state", -1);
+        const int64_t limit = integer_argument(args, "limit", LEASE_INDEX_DEFAULT_LIMIT);
+
+        response = leases_answer(lease_index->by_subnet(static_cast<uint32_t>(subnet_id), state,
+                                                        static_cast<size_t>(limit)));
+    } catch (const std::exception& e) {
+        response = isc::config::createAnswer(isc::config::CONTROL_RESULT_ERROR, e.what());
+    }
+
+    handle.setArgument("response", response);
+    return 0;
+}
+
+// lease-index-expiring command - {"seconds": N, "limit": L?}
+extern "C" int lease_index_expiring(CalloutHandle& handle) {
+    ConstElementPtr response;
+
+    try {
+        ConstElementPtr args = lease_index_arguments(handle);
+        const int64_t seconds = integer_argument(args, "seconds", 60);
+        const int64_t limit = integer_argument(args, "limit", LEASE_INDEX_DEFAULT_LIMIT);
+        if (seconds > UINT32_MAX) {
+            throw std::invalid_argument("'seconds' is out of range");
+        }
+
+        response = leases_answer(lease_index->expiring(time(nullptr),
+                                                       static_cast<uint32_t>(seconds),
+                                                       static_cast<size_t>(limit)));
+    } catch (const std::exception& e) {
+        response = isc::config::createAnswer(isc::config::CONTROL_RESULT_ERROR, e.what());
+    }
+
+    handle.setArgument("response", response);
+    return 0;
+}
+
+// lease-index-utilization command - {"subnet-id": N?}; IPv4 pools only
+extern "C" int lease_index_utilization(CalloutHandle& handle) {
+    ConstElementPtr response;
+
+    try {
+        ConstElementPtr args = lease_index_arguments(handle);
+        const int64_t subnet_id = integer_argument(args, "subnet-id", 0);
+
+        ElementPtr pools = Element::createList();
+        for (const auto& pool : lease_index->utilization(static_cast<uint32_t>(subnet_id))) {
+            ElementPtr entry = Element::createMap();
+            entry->set("subnet-id", Element::create(static_cast<long long int>(pool.subnet_id)));
+            entry->set("pool", Element::create(pool.first + "-" + pool.last));
+            entry->set("total", Element::create(static_cast<long long int>(pool.total)));
+            entry->set("assigned", Element::create(static_cast<long long int>(pool.assigned)));
+            pools->add(entry);
+        }
+
+        ElementPtr result = Element::createMap();
+        result->set("pools", pools);
+        response = isc::config::createAnswer(isc::config::CONTROL_RESULT_SUCCESS,
+                                             std::to_string(pools->size()) + " pools", result);
+    } catch (const std::exception& e) {
+        response = isc::config::createAnswer(isc::config::CONTROL_RESULT_ERROR, e.what());
+    }
+
+    handle.setArgument("response", response);
+    return 0;
+}
+
+// lease-index-client command - {"hw-address": "..."} or {"duid": "..."}
+extern "C" int lease_index_client(CalloutHandle& handle) {
+    ConstElementPtr response;
+
+    try {
+        ConstElementPtr args = lease_index_arguments(handle);
+        ConstElementPtr hwaddr = args->get("hw-address");
+        ConstElementPtr duid = args->get("duid");
+
+        if (hwaddr && hwaddr->getType() == Element::string) {
+            response = leases_answer(lease_index->by_hwaddr(hwaddr->stringValue()));
+        } else if (duid && duid->getType() == Element::string) {
+            response = leases_answer(lease_index->by_duid(duid->stringValue()));
+        } else {
+            throw std::invalid_argument("'hw-address' or 'duid' is required");
+        }
+    } catch (const std::exception& e) {
+        response = isc::config::createAnswer(isc::config::CONTROL_RESULT_ERROR, e.what());
+    }
+
+    handle.setArgument("response", response);
+    return 0;
+}
+
+// Hook library version
+extern "C" int version() {
+    return (KEA_HOOKS_VERSION);
+}
+
+static void post_scope_changes(const std::vector<nnoe::ScopeChange>& changes);
+
+// Account of a component in the memory budget, with its configured cap
+static nnoe::MemoryAccount* memory_account(const std::string& name) {
+    auto limit = memory_limits.find(name);
+    return memory_budget->account(name, limit != memory_limits.end() ? limit->second : 0);
+}
+
+// A user context with lease limits ({"limits": {"address-limit": ...}})
+static bool has_lease_limits(const ConstElementPtr& context) {
+    ConstElementPtr limits = context && context->getType() == Element::map ?
+        context->get("limits") : ConstElementPtr();
+    return limits && limits->getType() == Element::map &&
+           (limits->contains("address-limit") || limits->contains("prefix-limit"));
+}
+
+// Whether the configuration being committed sets lease limits on a client
+// class or subnet
+static bool lease_limits_configured() {
+    SrvConfigPtr cfg = CfgMgr::instance().getStagingCfg();
+    for (const auto& client_class : *cfg->getClientClassDictionary()->getClasses()) {
+        if (has_lease_limits(client_class->getContext())) {
+            return true;
+        }
+    }
+    for (const auto& subnet : *cfg->getCfgSubnets4()->getAll()) {
+        if (has_lease_limits(subnet->getContext())) {
+            return true;
+        }
+    }
+    for (const auto& subnet : *cfg->getCfgSubnets6()->getAll()) {
+        if (has_lease_limits(subnet->getContext())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Lease database factory for lease-database type "etcd"; refuses what the
+// backend cannot answer rather than answering it wrong
+static TrackingLeaseMgrPtr create_lease_backend(
+    const isc::db::DatabaseConnection::ParameterMap& parameters) {
+    if (lease_limits_configured()) {
+        isc_throw(isc::NotImplemented, "the etcd lease database does not support lease limits");
+    }
+    auto tables = parameters.find("extended-info-tables");
+    if (tables != parameters.end() && tables->second == "true") {
+        isc_throw(isc::NotImplemented, "the etcd lease database does not support "
+                  "extended-info-tables");
+    }
+
+    nnoe::EtcdLeaseMgrConfig config;
+    config.endpoint = etcd_endpoints;
+    auto name = parameters.find("name");
+    config.prefix = name != parameters.end() && !name->second.empty() ? name->second : etcd_prefix;
+    config.sequence_prefix = sequence_prefix;
+    config.node_id = node_id;
+    config.auth = etcd_auth;
+    config.tls = etcd_tls;
+    config.transport = kea_transport;
+    config.watches = watch_manager;
+    config.dns_enabled = dns_enabled;
+    config.dns = dns_config;
+    config.sync = sync_config;
+    return TrackingLeaseMgrPtr(new nnoe::EtcdLeaseMgr(config));
+}
+
+// Hook library load
+// Reads an integer parameter that must be positive; false, after logging why,
+// when it is set to anything else
+template <typename T>
+static bool positive_parameter(LibraryHandle& handle, const char* name, T& value) {
+    ConstElementPtr parameter = handle.getParameter(name);
+    if (!parameter) {
+        return true;
+    }
+    if (parameter->getType() != Element::integer || parameter->intValue() <= 0 ||
+        static_cast<uint64_t>(parameter->intValue()) > std::numeric_limits<T>::max()) {
+        std::cerr << "Kea etcd hook: " << name << " must be a positive integer" << std::endl;
+        return false;
+    }
+    value = static_cast<T>(parameter->intValue());
+    return true;
 }
 
-// Base64 encode using OpenSSL
-static std::string base64_encode(const std::string& input) {
-    BIO *bio, *b64;
-    BUF_MEM *bufferPtr;
+extern "C" int load(LibraryHandle& handle) {
+    // Read configuration
+    ConstElementPtr endpoints = handle.getParameter("etcd_endpoints");
+    if (endpoints && endpoints->getType() == Element::string) {
+        etcd_endpoints = endpoints->stringValue();
+    }
+    
+    ConstElementPtr prefix = handle.getParameter("prefix");
+    if (prefix && prefix->getType() == Element::string) {
+        etcd_prefix = prefix->stringValue();
+    }
+    
+    ConstElementPtr username = handle.getParameter("etcd_username");
+    if (username && username->getType() == Element::string) {
+        etcd_username = username->stringValue();
+    }
+
+    ConstElementPtr password = handle.getParameter("etcd_password");
+    if (password && password->getType() == Element::string) {
+        etcd_password = password->stringValue();
+    }
+
+    ConstElementPtr token_ttl = handle.getParameter("etcd_token_ttl");
+    if (token_ttl && token_ttl->getType() == Element::integer && token_ttl->intValue() > 0) {
+        etcd_token_ttl = token_ttl->intValue();
+    }
+
+    ConstElementPtr ca_file = handle.getParameter("etcd_ca_file");
+    if (ca_file && ca_file->getType() == Element::string) {
+        etcd_tls.ca_file = ca_file->stringValue();
+    }
+
+    ConstElementPtr cert_file = handle.getParameter("etcd_cert_file");
+    if (cert_file && cert_file->getType() == Element::string) {
+        etcd_tls.cert_file = cert_file->stringValue();
+    }
+
+    ConstElementPtr key_file = handle.getParameter("etcd_key_file");
+    if (key_file && key_file->getType() == Element::string) {
+        etcd_tls.key_file = key_file->stringValue();
+    }
+
+    ConstElementPtr transport = handle.getParameter("etcd_transport");
+    if (transport && transport->getType() == Element::string) {
+        const std::string name = transport->stringValue();
+        if (name == "kea") {
+            etcd_transport_kea = true;
+        } else if (name != "curl") {
+            std::cerr << "Kea etcd hook: unknown etcd_transport '" << name
+                      << "', using curl" << std::endl;
+        }
+    }
+
+    ConstElementPtr transport_threads = handle.getParameter("etcd_transport_threads");
+    if (transport_threads && transport_threads->getType() == Element::integer &&
+        transport_threads->intValue() >= 0) {
+        kea_transport_config.threads = static_cast<uint32_t>(transport_threads->intValue());
+    }
+
+    ConstElementPtr request_timeout = handle.getParameter("etcd_request_timeout_ms");
+    if (request_timeout && request_timeout->getType() == Element::integer &&
+        request_timeout->intValue() > 0) {
+        kea_transport_config.timeout_ms = static_cast<uint32_t>(request_timeout->intValue());
+    }
+
+    ConstElementPtr seq_prefix = handle.getParameter("sequence_prefix");
+    if (seq_prefix && seq_prefix->getType() == Element::string) {
+        sequence_prefix = seq_prefix->stringValue();
+    }
 
-    b64 = BIO_new(BIO_f_base64());
-    bio = BIO_new(BIO_s_mem());
-    bio = BIO_push(b64, bio);
+    ConstElementPtr delegations = handle.getParameter("pd_aggregate");
+    if (delegations && delegations->getType() == Element::boolean) {
+        pd_aggregate = delegations->boolValue();
+    }
+
+    ConstElementPtr delegation_prefix = handle.getParameter("pd_prefix");
+    if (delegation_prefix && delegation_prefix->getType() == Element::string) {
+        pd_prefix = delegation_prefix->stringValue();
+    }
 
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
-    BIO_write(bio, input.c_str(), static_cast<int>(input.length()));
-    BIO_flush(bio);
+    ConstElementPtr ttl = handle.getParameter("ttl");
+    if (ttl && ttl->getType() == Element::integer) {
+        lease_ttl = ttl->intValue();
+    }
 
-    BIO_get_mem_ptr(bio, &bufferPtr);
-    std::string encoded(bufferPtr->data, bufferPtr->length);
+    ConstElementPtr lease_sync = handle.getParameter("lease_sync_enabled");
+    if (lease_sync && lease_sync->getType() == Element::boolean) {
+        lease_sync_enabled = lease_sync->boolValue();
+    }
 
-    BIO_free_all(bio);
+    ConstElementPtr offers = handle.getParameter("offer_mode");
+    if (offers && offers->getType() == Element::string) {
+        const std::string mode = offers->stringValue();
+        if (mode == "full") {
+            offer_mode = OFFER_FULL;
+        } else if (mode == "local") {
+            offer_mode = OFFER_LOCAL;
+        } else if (mode == "ttl") {
+            offer_mode = OFFER_TTL;
+        } else {
+            std::cerr << "Kea etcd hook: unknown offer_mode '" << mode
+                      << "', writing offers in full" << std::endl;
+        }
+    }
+    if (!lease_sync_enabled && offer_mode == OFFER_TTL) {
+        // Offer keys are lease records too
+        std::cerr << "Kea etcd hook: offer_mode ttl needs lease sync, keeping offers local"
+                  << std::endl;
+        offer_mode = OFFER_LOCAL;
+    }
+
+    ConstElementPtr offers_ttl = handle.getParameter("offer_ttl");
+    if (offers_ttl && offers_ttl->getType() == Element::integer) {
+        offer_ttl = offers_ttl->intValue();
+    }
+
+    ConstElementPtr offers_prefix = handle.getParameter("offer_prefix");
+    if (offers_prefix && offers_prefix->getType() == Element::string) {
+        offer_prefix = offers_prefix->stringValue();
+    }
+
+    ConstElementPtr blocklist = handle.getParameter("blocklist_enabled");
+    if (blocklist && blocklist->getType() == Element::boolean) {
+        blocklist_enabled = blocklist->boolValue();
+    }
+
+    ConstElementPtr bl_prefix = handle.getParameter("blocklist_prefix");
+    if (bl_prefix && bl_prefix->getType() == Element::string) {
+        blocklist_prefix = bl_prefix->stringValue();
+    }
+
+    ConstElementPtr rate_limit = handle.getParameter("rate_limit_enabled");
+    if (rate_limit && rate_limit->getType() == Element::boolean) {
+        rate_limit_enabled = rate_limit->boolValue();
+    }
+
+    ConstElementPtr rate_packets = handle.getParameter("rate_limit_packets");
+    if (rate_packets && rate_packets->getType() == Element::integer &&
+        rate_packets->intValue() > 0) {
+        rate_limit_config.threshold = static_cast<uint32_t>(rate_packets->intValue());
+    }
+
+    ConstElementPtr rate_interval = handle.getParameter("rate_limit_interval_ms");
+    if (rate_interval && rate_interval->getType() == Element::integer &&
+        rate_interval->intValue() > 0) {
+        rate_limit_config.interval_ms = static_cast<uint32_t>(rate_interval->intValue());
+    }
+
+    ConstElementPtr rate_action = handle.getParameter("rate_limit_action");
+    if (rate_action && rate_action->getType() == Element::string) {
+        const std::string action = rate_action->stringValue();
+        if (action == "drop") {
+            rate_limit_config.action = nnoe::ClientRateConfig::DROP;
+        } else if (action == "throttle") {
+            rate_limit_config.action = nnoe::ClientRateConfig::THROTTLE;
+        } else if (action == "monitor") {
+            rate_limit_config.action = nnoe::ClientRateConfig::MONITOR;
+        } else {
+            std::cerr << "Kea etcd hook: unknown rate_limit_action '" << action
+                      << "', dropping" << std::endl;
+        }
+    }
+
+    ConstElementPtr jitter = handle.getParameter("renewal_jitter_enabled");
+    if (jitter && jitter->getType() == Element::boolean) {
+        renewal_jitter_enabled = jitter->boolValue();
+    }
+
+    ConstElementPtr jitter_percent = handle.getParameter("renewal_jitter_percent");
+    if (jitter_percent && jitter_percent->getType() == Element::integer &&
+        jitter_percent->intValue() >= 0) {
+        renewal_jitter_config.percent = static_cast<uint32_t>(jitter_percent->intValue());
+    }
+
+    ConstElementPtr jitter_window = handle.getParameter("renewal_jitter_window");
+    if (jitter_window && jitter_window->getType() == Element::integer &&
+        jitter_window->intValue() > 0) {
+        renewal_jitter_config.window_s = static_cast<uint32_t>(jitter_window->intValue());
+    }
+
+    ConstElementPtr rate_width = handle.getParameter("rate_limit_sketch_width");
+    if (rate_width && rate_width->getType() == Element::integer && rate_width->intValue() > 0) {
+        rate_limit_config.width = static_cast<uint32_t>(rate_width->intValue());
+    }
+
+    ConstElementPtr rate_offenders = handle.getParameter("rate_limit_offenders");
+    if (rate_offenders && rate_offenders->getType() == Element::integer &&
+        rate_offenders->intValue() > 0) {
+        rate_limit_config.offenders = static_cast<uint32_t>(rate_offenders->intValue());
+    }
+
+    ConstElementPtr cerbos = handle.getParameter("cerbos_enabled");
+    if (cerbos && cerbos->getType() == Element::boolean) {
+        cerbos_enabled = cerbos->boolValue();
+    }
+
+    ConstElementPtr cerbos_endpoint = handle.getParameter("cerbos_endpoint");
+    if (cerbos_endpoint && cerbos_endpoint->getType() == Element::string) {
+        cerbos_config.endpoint = cerbos_endpoint->stringValue();
+    }
+
+    ConstElementPtr cerbos_ttl = handle.getParameter("cerbos_cache_ttl");
+    if (cerbos_ttl && cerbos_ttl->getType() == Element::integer) {
+        cerbos_config.positive_ttl = cerbos_ttl->intValue();
+    }
+
+    ConstElementPtr cerbos_neg_ttl = handle.getParameter("cerbos_negative_ttl");
+    if (cerbos_neg_ttl && cerbos_neg_ttl->getType() == Element::integer) {
+        cerbos_config.negative_ttl = cerbos_neg_ttl->intValue();
+    }
+
+    ConstElementPtr cerbos_timeout = handle.getParameter("cerbos_timeout_ms");
+    if (cerbos_timeout && cerbos_timeout->getType() == Element::integer) {
+        cerbos_config.timeout_ms = cerbos_timeout->intValue();
+    }
+
+    ConstElementPtr cerbos_fail_open = handle.getParameter("cerbos_fail_open");
+    if (cerbos_fail_open && cerbos_fail_open->getType() == Element::boolean) {
+        cerbos_config.fail_open = cerbos_fail_open->boolValue();
+    }
+
+    ConstElementPtr dns = handle.getParameter("dns_enabled");
+    if (dns && dns->getType() == Element::boolean) {
+        dns_enabled = dns->boolValue();
+    }
+
+    ConstElementPtr dns_zone = handle.getParameter("dns_forward_zone");
+    if (dns_zone && dns_zone->getType() == Element::string) {
+        dns_config.forward_zone = dns_zone->stringValue();
+    }
+
+    ConstElementPtr dns_prefix = handle.getParameter("dns_zones_prefix");
+    if (dns_prefix && dns_prefix->getType() == Element::string) {
+        dns_config.zones_prefix = dns_prefix->stringValue();
+    }
+
+    ConstElementPtr dns_ttl = handle.getParameter("dns_ttl");
+    if (dns_ttl && dns_ttl->getType() == Element::integer) {
+        dns_config.ttl = dns_ttl->intValue();
+    }
+
+    ConstElementPtr dns_reverse = handle.getParameter("dns_reverse");
+    if (dns_reverse && dns_reverse->getType() == Element::boolean) {
+        dns_config.reverse = dns_reverse->boolValue();
+    }
+
+    if (!positive_parameter(handle, "batch_max_ops", sync_config.max_batch_ops) ||
+        !positive_parameter(handle, "batch_flush_interval_ms", sync_config.flush_interval_ms) ||
+        !positive_parameter(handle, "batch_senders", sync_config.senders) ||
+        !positive_parameter(handle, "batch_quantum_ops", sync_config.quantum_ops)) {
+        return 1;
+    }
+
+    // {"<subnet-id>": weight, ...}
+    ConstElementPtr weights = handle.getParameter("subnet_weights");
+    if (weights && weights->getType() == Element::map) {
+        for (const auto& weight : weights->mapValue()) {
+            if (weight.second->getType() != Element::integer || weight.second->intValue() <= 0) {
+                std::cerr << "Kea etcd hook: ignoring invalid weight for subnet "
+                          << weight.first << std::endl;
+                continue;
+            }
+            try {
+                sync_config.weights[std::stoul(weight.first)] = weight.second->intValue();
+            } catch (const std::exception&) {
+                std::cerr << "Kea etcd hook: ignoring weight for invalid subnet id "
+                          << weight.first << std::endl;
+            }
+        }
+    }
+
+    if (!positive_parameter(handle, "queue_limit", sync_config.queue_limit)) {
+        return 1;
+    }
+
+    ConstElementPtr sequence_grace = handle.getParameter("sequence_grace");
+    if (sequence_grace && sequence_grace->getType() == Element::integer) {
+        sync_config.guard_grace_s = sequence_grace->intValue();
+    }
+
+    ConstElementPtr warmup = handle.getParameter("warmup_on_start");
+    if (warmup && warmup->getType() == Element::boolean) {
+        warmup_on_start = warmup->boolValue();
+    }
+
+    ConstElementPtr warmup_page = handle.getParameter("warmup_page_size");
+    if (warmup_page && warmup_page->getType() == Element::integer) {
+        warmup_config.page_size = warmup_page->intValue();
+    }
+
+    ConstElementPtr warmup_threads = handle.getParameter("warmup_threads");
+    if (warmup_threads && warmup_threads->getType() == Element::integer) {
+        warmup_config.threads = warmup_threads->intValue();
+    }
+
+    ConstElementPtr node = handle.getParameter("node_id");
+    if (node && node->getType() == Element::string) {
+        node_id = node->stringValue();
+    }
+    if (node_id.empty()) {
+        char host[256] = {0};
+        if (gethostname(host, sizeof(host) - 1) == 0) {
+            node_id = host;
+        }
+    }
+
+    ConstElementPtr conflicts = handle.getParameter("conflict_filter_enabled");
+    if (conflicts && conflicts->getType() == Element::boolean) {
+        conflict_filter_enabled = conflicts->boolValue();
+    }
+
+    ConstElementPtr leasequery = handle.getParameter("leasequery_enabled");
+    if (leasequery && leasequery->getType() == Element::boolean) {
+        leasequery_enabled = leasequery->boolValue();
+    }
+
+    ConstElementPtr lq_address = handle.getParameter("leasequery_address");
+    if (lq_address && lq_address->getType() == Element::string) {
+        leasequery_config.address = lq_address->stringValue();
+        leasequery_address_set = true;
+    }
+
+    ConstElementPtr lq_port = handle.getParameter("leasequery_port");
+    if (lq_port && lq_port->getType() == Element::integer && lq_port->intValue() > 0 &&
+        lq_port->intValue() <= 65535) {
+        leasequery_config.port = static_cast<uint16_t>(lq_port->intValue());
+        leasequery_port_set = true;
+    }
+
+    ConstElementPtr lq_connections = handle.getParameter("leasequery_max_connections");
+    if (lq_connections && lq_connections->getType() == Element::integer &&
+        lq_connections->intValue() > 0) {
+        leasequery_config.max_connections = static_cast<uint32_t>(lq_connections->intValue());
+    }
+
+    ConstElementPtr lq_idle = handle.getParameter("leasequery_idle_timeout");
+    if (lq_idle && lq_idle->getType() == Element::integer && lq_idle->intValue() > 0) {
+        leasequery_config.idle_timeout_s = static_cast<uint32_t>(lq_idle->intValue());
+    }
+
+    // ["192.0.2.1", "2001:db8::1", ...]
+    ConstElementPtr lq_requestors = handle.getParameter("leasequery_requestors");
+    if (lq_requestors && lq_requestors->getType() == Element::list) {
+        for (const auto& requestor : lq_requestors->listValue()) {
+            if (requestor->getType() == Element::string) {
+                leasequery_config.requestors.push_back(requestor->stringValue());
+            }
+        }
+    }
+
+    ConstElementPtr lq_server_id = handle.getParameter("leasequery_server_id");
+    if (lq_server_id && lq_server_id->getType() == Element::string) {
+        leasequery_config.server_id = lq_server_id->stringValue();
+    }
+
+    ConstElementPtr scopes = handle.getParameter("scopes_enabled");
+    if (scopes && scopes->getType() == Element::boolean) {
+        scopes_enabled = scopes->boolValue();
+    }
+
+    ConstElementPtr sc_prefix = handle.getParameter("scopes_prefix");
+    if (sc_prefix && sc_prefix->getType() == Element::string) {
+        scopes_prefix = sc_prefix->stringValue();
+    }
+
+    ConstElementPtr history = handle.getParameter("history_enabled");
+    if (history && history->getType() == Element::boolean) {
+        history_enabled = history->boolValue();
+    }
+
+    history_config.directory = "/var/lib/kea/nnoe-history";
+    ConstElementPtr history_dir = handle.getParameter("history_dir");
+    if (history_dir && history_dir->getType() == Element::string) {
+        history_config.directory = history_dir->stringValue();
+    }
+
+    ConstElementPtr partition = handle.getParameter("history_partition_hours");
+    if (partition && partition->getType() == Element::integer && partition->intValue() > 0) {
+        history_config.partition_seconds = static_cast<uint32_t>(partition->intValue()) * 3600;
+    }
+
+    ConstElementPtr segment_events = handle.getParameter("history_segment_events");
+    if (segment_events && segment_events->getType() == Element::integer &&
+        segment_events->intValue() > 0) {
+        history_config.segment_events = static_cast<uint32_t>(segment_events->intValue());
+    }
+
+    ConstElementPtr history_flush = handle.getParameter("history_flush_interval");
+    if (history_flush && history_flush->getType() == Element::integer &&
+        history_flush->intValue() >= 0) {
+        history_config.flush_interval_s = static_cast<uint32_t>(history_flush->intValue());
+    }
+
+    ConstElementPtr retention = handle.getParameter("history_retention_days");
+    if (retention && retention->getType() == Element::integer && retention->intValue() >= 0) {
+        history_config.retention_days = static_cast<uint32_t>(retention->intValue());
+    }
+
+    ConstElementPtr budget = handle.getParameter("memory_budget_mb");
+    if (budget && budget->getType() == Element::integer && budget->intValue() >= 0) {
+        memory_budget_bytes = static_cast<uint64_t>(budget->intValue()) << 20;
+    }
+
+    // {"<component>": megabytes, ...}
+    ConstElementPtr limits = handle.getParameter("memory_limits_mb");
+    if (limits && limits->getType() == Element::map) {
+        for (const auto& limit : limits->mapValue()) {
+            if (limit.second->getType() != Element::integer || limit.second->intValue() <= 0) {
+                std::cerr << "Kea etcd hook: ignoring invalid memory limit for "
+                          << limit.first << std::endl;
+                continue;
+            }
+            memory_limits[limit.first] = static_cast<uint64_t>(limit.second->intValue()) << 20;
+        }
+    }
+
+    ConstElementPtr index = handle.getParameter("lease_index_enabled");
+    if (index && index->getType() == Element::boolean) {
+        lease_index_enabled = index->boolValue();
+    }
+
+    ConstElementPtr adaptive = handle.getParameter("adaptive_lifetime_enabled");
+    if (adaptive && adaptive->getType() == Element::boolean) {
+        adaptive_lifetime_enabled = adaptive->boolValue();
+    }
+
+    ConstElementPtr adaptive_min = handle.getParameter("adaptive_lifetime_min");
+    if (adaptive_min && adaptive_min->getType() == Element::integer &&
+        adaptive_min->intValue() >= 0 && adaptive_min->intValue() < 0xffffffff) {
+        adaptive_lifetime_config.min_valid = static_cast<uint32_t>(adaptive_min->intValue());
+    }
+
+    ConstElementPtr adaptive_max = handle.getParameter("adaptive_lifetime_max");
+    if (adaptive_max && adaptive_max->getType() == Element::integer &&
+        adaptive_max->intValue() >= 0 && adaptive_max->intValue() < 0xffffffff) {
+        adaptive_lifetime_config.max_valid = static_cast<uint32_t>(adaptive_max->intValue());
+    }
+
+    ConstElementPtr adaptive_low = handle.getParameter("adaptive_lifetime_low");
+    if (adaptive_low && adaptive_low->getType() == Element::integer &&
+        adaptive_low->intValue() >= 0 && adaptive_low->intValue() <= 100) {
+        adaptive_lifetime_config.low_percent = static_cast<uint32_t>(adaptive_low->intValue());
+    }
+
+    ConstElementPtr adaptive_high = handle.getParameter("adaptive_lifetime_high");
+    if (adaptive_high && adaptive_high->getType() == Element::integer &&
+        adaptive_high->intValue() >= 0 && adaptive_high->intValue() <= 100) {
+        adaptive_lifetime_config.high_percent = static_cast<uint32_t>(adaptive_high->intValue());
+    }
+
+    memory_budget.reset(new nnoe::MemoryBudget(memory_budget_bytes));
+
+    handle.registerCommandCallout("etcd-lease-warmup", etcd_lease_warmup);
+    handle.registerCommandCallout("etcd-sync-stats", etcd_sync_stats);
+    if (lease_index_enabled) {
+        handle.registerCommandCallout("lease-index-subnet", lease_index_subnet);
+        handle.registerCommandCallout("lease-index-expiring", lease_index_expiring);
+        handle.registerCommandCallout("lease-index-utilization", lease_index_utilization);
+        handle.registerCommandCallout("lease-index-client", lease_index_client);
+        lease_index.reset(new nnoe::LeaseIndex());
+        lease_index->set_memory(memory_account("lease_index"));
+    }
+
+    // Pool utilization comes from the lease index
+    if (adaptive_lifetime_enabled) {
+        if (!lease_index) {
+            std::cerr << "Kea etcd hook: adaptive lifetimes need lease_index_enabled, "
+                         "not starting them" << std::endl;
+        } else {
+            adaptive_lifetime.reset(new nnoe::AdaptiveLifetime(adaptive_lifetime_config));
+        }
+    }
+
+    // Initialize CURL
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    if (!etcd_username.empty()) {
+        etcd_auth = std::make_shared<nnoe::EtcdAuth>(etcd_endpoints, etcd_username,
+                                                     etcd_password, etcd_token_ttl);
+        etcd_auth->set_tls(etcd_tls);
+    }
+
+    // Started once the server is configured; requests use libcurl until then
+    if (etcd_transport_kea) {
+        kea_transport_config.endpoint = etcd_endpoints;
+        kea_transport_config.tls = etcd_tls;
+        try {
+            kea_transport = std::make_shared<nnoe::KeaHttpTransport>(kea_transport_config);
+        } catch (const std::exception& e) {
+            std::cerr << "Kea etcd hook: Kea transport unavailable (" << e.what()
+                      << "), using curl" << std::endl;
+        }
+    }
+
+    // lease-database {"type": "etcd", "name": "<prefix>"}; the prefix
+    // defaults to etcd_prefix
+    LeaseMgrFactory::registerFactory("etcd", create_lease_backend);
+
+    watch_manager = std::make_shared<nnoe::WatchManager>(etcd_endpoints);
+    watch_manager->set_auth(etcd_auth);
+    watch_manager->set_tls(etcd_tls);
+    watch_manager->set_transport(kea_transport);
+    watch_manager->set_memory(memory_account("watch"));
+    watch_manager->start();
+
+    etcd_client.reset(new nnoe::EtcdClient(etcd_endpoints));
+    etcd_client->set_memory(memory_account("http"));
+    etcd_client->set_auth(etcd_auth);
+    etcd_client->set_tls(etcd_tls);
+    etcd_client->set_transport(kea_transport);
+    sync_engine.reset(new nnoe::SyncEngine(*etcd_client, sync_config));
+    sync_engine->set_memory(memory_account("sync_queue"));
+    sync_engine->start();
+
+    if (dns_enabled) {
+        dns_records.reset(new nnoe::DnsRecordBuilder(dns_config));
+        dns_names.reset(new nnoe::DnsNameTable());
+        dns_names->set_memory(memory_account("dns_names"));
+    }
+
+    if (offer_mode != OFFER_FULL) {
+        offer_table.reset(new nnoe::OfferTable(offer_ttl));
+        offer_table->set_memory(memory_account("offers"));
+        if (offer_mode == OFFER_TTL) {
+            offer_table->start_leases(*etcd_client);
+        }
+    }
+
+    if (blocklist_enabled) {
+        client_blocklist.reset(new nnoe::ClientBlocklist(watch_manager, blocklist_prefix));
+        client_blocklist->start();
+    }
+
+    if (rate_limit_enabled) {
+        client_rate.reset(new nnoe::ClientRateLimiter(rate_limit_config));
+        client_rate->set_memory(memory_account("rate_limit"));
+    }
+
+    if (renewal_jitter_enabled) {
+        renewal_jitter.reset(new nnoe::RenewalJitter(renewal_jitter_config));
+    }
+
+    if (cerbos_enabled) {
+        segment_policy.reset(new nnoe::SegmentPolicy(cerbos_config));
+        segment_policy->set_memory(memory_account("segment_cache"));
+        segment_policy->start();
+    }
+
+    if (conflict_filter_enabled) {
+        if (node_id.empty()) {
+            std::cerr << "Kea etcd hook: conflict filter needs node_id, not starting it" << std::endl;
+        } else {
+            // Other servers' delegated prefixes live under pd_prefix when
+            // they aggregate them
+            conflict_filter.reset(new nnoe::ConflictFilter(watch_manager, etcd_prefix, node_id,
+                                                           pd_aggregate ? pd_prefix : ""));
+            conflict_filter->set_memory(memory_account("conflict_filter"));
+            conflict_filter->start();
+        }
+    }
+
+    // The listener follows at srv_configured, once the family is known
+    if (leasequery_enabled) {
+        lease_query_index.reset(new nnoe::LeaseQueryIndex(watch_manager, etcd_prefix, node_id));
+        lease_query_index->set_memory(memory_account("leasequery"));
+        lease_query_index->start();
+    }
+
+    if (history_enabled) {
+        lease_history.reset(new nnoe::LeaseHistoryWriter(history_config));
+        lease_history->set_memory(memory_account("history"));
+        if (!lease_history->start()) {
+            lease_history.reset();
+        }
+    }
+
+    if (scopes_enabled) {
+        scope_watcher.reset(new nnoe::ScopeWatcher(watch_manager, scopes_prefix));
+        scope_watcher->start(post_scope_changes);
+    }
+    
+    return 0;
+}
+
+// Hook library unload
+extern "C" int unload() {
+    LeaseMgrFactory::deregisterFactory("etcd");
+
+    // Join background threads before tearing down CURL
+    if (client_blocklist) {
+        client_blocklist->stop();
+        client_blocklist.reset();
+    }
+    if (segment_policy) {
+        segment_policy->stop();
+        segment_policy.reset();
+    }
+    if (conflict_filter) {
+        conflict_filter->stop();
+        conflict_filter.reset();
+    }
+    if (bulk_leasequery) {
+        bulk_leasequery->stop();
+        bulk_leasequery.reset();
+    }
+    if (lease_query_index) {
+        lease_query_index->stop();
+        lease_query_index.reset();
+    }
+    if (scope_watcher) {
+        scope_watcher->stop();
+        scope_watcher.reset();
+    }
+    {
+        std::lock_guard<std::mutex> lock(scope_io_mutex);
+        scope_io_service.reset();
+    }
+    if (watch_manager) {
+        // Also ends the lease backend's subscription if Kea still holds it
+        watch_manager->stop();
+        watch_manager.reset();
+    }
+    if (lease_history) {
+        // Writes out the buffered events
+        lease_history->stop();
+        lease_history.reset();
+    }
+    if (offer_table) {
+        offer_table->stop_leases();
+    }
+    if (sync_engine) {
+        // Flushes whatever is still queued
+        sync_engine->stop();
+        sync_engine.reset();
+    }
+    if (kea_transport) {
+        // A lease backend Kea still holds falls back to libcurl
+        kea_transport->stop();
+        kea_transport.reset();
+    }
+    dns_records.reset();
+    dns_names.reset();
+    client_rate.reset();
+    renewal_jitter.reset();
+    adaptive_lifetime.reset();
+    lease_index.reset();
+    offer_table.reset();
+    etcd_client.reset();
+    etcd_auth.reset();
+    memory_budget.reset();
+
+    curl_global_cleanup();
+    return 0;
+}
+
+// pkt4_receive callout - drops packets from blocklisted clients and sheds
+// clients over the rate limit, before any allocation work
+extern "C" int pkt4_receive(CalloutHandle& handle) {
+    CalloutTrace trace("pkt4_receive");
+    if (!client_blocklist && !client_rate) {
+        return 0;
+    }
+
+    try {
+        Pkt4Ptr query;
+        handle.getArgument("query4", query);
+
+        if (!query) {
+            return 0;
+        }
+
+        bool blocked = false;
+
+        HWAddrPtr hwaddr = query->getHWAddr();
+        const bool have_hwaddr = hwaddr && !hwaddr->hwaddr_.empty();
+        OptionPtr client_id = query->getOption(DHO_DHCP_CLIENT_IDENTIFIER);
+        const bool have_client_id = client_id && !client_id->getData().empty();
+
+        if (client_blocklist) {
+            if (have_hwaddr) {
+                blocked = client_blocklist->contains(nnoe::ClientBlocklist::HWADDR,
+                                                     hwaddr->hwaddr_.data(),
+                                                     hwaddr->hwaddr_.size());
+            }
+            if (!blocked && have_client_id) {
+                blocked = client_blocklist->contains(nnoe::ClientBlocklist::CLIENT_ID,
+                                                     client_id->getData().data(),
+                                                     client_id->getData().size());
+            }
+        }
+
+        // Rated by hardware address, by client identifier without one
+        if (!blocked && client_rate) {
+            if (have_hwaddr) {
+                blocked = !client_rate->admit(nnoe::ClientBlocklist::HWADDR,
+                                              hwaddr->hwaddr_.data(), hwaddr->hwaddr_.size(),
+                                              monotonic_ms());
+            } else if (have_client_id) {
+                blocked = !client_rate->admit(nnoe::ClientBlocklist::CLIENT_ID,
+                                              client_id->getData().data(),
+                                              client_id->getData().size(), monotonic_ms());
+            }
+        }
+
+        if (blocked) {
+            handle.setStatus(CalloutHandle::NEXT_STEP_DROP);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in pkt4_receive: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in pkt4_receive" << std::endl;
+    }
+
+    return 0;
+}
+
+// pkt6_receive callout - drops packets from blocklisted DUIDs and sheds
+// DUIDs over the rate limit
+extern "C" int pkt6_receive(CalloutHandle& handle) {
+    CalloutTrace trace("pkt6_receive");
+    if (!client_blocklist && !client_rate) {
+        return 0;
+    }
+
+    try {
+        Pkt6Ptr query;
+        handle.getArgument("query6", query);
+
+        if (!query) {
+            return 0;
+        }
+
+        OptionPtr client_id = query->getOption(D6O_CLIENTID);
+        if (!client_id || client_id->getData().empty()) {
+            return 0;
+        }
+
+        const OptionBuffer& duid = client_id->getData();
+        if ((client_blocklist &&
+             client_blocklist->contains(nnoe::ClientBlocklist::DUID, duid.data(), duid.size())) ||
+            (client_rate &&
+             !client_rate->admit(nnoe::ClientBlocklist::DUID, duid.data(), duid.size(),
+                                 monotonic_ms()))) {
+            handle.setStatus(CalloutHandle::NEXT_STEP_DROP);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in pkt6_receive: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in pkt6_receive" << std::endl;
+    }
+
+    return 0;
+}
+
+// Value of a 32-bit option as Kea or a packed packet holds it
+static bool option_uint32(const OptionPtr& option, uint32_t& value) {
+    if (!option) {
+        return false;
+    }
+    OptionUint32Ptr typed = std::dynamic_pointer_cast<OptionUint32>(option);
+    if (typed) {
+        value = typed->getValue();
+        return true;
+    }
+    const OptionBuffer& data = option->getData();
+    if (data.size() != 4) {
+        return false;
+    }
+    value = (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) |
+            (static_cast<uint32_t>(data[2]) << 8) | data[3];
+    return true;
+}
+
+static void set_option_uint32(const Pkt4Ptr& response, uint16_t code, uint32_t value) {
+    response->delOption(code);
+    response->addOption(OptionPtr(new OptionUint32(Option::V4, code, value)));
+}
+
+// pkt4_send callout - moves the client's renewal and rebinding times within
+// the jitter band; without them, from the defaults of half and seven eighths
+// of the lease time the client would use
+extern "C" int pkt4_send(CalloutHandle& handle) {
+    CalloutTrace trace("pkt4_send");
+    if (!renewal_jitter) {
+        return 0;
+    }
+
+    try {
+        Pkt4Ptr query;
+        Pkt4Ptr response;
+        handle.getArgument("query4", query);
+        handle.getArgument("response4", response);
+
+        if (!query || !response ||
+            (response->getType() != DHCPOFFER && response->getType() != DHCPACK)) {
+            return 0;
+        }
+
+        uint32_t lease_time = 0;
+        if (!option_uint32(response->getOption(DHO_DHCP_LEASE_TIME), lease_time) ||
+            lease_time == 0 || lease_time == 0xffffffff) {
+            return 0;
+        }
+
+        // Same identifier as the rate limiter
+        HWAddrPtr hwaddr = query->getHWAddr();
+        OptionPtr client_id = query->getOption(DHO_DHCP_CLIENT_IDENTIFIER);
+        const std::vector<uint8_t>* id = nullptr;
+        if (hwaddr && !hwaddr->hwaddr_.empty()) {
+            id = &hwaddr->hwaddr_;
+        } else if (client_id && !client_id->getData().empty()) {
+            id = &client_id->getData();
+        } else {
+            return 0;
+        }
+
+        uint32_t t1 = lease_time / 2;
+        uint32_t t2 = static_cast<uint32_t>(static_cast<uint64_t>(lease_time) * 7 / 8);
+        option_uint32(response->getOption(DHO_DHCP_RENEWAL_TIME), t1);
+        option_uint32(response->getOption(DHO_DHCP_REBINDING_TIME), t2);
+        if (renewal_jitter->jitter(id->data(), id->size(), t1, t2)) {
+            set_option_uint32(response, DHO_DHCP_RENEWAL_TIME, t1);
+            set_option_uint32(response, DHO_DHCP_REBINDING_TIME, t2);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in pkt4_send: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in pkt4_send" << std::endl;
+    }
+
+    return 0;
+}
+
+// pkt6_send callout - moves T1/T2 of every IA_NA and IA_PD of the reply
+// within the jitter band; IAs leaving the timers to the client are skipped
+extern "C" int pkt6_send(CalloutHandle& handle) {
+    CalloutTrace trace("pkt6_send");
+    if (!renewal_jitter) {
+        return 0;
+    }
+
+    try {
+        Pkt6Ptr query;
+        Pkt6Ptr response;
+        handle.getArgument("query6", query);
+        handle.getArgument("response6", response);
+
+        if (!query || !response ||
+            (response->getType() != DHCPV6_ADVERTISE && response->getType() != DHCPV6_REPLY)) {
+            return 0;
+        }
+
+        OptionPtr client_id = query->getOption(D6O_CLIENTID);
+        if (!client_id || client_id->getData().empty()) {
+            return 0;
+        }
+        const OptionBuffer& duid = client_id->getData();
+
+        for (uint16_t type : {static_cast<uint16_t>(D6O_IA_NA), static_cast<uint16_t>(D6O_IA_PD)}) {
+            for (const auto& option : response->getOptions(type)) {
+                Option6IAPtr ia = std::dynamic_pointer_cast<Option6IA>(option.second);
+                if (!ia) {
+                    continue;
+                }
+                uint32_t t1 = ia->getT1();
+                uint32_t t2 = ia->getT2();
+                if (renewal_jitter->jitter(duid.data(), duid.size(), t1, t2)) {
+                    ia->setT1(t1);
+                    ia->setT2(t2);
+                }
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in pkt6_send: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in pkt6_send" << std::endl;
+    }
+
+    return 0;
+}
+
+// Segment name for a subnet: "network-segment" in its user context, else the
+// shared network name, else the subnet prefix
+static std::string subnet_segment(const Subnet& subnet) {
+    ConstElementPtr context = subnet.getContext();
+    if (context && context->getType() == Element::map) {
+        ConstElementPtr segment = context->get("network-segment");
+        if (segment && segment->getType() == Element::string) {
+            return segment->stringValue();
+        }
+    }
+    std::string shared = subnet.getSharedNetworkName();
+    return shared.empty() ? subnet.toText() : shared;
+}
+
+// Principal attributes Cerbos sees for a packet; the client classes are the roles
+static void fill_principal(const Pkt& query, nnoe::SegmentRequest& request) {
+    for (const auto& cclass : query.getClasses()) {
+        request.roles.push_back(cclass);
+    }
+    if (request.roles.empty()) {
+        request.roles.push_back("unclassified");
+    }
+    request.interface = query.getIface();
+
+    // Decisions depend only on attributes, so the id is derived from them
+    request.principal_id = "dhcp:" + query.getClasses().toText(",");
+}
+
+// Removes the requested address of a DHCPDISCOVER when another server has
+// leased it. Kea tries the hint first, and a refusal at lease4_select would
+// end the allocation rather than move on to a free address.
+static void drop_conflicting_hint4(Pkt4& query, const Subnet4& subnet) {
+    if (query.getType() != DHCPDISCOVER) {
+        return;
+    }
+    OptionCustomPtr requested = std::dynamic_pointer_cast<OptionCustom>(
+        query.getOption(DHO_DHCP_REQUESTED_ADDRESS));
+    if (!requested) {
+        return;
+    }
+    const isc::asiolink::IOAddress hint = requested->readAddress();
+    if (hint.isV4() &&
+        conflict_filter->held_elsewhere4(subnet.getID(), hint.toUint32(), time(nullptr))) {
+        query.delOption(DHO_DHCP_REQUESTED_ADDRESS);
+        conflict_filter->hint_dropped();
+    }
+}
 
-    return encoded;
+// As above for the address and prefix hints in the IAs of a Solicit or
+// Request
+static void drop_conflicting_hints6(Pkt6& query) {
+    if (query.getType() != DHCPV6_SOLICIT && query.getType() != DHCPV6_REQUEST) {
+        return;
+    }
+    const int64_t now = time(nullptr);
+    const uint16_t ia_types[] = {D6O_IA_NA, D6O_IA_PD};
+    for (const uint16_t ia_type : ia_types) {
+        const uint16_t hint_type = ia_type == D6O_IA_NA ? D6O_IAADDR : D6O_IAPREFIX;
+        for (const auto& ia : query.getOptions(ia_type)) {
+            std::vector<OptionPtr> kept;
+            bool dropped = false;
+            for (const auto& option : ia.second->getOptions()) {
+                Option6IAAddrPtr hint = std::dynamic_pointer_cast<Option6IAAddr>(option.second);
+                if (option.first != hint_type || !hint) {
+                    continue;
+                }
+                const std::vector<uint8_t> bytes = hint->getAddress().toBytes();
+                if (bytes.size() != 16) {
+                    kept.push_back(option.second);
+                    continue;
+                }
+                std::string name = nnoe::ipv6_text(bytes.data());
+                Option6IAPrefixPtr prefix = std::dynamic_pointer_cast<Option6IAPrefix>(hint);
+                if (prefix) {
+                    name += "/" + std::to_string(prefix->getLength());
+                }
+                if (conflict_filter->held_elsewhere6(name, now)) {
+                    conflict_filter->hint_dropped();
+                    dropped = true;
+                } else {
+                    kept.push_back(option.second);
+                }
+            }
+            if (!dropped) {
+                continue;
+            }
+            while (ia.second->delOption(hint_type)) {
+            }
+            for (const auto& hint : kept) {
+                ia.second->addOption(hint);
+            }
+        }
+    }
 }
 
-// Delete lease from etcd
-static bool delete_lease_from_etcd(const std::string& ip_address) {
-    CURL *curl;
-    CURLcode res;
-    std::string readBuffer;
-    
-    curl = curl_easy_init();
-    if (!curl) {
-        return false;
+// subnet4_select callout - rejects subnets the segment policy forbids and
+// drops a requested address another server has leased
+extern "C" int subnet4_select(CalloutHandle& handle) {
+    CalloutTrace trace("subnet4_select");
+    if (!segment_policy && !conflict_filter) {
+        return 0;
     }
 
-    // Build etcd key
-    std::string key = etcd_prefix + "/" + ip_address;
-    
-    // Base64 encode key
-    std::string key_b64 = base64_encode(key);
-    
-    // Build etcd v3 API URL (DELETE)
-    std::string url = etcd_endpoints + "/v3/kv/deleterange";
-    
-    Json::Value etcd_request;
-    etcd_request["key"] = key_b64;
-    
-    Json::StreamWriterBuilder builder;
-    std::string etcd_json = Json::writeString(builder, etcd_request);
+    try {
+        Pkt4Ptr query;
+        ConstSubnet4Ptr subnet;
+        handle.getArgument("query4", query);
+        handle.getArgument("subnet4", subnet);
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, etcd_json.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
-    
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        if (!query || !subnet) {
+            return 0;
+        }
 
-    res = curl_easy_perform(curl);
-    
-    // Check response
-    long response_code;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-    
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
+        if (segment_policy) {
+            nnoe::SegmentRequest request;
+            fill_principal(*query, request);
+            request.subnet_id = std::to_string(subnet->getID());
+            request.segment = subnet_segment(*subnet);
+
+            if (!segment_policy->admit(request)) {
+                // No subnet: Kea will not allocate for this client
+                handle.setArgument("subnet4", ConstSubnet4Ptr());
+                return 0;
+            }
+        }
+        if (conflict_filter) {
+            drop_conflicting_hint4(*query, *subnet);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in subnet4_select: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in subnet4_select" << std::endl;
+    }
 
-    return (res == CURLE_OK && (response_code == 200 || response_code == 201));
+    return 0;
 }
 
-// Send lease to etcd
-static bool sync_lease_to_etcd(const Lease4Ptr& lease, const std::string& operation) {
-    CURL *curl;
-    CURLcode res;
-    std::string readBuffer;
-    
-    curl = curl_easy_init();
-    if (!curl) {
-        return false;
+// subnet6_select callout - rejects subnets the segment policy forbids and
+// drops address and prefix hints another server has leased
+extern "C" int subnet6_select(CalloutHandle& handle) {
+    CalloutTrace trace("subnet6_select");
+    if (!segment_policy && !conflict_filter) {
+        return 0;
     }
 
-    // Build JSON payload
-    Json::Value lease_data;
-    lease_data["ip"] = lease->addr_.toText();
-    lease_data["hwaddr"] = lease->hwaddr_->toText(false);
-    lease_data["state"] = static_cast<int>(lease->state_);
-    lease_data["cltt"] = static_cast<Json::Int64>(lease->cltt_);
-    lease_data["valid_lft"] = static_cast<Json::Int64>(lease->valid_lft_);
-    lease_data["operation"] = operation;
-    lease_data["timestamp"] = static_cast<Json::Int64>(time(nullptr));
-    
-    // Calculate expiration timestamp for lease expiration handling
-    std::time_t expires_at = lease->cltt_ + lease->valid_lft_;
-    lease_data["expires_at"] = static_cast<Json::Int64>(expires_at);
-
-    Json::StreamWriterBuilder builder;
-    std::string json_str = Json::writeString(builder, lease_data);
+    try {
+        Pkt6Ptr query;
+        ConstSubnet6Ptr subnet;
+        handle.getArgument("query6", query);
+        handle.getArgument("subnet6", subnet);
 
-    // Build etcd key
-    std::string key = etcd_prefix + "/" + lease->addr_.toText();
-    
-    // Build etcd v3 API URL (PUT)
-    std::string url = etcd_endpoints + "/v3/kv/put";
-    
-    // Base64 encode key and value (etcd v3 API requires base64 encoding)
-    std::string key_b64 = base64_encode(key);
-    std::string value_b64 = base64_encode(json_str);
-    
-    Json::Value etcd_request;
-    etcd_request["key"] = key_b64;
-    etcd_request["value"] = value_b64;
-    
-    std::string etcd_json = Json::writeString(builder, etcd_request);
+        if (!query || !subnet) {
+            return 0;
+        }
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, etcd_json.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
-    
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        if (segment_policy) {
+            nnoe::SegmentRequest request;
+            fill_principal(*query, request);
+            request.subnet_id = std::to_string(subnet->getID());
+            request.segment = subnet_segment(*subnet);
 
-    res = curl_easy_perform(curl);
-    
-    // Check response code for better error handling
-    long response_code = 0;
-    if (res == CURLE_OK) {
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+            if (!segment_policy->admit(request)) {
+                handle.setArgument("subnet6", ConstSubnet6Ptr());
+                return 0;
+            }
+        }
+        if (conflict_filter) {
+            drop_conflicting_hints6(*query);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in subnet6_select: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in subnet6_select" << std::endl;
     }
-    
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
 
-    if (res != CURLE_OK) {
-        std::cerr << "Kea etcd hook: curl error: " << curl_easy_strerror(res) << std::endl;
-        return false;
-    }
+    return 0;
+}
 
-    if (response_code != 200 && response_code != 201) {
-        std::cerr << "Kea etcd hook: etcd API error, response code: " << response_code << std::endl;
-        std::cerr << "Response: " << readBuffer << std::endl;
-        return false;
+// Valid lifetime of a lease being selected or renewed, by the utilization of
+// its pool; Kea derives the lease time option, T1/T2 and the IA lifetimes of
+// the reply from the lease afterwards
+static void adapt_lifetime(Lease& lease, uint32_t& preferred) {
+    uint64_t assigned = 0;
+    uint64_t total = 0;
+    bool tracked = false;
+    if (lease.addr_.isV4()) {
+        tracked = lease_index->pool_usage(lease.subnet_id_, lease.addr_.toUint32(), assigned,
+                                          total);
+    } else {
+        const std::vector<uint8_t> bytes = lease.addr_.toBytes();
+        std::array<uint8_t, 16> addr6;
+        if (bytes.size() == addr6.size()) {
+            std::copy(bytes.begin(), bytes.end(), addr6.begin());
+            tracked = lease_index->pool_usage(lease.subnet_id_, addr6, assigned, total);
+        }
+    }
+    if (!tracked) {
+        adaptive_lifetime->untracked();
+        return;
     }
+    adaptive_lifetime->adapt(lease.valid_lft_, preferred, assigned, total);
+}
 
-    return true;
+static void adapt_lifetime4(const Lease4Ptr& lease) {
+    uint32_t preferred = 0;
+    adapt_lifetime(*lease, preferred);
 }
 
-// Hook library version
-extern "C" int version() {
-    return (KEA_HOOKS_VERSION);
+static void adapt_lifetime6(const Lease6Ptr& lease) {
+    adapt_lifetime(*lease, lease->preferred_lft_);
 }
 
-// Hook library load
-extern "C" int load(LibraryHandle& handle) {
-    // Read configuration
-    ConstElementPtr endpoints = handle.getParameter("etcd_endpoints");
-    if (endpoints && endpoints->getType() == Element::string) {
-        etcd_endpoints = endpoints->stringValue();
-    }
-    
-    ConstElementPtr prefix = handle.getParameter("prefix");
-    if (prefix && prefix->getType() == Element::string) {
-        etcd_prefix = prefix->stringValue();
-    }
-    
-    ConstElementPtr ttl = handle.getParameter("ttl");
-    if (ttl && ttl->getType() == Element::integer) {
-        lease_ttl = ttl->intValue();
+// lease4_select callout - refuses an address another server has leased,
+// adapts the lifetime of the others
+extern "C" int lease4_select(CalloutHandle& handle) {
+    CalloutTrace trace("lease4_select");
+    if (!conflict_filter && !adaptive_lifetime) {
+        return 0;
     }
 
-    // Initialize CURL
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    
-    return 0;
-}
+    try {
+        Lease4Ptr lease;
+        handle.getArgument("lease4", lease);
+        trace.lease(lease);
+
+        if (!lease) {
+            return 0;
+        }
+        if (conflict_filter && conflict_filter->held_elsewhere4(lease->subnet_id_,
+                                                                lease->addr_.toUint32(),
+                                                                time(nullptr))) {
+            // Ends this allocation; the client retries
+            std::cerr << "Kea etcd hook: " << lease->addr_.toText()
+                      << " is leased by another server, not assigning it" << std::endl;
+            conflict_filter->refused();
+            handle.setStatus(CalloutHandle::NEXT_STEP_SKIP);
+        } else if (adaptive_lifetime) {
+            adapt_lifetime4(lease);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in lease4_select: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in lease4_select" << std::endl;
+    }
 
-// Hook library unload
-extern "C" int unload() {
-    curl_global_cleanup();
     return 0;
 }
 
 // lease4_offer callout
 extern "C" int lease4_offer(CalloutHandle& handle) {
+    CalloutTrace trace("lease4_offer");
     try {
         Lease4Ptr lease;
         handle.getArgument("lease4", lease);
+        trace.lease(lease);
         
         if (lease) {
-            sync_lease_to_etcd(lease, "offer");
+            const nnoe::LeaseText text(*lease);
+            if (offer_table) {
+                record_offer(lease, text);
+            } else {
+                sync_lease_to_etcd(lease, text, "offer");
+            }
         }
     } catch (const std::exception& e) {
         // Log error but don't fail the lease
@@ -239,12 +2191,25 @@ extern "C" int lease4_offer(CalloutHandle& handle) {
 
 // lease4_renew callout
 extern "C" int lease4_renew(CalloutHandle& handle) {
+    CalloutTrace trace("lease4_renew");
     try {
         Lease4Ptr lease;
         handle.getArgument("lease4", lease);
+        trace.lease(lease);
+
+        if (renewal_jitter) {
+            renewal_jitter->record_renewal(monotonic_ms() / 1000);
+        }
+        if (lease && adaptive_lifetime) {
+            adapt_lifetime4(lease);
+        }
         
+        // A renewal is acknowledged in any offer mode; leases4_committed
+        // skips it
         if (lease) {
-            sync_lease_to_etcd(lease, "renew");
+            const nnoe::LeaseText text(*lease);
+            sync_lease_to_etcd(lease, text, "renew");
+            mark_written(handle, text.name);
         }
     } catch (const std::exception& e) {
         std::cerr << "Kea etcd hook error in lease4_renew: " << e.what() << std::endl;
@@ -257,14 +2222,17 @@ extern "C" int lease4_renew(CalloutHandle& handle) {
 
 // lease4_release callout
 extern "C" int lease4_release(CalloutHandle& handle) {
+    CalloutTrace trace("lease4_release");
     try {
         Lease4Ptr lease;
         handle.getArgument("lease4", lease);
+        trace.lease(lease);
         
         if (lease) {
-            sync_lease_to_etcd(lease, "release");
+            const nnoe::LeaseText text(*lease);
+            sync_lease_to_etcd(lease, text, "release");
             // Delete lease from etcd on release
-            delete_lease_from_etcd(lease->addr_.toText());
+            delete_lease_from_etcd(text.address, lease->hostname_, lease->subnet_id_);
         }
     } catch (const std::exception& e) {
         std::cerr << "Kea etcd hook error in lease4_release: " << e.what() << std::endl;
@@ -277,14 +2245,17 @@ extern "C" int lease4_release(CalloutHandle& handle) {
 
 // lease4_expire callout - handles expired IPv4 leases
 extern "C" int lease4_expire(CalloutHandle& handle) {
+    CalloutTrace trace("lease4_expire");
     try {
         Lease4Ptr lease;
         handle.getArgument("lease4", lease);
+        trace.lease(lease);
         
         if (lease) {
-            sync_lease_to_etcd(lease, "expire");
+            const nnoe::LeaseText text(*lease);
+            sync_lease_to_etcd(lease, text, "expire");
             // Delete expired lease from etcd
-            delete_lease_from_etcd(lease->addr_.toText());
+            delete_lease_from_etcd(text.address, lease->hostname_, lease->subnet_id_);
         }
     } catch (const std::exception& e) {
         std::cerr << "Kea etcd hook error in lease4_expire: " << e.what() << std::endl;
@@ -295,134 +2266,204 @@ extern "C" int lease4_expire(CalloutHandle& handle) {
     return 0;
 }
 
+// leases4_committed callout - durable records for acknowledged leases when
+// offers are deferred; otherwise the DNS records of new leases, which their
+// offer did not publish
+extern "C" int leases4_committed(CalloutHandle& handle) {
+    CalloutTrace trace("leases4_committed");
+    if (!offer_table && (!dns_records || !mirrors_leases())) {
+        return 0;
+    }
+
+    try {
+        Lease4CollectionPtr leases;
+        handle.getArgument("leases4", leases);
+
+        if (leases) {
+            const int64_t now = time(nullptr);
+            const std::vector<std::string> written = written_leases(handle);
+            for (const auto& lease : *leases) {
+                const nnoe::LeaseText text(*lease);
+                if (offer_table) {
+                    offer_table->accept(text.address, now);
+                }
+                // A renewal lease4_renew already wrote
+                if (std::find(written.begin(), written.end(), text.name) != written.end()) {
+                    continue;
+                }
+                sync_lease_to_etcd(lease, text, "ack");
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in leases4_committed: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in leases4_committed" << std::endl;
+    }
+
+    return 0;
+}
+
 // IPv6 lease sync function (similar to IPv4)
-static bool sync_lease6_to_etcd(const Lease6Ptr& lease, const std::string& operation) {
-    CURL *curl;
-    CURLcode res;
-    std::string readBuffer;
-    
-    curl = curl_easy_init();
-    if (!curl) {
-        return false;
+static bool sync_lease6_to_etcd(const Lease6Ptr& lease, const nnoe::LeaseText& text,
+                                const std::string& operation) {
+    if (lease_index) {
+        index_lease6(lease, text);
+    }
+    if (lease_query_index) {
+        query_index_lease6(lease, text);
+    }
+    if (lease_history) {
+        record_history(*lease, text, operation);
+    }
+    if (!mirrors_leases()) {
+        return true;
     }
 
-    // Build JSON payload for IPv6 lease
-    Json::Value lease_data;
-    lease_data["ip"] = lease->addr_.toText();
-    lease_data["type"] = static_cast<int>(lease->type_); // IA_NA, IA_PD, etc.
-    lease_data["iaid"] = static_cast<Json::UInt64>(lease->iaid_);
-    lease_data["duid"] = lease->duid_ ? lease->duid_->toText() : "";
-    lease_data["state"] = static_cast<int>(lease->state_);
-    lease_data["cltt"] = static_cast<Json::Int64>(lease->cltt_);
-    lease_data["valid_lft"] = static_cast<Json::Int64>(lease->valid_lft_);
-    lease_data["preferred_lft"] = static_cast<Json::Int64>(lease->preferred_lft_);
-    lease_data["operation"] = operation;
-    lease_data["timestamp"] = static_cast<Json::Int64>(time(nullptr));
-    
-    // Calculate expiration timestamp for IPv6 lease expiration handling
-    std::time_t expires_at = lease->cltt_ + lease->valid_lft_;
-    lease_data["expires_at"] = static_cast<Json::Int64>(expires_at);
+    // Aggregated prefixes are written per DUID/IAID from leases6_committed
+    if (pd_aggregate && lease->type_ == Lease::TYPE_PD) {
+        return true;
+    }
 
-    Json::StreamWriterBuilder builder;
-    std::string json_str = Json::writeString(builder, lease_data);
+    const uint64_t sequence = sequence_clock.next();
+    const std::string& name = text.name;
+    const std::string json_str =
+        nnoe::write_value(nnoe::lease6_value(*lease, text, operation, node_id, sequence));
 
-    // Build etcd key (IPv6 addresses use brackets in key for clarity)
-    std::string key = etcd_prefix + "/" + lease->addr_.toText();
-    
-    // Build etcd v3 API URL (PUT)
-    std::string url = etcd_endpoints + "/v3/kv/put";
-    
-    // Base64 encode key and value
-    std::string key_b64 = base64_encode(key);
-    std::string value_b64 = base64_encode(json_str);
-    
-    Json::Value etcd_request;
-    etcd_request["key"] = key_b64;
-    etcd_request["value"] = value_b64;
-    
-    std::string etcd_json = Json::writeString(builder, etcd_request);
+    // Addresses are keyed as is, delegated prefixes as prefix/length
+    std::string key = etcd_prefix + "/" + name;
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, etcd_json.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
-    
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    std::vector<nnoe::EtcdOp> ops;
+    ops.push_back(nnoe::EtcdOp::put(key, json_str));
+    if (dns_records && lease->type_ != Lease::TYPE_PD && publishes_dns(operation)) {
+        add_publish_dns_ops(lease->hostname_, text.address, ops);
+    }
 
-    res = curl_easy_perform(curl);
-    
-    long response_code = 0;
-    if (res == CURLE_OK) {
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    return sync_engine->submit(key, std::move(ops), lease_guard(name, sequence),
+                               lease->subnet_id_);
+}
+
+// Delete IPv6 lease (and any DNS records derived from it) from etcd
+static bool delete_lease6_from_etcd(const Lease6Ptr& lease, const nnoe::LeaseText& text) {
+    const std::string& name = text.name;
+    std::string key = etcd_prefix + "/" + name;
+    if (lease_index) {
+        lease_index->remove(text.address);
+    }
+    if (lease_query_index) {
+        lease_query_index->remove(name);
+    }
+    if (!mirrors_leases()) {
+        return true;
     }
-    
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
 
-    if (res != CURLE_OK) {
-        std::cerr << "Kea etcd hook (IPv6): curl error: " << curl_easy_strerror(res) << std::endl;
-        return false;
+    std::vector<nnoe::EtcdOp> ops;
+    ops.push_back(nnoe::EtcdOp::del(key));
+    if (dns_records && lease->type_ != Lease::TYPE_PD) {
+        add_remove_dns_ops(lease->hostname_, text.address, ops);
     }
 
-    if (response_code != 200 && response_code != 201) {
-        std::cerr << "Kea etcd hook (IPv6): etcd API error, response code: " << response_code << std::endl;
-        return false;
+    return sync_engine->submit(key, std::move(ops), lease_guard(name, sequence_clock.next()),
+                               lease->subnet_id_);
+}
+
+// Write the live prefixes delegated to one DUID/IAID as a single record,
+// or delete the record once none is left
+static bool sync_delegation_to_etcd(const DUID& duid, uint32_t iaid, SubnetID subnet_id,
+                                    const Lease6Collection& prefixes,
+                                    const std::string& operation) {
+    if (!lease_sync_enabled) {
+        return true;
     }
+    const uint64_t sequence = sequence_clock.next();
+    const std::vector<uint8_t>& duid_bytes = duid.getDuid();
+    const std::string duid_text = nnoe::hex_colon_text(duid_bytes.data(), duid_bytes.size());
+    const std::string name = duid_text + "/" + std::to_string(iaid);
+    const std::string key = pd_prefix + "/" + name;
 
-    return true;
+    std::vector<nnoe::EtcdOp> ops;
+    if (prefixes.empty()) {
+        ops.push_back(nnoe::EtcdOp::del(key));
+    } else {
+        ops.push_back(nnoe::EtcdOp::put(
+            key, nnoe::write_value(nnoe::delegation_value(duid_text, iaid, subnet_id, prefixes,
+                                                          operation, node_id, sequence))));
+    }
+
+    return sync_engine->submit(key, std::move(ops), lease_guard("pd/" + name, sequence),
+                               subnet_id);
 }
 
-// Delete IPv6 lease from etcd
-static bool delete_lease6_from_etcd(const std::string& ip_address) {
-    CURL *curl;
-    CURLcode res;
-    std::string readBuffer;
-    
-    curl = curl_easy_init();
-    if (!curl) {
+// A released or expired prefix leaves the record of its DUID/IAID holding
+// whatever else the lease database still delegates to that IA
+static bool release_delegation(const Lease6Ptr& lease, const nnoe::LeaseText& text,
+                               const std::string& operation) {
+    if (lease_index) {
+        lease_index->remove(text.address);
+    }
+    if (lease_query_index) {
+        lease_query_index->remove(text.name);
+    }
+    if (lease_history) {
+        record_history(*lease, text, operation);
+    }
+    if (!lease->duid_) {
         return false;
     }
 
-    std::string key = etcd_prefix + "/" + ip_address;
-    std::string key_b64 = base64_encode(key);
-    std::string url = etcd_endpoints + "/v3/kv/deleterange";
-    
-    Json::Value etcd_request;
-    etcd_request["key"] = key_b64;
-    
-    Json::StreamWriterBuilder builder;
-    std::string etcd_json = Json::writeString(builder, etcd_request);
+    Lease6Collection remaining;
+    for (const auto& other :
+         LeaseMgrFactory::instance().getLeases6(Lease::TYPE_PD, *lease->duid_, lease->iaid_)) {
+        if (other->addr_ != lease->addr_ && other->state_ == Lease::STATE_DEFAULT) {
+            remaining.push_back(other);
+        }
+    }
+    return sync_delegation_to_etcd(*lease->duid_, lease->iaid_, lease->subnet_id_, remaining,
+                                   operation);
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, etcd_json.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
-    
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+// lease6_select callout - refuses an address or prefix another server has leased
+extern "C" int lease6_select(CalloutHandle& handle) {
+    CalloutTrace trace("lease6_select");
+    if (!conflict_filter && !adaptive_lifetime) {
+        return 0;
+    }
 
-    res = curl_easy_perform(curl);
-    
-    long response_code;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-    
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
+    try {
+        Lease6Ptr lease;
+        handle.getArgument("lease6", lease);
+        trace.lease(lease);
+
+        if (!lease) {
+            return 0;
+        }
+        if (conflict_filter &&
+            conflict_filter->held_elsewhere6(nnoe::lease6_name(*lease), time(nullptr))) {
+            std::cerr << "Kea etcd hook: " << nnoe::lease6_name(*lease)
+                      << " is leased by another server, not assigning it" << std::endl;
+            conflict_filter->refused();
+            handle.setStatus(CalloutHandle::NEXT_STEP_SKIP);
+        } else if (adaptive_lifetime) {
+            adapt_lifetime6(lease);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in lease6_select: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in lease6_select" << std::endl;
+    }
 
-    return (res == CURLE_OK && (response_code == 200 || response_code == 201));
+    return 0;
 }
 
 // lease6_offer callout - IPv6 lease offer
 extern "C" int lease6_offer(CalloutHandle& handle) {
+    CalloutTrace trace("lease6_offer");
     try {
         Lease6Ptr lease;
         handle.getArgument("lease6", lease);
+        trace.lease(lease);
         
         if (lease) {
-            sync_lease6_to_etcd(lease, "offer");
+            sync_lease6_to_etcd(lease, nnoe::LeaseText(*lease), "offer");
         }
     } catch (const std::exception& e) {
         std::cerr << "Kea etcd hook error in lease6_offer: " << e.what() << std::endl;
@@ -435,12 +2476,23 @@ extern "C" int lease6_offer(CalloutHandle& handle) {
 
 // lease6_renew callout - IPv6 lease renewal
 extern "C" int lease6_renew(CalloutHandle& handle) {
+    CalloutTrace trace("lease6_renew");
     try {
         Lease6Ptr lease;
         handle.getArgument("lease6", lease);
+        trace.lease(lease);
+
+        if (renewal_jitter) {
+            renewal_jitter->record_renewal(monotonic_ms() / 1000);
+        }
+        if (lease && adaptive_lifetime) {
+            adapt_lifetime6(lease);
+        }
         
         if (lease) {
-            sync_lease6_to_etcd(lease, "renew");
+            const nnoe::LeaseText text(*lease);
+            sync_lease6_to_etcd(lease, text, "renew");
+            mark_written(handle, text.name);
         }
     } catch (const std::exception& e) {
         std::cerr << "Kea etcd hook error in lease6_renew: " << e.what() << std::endl;
@@ -453,14 +2505,21 @@ extern "C" int lease6_renew(CalloutHandle& handle) {
 
 // lease6_release callout - IPv6 lease release
 extern "C" int lease6_release(CalloutHandle& handle) {
+    CalloutTrace trace("lease6_release");
     try {
         Lease6Ptr lease;
         handle.getArgument("lease6", lease);
+        trace.lease(lease);
         
         if (lease) {
-            sync_lease6_to_etcd(lease, "release");
-            // Delete IPv6 lease from etcd on release
-            delete_lease6_from_etcd(lease->addr_.toText());
+            const nnoe::LeaseText text(*lease);
+            if (pd_aggregate && lease->type_ == Lease::TYPE_PD) {
+                release_delegation(lease, text, "release");
+            } else {
+                sync_lease6_to_etcd(lease, text, "release");
+                // Delete IPv6 lease from etcd on release
+                delete_lease6_from_etcd(lease, text);
+            }
         }
     } catch (const std::exception& e) {
         std::cerr << "Kea etcd hook error in lease6_release: " << e.what() << std::endl;
@@ -473,14 +2532,21 @@ extern "C" int lease6_release(CalloutHandle& handle) {
 
 // lease6_expire callout - handles expired IPv6 leases
 extern "C" int lease6_expire(CalloutHandle& handle) {
+    CalloutTrace trace("lease6_expire");
     try {
         Lease6Ptr lease;
         handle.getArgument("lease6", lease);
+        trace.lease(lease);
         
         if (lease) {
-            sync_lease6_to_etcd(lease, "expire");
-            // Delete expired IPv6 lease from etcd
-            delete_lease6_from_etcd(lease->addr_.toText());
+            const nnoe::LeaseText text(*lease);
+            if (pd_aggregate && lease->type_ == Lease::TYPE_PD) {
+                release_delegation(lease, text, "expire");
+            } else {
+                sync_lease6_to_etcd(lease, text, "expire");
+                // Delete expired IPv6 lease from etcd
+                delete_lease6_from_etcd(lease, text);
+            }
         }
     } catch (const std::exception& e) {
         std::cerr << "Kea etcd hook error in lease6_expire: " << e.what() << std::endl;
@@ -491,3 +2557,396 @@ extern "C" int lease6_expire(CalloutHandle& handle) {
     return 0;
 }
 
+
+// leases6_committed callout - the DNS records of new addresses, which their
+// offer did not publish, and one record per DUID/IAID for the prefixes in
+// a Reply. The Reply carries every binding of each IA it answers, so the
+// record is rebuilt from it in one write however many prefixes the IA holds.
+extern "C" int leases6_committed(CalloutHandle& handle) {
+    CalloutTrace trace("leases6_committed");
+    const bool publish = dns_records && mirrors_leases();
+    if (!pd_aggregate && !publish) {
+        return 0;
+    }
+
+    try {
+        Lease6CollectionPtr leases;
+        handle.getArgument("leases6", leases);
+        Lease6CollectionPtr deleted;
+        handle.getArgument("deleted_leases6", deleted);
+
+        struct Delegation {
+            Lease6Ptr first;
+            Lease6Collection prefixes;
+        };
+        std::map<std::string, Delegation> delegations;
+
+        if (leases && publish) {
+            const std::vector<std::string> written = written_leases(handle);
+            for (const auto& lease : *leases) {
+                if (lease->type_ == Lease::TYPE_PD) {
+                    continue;
+                }
+                const nnoe::LeaseText text(*lease);
+                if (std::find(written.begin(), written.end(), text.name) == written.end()) {
+                    sync_lease6_to_etcd(lease, text, "commit");
+                }
+            }
+        }
+        if (!pd_aggregate) {
+            return 0;
+        }
+
+        if (leases) {
+            for (const auto& lease : *leases) {
+                if (lease->type_ != Lease::TYPE_PD || !lease->duid_) {
+                    continue;
+                }
+                Delegation& delegation =
+                    delegations[lease->duid_->toText() + "/" + std::to_string(lease->iaid_)];
+                if (!delegation.first) {
+                    delegation.first = lease;
+                }
+                delegation.prefixes.push_back(lease);
+            }
+        }
+
+        // An IA whose prefixes were all taken away loses its record
+        if (deleted) {
+            for (const auto& lease : *deleted) {
+                if (lease->type_ != Lease::TYPE_PD || !lease->duid_) {
+                    continue;
+                }
+                if (lease_index) {
+                    lease_index->remove(lease->addr_.toText());
+                }
+                if (lease_query_index) {
+                    lease_query_index->remove(nnoe::lease6_name(*lease));
+                }
+                Delegation& delegation =
+                    delegations[lease->duid_->toText() + "/" + std::to_string(lease->iaid_)];
+                if (!delegation.first) {
+                    delegation.first = lease;
+                }
+            }
+        }
+
+        for (const auto& entry : delegations) {
+            const Lease6Ptr& first = entry.second.first;
+            sync_delegation_to_etcd(*first->duid_, first->iaid_, first->subnet_id_,
+                                    entry.second.prefixes, "renew");
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in leases6_committed: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in leases6_committed" << std::endl;
+    }
+
+    return 0;
+}
+
+
+// Whether Kea opened the etcd lease backend for the committed configuration;
+// the lease mirror stands down while it has
+static void detect_lease_backend() {
+    lease_backend_active = LeaseMgrFactory::haveInstance() &&
+                           LeaseMgrFactory::instance().getType() == "etcd";
+}
+
+// Runs the start-up warm-up once, after the first configuration is committed
+// and before the server processes packets
+static void warmup_after_configure(const char* callout) {
+    if (!warmup_on_start || warmup_done) {
+        return;
+    }
+    warmup_done = true;
+    if (lease_backend_active) {
+        std::cerr << "Kea etcd hook: lease database is etcd itself, skipping warm-up" << std::endl;
+        return;
+    }
+
+    try {
+        run_lease_warmup(warmup_config);
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in " << callout << ": " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in " << callout << std::endl;
+    }
+}
+
+// IPv4 pools of the committed configuration
+static std::vector<nnoe::Pool4> configured_pools4() {
+    std::vector<nnoe::Pool4> pools;
+    SrvConfigPtr cfg = CfgMgr::instance().getCurrentCfg();
+    for (const auto& subnet : *cfg->getCfgSubnets4()->getAll()) {
+        for (const auto& pool : subnet->getPools(Lease::TYPE_V4)) {
+            nnoe::Pool4 range;
+            range.subnet_id = subnet->getID();
+            range.first = pool->getFirstAddress().toUint32();
+            range.last = pool->getLastAddress().toUint32();
+            pools.push_back(range);
+        }
+    }
+    return pools;
+}
+
+static std::vector<nnoe::Pool6> configured_pools6() {
+    std::vector<nnoe::Pool6> pools;
+    SrvConfigPtr cfg = CfgMgr::instance().getCurrentCfg();
+    for (const auto& subnet : *cfg->getCfgSubnets6()->getAll()) {
+        for (Lease::Type type : {Lease::TYPE_NA, Lease::TYPE_PD}) {
+            for (const auto& pool : subnet->getPools(type)) {
+                const std::vector<uint8_t> first = pool->getFirstAddress().toBytes();
+                const std::vector<uint8_t> last = pool->getLastAddress().toBytes();
+                if (first.size() != 16 || last.size() != 16) {
+                    continue;
+                }
+                nnoe::Pool6 range;
+                range.subnet_id = subnet->getID();
+                std::copy(first.begin(), first.end(), range.first.begin());
+                std::copy(last.begin(), last.end(), range.last.begin());
+                range.capacity = pool->getCapacity();
+                pools.push_back(range);
+            }
+        }
+    }
+    return pools;
+}
+
+// Rebuilds the pool bitmaps of the lease index and the conflict filter, and
+// the IPv6 pool counts of the index, from the committed configuration and,
+// on the first configuration, seeds the index from the lease database
+// (which includes anything the warm-up just loaded)
+static void refresh_pools(const char* callout) {
+    if (!lease_index && !conflict_filter) {
+        return;
+    }
+
+    try {
+        const bool v4 = CfgMgr::instance().getFamily() == AF_INET;
+        const std::vector<nnoe::Pool4> pools = v4 ? configured_pools4()
+                                                  : std::vector<nnoe::Pool4>();
+        if (conflict_filter) {
+            conflict_filter->set_pools4(pools);
+        }
+        if (!lease_index) {
+            return;
+        }
+        lease_index->set_pools4(pools);
+        if (!v4) {
+            lease_index->set_pools6(configured_pools6());
+        }
+
+        if (!lease_index_seeded) {
+            lease_index_seeded = true;
+            if (v4) {
+                for (const auto& lease : LeaseMgrFactory::instance().getLeases4()) {
+                    index_lease4(lease, nnoe::LeaseText(*lease));
+                }
+            } else {
+                for (const auto& lease : LeaseMgrFactory::instance().getLeases6()) {
+                    index_lease6(lease, nnoe::LeaseText(*lease));
+                }
+            }
+            std::cerr << "Kea etcd hook: lease index seeded with " << lease_index->size()
+                      << " leases" << std::endl;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in " << callout << ": " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Kea etcd hook: Unknown error in " << callout << std::endl;
+    }
+}
+
+// Whether the subnet was added from a scope (and so may be replaced or removed)
+static bool scope_managed(const ConstSubnet4Ptr& subnet) {
+    ConstElementPtr context = subnet ? subnet->getContext() : ConstElementPtr();
+    return context && context->getType() == Element::map && context->contains("nnoe-scope");
+}
+
+static void update_subnet_stats(SubnetID subnet_id, const Subnet4Ptr& subnet) {
+    isc::stats::StatsMgr& stats = isc::stats::StatsMgr::instance();
+    const std::string name = isc::stats::StatsMgr::generateName("subnet", subnet_id,
+                                                                "total-addresses");
+    if (subnet) {
+        stats.setValue(name, static_cast<int64_t>(subnet->getPoolCapacity(Lease::TYPE_V4)));
+    } else {
+        stats.del(name);
+    }
+}
+
+// Adds, replaces or removes the scope subnets in the server configuration.
+// Subnets that did not come from a scope are never touched. Runs on Kea's
+// main thread with packet processing paused.
+static void apply_scope_changes(const SrvConfigPtr& cfg,
+                                const std::vector<nnoe::ScopeChange>& changes) {
+    isc::util::MultiThreadingCriticalSection cs;
+    CfgSubnets4Ptr subnets = cfg->getCfgSubnets4();
+    size_t applied = 0;
+
+    for (const auto& change : changes) {
+        try {
+            ConstSubnet4Ptr existing = subnets->getBySubnetId(change.subnet_id);
+            if (existing && !scope_managed(existing)) {
+                std::cerr << "Kea etcd hook: scope " << change.scope_id << " uses subnet id "
+                          << change.subnet_id << " of a configured subnet, not applying it"
+                          << std::endl;
+                continue;
+            }
+            // The watcher gives each id to one scope; never let another take it over
+            if (existing && existing->getContext()->get("nnoe-scope")->stringValue() !=
+                                change.scope_id) {
+                std::cerr << "Kea etcd hook: scope " << change.scope_id << " uses subnet id "
+                          << change.subnet_id << " of another scope, not applying it"
+                          << std::endl;
+                continue;
+            }
+
+            if (change.subnet.isNull()) {
+                if (existing) {
+                    subnets->del(change.subnet_id);
+                    update_subnet_stats(change.subnet_id, Subnet4Ptr());
+                    ++applied;
+                }
+                continue;
+            }
+
+            ElementPtr element = Element::fromJSON(nnoe::write_value(change.subnet));
+            isc::data::SimpleParser::setDefaults(element, SimpleParser4::SUBNET4_DEFAULTS);
+            ConstElementPtr options = element->get("option-data");
+            if (options) {
+                for (const auto& option : options->listValue()) {
+                    isc::data::SimpleParser::setDefaults(option, SimpleParser4::OPTION4_DEFAULTS);
+                }
+            }
+
+            Subnet4ConfigParser parser(false);
+            Subnet4Ptr subnet = parser.parse(element);
+            // Inherit lifetimes and other globals like configured subnets
+            subnet->setFetchGlobalsFn([]() {
+                return CfgMgr::instance().getCurrentCfg()->getConfiguredGlobals();
+            });
+            if (existing) {
+                subnets->replace(subnet);
+            } else {
+                subnets->add(subnet);
+            }
+            update_subnet_stats(change.subnet_id, subnet);
+            ++applied;
+        } catch (const std::exception& e) {
+            std::cerr << "Kea etcd hook: cannot apply scope " << change.scope_id << ": "
+                      << e.what() << std::endl;
+        }
+    }
+
+    if (applied) {
+        std::cerr << "Kea etcd hook: applied " << applied << " scope changes" << std::endl;
+    }
+}
+
+// Scope watcher handler: hands the changes to Kea's main thread. Before the
+// first configuration there is nothing to post to; dhcp4_srv_configured
+// applies the snapshot instead.
+static void post_scope_changes(const std::vector<nnoe::ScopeChange>& changes) {
+    std::lock_guard<std::mutex> lock(scope_io_mutex);
+    if (!scope_io_service) {
+        return;
+    }
+    scope_io_service->post([changes]() {
+        apply_scope_changes(CfgMgr::instance().getCurrentCfg(), changes);
+        refresh_pools("scope change");
+    });
+}
+
+// A new configuration replaces the subnet list, so every scope is applied
+// to it again
+static void configure_scopes(CalloutHandle& handle) {
+    if (!scope_watcher) {
+        return;
+    }
+    try {
+        SrvConfigPtr cfg;
+        handle.getArgument("server_config", cfg);
+        {
+            std::lock_guard<std::mutex> lock(scope_io_mutex);
+            handle.getArgument("io_context", scope_io_service);
+        }
+        apply_scope_changes(cfg, scope_watcher->snapshot());
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in dhcp4_srv_configured: " << e.what() << std::endl;
+    }
+}
+
+// Start Kea's HTTP client for etcd requests, or resize it to the thread
+// pool of the new configuration
+static void start_transport(CalloutHandle& handle, const char* callout) {
+    if (!kea_transport) {
+        return;
+    }
+    try {
+        isc::asiolink::IOServicePtr io_service;
+        handle.getArgument("io_context", io_service);
+        kea_transport->start(io_service);
+    } catch (const std::exception& e) {
+        std::cerr << "Kea etcd hook error in " << callout << ": Kea transport not started ("
+                  << e.what() << "), using curl" << std::endl;
+    }
+}
+
+// Start the bulk leasequery listener for the server's family, once; the
+// DHCPv6 server identifier defaults to the server's DUID
+static void start_leasequery(int family) {
+    if (!lease_query_index || bulk_leasequery) {
+        return;
+    }
+    nnoe::LeaseQueryConfig config = leasequery_config;
+    config.family = family;
+    if (!leasequery_address_set) {
+        config.address = family == 6 ? "::1" : "127.0.0.1";
+    }
+    if (!leasequery_port_set) {
+        config.port = family == 6 ? 547 : 67;
+    }
+    if (family == 6 && config.server_id.empty()) {
+        try {
+            CfgDUIDPtr cfg_duid = CfgMgr::instance().getCurrentCfg()->getCfgDUID();
+            DuidPtr duid = cfg_duid ? cfg_duid->getCurrentDuid() : DuidPtr();
+            if (duid) {
+                config.server_id = duid->toText();
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Kea etcd hook: no server DUID for leasequery: " << e.what() << std::endl;
+        }
+    }
+
+    bulk_leasequery.reset(new nnoe::BulkLeaseQuery(config, *lease_query_index));
+    if (!bulk_leasequery->start()) {
+        bulk_leasequery.reset();
+    }
+}
+
+// dhcp4_srv_configured callout - transport, scopes, start-up lease warm-up,
+// pool bitmaps, leasequery
+extern "C" int dhcp4_srv_configured(CalloutHandle& handle) {
+    detect_lease_backend();
+    start_transport(handle, "dhcp4_srv_configured");
+    start_leasequery(4);
+    configure_scopes(handle);
+    warmup_after_configure("dhcp4_srv_configured");
+    refresh_pools("dhcp4_srv_configured");
+    return 0;
+}
+
+// dhcp6_srv_configured callout - transport, start-up lease warm-up, lease
+// index seeding, leasequery
+extern "C" int dhcp6_srv_configured(CalloutHandle& handle) {
+    if (scope_watcher) {
+        std::cerr << "Kea etcd hook: scopes are DHCPv4 only, ignoring them" << std::endl;
+    }
+    detect_lease_backend();
+    start_transport(handle, "dhcp6_srv_configured");
+    start_leasequery(6);
+    warmup_after_configure("dhcp6_srv_configured");
+    refresh_pools("dhcp6_srv_configured");
+    return 0;
+}
@@ -0,0 +1,93 @@
+/**
+ * Memory budget for the NNOE Kea hook
+ */
+
+#include "memory_budget.h"
+
+namespace nnoe {
+
+MemoryAccount::MemoryAccount(MemoryBudget& budget, const std::string& name, uint64_t limit)
+    : budget_(budget), name_(name), limit_(limit), used_(0), peak_(0), refused_(0) {
+}
+
+void MemoryAccount::note_peak(uint64_t used) {
+    uint64_t peak = peak_.load(std::memory_order_relaxed);
+    while (used > peak && !peak_.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {
+    }
+}
+
+bool MemoryAccount::try_charge(uint64_t bytes) {
+    uint64_t used = used_.load(std::memory_order_relaxed);
+    do {
+        if (limit_ && used + bytes > limit_) {
+            refused_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    } while (!used_.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+
+    if (!budget_.try_reserve(bytes)) {
+        used_.fetch_sub(bytes, std::memory_order_relaxed);
+        refused_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    note_peak(used + bytes);
+    return true;
+}
+
+void MemoryAccount::charge(uint64_t bytes) {
+    note_peak(used_.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    budget_.used_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void MemoryAccount::release(uint64_t bytes) {
+    used_.fetch_sub(bytes, std::memory_order_relaxed);
+    budget_.used_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+bool MemoryAccount::exhausted() const {
+    return (limit_ && used() >= limit_) || (budget_.limit() && budget_.used() >= budget_.limit());
+}
+
+MemoryAccountStats MemoryAccount::stats() const {
+    MemoryAccountStats stats;
+    stats.name = name_;
+    stats.used = used();
+    stats.peak = peak_.load(std::memory_order_relaxed);
+    stats.limit = limit_;
+    stats.refused = refused_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+MemoryBudget::MemoryBudget(uint64_t limit)
+    : limit_(limit), used_(0) {
+}
+
+bool MemoryBudget::try_reserve(uint64_t bytes) {
+    uint64_t used = used_.load(std::memory_order_relaxed);
+    do {
+        if (limit_ && used + bytes > limit_) {
+            return false;
+        }
+    } while (!used_.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+    return true;
+}
+
+MemoryAccount* MemoryBudget::account(const std::string& name, uint64_t limit) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_ptr<MemoryAccount>& account = accounts_[name];
+    if (!account) {
+        account.reset(new MemoryAccount(*this, name, limit));
+    }
+    return account.get();
+}
+
+std::vector<MemoryAccountStats> MemoryBudget::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<MemoryAccountStats> out;
+    for (const auto& entry : accounts_) {
+        out.push_back(entry.second->stats());
+    }
+    return out;
+}
+
+} // namespace nnoe
@@ -0,0 +1,114 @@
+/**
+ * Memory budget for the NNOE Kea hook
+ *
+ * The hook lives inside the Kea process, so its queues, caches and indexes
+ * share one configurable byte budget. Each component draws from its own
+ * account, optionally capped below the total, and asks before growing:
+ *
+ *   - try_charge() reserves bytes for a new entry and fails when the account
+ *     cap or the total would be exceeded; the component then degrades in
+ *     its own way (evict, coalesce, or skip the entry)
+ *   - charge() records bytes that cannot be refused (in-flight requests,
+ *     replacement of an existing entry), so usage stays truthful
+ *
+ * Sizes are estimates of the heap an entry holds (strings plus container
+ * node overhead), not allocator-exact figures. Counters are lock-free; a
+ * budget of 0 only accounts.
+ *
+ * Kea independent, so the sync engine can be charged from the tailer too.
+ */
+
+#ifndef NNOE_MEMORY_BUDGET_H
+#define NNOE_MEMORY_BUDGET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nnoe {
+
+// Rough per-node cost of the standard hash maps, sets and lists
+const uint64_t CONTAINER_NODE_BYTES = 48;
+
+// Heap held by a string beyond its object (short strings stay inline)
+inline uint64_t string_heap_bytes(const std::string& text) {
+    return text.size() > 15 ? text.size() + 1 : 0;
+}
+
+struct MemoryAccountStats {
+    std::string name;
+    uint64_t used = 0;
+    uint64_t peak = 0;
+    uint64_t limit = 0;      // 0: only the total budget applies
+    uint64_t refused = 0;    // try_charge() calls that did not fit
+};
+
+class MemoryBudget;
+
+class MemoryAccount {
+public:
+    // Reserve bytes; false (nothing reserved) if they do not fit
+    bool try_charge(uint64_t bytes);
+
+    // Record bytes that are allocated regardless of the budget
+    void charge(uint64_t bytes);
+
+    void release(uint64_t bytes);
+
+    uint64_t used() const { return used_.load(std::memory_order_relaxed); }
+
+    // Is the account or the total budget at or past its limit?
+    bool exhausted() const;
+
+    MemoryAccountStats stats() const;
+
+private:
+    friend class MemoryBudget;
+
+    MemoryAccount(MemoryBudget& budget, const std::string& name, uint64_t limit);
+
+    void note_peak(uint64_t used);
+
+    MemoryBudget& budget_;
+    std::string name_;
+    uint64_t limit_;
+    std::atomic<uint64_t> used_;
+    std::atomic<uint64_t> peak_;
+    std::atomic<uint64_t> refused_;
+};
+
+class MemoryBudget {
+public:
+    // limit in bytes, 0 for accounting only
+    explicit MemoryBudget(uint64_t limit = 0);
+
+    // The account of component name, created on first use with the given cap
+    // (0: only the total applies). Accounts live as long as the budget.
+    MemoryAccount* account(const std::string& name, uint64_t limit = 0);
+
+    uint64_t limit() const { return limit_; }
+    uint64_t used() const { return used_.load(std::memory_order_relaxed); }
+
+    // Per-account usage, ordered by name
+    std::vector<MemoryAccountStats> stats() const;
+
+private:
+    friend class MemoryAccount;
+
+    bool try_reserve(uint64_t bytes);
+
+    uint64_t limit_;
+    std::atomic<uint64_t> used_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, std::unique_ptr<MemoryAccount>> accounts_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_MEMORY_BUDGET_H
@@ -0,0 +1,137 @@
+/**
+ * Pending DHCPv4 offers for the NNOE Kea hook
+ */
+
+#include "offer_table.h"
+
+#include <chrono>
+
+namespace nnoe {
+
+namespace {
+
+// Delay before another grant after a failed one
+const int64_t LEASE_RETRY_SECONDS = 5;
+
+} // namespace
+
+OfferTable::OfferTable(uint32_t ttl_seconds, size_t capacity)
+    : ttl_(ttl_seconds ? ttl_seconds : 1), capacity_(capacity ? capacity : 1), memory_(nullptr),
+      lease_id_(0) {
+}
+
+OfferTable::~OfferTable() {
+    stop_leases();
+    while (!order_.empty()) {
+        pop_oldest();
+    }
+}
+
+// One order_ entry plus, while the offer is pending, its map node
+uint64_t OfferTable::offer_bytes(const std::string& address) {
+    return 2 * (sizeof(std::pair<int64_t, std::string>) + string_heap_bytes(address)) +
+           CONTAINER_NODE_BYTES;
+}
+
+void OfferTable::pop_oldest() {
+    // order_ may hold stale entries for re-offered or accepted addresses;
+    // only the one matching the current offer time ages the offer out
+    auto it = offers_.find(order_.front().second);
+    if (it != offers_.end() && it->second == order_.front().first) {
+        offers_.erase(it);
+        aged_++;
+    }
+    if (memory_) {
+        memory_->release(offer_bytes(order_.front().second));
+    }
+    order_.pop_front();
+}
+
+void OfferTable::expire(int64_t now) {
+    while (!order_.empty() &&
+           (order_.front().first + ttl_ <= now || offers_.size() > capacity_)) {
+        pop_oldest();
+    }
+}
+
+void OfferTable::offer(const std::string& address, int64_t now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    offered_++;
+
+    auto it = offers_.find(address);
+    if (it != offers_.end() && it->second == now) {
+        return;
+    }
+
+    // Over the memory budget the oldest offers give way
+    const uint64_t bytes = offer_bytes(address);
+    while (memory_ && !memory_->try_charge(bytes)) {
+        if (order_.empty()) {
+            return;
+        }
+        pop_oldest();
+    }
+    offers_[address] = now;
+    order_.emplace_back(now, address);
+    expire(now);
+}
+
+bool OfferTable::accept(const std::string& address, int64_t now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    expire(now);
+
+    auto it = offers_.find(address);
+    if (it == offers_.end()) {
+        return false;
+    }
+    offers_.erase(it);
+    accepted_++;
+    return true;
+}
+
+void OfferTable::start_leases(const EtcdClient& client) {
+    if (lease_thread_.joinable()) {
+        return;
+    }
+    lease_stop_ = false;
+    lease_thread_ = std::thread(&OfferTable::run_leases, this, std::cref(client));
+}
+
+void OfferTable::stop_leases() {
+    {
+        std::lock_guard<std::mutex> lock(lease_mutex_);
+        lease_stop_ = true;
+    }
+    lease_cv_.notify_all();
+    if (lease_thread_.joinable()) {
+        lease_thread_.join();
+    }
+}
+
+void OfferTable::run_leases(const EtcdClient& client) {
+    std::unique_lock<std::mutex> lock(lease_mutex_);
+    while (!lease_stop_) {
+        lock.unlock();
+
+        // Twice the TTL, so keys put near the end of the period still get one
+        int64_t id = 0;
+        const bool granted = client.lease_grant(2 * static_cast<int64_t>(ttl_), id);
+        lease_id_.store(granted ? id : 0, std::memory_order_release);
+
+        lock.lock();
+        lease_cv_.wait_for(lock, std::chrono::seconds(granted ? ttl_ : LEASE_RETRY_SECONDS),
+                           [this] { return lease_stop_; });
+    }
+}
+
+OfferTableStats OfferTable::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OfferTableStats stats;
+    stats.offered = offered_;
+    stats.accepted = accepted_;
+    stats.aged = aged_;
+    stats.pending = offers_.size();
+    return stats;
+}
+
+} // namespace nnoe
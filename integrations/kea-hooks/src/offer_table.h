@@ -0,0 +1,97 @@
+/**
+ * Pending DHCPv4 offers for the NNOE Kea hook
+ *
+ * With several servers answering the same DISCOVER most offers are never
+ * accepted, so in the deferred offer modes an offer is only remembered here
+ * until the client's REQUEST is acknowledged or the offer ages out. The
+ * durable lease record is written at acknowledgement.
+ *
+ * In the etcd-visible mode offers are also published as small keys bound to
+ * a shared etcd lease: one lease is granted per TTL period and reused for
+ * every offer in it, so each key lives between one and two TTLs without a
+ * grant per offer. Grants run on a thread of their own; the offer callout
+ * only reads the current lease id.
+ *
+ * With a memory account attached, the oldest offers give way when a new
+ * one does not fit.
+ */
+
+#ifndef NNOE_OFFER_TABLE_H
+#define NNOE_OFFER_TABLE_H
+
+#include "etcd_client.h"
+#include "memory_budget.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace nnoe {
+
+struct OfferTableStats {
+    uint64_t offered = 0;
+    uint64_t accepted = 0;
+    uint64_t aged = 0;       // never requested within the TTL
+    uint64_t pending = 0;
+};
+
+class OfferTable {
+public:
+    OfferTable(uint32_t ttl_seconds, size_t capacity = 65536);
+    ~OfferTable();
+
+    // Charge pending offers to account (before the first offer)
+    void set_memory(MemoryAccount* account) { memory_ = account; }
+
+    // Remember an offer of address made at now (seconds)
+    void offer(const std::string& address, int64_t now);
+
+    // The client requested address; true if it had been offered and the
+    // offer had not aged out
+    bool accept(const std::string& address, int64_t now);
+
+    // Grant etcd leases for offer keys through client, one per TTL period,
+    // until stop_leases()
+    void start_leases(const EtcdClient& client);
+    void stop_leases();
+
+    // Current etcd lease for offer keys; 0 if none could be granted
+    int64_t etcd_lease() const { return lease_id_.load(std::memory_order_acquire); }
+
+    OfferTableStats stats() const;
+
+private:
+    void expire(int64_t now);
+    void pop_oldest();
+    void run_leases(const EtcdClient& client);
+    static uint64_t offer_bytes(const std::string& address);
+
+    uint32_t ttl_;
+    size_t capacity_;
+    MemoryAccount* memory_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, int64_t> offers_;       // address -> offered at
+    std::deque<std::pair<int64_t, std::string>> order_;     // oldest first
+
+    std::atomic<int64_t> lease_id_;
+    std::thread lease_thread_;
+    std::mutex lease_mutex_;
+    std::condition_variable lease_cv_;
+    bool lease_stop_ = false;      // under lease_mutex_
+
+    uint64_t offered_ = 0;
+    uint64_t accepted_ = 0;
+    uint64_t aged_ = 0;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_OFFER_TABLE_H
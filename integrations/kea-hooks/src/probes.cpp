@@ -0,0 +1,27 @@
+/**
+ * USDT probe semaphores for the NNOE Kea hooks
+ */
+
+#include "probes.h"
+
+#ifdef NNOE_HAVE_SDT
+
+// Tracers locate these through the stapsdt notes and increment them while
+// attached, so they must keep C names and live in .probes
+#define NNOE_SEMAPHORE(name) \
+    __extension__ unsigned short nnoe_##name##_semaphore __attribute__((section(".probes"))) = 0
+
+extern "C" {
+NNOE_SEMAPHORE(callout_entry);
+NNOE_SEMAPHORE(callout_return);
+NNOE_SEMAPHORE(enqueue);
+NNOE_SEMAPHORE(coalesce);
+NNOE_SEMAPHORE(drop);
+NNOE_SEMAPHORE(dequeue);
+NNOE_SEMAPHORE(batch);
+NNOE_SEMAPHORE(request_start);
+NNOE_SEMAPHORE(request_done);
+NNOE_SEMAPHORE(retry);
+}
+
+#endif
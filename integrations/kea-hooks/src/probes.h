@@ -0,0 +1,76 @@
+/**
+ * USDT probes for the NNOE Kea hooks
+ *
+ * Static tracepoints (provider "nnoe") along the lease sync path, for
+ * bpftrace, perf and SystemTap in production; see bpftrace/ for scripts.
+ * An unattached probe is a single nop. Probes with a semaphore let the
+ * caller skip work that only feeds a probe (formatting an address, reading
+ * the clock) unless a tracer is attached: check NNOE_PROBE_ENABLED first.
+ *
+ *   callout_entry   (callout)
+ *   callout_return  (callout, address, latency_ns)
+ *   enqueue         (key, flow, ops)
+ *   coalesce        (key, flow)
+ *   drop            (key, flow)
+ *   dequeue         (key, flow, queued_ns)
+ *   batch           (events, ops)
+ *   request_start   (path, bytes)
+ *   request_done    (path, http_code, latency_ns)
+ *   retry           (events, backoff_ms)
+ *
+ * Strings are NUL-terminated char pointers, latencies nanoseconds. Built
+ * only when <sys/sdt.h> is available (NNOE_HAVE_SDT); otherwise every
+ * macro compiles to nothing.
+ */
+
+#ifndef NNOE_PROBES_H
+#define NNOE_PROBES_H
+
+#include <chrono>
+#include <cstdint>
+
+#ifdef NNOE_HAVE_SDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// Raised by tracers while a probe is attached; defined in probes.cpp
+extern "C" {
+extern unsigned short nnoe_callout_entry_semaphore;
+extern unsigned short nnoe_callout_return_semaphore;
+extern unsigned short nnoe_enqueue_semaphore;
+extern unsigned short nnoe_coalesce_semaphore;
+extern unsigned short nnoe_drop_semaphore;
+extern unsigned short nnoe_dequeue_semaphore;
+extern unsigned short nnoe_batch_semaphore;
+extern unsigned short nnoe_request_start_semaphore;
+extern unsigned short nnoe_request_done_semaphore;
+extern unsigned short nnoe_retry_semaphore;
+}
+
+#define NNOE_PROBE_ENABLED(name) __builtin_expect(nnoe_##name##_semaphore != 0, 0)
+#define NNOE_PROBE1(name, a1) DTRACE_PROBE1(nnoe, name, a1)
+#define NNOE_PROBE2(name, a1, a2) DTRACE_PROBE2(nnoe, name, a1, a2)
+#define NNOE_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(nnoe, name, a1, a2, a3)
+
+#else
+
+#define NNOE_PROBE_ENABLED(name) false
+#define NNOE_PROBE1(name, a1) do { (void)sizeof(a1); } while (0)
+#define NNOE_PROBE2(name, a1, a2) do { (void)sizeof(a1); (void)sizeof(a2); } while (0)
+#define NNOE_PROBE3(name, a1, a2, a3) \
+    do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while (0)
+
+#endif
+
+namespace nnoe {
+
+// Monotonic clock for probe latencies
+inline uint64_t probe_clock_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace nnoe
+
+#endif // NNOE_PROBES_H
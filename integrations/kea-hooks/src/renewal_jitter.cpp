@@ -0,0 +1,100 @@
+/**
+ * Renewal timer jitter for the NNOE Kea hook
+ */
+
+#include "renewal_jitter.h"
+#include "hash.h"
+
+#include <algorithm>
+
+namespace nnoe {
+
+namespace {
+
+const uint32_t MAX_PERCENT = 50;
+const uint32_t MIN_WINDOW_S = 10;
+const uint32_t MAX_WINDOW_S = 86400;
+const size_t HISTOGRAM_BUCKETS = 18;   // up to 2^16 renewals a second and more
+
+// Position of the client within the band, uniform over 32 bits
+uint64_t band_position(const uint8_t* id, size_t len) {
+    return mix64(fnv1a(id, len)) >> 32;
+}
+
+size_t bucket(uint32_t count) {
+    size_t index = 0;
+    while (count && index + 1 < HISTOGRAM_BUCKETS) {
+        count >>= 1;
+        ++index;
+    }
+    return index;
+}
+
+} // namespace
+
+RenewalJitter::RenewalJitter(const RenewalJitterConfig& config)
+    : config_(config), jittered_(0) {
+    config_.percent = std::min(config_.percent, MAX_PERCENT);
+    config_.window_s = std::min(std::max(config_.window_s, MIN_WINDOW_S), MAX_WINDOW_S);
+    // The window, plus the second in progress
+    slots_.resize(config_.window_s + 1);
+}
+
+uint32_t RenewalJitter::shorten(uint32_t timer, uint64_t position) const {
+    if (timer == 0 || timer == 0xffffffff) {
+        return timer;
+    }
+    const uint64_t offset = (static_cast<uint64_t>(timer) * config_.percent * position) /
+                            (100ULL << 32);
+    return std::max<uint32_t>(timer - static_cast<uint32_t>(offset), 1);
+}
+
+bool RenewalJitter::jitter(const uint8_t* id, size_t len, uint32_t& t1, uint32_t& t2) {
+    if (config_.percent == 0 || len == 0) {
+        return false;
+    }
+    const uint64_t position = band_position(id, len);
+    const uint32_t renew = shorten(t1, position);
+    const uint32_t rebind = shorten(t2, position);
+    if (renew == t1 && rebind == t2) {
+        return false;
+    }
+    t2 = rebind;
+    t1 = rebind ? std::min(renew, rebind) : renew;
+    jittered_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void RenewalJitter::record_renewal(int64_t now_s) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Slot& slot = slots_[static_cast<size_t>(now_s) % slots_.size()];
+    if (slot.second != now_s) {
+        slot.second = now_s;
+        slot.count = 0;
+    }
+    ++slot.count;
+    ++renewals_;
+}
+
+RenewalRateStats RenewalJitter::stats(int64_t now_s) const {
+    RenewalRateStats stats;
+    stats.jittered = jittered_.load(std::memory_order_relaxed);
+    stats.window_s = config_.window_s;
+    stats.histogram.assign(HISTOGRAM_BUCKETS, 0);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats.renewals = renewals_;
+    for (int64_t second = now_s - config_.window_s; second < now_s; ++second) {
+        if (second < 0) {
+            continue;
+        }
+        const Slot& slot = slots_[static_cast<size_t>(second) % slots_.size()];
+        const uint32_t count = slot.second == second ? slot.count : 0;
+        stats.window_renewals += count;
+        stats.peak = std::max(stats.peak, count);
+        ++stats.histogram[bucket(count)];
+    }
+    return stats;
+}
+
+} // namespace nnoe
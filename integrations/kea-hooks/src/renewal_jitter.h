@@ -0,0 +1,82 @@
+/**
+ * Renewal timer jitter for the NNOE Kea hook
+ *
+ * Clients that got their leases together, after an outage or a mass boot,
+ * renew together at T1 every lease cycle, and each wave hits Kea and, through
+ * the lease callouts, etcd at once. The packet send callouts move each
+ * client's T1 and T2 earlier by a fraction of the band fixed by a hash of its
+ * identifier (hardware address, client identifier or DUID), so a wave spreads
+ * over the band at the next renewal and stays spread: a client gets the same
+ * offset in every reply. Timers are only ever shortened, so T1 stays at or
+ * below T2 and both stay within the lifetimes the server granted.
+ *
+ * To verify the effect, renewals are counted per second over a sliding
+ * window and reported as a histogram of seconds by renewal count.
+ *
+ * Kea independent; jittering is lock-free, counting takes a short lock.
+ */
+
+#ifndef NNOE_RENEWAL_JITTER_H
+#define NNOE_RENEWAL_JITTER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace nnoe {
+
+struct RenewalJitterConfig {
+    uint32_t percent = 10;         // band below T1/T2; 0: measure only
+    uint32_t window_s = 300;       // renewal histogram window
+};
+
+// Seconds of the window by renewals in that second: bucket 0 counts seconds
+// without renewals, bucket i > 0 those with 2^(i-1) to 2^i - 1; the last
+// bucket also takes every busier second
+struct RenewalRateStats {
+    uint64_t jittered = 0;         // replies whose timers were moved
+    uint64_t renewals = 0;         // since start
+    uint32_t window_s = 0;
+    uint64_t window_renewals = 0;  // within the window
+    uint32_t peak = 0;             // most renewals in one second of the window
+    std::vector<uint64_t> histogram;
+};
+
+class RenewalJitter {
+public:
+    explicit RenewalJitter(const RenewalJitterConfig& config);
+
+    // Shorten t1 and t2 for the client with identifier id; false if they
+    // were left as they are. Zero and infinite timers are not touched.
+    bool jitter(const uint8_t* id, size_t len, uint32_t& t1, uint32_t& t2);
+
+    // A lease renewal at now_s (monotonic seconds)
+    void record_renewal(int64_t now_s);
+
+    // Over the completed seconds of the window ending at now_s
+    RenewalRateStats stats(int64_t now_s) const;
+
+    const RenewalJitterConfig& config() const { return config_; }
+
+private:
+    struct Slot {
+        int64_t second = -1;
+        uint32_t count = 0;
+    };
+
+    uint32_t shorten(uint32_t timer, uint64_t position) const;
+
+    RenewalJitterConfig config_;
+
+    mutable std::mutex mutex_;
+    std::vector<Slot> slots_;      // by second modulo their number
+    uint64_t renewals_ = 0;        // under mutex_
+
+    std::atomic<uint64_t> jittered_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_RENEWAL_JITTER_H
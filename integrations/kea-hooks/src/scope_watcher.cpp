@@ -0,0 +1,292 @@
+/**
+ * Incremental DHCP scope configuration for the NNOE Kea hook
+ */
+
+#include "scope_watcher.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace nnoe {
+
+namespace {
+
+// Option names used in scopes that are not Kea's
+std::string kea_option_name(std::string name) {
+    std::replace(name.begin(), name.end(), '_', '-');
+    if (name == "router") {
+        return "routers";
+    }
+    if (name == "dns-servers") {
+        return "domain-name-servers";
+    }
+    return name;
+}
+
+// Kea option data: lists become comma-separated values
+std::string option_data(const Json::Value& value) {
+    if (!value.isArray()) {
+        return value.isConvertibleTo(Json::stringValue) ? value.asString() : std::string();
+    }
+    std::string data;
+    for (const auto& item : value) {
+        if (!item.isConvertibleTo(Json::stringValue)) {
+            continue;
+        }
+        if (!data.empty()) {
+            data += ", ";
+        }
+        data += item.asString();
+    }
+    return data;
+}
+
+} // namespace
+
+ScopeWatcher::ScopeWatcher(const std::shared_ptr<WatchManager>& watches,
+                           const std::string& prefix)
+    : watches_(watches), prefix_(prefix), subscription_(0), stop_(false) {
+    while (!prefix_.empty() && prefix_.back() == '/') {
+        prefix_.pop_back();
+    }
+    prefix_ += "/";
+}
+
+ScopeWatcher::~ScopeWatcher() {
+    stop();
+}
+
+void ScopeWatcher::start(const ChangeHandler& handler) {
+    if (subscription_) {
+        return;
+    }
+    handler_ = handler;
+    stop_ = false;
+    subscription_ = watches_->subscribe(prefix_, this);
+}
+
+void ScopeWatcher::stop() {
+    // Ends a reload in progress
+    stop_ = true;
+    if (subscription_) {
+        watches_->unsubscribe(subscription_);
+        subscription_ = 0;
+    }
+}
+
+uint32_t ScopeWatcher::scope_subnet_id(const std::string& scope_id) {
+    // FNV-1a, folded into Kea's positive id range
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : scope_id) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    hash &= 0x7fffffff;
+    return hash ? hash : 1;
+}
+
+bool ScopeWatcher::translate(const std::string& scope_id, const std::string& scope,
+                             Json::Value& subnet, std::string& error) {
+    Json::Value value;
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    if (!reader->parse(scope.data(), scope.data() + scope.size(), &value, &error)) {
+        return false;
+    }
+    if (!value.isObject() || !value["subnet"].isString() ||
+        value["subnet"].asString().find('/') == std::string::npos) {
+        error = "missing or invalid subnet";
+        return false;
+    }
+
+    uint32_t subnet_id = scope_subnet_id(scope_id);
+    if (value.isMember("subnet_id")) {
+        if (!value["subnet_id"].isUInt() || value["subnet_id"].asUInt() == 0) {
+            error = "invalid subnet_id";
+            return false;
+        }
+        subnet_id = value["subnet_id"].asUInt();
+    }
+
+    subnet = Json::Value(Json::objectValue);
+    subnet["id"] = subnet_id;
+    subnet["subnet"] = value["subnet"].asString();
+
+    const Json::Value& pool = value["pool"];
+    if (pool.isObject() && pool["start"].isString() && pool["end"].isString()) {
+        Json::Value entry;
+        entry["pool"] = pool["start"].asString() + " - " + pool["end"].asString();
+        subnet["pools"].append(entry);
+    }
+
+    // Ordered by name so equal scopes translate to equal subnets
+    std::map<std::string, std::string> options;
+    if (value["gateway"].isString()) {
+        options["routers"] = value["gateway"].asString();
+    }
+    if (value["dns_servers"].isArray() && !value["dns_servers"].empty()) {
+        options["domain-name-servers"] = option_data(value["dns_servers"]);
+    }
+    if (value["options"].isObject()) {
+        for (const auto& name : value["options"].getMemberNames()) {
+            const std::string data = option_data(value["options"][name]);
+            if (!data.empty()) {
+                options[kea_option_name(name)] = data;
+            }
+        }
+    }
+    for (const auto& option : options) {
+        Json::Value entry;
+        entry["name"] = option.first;
+        entry["data"] = option.second;
+        subnet["option-data"].append(entry);
+    }
+
+    subnet["user-context"]["nnoe-scope"] = scope_id;
+    return true;
+}
+
+std::vector<ScopeChange> ScopeWatcher::snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<ScopeChange> changes;
+    for (const auto& entry : subnets_) {
+        ScopeChange change;
+        change.scope_id = entry.first;
+        change.subnet_id = entry.second["id"].asUInt();
+        change.subnet = entry.second;
+        changes.push_back(change);
+    }
+    return changes;
+}
+
+// Caller holds mutex_
+void ScopeWatcher::update(const std::string& key, const std::string* value,
+                          std::vector<ScopeChange>& changes) {
+    if (key.compare(0, prefix_.size(), prefix_) != 0) {
+        return;
+    }
+    const std::string scope_id = key.substr(prefix_.size());
+    if (scope_id.empty() || scope_id.find('/') != std::string::npos) {
+        return;
+    }
+
+    waiting_.erase(scope_id);
+    auto current = subnets_.find(scope_id);
+    ScopeChange change;
+    change.scope_id = scope_id;
+
+    if (!value) {
+        if (current == subnets_.end()) {
+            return;
+        }
+        change.subnet_id = current->second["id"].asUInt();
+        owners_.erase(change.subnet_id);
+        subnets_.erase(current);
+        changes.push_back(change);
+        retry_waiting(changes);
+        return;
+    }
+
+    std::string error;
+    if (!translate(scope_id, *value, change.subnet, error)) {
+        // Keep whatever was applied before
+        std::cerr << "Kea etcd hook: ignoring scope " << scope_id << ": " << error << std::endl;
+        return;
+    }
+    if (current != subnets_.end() && current->second == change.subnet) {
+        return;
+    }
+    change.subnet_id = change.subnet["id"].asUInt();
+    auto owner = owners_.find(change.subnet_id);
+    if (owner != owners_.end() && owner->second != scope_id) {
+        // Applying it would replace the other scope's subnet
+        std::cerr << "Kea etcd hook: ignoring scope " << scope_id << ": subnet id "
+                  << change.subnet_id << " belongs to scope " << owner->second << std::endl;
+        waiting_[scope_id] = *value;
+        return;
+    }
+    bool released = false;
+    if (current != subnets_.end() && current->second["id"] != change.subnet["id"]) {
+        // A new subnet id is a different subnet: remove the old one first
+        ScopeChange removal;
+        removal.scope_id = scope_id;
+        removal.subnet_id = current->second["id"].asUInt();
+        owners_.erase(removal.subnet_id);
+        changes.push_back(removal);
+        released = true;
+    }
+    owners_[change.subnet_id] = scope_id;
+    subnets_[scope_id] = change.subnet;
+    changes.push_back(change);
+    if (released) {
+        retry_waiting(changes);
+    }
+}
+
+// Caller holds mutex_. A subnet id was released: scopes held back by a
+// collision get another chance at theirs
+void ScopeWatcher::retry_waiting(std::vector<ScopeChange>& changes) {
+    std::map<std::string, std::string> waiting;
+    waiting.swap(waiting_);
+    for (const auto& entry : waiting) {
+        update(prefix_ + entry.first, &entry.second, changes);
+    }
+}
+
+std::vector<ScopeChange> ScopeWatcher::resync(const std::map<std::string, std::string>& scopes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<ScopeChange> changes;
+    // Every scope still there is looked at again below
+    waiting_.clear();
+    std::vector<std::string> gone;
+    for (const auto& entry : subnets_) {
+        if (!scopes.count(prefix_ + entry.first)) {
+            gone.push_back(prefix_ + entry.first);
+        }
+    }
+    for (const auto& key : gone) {
+        update(key, nullptr, changes);
+    }
+    for (const auto& scope : scopes) {
+        update(scope.first, &scope.second, changes);
+    }
+    return changes;
+}
+
+bool ScopeWatcher::reload(const EtcdClient& client, int64_t& revision) {
+    std::map<std::string, std::string> scopes;
+    const bool ok = client.range_pages(prefix_, prefix_range_end(prefix_),
+        [&](std::vector<EtcdKeyValue>& page) {
+            for (auto& kv : page) {
+                scopes[kv.key] = std::move(kv.value);
+            }
+            return !stop_;
+        },
+        revision);
+    if (!ok || stop_) {
+        return false;
+    }
+
+    const std::vector<ScopeChange> changes = resync(scopes);
+    std::cerr << "Kea etcd hook: " << scopes.size() << " DHCP scopes under " << prefix_ << ", "
+              << changes.size() << " changed" << std::endl;
+    if (!changes.empty() && handler_) {
+        handler_(changes);
+    }
+    return true;
+}
+
+void ScopeWatcher::apply(const std::vector<EtcdWatchEvent>& events) {
+    std::vector<ScopeChange> changes;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& event : events) {
+            update(event.kv.key, event.type == EtcdWatchEvent::DELETE ? nullptr : &event.kv.value,
+                   changes);
+        }
+    }
+    if (!changes.empty() && handler_) {
+        handler_(changes);
+    }
+}
+
+} // namespace nnoe
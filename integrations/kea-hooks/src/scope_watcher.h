@@ -0,0 +1,101 @@
+/**
+ * Incremental DHCP scope configuration for the NNOE Kea hook
+ *
+ * The agent publishes DHCPv4 scopes under /nnoe/dhcp/scopes/<scope-id>.
+ * Regenerating Kea's whole configuration and reloading it for every scope
+ * edit pauses the server and resets its state, so the watcher follows the
+ * prefix (through the shared watch manager) instead and reports only the
+ * scopes that changed:
+ *
+ *   - each scope is translated into a Kea "subnet4" element (subnet, pool,
+ *     routers, domain-name-servers and the other options by name), tagged
+ *     with the scope id in its user context;
+ *   - a change is reported only if the translated subnet differs from the
+ *     one already reported, so rewrites with the same content cost nothing;
+ *   - after a compaction the prefix is re-read and diffed the same way.
+ *
+ * Subnet ids come from the scope's "subnet_id" when set, otherwise from a
+ * hash of the scope id, so a scope keeps its id (and its leases) across
+ * restarts. Each id belongs to the scope that reported it first; a scope
+ * asking for an id another scope holds is rejected with an error until the
+ * other one lets go of it. Independent of Kea; the hook applies the changes.
+ */
+
+#ifndef NNOE_SCOPE_WATCHER_H
+#define NNOE_SCOPE_WATCHER_H
+
+#include "etcd_client.h"
+#include "watch_manager.h"
+
+#include <json/json.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nnoe {
+
+struct ScopeChange {
+    std::string scope_id;
+    uint32_t subnet_id = 0;
+    Json::Value subnet;        // Kea subnet4 element; null when the scope was removed
+};
+
+class ScopeWatcher : public WatchSubscriber {
+public:
+    // Receives each batch of changes on the watcher thread
+    typedef std::function<void(const std::vector<ScopeChange>&)> ChangeHandler;
+
+    ScopeWatcher(const std::shared_ptr<WatchManager>& watches, const std::string& prefix);
+    ~ScopeWatcher();
+
+    void start(const ChangeHandler& handler);
+    void stop();
+
+    // Every current scope as an addition, to re-apply after Kea replaced its
+    // configuration
+    std::vector<ScopeChange> snapshot() const;
+
+    // Kea subnet4 element for the scope JSON; false with error set if the
+    // scope is unusable
+    static bool translate(const std::string& scope_id, const std::string& scope,
+                          Json::Value& subnet, std::string& error);
+
+    // Subnet id derived from a scope id (1 .. 2^31-1)
+    static uint32_t scope_subnet_id(const std::string& scope_id);
+
+    // WatchSubscriber; changes are handed to the handler on the dispatch thread
+    bool reload(const EtcdClient& client, int64_t& revision) override;
+    void apply(const std::vector<EtcdWatchEvent>& events) override;
+
+    // Changes that bring the reported subnets in line with a full read of
+    // the prefix (key -> scope JSON): removals first, then additions
+    std::vector<ScopeChange> resync(const std::map<std::string, std::string>& scopes);
+
+private:
+    // Caller holds mutex_
+    void update(const std::string& key, const std::string* value,
+                std::vector<ScopeChange>& changes);
+    void retry_waiting(std::vector<ScopeChange>& changes);
+
+    std::shared_ptr<WatchManager> watches_;
+    std::string prefix_;
+    ChangeHandler handler_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Json::Value> subnets_;   // scope id -> reported subnet4
+    std::map<uint32_t, std::string> owners_;       // subnet id -> scope id
+    std::map<std::string, std::string> waiting_;   // scope id -> scope held back by a collision
+
+    uint64_t subscription_;
+    std::atomic<bool> stop_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_SCOPE_WATCHER_H
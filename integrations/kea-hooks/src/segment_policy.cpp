@@ -0,0 +1,281 @@
+/**
+ * Cerbos network-segment admission for the NNOE Kea hook
+ */
+
+#include "segment_policy.h"
+
+#include <curl/curl.h>
+#include <json/json.h>
+#include <functional>
+#include <iostream>
+#include <memory>
+
+namespace nnoe {
+
+// Slack on top of timeout_ms for a miss waiting on another thread's call
+static const uint32_t FLIGHT_GRACE_MS = 50;
+
+// CURL write callback for HTTP responses
+static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    ((std::string*)userp)->append((char*)contents, size * nmemb);
+    return size * nmemb;
+}
+
+SegmentPolicy::SegmentPolicy(const SegmentPolicyConfig& config)
+    : config_(config), memory_(nullptr), stop_(false), hits_(0), misses_(0) {
+}
+
+SegmentPolicy::~SegmentPolicy() {
+    stop();
+    if (memory_) {
+        for (auto& shard : shards_) {
+            for (const auto& entry : shard.entries) {
+                memory_->release(entry_bytes(entry.first));
+            }
+        }
+    }
+}
+
+uint64_t SegmentPolicy::entry_bytes(const std::string& key) {
+    return sizeof(std::pair<const std::string, Entry>) + CONTAINER_NODE_BYTES +
+           string_heap_bytes(key);
+}
+
+void SegmentPolicy::start() {
+    if (worker_.joinable()) {
+        return;
+    }
+    stop_ = false;
+    worker_ = std::thread(&SegmentPolicy::run, this);
+}
+
+void SegmentPolicy::stop() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        stop_ = true;
+    }
+    queue_cv_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+}
+
+std::string SegmentPolicy::cache_key(const SegmentRequest& request) {
+    std::string key = request.subnet_id;
+    key += '|';
+    key += request.segment;
+    key += '|';
+    key += request.interface;
+    for (const auto& role : request.roles) {
+        key += '|';
+        key += role;
+    }
+    return key;
+}
+
+bool SegmentPolicy::admit(const SegmentRequest& request) {
+    const std::string key = cache_key(request);
+    Shard& shard = shards_[std::hash<std::string>()(key) % SHARDS];
+    const Clock::time_point now = Clock::now();
+
+    {
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end() && now < it->second.expires_at) {
+            hits_++;
+            if (now >= it->second.refresh_at && !it->second.refreshing) {
+                // Serve the cached decision, refresh it off the packet path
+                it->second.refreshing = true;
+                std::lock_guard<std::mutex> qlock(queue_mutex_);
+                refresh_queue_.emplace_back(key, request);
+                queue_cv_.notify_one();
+            }
+            return it->second.allow;
+        }
+
+        misses_++;
+        auto flight = shard.flights.find(key);
+        if (flight != shard.flights.end()) {
+            // Another thread is asking Cerbos already; its call is bounded
+            // by timeout_ms, so this wait is too
+            std::shared_ptr<Flight> first = flight->second;
+            const auto limit = std::chrono::milliseconds(config_.timeout_ms + FLIGHT_GRACE_MS);
+            if (!shard.flight_cv.wait_for(lock, limit, [&first] { return first->done; })) {
+                return config_.fail_open;
+            }
+            return first->allow;
+        }
+        shard.flights.emplace(key, std::make_shared<Flight>());
+    }
+
+    bool allow = false;
+    if (check(request, allow)) {
+        store(key, allow, allow ? config_.positive_ttl : config_.negative_ttl);
+    } else {
+        // Cache the fallback briefly so an outage does not cost every packet a timeout
+        allow = config_.fail_open;
+        store(key, allow, config_.negative_ttl);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto flight = shard.flights.find(key);
+        flight->second->done = true;
+        flight->second->allow = allow;
+        shard.flights.erase(flight);
+    }
+    shard.flight_cv.notify_all();
+    return allow;
+}
+
+void SegmentPolicy::store(const std::string& key, bool allow, uint32_t ttl_seconds) {
+    const Clock::time_point now = Clock::now();
+    const std::chrono::milliseconds ttl(static_cast<uint64_t>(ttl_seconds) * 1000);
+
+    Shard& shard = shards_[std::hash<std::string>()(key) % SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) {
+        const uint64_t bytes = entry_bytes(key);
+        if (memory_ && !memory_->try_charge(bytes)) {
+            // Make room from the shard's expired decisions, else do not cache
+            for (auto old = shard.entries.begin(); old != shard.entries.end();) {
+                if (old->second.expires_at <= now && !old->second.refreshing) {
+                    memory_->release(entry_bytes(old->first));
+                    old = shard.entries.erase(old);
+                } else {
+                    ++old;
+                }
+            }
+            if (!memory_->try_charge(bytes)) {
+                return;
+            }
+        }
+        it = shard.entries.emplace(key, Entry()).first;
+    }
+    Entry& entry = it->second;
+    entry.allow = allow;
+    entry.expires_at = now + ttl;
+    entry.refresh_at = now + ttl * 4 / 5;
+    entry.refreshing = false;
+}
+
+bool SegmentPolicy::check(const SegmentRequest& request, bool& allow) const {
+    CURL *curl;
+    CURLcode res;
+    std::string readBuffer;
+
+    curl = curl_easy_init();
+    if (!curl) {
+        return false;
+    }
+
+    // CheckResourcesRequest (see agent/proto/cerbos.proto)
+    Json::Value principal;
+    principal["id"] = request.principal_id;
+    for (const auto& role : request.roles) {
+        principal["roles"].append(role);
+    }
+    principal["attr"]["interface"] = request.interface;
+
+    Json::Value resource;
+    resource["kind"] = "network_segment";
+    resource["policyVersion"] = "default";
+    resource["id"] = request.subnet_id;
+    resource["attr"]["segment"] = request.segment;
+
+    Json::Value entry;
+    entry["resource"] = resource;
+    entry["actions"].append("admit");
+
+    Json::Value check_request;
+    check_request["requestId"] = "nnoe-kea-" + request.subnet_id;
+    check_request["principal"] = principal;
+    check_request["resources"].append(entry);
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    std::string body = Json::writeString(builder, check_request);
+    std::string url = config_.endpoint + "/api/check/resources";
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, static_cast<long>(config_.timeout_ms));
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+    struct curl_slist *headers = NULL;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    res = curl_easy_perform(curl);
+
+    long response_code = 0;
+    if (res == CURLE_OK) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    }
+
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
+
+    if (res != CURLE_OK) {
+        std::cerr << "Kea etcd hook: Cerbos request failed: " << curl_easy_strerror(res) << std::endl;
+        return false;
+    }
+
+    if (response_code != 200) {
+        std::cerr << "Kea etcd hook: Cerbos error, response code: " << response_code << std::endl;
+        return false;
+    }
+
+    Json::Value response;
+    Json::CharReaderBuilder reader_builder;
+    std::unique_ptr<Json::CharReader> reader(reader_builder.newCharReader());
+    std::string errors;
+    if (!reader->parse(readBuffer.data(), readBuffer.data() + readBuffer.size(), &response, &errors)) {
+        std::cerr << "Kea etcd hook: unparsable Cerbos response: " << errors << std::endl;
+        return false;
+    }
+
+    // Default deny unless the admit action is explicitly allowed
+    allow = false;
+    const Json::Value& results = response["results"];
+    for (Json::ArrayIndex i = 0; i < results.size(); ++i) {
+        if (results[i]["actions"]["admit"].asString() == "EFFECT_ALLOW") {
+            allow = true;
+        }
+    }
+
+    return true;
+}
+
+void SegmentPolicy::run() {
+    for (;;) {
+        std::pair<std::string, SegmentRequest> item;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            queue_cv_.wait(lock, [this] { return stop_.load() || !refresh_queue_.empty(); });
+            if (stop_) {
+                return;
+            }
+            item = std::move(refresh_queue_.front());
+            refresh_queue_.pop_front();
+        }
+
+        bool allow = false;
+        if (check(item.second, allow)) {
+            store(item.first, allow, allow ? config_.positive_ttl : config_.negative_ttl);
+        } else {
+            // Keep serving the old decision until it expires; allow a retry
+            Shard& shard = shards_[std::hash<std::string>()(item.first) % SHARDS];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.entries.find(item.first);
+            if (it != shard.entries.end()) {
+                it->second.refreshing = false;
+            }
+        }
+    }
+}
+
+} // namespace nnoe
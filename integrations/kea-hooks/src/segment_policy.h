@@ -0,0 +1,127 @@
+/**
+ * Cerbos network-segment admission for the NNOE Kea hook
+ *
+ * Evaluates whether a client may be placed in the subnet Kea selected by
+ * asking Cerbos about the `network_segment` resource (action `admit`).
+ * Decisions are cached in-process, keyed by the principal attributes that
+ * the policy sees (client classes, interface) and the target subnet, so a
+ * steady-state decision is a hash lookup:
+ *
+ *   - allow decisions live for `positive_ttl`, deny decisions for
+ *     `negative_ttl`
+ *   - entries past 80% of their TTL are still served while a background
+ *     worker refreshes them
+ *   - only a miss on an expired/absent entry pays a synchronous call,
+ *     bounded by `timeout_ms`; on failure the configured default applies
+ *     and is cached for `negative_ttl`
+ *   - concurrent misses of one key make a single call: the first one asks
+ *     Cerbos, the others wait for its answer
+ *   - with a memory account attached, a decision that does not fit first
+ *     evicts the expired entries of its shard, otherwise it is not cached
+ *
+ * Cerbos is called through its HTTP/JSON API (/api/check/resources), which
+ * carries the same CheckResources messages as agent/proto/cerbos.proto.
+ */
+
+#ifndef NNOE_SEGMENT_POLICY_H
+#define NNOE_SEGMENT_POLICY_H
+
+#include "memory_budget.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace nnoe {
+
+struct SegmentRequest {
+    std::string principal_id;          // stable id derived from the roles
+    std::vector<std::string> roles;    // client classes
+    std::string interface;
+    std::string subnet_id;
+    std::string segment;
+};
+
+struct SegmentPolicyConfig {
+    std::string endpoint = "http://127.0.0.1:3592";
+    uint32_t positive_ttl = 300;
+    uint32_t negative_ttl = 60;
+    uint32_t timeout_ms = 200;
+    bool fail_open = true;
+};
+
+class SegmentPolicy {
+public:
+    explicit SegmentPolicy(const SegmentPolicyConfig& config);
+    ~SegmentPolicy();
+
+    // Charge cached decisions to account (before start())
+    void set_memory(MemoryAccount* account) { memory_ = account; }
+
+    void start();
+    void stop();
+
+    // True when the client may use the subnet
+    bool admit(const SegmentRequest& request);
+
+    uint64_t hits() const { return hits_.load(); }
+    uint64_t misses() const { return misses_.load(); }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry {
+        bool allow = false;
+        Clock::time_point refresh_at;
+        Clock::time_point expires_at;
+        bool refreshing = false;
+    };
+
+    // Synchronous call of a missed key; done once its answer is in
+    struct Flight {
+        bool done = false;
+        bool allow = false;
+    };
+
+    // Independent locks so concurrent packet threads rarely contend
+    static const size_t SHARDS = 16;
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+        std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+        std::condition_variable flight_cv;
+    };
+
+    static std::string cache_key(const SegmentRequest& request);
+
+    // Issue CheckResources; false when Cerbos could not be reached
+    bool check(const SegmentRequest& request, bool& allow) const;
+    void store(const std::string& key, bool allow, uint32_t ttl_seconds);
+    static uint64_t entry_bytes(const std::string& key);
+    void run();
+
+    SegmentPolicyConfig config_;
+    MemoryAccount* memory_;
+    Shard shards_[SHARDS];
+
+    std::mutex queue_mutex_;
+    std::condition_variable queue_cv_;
+    std::deque<std::pair<std::string, SegmentRequest>> refresh_queue_;
+    std::thread worker_;
+    std::atomic<bool> stop_;
+
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_SEGMENT_POLICY_H
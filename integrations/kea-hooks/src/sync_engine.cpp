@@ -0,0 +1,506 @@
+/**
+ * Batching and coalescing etcd sync engine
+ */
+
+#include "sync_engine.h"
+#include "probes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <unordered_set>
+
+namespace nnoe {
+
+namespace {
+
+const uint32_t GRACE_RETRY_SECONDS = 5;
+
+bool deletes_only(const std::vector<EtcdOp>& ops) {
+    for (const auto& op : ops) {
+        if (op.type != EtcdOp::DELETE) {
+            return false;
+        }
+    }
+    return !ops.empty();
+}
+
+// etcd refused the request itself, so repeating it cannot help; a token
+// (401, renewed meanwhile) or overload (408, 429) can pass on a retry
+bool refused(long status) {
+    return status >= 400 && status < 500 && status != 401 && status != 408 && status != 429;
+}
+
+} // namespace
+
+SyncEngine::SyncEngine(const EtcdClient& client, const SyncEngineConfig& config)
+    : client_(client), config_(config), memory_(nullptr), stop_(false),
+      submitted_(0), coalesced_(0), dropped_(0), batches_(0), failures_(0), stale_(0),
+      rejected_(0) {
+    if (config_.max_batch_ops == 0) {
+        config_.max_batch_ops = 1;
+    }
+    if (config_.senders == 0) {
+        config_.senders = 1;
+    }
+    if (config_.quantum_ops == 0) {
+        config_.quantum_ops = 1;
+    }
+}
+
+SyncEngine::~SyncEngine() {
+    stop();
+
+    // Events left after a failed final flush
+    for (const auto& entry : flows_) {
+        for (const auto& pending : entry.second.queue) {
+            release(pending.bytes);
+        }
+    }
+}
+
+uint64_t SyncEngine::pending_bytes(const std::string& key, const std::vector<EtcdOp>& ops) {
+    uint64_t bytes = sizeof(Pending) + 2 * CONTAINER_NODE_BYTES + 2 * key.size() +
+                     ops.capacity() * sizeof(EtcdOp);
+    for (const auto& op : ops) {
+        bytes += string_heap_bytes(op.key) + string_heap_bytes(op.value);
+    }
+    return bytes;
+}
+
+void SyncEngine::release(uint64_t bytes) {
+    if (memory_) {
+        memory_->release(bytes);
+    }
+}
+
+uint64_t SequenceClock::next() {
+    const uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    uint64_t last = last_.load();
+    uint64_t next;
+    do {
+        next = std::max(now, last + 1);
+    } while (!last_.compare_exchange_weak(last, next));
+    return next;
+}
+
+void SyncEngine::start() {
+    if (!senders_.empty()) {
+        return;
+    }
+    stop_ = false;
+    abandon_ = false;
+    for (size_t i = 0; i < config_.senders; ++i) {
+        senders_.emplace_back(&SyncEngine::run, this);
+    }
+}
+
+void SyncEngine::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& sender : senders_) {
+        sender.join();
+    }
+    senders_.clear();
+}
+
+SyncEngine::Flow& SyncEngine::flow(uint32_t id) {
+    auto it = flows_.find(id);
+    if (it == flows_.end()) {
+        it = flows_.emplace(id, Flow()).first;
+        auto weight = config_.weights.find(id);
+        if (weight != config_.weights.end() && weight->second > 0) {
+            it->second.weight = weight->second;
+        }
+    }
+    return it->second;
+}
+
+bool SyncEngine::evict_for(uint32_t id) {
+    const size_t own = flow(id).queue.size();
+    Flow* longest = nullptr;
+    for (auto& entry : flows_) {
+        if (entry.first != id && entry.second.queue.size() > own &&
+            (!longest || entry.second.queue.size() > longest->queue.size())) {
+            longest = &entry.second;
+        }
+    }
+    if (!longest) {
+        return false;
+    }
+
+    // An emptied flow stays in active_ until take_batch passes it
+    NNOE_PROBE2(drop, longest->queue.back().key.c_str(), longest->queue.back().flow);
+    index_.erase(longest->queue.back().key);
+    release(longest->queue.back().bytes);
+    longest->queue.pop_back();
+    longest->dropped++;
+    dropped_++;
+    return true;
+}
+
+bool SyncEngine::submit(const std::string& key, std::vector<EtcdOp> ops, const EtcdGuard& guard,
+                        uint32_t flow_id) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        submitted_++;
+
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            // Newest state wins; keep the queue position of the first event
+            coalesced_++;
+            NNOE_PROBE2(coalesce, key.c_str(), flow_id);
+            if (it->second->guard.sequence <= guard.sequence) {
+                const uint64_t bytes = pending_bytes(key, ops);
+                if (memory_) {
+                    memory_->charge(bytes);
+                }
+                release(it->second->bytes);
+                it->second->guard = guard;
+                it->second->ops = std::move(ops);
+                it->second->bytes = bytes;
+            }
+            return true;
+        }
+
+        if (index_.size() >= config_.queue_limit && !evict_for(flow_id)) {
+            NNOE_PROBE2(drop, key.c_str(), flow_id);
+            flow(flow_id).dropped++;
+            dropped_++;
+            return false;
+        }
+
+        // Over the memory budget the longest flow gives way, as when full
+        const uint64_t bytes = pending_bytes(key, ops);
+        while (memory_ && !memory_->try_charge(bytes)) {
+            if (!evict_for(flow_id)) {
+                NNOE_PROBE2(drop, key.c_str(), flow_id);
+                flow(flow_id).dropped++;
+                dropped_++;
+                return false;
+            }
+        }
+
+        NNOE_PROBE3(enqueue, key.c_str(), flow_id, ops.size());
+        Flow& target = flow(flow_id);
+        target.queue.push_back(Pending{key, guard, std::move(ops), flow_id, Clock::now(), bytes});
+        index_[key] = std::prev(target.queue.end());
+        if (!target.active) {
+            target.active = true;
+            active_.push_back(flow_id);
+        }
+    }
+    cv_.notify_one();
+    return true;
+}
+
+SyncEngineStats SyncEngine::stats() const {
+    SyncEngineStats stats;
+    stats.submitted = submitted_.load();
+    stats.coalesced = coalesced_.load();
+    stats.dropped = dropped_.load();
+    stats.batches = batches_.load();
+    stats.failures = failures_.load();
+    stats.stale = stale_.load();
+    stats.rejected = rejected_.load();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats.pending = index_.size();
+    }
+    return stats;
+}
+
+std::vector<SyncFlowStats> SyncEngine::flow_stats() const {
+    std::vector<SyncFlowStats> out;
+    const Clock::time_point now = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& entry : flows_) {
+            const Flow& flow = entry.second;
+            SyncFlowStats stats;
+            stats.flow = entry.first;
+            stats.weight = flow.weight;
+            stats.pending = flow.queue.size();
+            stats.sent = flow.sent;
+            stats.dropped = flow.dropped;
+            stats.max_lag_ms = flow.max_lag_ms;
+            if (!flow.queue.empty()) {
+                stats.lag_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    now - flow.queue.front().queued).count();
+            }
+            out.push_back(stats);
+        }
+    }
+    std::sort(out.begin(), out.end(), [](const SyncFlowStats& a, const SyncFlowStats& b) {
+        return a.flow < b.flow;
+    });
+    return out;
+}
+
+void SyncEngine::take_batch(std::vector<Pending>& batch) {
+    // etcd rejects a txn that names the same key twice, so the batch ends
+    // at the first event touching a key already in it
+    std::unordered_set<std::string> keys;
+    size_t ops = 0;
+    bool full = false;
+    const Clock::time_point now = Clock::now();
+
+    while (!active_.empty() && !full) {
+        Flow& current = flows_[active_.front()];
+
+        // A flow keeps its turn (and deficit) across batches until it has
+        // spent its quantum or run dry
+        if (!current.granted) {
+            current.deficit += static_cast<int64_t>(config_.quantum_ops) * current.weight;
+            current.granted = true;
+        }
+
+        while (!current.queue.empty()) {
+            Pending& next = current.queue.front();
+            if (next.alone && !batch.empty()) {
+                full = true;
+                break;
+            }
+
+            // Count the guard stamp as one more op
+            const size_t cost = next.ops.size() + 1;
+            if (static_cast<int64_t>(cost) > current.deficit) {
+                break;
+            }
+            if (!batch.empty() && ops + cost > config_.max_batch_ops) {
+                full = true;
+                break;
+            }
+
+            bool duplicate = next.guard.active() && keys.count(next.guard.key);
+            for (const auto& op : next.ops) {
+                if (duplicate || keys.count(op.key)) {
+                    duplicate = true;
+                    break;
+                }
+            }
+            if (duplicate) {
+                full = true;
+                break;
+            }
+
+            for (const auto& op : next.ops) {
+                keys.insert(op.key);
+            }
+            if (next.guard.active()) {
+                keys.insert(next.guard.key);
+            }
+            ops += cost;
+            current.deficit -= cost;
+            current.sent++;
+            current.max_lag_ms = std::max<uint64_t>(current.max_lag_ms,
+                std::chrono::duration_cast<std::chrono::milliseconds>(now - next.queued).count());
+
+            if (NNOE_PROBE_ENABLED(dequeue)) {
+                const uint64_t queued_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    now - next.queued).count();
+                NNOE_PROBE3(dequeue, next.key.c_str(), next.flow, queued_ns);
+            }
+
+            index_.erase(next.key);
+            batch.push_back(std::move(next));
+            current.queue.pop_front();
+            if (batch.back().alone) {
+                full = true;
+                break;
+            }
+        }
+
+        if (full) {
+            break;
+        }
+
+        // Turn over: an idle flow does not bank credit
+        const uint32_t id = active_.front();
+        active_.pop_front();
+        current.granted = false;
+        if (current.queue.empty()) {
+            current.deficit = 0;
+            current.active = false;
+        } else {
+            active_.push_back(id);
+        }
+    }
+}
+
+void SyncEngine::send_batch(std::vector<Pending> batch) {
+    std::vector<EtcdGuardedOps> groups;
+    groups.reserve(batch.size());
+    size_t ops = 0;
+    for (const auto& pending : batch) {
+        groups.push_back(EtcdGuardedOps{pending.guard, pending.ops});
+        if (pending.guard.active() && deletes_only(pending.ops)) {
+            groups.back().guard.lease = grace_lease();
+        }
+        ops += pending.ops.size() + 1;
+    }
+    NNOE_PROBE2(batch, batch.size(), ops);
+
+    batches_++;
+    auto sent = std::make_shared<std::vector<Pending>>(std::move(batch));
+    client_.txn_guarded_async(groups,
+        [this, sent](bool ok, long status, const std::vector<bool>& applied) {
+            if (ok) {
+                stale_ += std::count(applied.begin(), applied.end(), false);
+            }
+            complete(*sent, ok, status);
+        });
+}
+
+// On the sender threads; a grant blocks only the sender that makes it
+int64_t SyncEngine::grace_lease() {
+    if (config_.guard_grace_s == 0) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(grace_mutex_);
+    const Clock::time_point now = Clock::now();
+    if (now < grace_renew_at_) {
+        return grace_lease_;
+    }
+
+    // Granted for two periods and replaced after one, so a guard stamped
+    // just before the renewal still lives a full period
+    int64_t id = 0;
+    if (client_.lease_grant(2 * static_cast<int64_t>(config_.guard_grace_s), id)) {
+        grace_lease_ = id;
+        grace_renew_at_ = now + std::chrono::seconds(config_.guard_grace_s);
+    } else {
+        // Until the next attempt guards are stamped without expiry
+        std::cerr << "Kea etcd hook: failed to grant the sequence guard lease" << std::endl;
+        grace_lease_ = 0;
+        grace_renew_at_ = now + std::chrono::seconds(GRACE_RETRY_SECONDS);
+    }
+    return grace_lease_;
+}
+
+// Completion of a batch, on the sender or a transport thread
+void SyncEngine::complete(std::vector<Pending>& batch, bool ok, long status) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_flight_--;
+
+        if (ok) {
+            for (const auto& pending : batch) {
+                release(pending.bytes);
+            }
+            backoff_ms_ = 0;
+        } else if (refused(status)) {
+            // etcd is up; find the event it refuses by sending them singly
+            failures_++;
+            if (batch.size() > 1) {
+                std::cerr << "Kea etcd hook: etcd refused a batch of " << batch.size()
+                          << " lease events (HTTP " << status << "), retrying them one by one"
+                          << std::endl;
+                for (auto& pending : batch) {
+                    pending.alone = true;
+                }
+                requeue(batch);
+            } else {
+                for (const auto& pending : batch) {
+                    std::cerr << "Kea etcd hook: etcd refused the lease event for "
+                              << pending.key << " (HTTP " << status << "), dropping it"
+                              << std::endl;
+                    NNOE_PROBE2(drop, pending.key.c_str(), pending.flow);
+                    release(pending.bytes);
+                    rejected_++;
+                }
+            }
+        } else {
+            failures_++;
+            if (stop_) {
+                if (!abandon_) {
+                    std::cerr << "Kea etcd hook: dropping " << batch.size() + index_.size()
+                              << " unsent lease events on shutdown" << std::endl;
+                }
+                abandon_ = true;
+                for (const auto& pending : batch) {
+                    release(pending.bytes);
+                }
+            } else {
+                requeue(batch);
+                backoff_ms_ = std::min(std::max(backoff_ms_ * 2, 100u), config_.max_retry_ms);
+                NNOE_PROBE2(retry, batch.size(), backoff_ms_);
+                retry_at_ = Clock::now() + std::chrono::milliseconds(backoff_ms_);
+            }
+        }
+    }
+    cv_.notify_all();
+}
+
+void SyncEngine::requeue(std::vector<Pending>& batch) {
+    // Put failed events back at the front of their flows unless a newer
+    // state for the same key arrived meanwhile
+    for (auto it = batch.rbegin(); it != batch.rend(); ++it) {
+        if (index_.count(it->key)) {
+            release(it->bytes);
+            continue;
+        }
+        Flow& target = flow(it->flow);
+        target.queue.push_front(std::move(*it));
+        index_[target.queue.front().key] = target.queue.begin();
+        if (!target.active) {
+            target.active = true;
+            active_.push_front(target.queue.front().flow);
+        }
+    }
+}
+
+void SyncEngine::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // Stopped once the final flush has gone out (or failed) and nothing is
+    // in flight any more
+    auto done = [this] {
+        return stop_ && in_flight_ == 0 && (abandon_ || index_.empty());
+    };
+
+    for (;;) {
+        cv_.wait(lock, [this, &done] {
+            return done() || (!abandon_ && !index_.empty() && in_flight_ < config_.senders);
+        });
+        if (done()) {
+            return;
+        }
+
+        // Back off after a failure; the final flush does not wait
+        if (!stop_ && Clock::now() < retry_at_) {
+            cv_.wait_until(lock, retry_at_, [this] { return stop_.load(); });
+            continue;
+        }
+
+        // Give a partial batch a moment to fill up
+        if (!stop_ && index_.size() < config_.max_batch_ops && config_.flush_interval_ms > 0) {
+            cv_.wait_for(lock, std::chrono::milliseconds(config_.flush_interval_ms), [this] {
+                return stop_.load() || index_.size() >= config_.max_batch_ops;
+            });
+            if (index_.empty() || in_flight_ >= config_.senders || abandon_) {
+                continue;
+            }
+        }
+
+        std::vector<Pending> batch;
+        take_batch(batch);
+        if (batch.empty()) {
+            continue;
+        }
+        in_flight_++;
+
+        // Returns at once on an asynchronous client
+        lock.unlock();
+        send_batch(std::move(batch));
+        lock.lock();
+    }
+}
+
+} // namespace nnoe
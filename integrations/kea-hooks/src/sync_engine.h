@@ -0,0 +1,203 @@
+/**
+ * Batching and coalescing etcd sync engine
+ *
+ * Lease events are submitted under their lease key together with the etcd
+ * operations that express them (lease put/delete plus derived records) and
+ * a sequence guard. Pending events for the same key coalesce: the highest
+ * sequence replaces the older state in place, keeping the position of the
+ * first arrival so a busy key cannot starve others. Sender threads drain
+ * the queue into /v3/kv/txn batches, at most `senders` in flight. Batches
+ * complete through a handler, which requeues failed ones and backs off; on
+ * an asynchronous client (see EtcdTransport) a single sender keeps every
+ * transaction in flight and the others stay idle. A batch etcd refuses
+ * outright (a 4xx such as too many operations) would fail the same way
+ * forever, so its events are requeued to go one per batch without a
+ * backoff, and an event refused on its own is dropped as rejected.
+ *
+ * Events are queued per flow (the subnet of the lease) and batches are
+ * filled by deficit round-robin over the flows with pending events: each
+ * turn a flow may send up to quantum_ops times its weight in operations.
+ * A subnet with short lease times therefore cannot delay the updates of
+ * other subnets, and when the queue is full the longest flow gives way.
+ *
+ * With a memory account attached, queued events are charged to it and an
+ * event that does not fit makes the longest flow give way as if the queue
+ * were full.
+ *
+ * Ordering is enforced by etcd rather than by the engine: every event is
+ * applied only if its sequence is newer than the one stored for the key,
+ * so retries, replays and concurrent senders can never roll a lease back.
+ * A group that only deletes stamps its sequence under a shared etcd lease
+ * of twice guard_grace_s, granted again every guard_grace_s, so the guard
+ * of a deleted key outlives it by one to two grace periods and then goes.
+ *
+ * Independent of Kea, so both the in-process hook and the out-of-process
+ * memfile tailer feed the same engine.
+ */
+
+#ifndef NNOE_SYNC_ENGINE_H
+#define NNOE_SYNC_ENGINE_H
+
+#include "etcd_client.h"
+#include "memory_budget.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace nnoe {
+
+struct SyncEngineConfig {
+    size_t max_batch_ops = 128;       // etcd default --max-txn-ops
+    uint32_t flush_interval_ms = 20;  // how long a partial batch may wait
+    size_t queue_limit = 100000;      // distinct pending keys
+    uint32_t max_retry_ms = 5000;     // cap for failure backoff
+    size_t senders = 2;               // txns in flight at once
+    uint32_t quantum_ops = 32;        // ops per weight unit and round-robin turn
+    uint32_t guard_grace_s = 86400;   // sequence guard lifetime after a delete; 0: forever
+    std::unordered_map<uint32_t, uint32_t> weights;  // flow -> weight, default 1
+};
+
+struct SyncEngineStats {
+    uint64_t submitted = 0;
+    uint64_t coalesced = 0;
+    uint64_t dropped = 0;
+    uint64_t batches = 0;
+    uint64_t failures = 0;
+    uint64_t stale = 0;      // rejected by etcd as older than the stored state
+    uint64_t rejected = 0;   // refused by etcd outright and dropped
+    uint64_t pending = 0;
+};
+
+struct SyncFlowStats {
+    uint32_t flow = 0;
+    uint32_t weight = 1;
+    uint64_t pending = 0;
+    uint64_t sent = 0;
+    uint64_t dropped = 0;
+    uint64_t lag_ms = 0;       // age of the oldest pending event
+    uint64_t max_lag_ms = 0;   // longest queueing delay of a sent event
+};
+
+// Event sequences: wall-clock microseconds, bumped to stay strictly
+// increasing within the process, so they also order across restarts
+class SequenceClock {
+public:
+    SequenceClock() : last_(0) {}
+
+    uint64_t next();
+
+private:
+    std::atomic<uint64_t> last_;
+};
+
+class SyncEngine {
+public:
+    SyncEngine(const EtcdClient& client, const SyncEngineConfig& config);
+    ~SyncEngine();
+
+    // Charge queued and in-flight events to account (before start())
+    void set_memory(MemoryAccount* account) { memory_ = account; }
+
+    void start();
+
+    // Stops the sender after a final best-effort flush
+    void stop();
+
+    // Queue ops for key under guard in flow, replacing pending ops for the
+    // same key unless those carry a higher sequence. Returns false if the
+    // queue is full and the event was dropped.
+    bool submit(const std::string& key, std::vector<EtcdOp> ops, const EtcdGuard& guard,
+                uint32_t flow = 0);
+
+    SyncEngineStats stats() const;
+
+    // Per-flow scheduler state, ordered by flow
+    std::vector<SyncFlowStats> flow_stats() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Pending {
+        std::string key;
+        EtcdGuard guard;
+        std::vector<EtcdOp> ops;
+        uint32_t flow;
+        Clock::time_point queued;
+        uint64_t bytes;           // charged to memory_
+        bool alone = false;       // in a batch etcd refused; sent in one of its own
+    };
+
+    static uint64_t pending_bytes(const std::string& key, const std::vector<EtcdOp>& ops);
+    void release(uint64_t bytes);
+
+    typedef std::list<Pending> PendingList;
+
+    struct Flow {
+        PendingList queue;
+        uint32_t weight = 1;
+        int64_t deficit = 0;
+        bool active = false;      // listed in active_
+        bool granted = false;     // quantum added for the current turn
+        uint64_t sent = 0;
+        uint64_t dropped = 0;
+        uint64_t max_lag_ms = 0;
+    };
+
+    Flow& flow(uint32_t id);
+
+    // Drop the newest event of the longest flow to make room for one in
+    // flow id; false if flow id is itself the longest
+    bool evict_for(uint32_t id);
+
+    // Move up to max_batch_ops worth of events out of the queues
+    void take_batch(std::vector<Pending>& batch);
+    void send_batch(std::vector<Pending> batch);
+
+    // Lease for the guards of deleted keys, 0 if disabled or not granted
+    int64_t grace_lease();
+    void complete(std::vector<Pending>& batch, bool ok, long status);
+    void requeue(std::vector<Pending>& batch);
+    void run();
+
+    const EtcdClient& client_;
+    SyncEngineConfig config_;
+    MemoryAccount* memory_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unordered_map<uint32_t, Flow> flows_;
+    std::list<uint32_t> active_;    // round-robin order of non-empty flows
+    std::unordered_map<std::string, PendingList::iterator> index_;
+    size_t in_flight_ = 0;          // batches sent and not completed
+    uint32_t backoff_ms_ = 0;
+    Clock::time_point retry_at_;    // no batch is sent before, after a failure
+    bool abandon_ = false;          // a final flush failed; drop the rest
+
+    std::mutex grace_mutex_;
+    int64_t grace_lease_ = 0;
+    Clock::time_point grace_renew_at_;
+
+    std::vector<std::thread> senders_;
+    std::atomic<bool> stop_;
+
+    std::atomic<uint64_t> submitted_;
+    std::atomic<uint64_t> coalesced_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<uint64_t> batches_;
+    std::atomic<uint64_t> failures_;
+    std::atomic<uint64_t> stale_;
+    std::atomic<uint64_t> rejected_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_SYNC_ENGINE_H
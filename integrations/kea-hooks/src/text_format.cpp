@@ -0,0 +1,251 @@
+/**
+ * Fast address and identifier formatting for the NNOE Kea hook
+ */
+
+#include "text_format.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define NNOE_TEXT_FORMAT_SSSE3 1
+#endif
+
+namespace nnoe {
+
+namespace {
+
+const char HEX_DIGITS[] = "0123456789abcdef";
+
+// Octet text in the low three bytes (little-endian order), length in the top one
+constexpr std::array<uint32_t, 256> make_octets() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t chars = 0;
+        uint32_t length = 0;
+        if (i >= 100) {
+            chars = ('0' + i / 100) | (('0' + i / 10 % 10) << 8) | (('0' + i % 10) << 16);
+            length = 3;
+        } else if (i >= 10) {
+            chars = ('0' + i / 10) | (('0' + i % 10) << 8);
+            length = 2;
+        } else {
+            chars = '0' + i;
+            length = 1;
+        }
+        table[i] = chars | (length << 24);
+    }
+    return table;
+}
+
+constexpr std::array<uint32_t, 256> OCTETS = make_octets();
+
+// Two hex digits of each byte, in memory order
+constexpr std::array<uint16_t, 256> make_hex_pairs() {
+    std::array<uint16_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        table[i] = static_cast<uint16_t>(HEX_DIGITS[i >> 4] | (HEX_DIGITS[i & 15] << 8));
+    }
+    return table;
+}
+
+constexpr std::array<uint16_t, 256> HEX_PAIRS = make_hex_pairs();
+
+// Writes octet and its '.' (4 bytes at most); returns the length with the dot
+inline size_t put_octet(uint8_t octet, char* out) {
+    const uint32_t entry = OCTETS[octet];
+    const size_t length = entry >> 24;
+    const uint32_t chars = (entry & 0xffffff) | (static_cast<uint32_t>('.') << (8 * length));
+    // Byte order independent store of the four characters
+    out[0] = static_cast<char>(chars);
+    out[1] = static_cast<char>(chars >> 8);
+    out[2] = static_cast<char>(chars >> 16);
+    out[3] = static_cast<char>(chars >> 24);
+    return length + 1;
+}
+
+// Lowercase hex of a 16-bit group without leading zeros
+inline size_t put_group(uint16_t group, char* out) {
+    if (group >= 0x1000) {
+        out[0] = HEX_DIGITS[group >> 12];
+        out[1] = HEX_DIGITS[(group >> 8) & 15];
+        out[2] = HEX_DIGITS[(group >> 4) & 15];
+        out[3] = HEX_DIGITS[group & 15];
+        return 4;
+    }
+    if (group >= 0x100) {
+        out[0] = HEX_DIGITS[group >> 8];
+        out[1] = HEX_DIGITS[(group >> 4) & 15];
+        out[2] = HEX_DIGITS[group & 15];
+        return 3;
+    }
+    if (group >= 0x10) {
+        out[0] = HEX_DIGITS[group >> 4];
+        out[1] = HEX_DIGITS[group & 15];
+        return 2;
+    }
+    out[0] = HEX_DIGITS[group];
+    return 1;
+}
+
+#ifdef NNOE_TEXT_FORMAT_SSSE3
+
+// 16 bytes -> 48 characters ("xx:" per byte) per step
+__attribute__((target("ssse3")))
+size_t hex_colon_ssse3(const uint8_t* data, size_t length, char* out, size_t& consumed) {
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+    // Positions of the interleaved digit pairs in each 16-byte output block;
+    // -1 leaves a zero for the colon (or for the other source)
+    const __m128i block0_a = _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10);
+    const __m128i block1_a = _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1,
+                                           -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i block1_b = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                           0, 1, -1, 2, 3, -1, 4, 5);
+    const __m128i block2_b = _mm_setr_epi8(-1, 6, 7, -1, 8, 9, -1, 10, 11, -1, 12, 13, -1,
+                                           14, 15, -1);
+    const __m128i colons0 = _mm_setr_epi8(0, 0, ':', 0, 0, ':', 0, 0, ':', 0, 0, ':', 0, 0, ':', 0);
+    const __m128i colons1 = _mm_setr_epi8(0, ':', 0, 0, ':', 0, 0, ':', 0, 0, ':', 0, 0, ':', 0, 0);
+    const __m128i colons2 = _mm_setr_epi8(':', 0, 0, ':', 0, 0, ':', 0, 0, ':', 0, 0, ':', 0, 0, ':');
+
+    size_t i = 0;
+    size_t o = 0;
+    while (length - i >= 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const __m128i high = _mm_shuffle_epi8(digits,
+                                              _mm_and_si128(_mm_srli_epi16(bytes, 4), low_nibble));
+        const __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(bytes, low_nibble));
+        const __m128i a = _mm_unpacklo_epi8(high, low);   // bytes 0-7
+        const __m128i b = _mm_unpackhi_epi8(high, low);   // bytes 8-15
+
+        const __m128i block0 = _mm_or_si128(_mm_shuffle_epi8(a, block0_a), colons0);
+        const __m128i block1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, block1_a),
+                                                         _mm_shuffle_epi8(b, block1_b)),
+                                            colons1);
+        const __m128i block2 = _mm_or_si128(_mm_shuffle_epi8(b, block2_b), colons2);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + o), block0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + o + 16), block1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + o + 32), block2);
+        i += 16;
+        o += 48;
+    }
+    consumed = i;
+    return o;
+}
+
+bool cpu_has_ssse3() {
+    static const bool has = __builtin_cpu_supports("ssse3");
+    return has;
+}
+
+#endif // NNOE_TEXT_FORMAT_SSSE3
+
+} // namespace
+
+size_t format_ipv4(uint32_t address, char* out) {
+    size_t length = put_octet(static_cast<uint8_t>(address >> 24), out);
+    length += put_octet(static_cast<uint8_t>(address >> 16), out + length);
+    length += put_octet(static_cast<uint8_t>(address >> 8), out + length);
+    length += put_octet(static_cast<uint8_t>(address), out + length);
+    return length - 1;   // no dot after the last octet
+}
+
+size_t format_ipv6(const uint8_t* address, char* out) {
+    uint16_t groups[8];
+    for (int i = 0; i < 8; ++i) {
+        groups[i] = static_cast<uint16_t>((address[2 * i] << 8) | address[2 * i + 1]);
+    }
+
+    // Longest run of zero groups, the first of equal ones
+    int best = -1, best_length = 0;
+    for (int i = 0; i < 8;) {
+        if (groups[i]) {
+            ++i;
+            continue;
+        }
+        int end = i;
+        while (end < 8 && !groups[end]) {
+            ++end;
+        }
+        if (end - i > best_length) {
+            best = i;
+            best_length = end - i;
+        }
+        i = end;
+    }
+    if (best_length < 2) {
+        best = -1;
+    }
+
+    size_t length = 0;
+    for (int i = 0; i < 8; ++i) {
+        if (best >= 0 && i >= best && i < best + best_length) {
+            if (i == best) {
+                out[length++] = ':';
+            }
+            continue;
+        }
+        if (i) {
+            out[length++] = ':';
+        }
+        // IPv4-compatible and IPv4-mapped addresses end in a dotted quad
+        if (i == 6 && best == 0 &&
+            (best_length == 6 || (best_length == 5 && groups[5] == 0xffff))) {
+            const uint32_t v4 = (static_cast<uint32_t>(address[12]) << 24) |
+                                (static_cast<uint32_t>(address[13]) << 16) |
+                                (static_cast<uint32_t>(address[14]) << 8) | address[15];
+            return length + format_ipv4(v4, out + length);
+        }
+        length += put_group(groups[i], out + length);
+    }
+    if (best >= 0 && best + best_length == 8) {
+        out[length++] = ':';
+    }
+    return length;
+}
+
+size_t format_hex_colon(const uint8_t* data, size_t length, char* out) {
+    if (!length) {
+        return 0;
+    }
+    size_t consumed = 0;
+    size_t written = 0;
+#ifdef NNOE_TEXT_FORMAT_SSSE3
+    if (length >= 16 && cpu_has_ssse3()) {
+        written = hex_colon_ssse3(data, length, out, consumed);
+    }
+#endif
+    for (size_t i = consumed; i < length; ++i) {
+        const uint16_t pair = HEX_PAIRS[data[i]];
+        out[written] = static_cast<char>(pair);
+        out[written + 1] = static_cast<char>(pair >> 8);
+        out[written + 2] = ':';
+        written += 3;
+    }
+    return written - 1;   // no colon after the last byte
+}
+
+std::string ipv4_text(uint32_t address) {
+    char buffer[IPV4_TEXT_BUFFER];
+    return std::string(buffer, format_ipv4(address, buffer));
+}
+
+std::string ipv6_text(const uint8_t* address) {
+    char buffer[IPV6_TEXT_BUFFER];
+    return std::string(buffer, format_ipv6(address, buffer));
+}
+
+std::string hex_colon_text(const uint8_t* data, size_t length) {
+    if (length <= 16) {
+        char buffer[3 * 16];
+        return std::string(buffer, format_hex_colon(data, length, buffer));
+    }
+    std::string text(hex_colon_buffer(length), '\0');
+    text.resize(format_hex_colon(data, length, &text[0]));
+    return text;
+}
+
+} // namespace nnoe
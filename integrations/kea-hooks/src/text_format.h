@@ -0,0 +1,53 @@
+/**
+ * Fast address and identifier formatting for the NNOE Kea hook
+ *
+ * Every lease event needs its address, hardware address or DUID as text,
+ * for the record, the key, the sequence guard, DNS, the index and the
+ * history. Kea's toText() goes through an ostringstream per call; these
+ * write into a caller buffer instead, with the same output:
+ *
+ *   - IPv4 dotted quad from a 256-entry table of octet strings
+ *   - IPv6 in RFC 5952 form, exactly as inet_ntop() writes it (longest run
+ *     of two or more zero groups compressed, first one on a tie, lowercase
+ *     hex, ::ffff:a.b.c.d for mapped addresses)
+ *   - colon-separated lowercase hex (HWAddr/DUID/ClientId toText()) from a
+ *     table of byte pairs, 16 bytes per SSSE3 step for identifiers of that
+ *     length or more
+ *
+ * Kea independent; lease_values.h wraps them for leases.
+ */
+
+#ifndef NNOE_TEXT_FORMAT_H
+#define NNOE_TEXT_FORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace nnoe {
+
+// Buffer sizes; the formatters may write a byte past the text
+const size_t IPV4_TEXT_BUFFER = 16;
+const size_t IPV6_TEXT_BUFFER = 48;
+
+inline size_t hex_colon_buffer(size_t length) {
+    return 3 * length;
+}
+
+// Dotted quad of a host-order address; returns the length
+size_t format_ipv4(uint32_t address, char* out);
+
+// RFC 5952 text of 16 network-order bytes; returns the length
+size_t format_ipv6(const uint8_t* address, char* out);
+
+// "0a:1b:..." of length bytes; returns the length (3 * length - 1, or 0)
+size_t format_hex_colon(const uint8_t* data, size_t length, char* out);
+
+// Convenience forms returning strings
+std::string ipv4_text(uint32_t address);
+std::string ipv6_text(const uint8_t* address);
+std::string hex_colon_text(const uint8_t* data, size_t length);
+
+} // namespace nnoe
+
+#endif // NNOE_TEXT_FORMAT_H
@@ -0,0 +1,360 @@
+/**
+ * Shared etcd watch manager for the NNOE Kea hook
+ */
+
+#include "watch_manager.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace nnoe {
+
+WatchManager::Subscription::Subscription(uint64_t id, const std::string& prefix,
+                                         WatchSubscriber* subscriber, size_t queue_batches,
+                                         MemoryAccount* memory)
+    : id(id), prefix(prefix), subscriber(subscriber), queue(queue_batches), memory(memory),
+      revision(0), watching(false), resync(true), stop(false), sleeping(false), events(0),
+      reloads(0) {
+}
+
+WatchManager::Subscription::~Subscription() {
+    Batch batch;
+    while (queue.pop(batch)) {
+        if (memory) {
+            memory->release(batch.bytes);
+        }
+    }
+}
+
+WatchManager::WatchManager(const std::string& endpoint, size_t queue_batches)
+    : client_(endpoint), queue_batches_(queue_batches ? queue_batches : 1), memory_(nullptr),
+      next_id_(0), rebuild_(false), stop_(false), interrupt_(false), streams_(0), resumed_(0),
+      reloads_(0), compactions_(0), overflows_(0), events_(0) {
+}
+
+WatchManager::~WatchManager() {
+    stop();
+}
+
+void WatchManager::set_memory(MemoryAccount* account) {
+    memory_ = account;
+    client_.set_memory(account);
+}
+
+void WatchManager::start() {
+    if (thread_.joinable()) {
+        return;
+    }
+    stop_ = false;
+    thread_ = std::thread(&WatchManager::run, this);
+}
+
+void WatchManager::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        interrupt_ = true;
+    }
+    wait_cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+
+    std::vector<std::shared_ptr<Subscription>> subscriptions;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        subscriptions.swap(subscriptions_);
+    }
+    for (auto& sub : subscriptions) {
+        sub->stop = true;
+        wake(*sub);
+        if (sub->thread.joinable()) {
+            sub->thread.join();
+        }
+    }
+}
+
+uint64_t WatchManager::subscribe(const std::string& prefix, WatchSubscriber* subscriber,
+                                 int64_t revision) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto sub = std::make_shared<Subscription>(++next_id_, prefix, subscriber, queue_batches_,
+                                              memory_);
+    if (revision > 0) {
+        sub->revision = revision;
+        sub->resync = false;
+        sub->watching = true;
+        rebuild_ = true;
+        interrupt_ = true;
+        wait_cv_.notify_all();
+    }
+    sub->thread = std::thread(&WatchManager::dispatch, this, std::ref(*sub));
+    subscriptions_.push_back(sub);
+    return sub->id;
+}
+
+void WatchManager::unsubscribe(uint64_t id) {
+    std::shared_ptr<Subscription> sub;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::find_if(subscriptions_.begin(), subscriptions_.end(),
+                               [id](const std::shared_ptr<Subscription>& entry) {
+                                   return entry->id == id;
+                               });
+        if (it == subscriptions_.end()) {
+            return;
+        }
+        sub = *it;
+        subscriptions_.erase(it);
+        rebuild_ = true;
+        interrupt_ = true;
+    }
+    wait_cv_.notify_all();
+
+    sub->stop = true;
+    wake(*sub);
+    if (sub->thread.joinable()) {
+        sub->thread.join();
+    }
+    // The stream may still hold the subscription until it reconnects
+}
+
+void WatchManager::request_rebuild() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rebuild_ = true;
+        interrupt_ = true;
+    }
+    wait_cv_.notify_all();
+}
+
+void WatchManager::wait_backoff(int seconds) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    wait_cv_.wait_for(lock, std::chrono::seconds(seconds), [this] { return stop_.load(); });
+}
+
+void WatchManager::wake(Subscription& sub) {
+    // Pairs with the fence in dispatch(): either the dispatch thread sees
+    // the new batch or flag, or it is seen sleeping and notified
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sub.sleeping.load()) {
+        std::lock_guard<std::mutex> lock(sub.wait_mutex);
+        sub.wait_cv.notify_one();
+    }
+}
+
+uint64_t WatchManager::batch_bytes(const std::vector<EtcdWatchEvent>& events) {
+    uint64_t bytes = sizeof(Batch);
+    for (const auto& event : events) {
+        bytes += sizeof(EtcdWatchEvent) + string_heap_bytes(event.kv.key) +
+                 string_heap_bytes(event.kv.value);
+    }
+    return bytes;
+}
+
+// Stream thread: hands a response to its subscription; false once the
+// subscription no longer follows this stream's watch
+bool WatchManager::deliver(Subscription& sub, EtcdWatchResponse& response) {
+    if (!sub.watching) {
+        return false;
+    }
+
+    switch (response.type) {
+    case EtcdWatchResponse::COMPACTED:
+        std::cerr << "Kea etcd hook: watch on " << sub.prefix << " compacted at revision "
+                  << response.revision << ", re-reading" << std::endl;
+        compactions_++;
+        sub.watching = false;
+        sub.resync = true;
+        wake(sub);
+        return false;
+
+    case EtcdWatchResponse::PROGRESS:
+        // Every change up to the header revision has been sent
+        if (response.revision > sub.revision) {
+            sub.revision = response.revision;
+        }
+        return true;
+
+    case EtcdWatchResponse::EVENTS:
+        break;
+    }
+
+    int64_t revision = sub.revision;
+    for (const auto& event : response.events) {
+        revision = std::max(revision, event.kv.mod_revision);
+    }
+    const size_t count = response.events.size();
+
+    Batch batch;
+    batch.events = std::move(response.events);
+    batch.bytes = batch_bytes(batch.events);
+    if (memory_) {
+        memory_->charge(batch.bytes);
+    }
+    if (!sub.queue.push(batch)) {
+        if (memory_) {
+            memory_->release(batch.bytes);
+        }
+        std::cerr << "Kea etcd hook: watch subscriber for " << sub.prefix
+                  << " fell behind, re-reading" << std::endl;
+        overflows_++;
+        sub.watching = false;
+        sub.resync = true;
+        wake(sub);
+        return false;
+    }
+
+    sub.revision = revision;
+    events_ += count;
+    wake(sub);
+    return true;
+}
+
+void WatchManager::discard(Subscription& sub) {
+    Batch batch;
+    while (sub.queue.pop(batch)) {
+        if (memory_) {
+            memory_->release(batch.bytes);
+        }
+    }
+}
+
+// Dispatch thread of one subscription: reloads when needed, then applies
+// queued batches
+void WatchManager::dispatch(Subscription& sub) {
+    int backoff = 1;
+    Batch batch;
+
+    while (!sub.stop) {
+        if (sub.resync) {
+            // Whatever is still queued predates the reload
+            discard(sub);
+            int64_t revision = 0;
+            if (!sub.subscriber->reload(client_, revision) || revision <= 0) {
+                std::unique_lock<std::mutex> lock(sub.wait_mutex);
+                sub.sleeping = true;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                sub.wait_cv.wait_for(lock, std::chrono::seconds(backoff),
+                                     [&sub] { return sub.stop.load(); });
+                sub.sleeping = false;
+                backoff = std::min(backoff * 2, 30);
+                continue;
+            }
+            backoff = 1;
+            sub.reloads++;
+            reloads_++;
+            sub.revision = revision;
+            sub.resync = false;
+            sub.watching = true;
+            request_rebuild();
+            continue;
+        }
+
+        if (sub.queue.pop(batch)) {
+            if (memory_) {
+                memory_->release(batch.bytes);
+            }
+            sub.subscriber->apply(batch.events);
+            sub.events += batch.events.size();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sub.wait_mutex);
+        sub.sleeping = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sub.queue.empty() && !sub.resync && !sub.stop) {
+            // The timeout only bounds a missed wakeup
+            sub.wait_cv.wait_for(lock, std::chrono::seconds(1));
+        }
+        sub.sleeping = false;
+    }
+}
+
+// Stream thread: one multiplexed watch over every subscription that holds a
+// snapshot, rebuilt whenever that set changes
+void WatchManager::run() {
+    int backoff = 1;
+    std::vector<uint64_t> streamed;   // subscriptions of the previous stream
+
+    while (!stop_) {
+        std::vector<std::shared_ptr<Subscription>> active;
+        std::vector<EtcdWatchTarget> targets;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            rebuild_ = false;
+            interrupt_ = false;
+            for (const auto& sub : subscriptions_) {
+                if (sub->watching) {
+                    active.push_back(sub);
+                }
+            }
+            if (active.empty()) {
+                streamed.clear();
+                wait_cv_.wait(lock, [this] { return stop_ || rebuild_; });
+                continue;
+            }
+        }
+
+        for (const auto& sub : active) {
+            EtcdWatchTarget target;
+            target.prefix = sub->prefix;
+            target.start_revision = sub->revision + 1;
+            targets.push_back(target);
+            if (std::find(streamed.begin(), streamed.end(), sub->id) != streamed.end()) {
+                resumed_++;
+            }
+        }
+        streamed.clear();
+        for (const auto& sub : active) {
+            streamed.push_back(sub->id);
+        }
+
+        // A subscription that left this stream (compaction, overflow) is
+        // back only in the next one, from the revision of its reload
+        std::vector<bool> live(active.size(), true);
+        streams_++;
+        const EtcdClient::WatchResult result = client_.watch_stream(targets,
+            [this, &active, &live](EtcdWatchResponse& response) {
+                if (live[response.target] && !deliver(*active[response.target], response)) {
+                    live[response.target] = false;
+                }
+                return true;
+            },
+            interrupt_);
+
+        if (stop_) {
+            break;
+        }
+        if (result == EtcdClient::WATCH_ERROR) {
+            wait_backoff(backoff);
+            backoff = std::min(backoff * 2, 30);
+            continue;
+        }
+        backoff = 1;
+    }
+}
+
+WatchManagerStats WatchManager::stats() const {
+    WatchManagerStats stats;
+    stats.streams = streams_.load();
+    stats.resumed = resumed_.load();
+    stats.reloads = reloads_.load();
+    stats.compactions = compactions_.load();
+    stats.overflows = overflows_.load();
+    stats.events = events_.load();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& sub : subscriptions_) {
+        WatchSubscriptionStats entry;
+        entry.prefix = sub->prefix;
+        entry.revision = sub->revision.load();
+        entry.events = sub->events.load();
+        entry.reloads = sub->reloads.load();
+        entry.queued = sub->queue.size();
+        stats.subscriptions.push_back(entry);
+    }
+    return stats;
+}
+
+} // namespace nnoe
@@ -0,0 +1,230 @@
+/**
+ * Shared etcd watch manager for the NNOE Kea hook
+ *
+ * The hook mirrors several prefixes (blocklist, leases of other servers,
+ * scopes, the lease backend). Instead of a watch stream each, their watches
+ * share one connection: the manager opens a single multiplexed stream with
+ * a create request per subscribed prefix and remembers, per prefix, the
+ * last revision delivered (events, or a progress notification on a quiet
+ * prefix). After a disconnect or a change of subscriptions it reconnects
+ * every watch from where it left off, so a blip costs etcd no re-reads.
+ *
+ * A subscriber reads its whole prefix (paged, through reload()) only when it
+ * starts without a snapshot, when etcd has compacted the revision its watch
+ * would resume from, or when it fell so far behind that its queue
+ * overflowed. The other watches keep streaming meanwhile.
+ *
+ * Events reach each subscriber through a bounded single-producer,
+ * single-consumer queue drained by a dispatch thread of its own, so a slow
+ * subscriber never holds up the stream or the other subscribers.
+ *
+ * Kea independent.
+ */
+
+#ifndef NNOE_WATCH_MANAGER_H
+#define NNOE_WATCH_MANAGER_H
+
+#include "etcd_client.h"
+#include "memory_budget.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace nnoe {
+
+// Bounded lock-free queue for one producer thread and one consumer thread
+template <typename T>
+class SpscQueue {
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity) : head_(0), tail_(0) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    // Producer side; false (item untouched) if the queue is full
+    bool push(T& item) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == slots_.size()) {
+            return false;
+        }
+        slots_[tail & mask_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side; false if the queue is empty
+    bool pop(T& item) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(slots_[head & mask_]);
+        slots_[head & mask_] = T();
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    std::vector<T> slots_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+};
+
+// A mirror of an etcd prefix, fed by WatchManager. Both calls come from the
+// subscription's dispatch thread, never concurrently.
+class WatchSubscriber {
+public:
+    virtual ~WatchSubscriber() {}
+
+    // Replace the mirror with a full (paged) read of the prefix through
+    // client; revision receives the revision of the read. false to retry
+    // after a backoff.
+    virtual bool reload(const EtcdClient& client, int64_t& revision) = 0;
+
+    // Changes under the prefix after the last reload, in revision order
+    virtual void apply(const std::vector<EtcdWatchEvent>& events) = 0;
+};
+
+struct WatchSubscriptionStats {
+    std::string prefix;
+    int64_t revision = 0;        // resume point
+    uint64_t events = 0;
+    uint64_t reloads = 0;
+    uint64_t queued = 0;         // batches waiting for the subscriber
+};
+
+struct WatchManagerStats {
+    uint64_t streams = 0;        // connections opened
+    uint64_t resumed = 0;        // watches resumed from a known revision
+    uint64_t reloads = 0;        // full re-reads
+    uint64_t compactions = 0;
+    uint64_t overflows = 0;      // subscribers that fell a queue behind
+    uint64_t events = 0;
+    std::vector<WatchSubscriptionStats> subscriptions;
+};
+
+class WatchManager {
+public:
+    explicit WatchManager(const std::string& endpoint, size_t queue_batches = 1024);
+    ~WatchManager();
+
+    // Authenticate the stream and reloads with the process-wide token cache
+    // (before start())
+    void set_auth(const std::shared_ptr<EtcdAuth>& auth) { client_.set_auth(auth); }
+
+    // TLS files of the stream and reloads (before start())
+    void set_tls(const EtcdTls& tls) { client_.set_tls(tls); }
+
+    // Send reloads through transport while it is available; the stream
+    // itself stays on libcurl (before start())
+    void set_transport(const std::shared_ptr<EtcdTransport>& transport) {
+        client_.set_transport(transport);
+    }
+
+    // Charge queued events and reload buffers to account (before start())
+    void set_memory(MemoryAccount* account);
+
+    void start();
+    void stop();
+
+    // Mirror prefix into subscriber, which must outlive the subscription.
+    // With revision > 0 the subscriber already holds the prefix as of that
+    // revision and is only sent later changes; otherwise it is reloaded
+    // first. Returns the id to unsubscribe with.
+    uint64_t subscribe(const std::string& prefix, WatchSubscriber* subscriber,
+                       int64_t revision = 0);
+
+    // Stop delivering to the subscription, waiting for a call in progress
+    // (not from the subscriber's own calls)
+    void unsubscribe(uint64_t id);
+
+    WatchManagerStats stats() const;
+
+private:
+    struct Batch {
+        std::vector<EtcdWatchEvent> events;
+        uint64_t bytes = 0;
+    };
+
+    struct Subscription {
+        Subscription(uint64_t id, const std::string& prefix, WatchSubscriber* subscriber,
+                     size_t queue_batches, MemoryAccount* memory);
+        // Releases what is still queued
+        ~Subscription();
+
+        uint64_t id;
+        std::string prefix;
+        WatchSubscriber* subscriber;
+        SpscQueue<Batch> queue;
+        MemoryAccount* memory;
+
+        // The stream thread writes revision and clears watching; the dispatch
+        // thread sets them again after a reload
+        std::atomic<int64_t> revision;
+        std::atomic<bool> watching;   // part of the stream
+        std::atomic<bool> resync;     // the dispatch thread must reload
+
+        std::thread thread;
+        std::atomic<bool> stop;
+        std::atomic<bool> sleeping;
+        std::mutex wait_mutex;
+        std::condition_variable wait_cv;
+
+        std::atomic<uint64_t> events;
+        std::atomic<uint64_t> reloads;
+    };
+
+    void run();
+    bool deliver(Subscription& sub, EtcdWatchResponse& response);
+    void dispatch(Subscription& sub);
+    void discard(Subscription& sub);
+    void wake(Subscription& sub);
+    void request_rebuild();
+    void wait_backoff(int seconds);
+    static uint64_t batch_bytes(const std::vector<EtcdWatchEvent>& events);
+
+    EtcdClient client_;
+    size_t queue_batches_;
+    MemoryAccount* memory_;
+
+    mutable std::mutex mutex_;
+    std::vector<std::shared_ptr<Subscription>> subscriptions_;
+    uint64_t next_id_;
+    bool rebuild_;                    // subscriptions to stream changed
+
+    std::thread thread_;
+    std::atomic<bool> stop_;
+    std::atomic<bool> interrupt_;     // ends the current stream
+    std::condition_variable wait_cv_;
+
+    std::atomic<uint64_t> streams_;
+    std::atomic<uint64_t> resumed_;
+    std::atomic<uint64_t> reloads_;
+    std::atomic<uint64_t> compactions_;
+    std::atomic<uint64_t> overflows_;
+    std::atomic<uint64_t> events_;
+};
+
+} // namespace nnoe
+
+#endif // NNOE_WATCH_MANAGER_H
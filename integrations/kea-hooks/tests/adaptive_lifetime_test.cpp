@@ -0,0 +1,107 @@
+/**
+ * Tests for utilization-adaptive lease lifetimes
+ */
+
+#include "adaptive_lifetime.h"
+#include "check.h"
+
+
+static uint32_t adapted(nnoe::AdaptiveLifetime& policy, uint32_t valid, uint64_t assigned,
+                        uint64_t total) {
+    uint32_t preferred = 0;
+    policy.adapt(valid, preferred, assigned, total);
+    return valid;
+}
+
+static void test_bounds() {
+    nnoe::AdaptiveLifetimeConfig config;
+    config.min_valid = 600;
+    config.max_valid = 86400;
+    config.low_percent = 50;
+    config.high_percent = 90;
+    nnoe::AdaptiveLifetime policy(config);
+
+    CHECK(adapted(policy, 3600, 0, 1000) == 86400);
+    CHECK(adapted(policy, 3600, 500, 1000) == 86400);
+    CHECK(adapted(policy, 3600, 900, 1000) == 600);
+    CHECK(adapted(policy, 3600, 1000, 1000) == 600);
+    CHECK(adapted(policy, 3600, 5000, 1000) == 600);       // overcounted pool
+
+    // Halfway between the thresholds, halfway between the bounds
+    CHECK(adapted(policy, 3600, 700, 1000) == 600 + (86400 - 600) / 2);
+
+    // Longer as the pool empties
+    uint32_t previous = 0;
+    for (uint64_t assigned = 1000; assigned-- > 0;) {
+        const uint32_t valid = adapted(policy, 3600, assigned, 1000);
+        CHECK(valid >= previous);
+        previous = valid;
+    }
+
+    const nnoe::AdaptiveLifetimeStats stats = policy.stats();
+    CHECK(stats.lengthened > 0 && stats.shortened > 0);
+    CHECK(stats.unchanged == 0 && stats.untracked == 0);
+}
+
+static void test_configured_bound() {
+    // Only lengthen: near exhaustion the configured lifetime applies
+    nnoe::AdaptiveLifetimeConfig config;
+    config.max_valid = 43200;
+    nnoe::AdaptiveLifetime policy(config);
+
+    CHECK(adapted(policy, 3600, 10, 1000) == 43200);
+    CHECK(adapted(policy, 3600, 950, 1000) == 3600);
+    CHECK(policy.stats().unchanged == 1);
+
+    // A maximum below the configured lifetime caps the minimum too
+    CHECK(adapted(policy, 86400, 950, 1000) == 43200);
+
+    // Infinite, zero lifetimes and empty pools are left alone
+    CHECK(adapted(policy, 0xffffffff, 0, 1000) == 0xffffffff);
+    CHECK(adapted(policy, 0, 0, 1000) == 0);
+    CHECK(adapted(policy, 3600, 0, 0) == 3600);
+
+    policy.untracked();
+    CHECK(policy.stats().untracked == 1);
+}
+
+static void test_preferred() {
+    nnoe::AdaptiveLifetimeConfig config;
+    config.min_valid = 1800;
+    config.max_valid = 14400;
+    nnoe::AdaptiveLifetime policy(config);
+
+    uint32_t valid = 7200;
+    uint32_t preferred = 3600;
+    CHECK(policy.adapt(valid, preferred, 0, 1u << 20));
+    CHECK(valid == 14400 && preferred == 7200);
+
+    valid = 7200;
+    preferred = 3600;
+    CHECK(policy.adapt(valid, preferred, 1u << 20, 1u << 20));
+    CHECK(valid == 1800 && preferred == 900);
+
+    // Infinite preferred lifetimes stay infinite
+    valid = 7200;
+    preferred = 0xffffffff;
+    policy.adapt(valid, preferred, 0, 100);
+    CHECK(valid == 14400 && preferred == 0xffffffff);
+
+    // Thresholds out of order are put back in order
+    config.low_percent = 95;
+    config.high_percent = 120;
+    nnoe::AdaptiveLifetime clamped(config);
+    CHECK(clamped.config().high_percent == 100 && clamped.config().low_percent == 95);
+    config.low_percent = 90;
+    config.high_percent = 80;
+    nnoe::AdaptiveLifetime swapped(config);
+    CHECK(swapped.config().low_percent < swapped.config().high_percent);
+}
+
+int main() {
+    test_bounds();
+    test_configured_bound();
+    test_preferred();
+
+    return check_result("adaptive_lifetime_test");
+}
@@ -0,0 +1,150 @@
+/**
+ * Tests for the client blocklist snapshot: bloom filter plus sorted
+ * fingerprint lookup, and publishing while lookups run
+ */
+
+#include "blocklist.h"
+#include "check.h"
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const std::string PREFIX = "/nnoe/dhcp/blocklist/";
+
+static nnoe::EtcdWatchEvent put(const std::string& name) {
+    nnoe::EtcdWatchEvent event;
+    event.kv.key = PREFIX + name;
+    return event;
+}
+
+static nnoe::EtcdWatchEvent erase(const std::string& name) {
+    nnoe::EtcdWatchEvent event;
+    event.type = nnoe::EtcdWatchEvent::DELETE;
+    event.kv.key = PREFIX + name;
+    return event;
+}
+
+// Six-byte hardware address derived from n
+static std::vector<uint8_t> mac(uint32_t n) {
+    return {0x02, 0x00, static_cast<uint8_t>(n >> 24), static_cast<uint8_t>(n >> 16),
+            static_cast<uint8_t>(n >> 8), static_cast<uint8_t>(n)};
+}
+
+static std::string mac_text(uint32_t n) {
+    const std::vector<uint8_t> bytes = mac(n);
+    std::string text;
+    char octet[4];
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        std::snprintf(octet, sizeof(octet), i ? ":%02x" : "%02x", bytes[i]);
+        text += octet;
+    }
+    return text;
+}
+
+static bool blocked_mac(const nnoe::ClientBlocklist& blocklist, uint32_t n) {
+    const std::vector<uint8_t> bytes = mac(n);
+    return blocklist.contains(nnoe::ClientBlocklist::HWADDR, bytes.data(), bytes.size());
+}
+
+static void test_lookup() {
+    // Never started: events are fed in directly
+    nnoe::ClientBlocklist blocklist(nullptr, "/nnoe/dhcp/blocklist/");
+    const uint8_t hwaddr[] = {0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+    const uint8_t client_id[] = {0x01, 0xaa, 0xbb};
+    const uint8_t duid[] = {0x00, 0x01, 0x00, 0x01, 0x12, 0x34};
+
+    CHECK(!blocklist.contains(nnoe::ClientBlocklist::HWADDR, hwaddr, sizeof(hwaddr)));
+    CHECK(blocklist.size() == 0);
+
+    blocklist.apply({put("hwaddr/aa:bb:cc:dd:ee:ff"), put("client-id/01-AA-BB"),
+                     put("duid/000100011234"), put("hwaddr/zz:00"), put("serial/aa"),
+                     put("hwaddr")});
+    CHECK(blocklist.size() == 3);
+    CHECK(blocklist.contains(nnoe::ClientBlocklist::HWADDR, hwaddr, sizeof(hwaddr)));
+    CHECK(blocklist.contains(nnoe::ClientBlocklist::CLIENT_ID, client_id, sizeof(client_id)));
+    CHECK(blocklist.contains(nnoe::ClientBlocklist::DUID, duid, sizeof(duid)));
+    CHECK(!blocklist.contains(nnoe::ClientBlocklist::HWADDR, hwaddr, 0));
+
+    // The kind is part of the identity
+    CHECK(!blocklist.contains(nnoe::ClientBlocklist::CLIENT_ID, hwaddr, sizeof(hwaddr)));
+    CHECK(!blocklist.contains(nnoe::ClientBlocklist::HWADDR, hwaddr, sizeof(hwaddr) - 1));
+
+    blocklist.apply({erase("hwaddr/aa:bb:cc:dd:ee:ff")});
+    CHECK(!blocklist.contains(nnoe::ClientBlocklist::HWADDR, hwaddr, sizeof(hwaddr)));
+    CHECK(blocklist.size() == 2);
+}
+
+static void test_large_set() {
+    // Bloom false positives fall through to the sorted fingerprints, so
+    // the answer stays exact at any size
+    nnoe::ClientBlocklist blocklist(nullptr, "/nnoe/dhcp/blocklist");
+    std::vector<nnoe::EtcdWatchEvent> events;
+    for (uint32_t n = 0; n < 20000; n += 2) {
+        events.push_back(put("hwaddr/" + mac_text(n)));
+    }
+    blocklist.apply(events);
+    CHECK(blocklist.size() == 10000);
+
+    int missing = 0;
+    int false_positives = 0;
+    for (uint32_t n = 0; n < 20000; ++n) {
+        const bool blocked = blocked_mac(blocklist, n);
+        missing += n % 2 == 0 && !blocked;
+        false_positives += n % 2 == 1 && blocked;
+    }
+    for (uint32_t n = 1000000; n < 1100000; ++n) {
+        false_positives += blocked_mac(blocklist, n);
+    }
+    CHECK(missing == 0);
+    CHECK(false_positives == 0);
+}
+
+static void test_concurrent_publish() {
+    nnoe::ClientBlocklist blocklist(nullptr, "/nnoe/dhcp/blocklist");
+    blocklist.apply({put("hwaddr/" + mac_text(1))});
+
+    // Lookups never see a torn or empty snapshot while others come and go
+    std::atomic<bool> stop(false);
+    std::atomic<int> wrong(0);
+    std::atomic<uint64_t> lookups(0);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&] {
+            while (!stop) {
+                if (!blocked_mac(blocklist, 1) || blocked_mac(blocklist, 2)) {
+                    wrong++;
+                }
+                lookups++;
+            }
+        });
+    }
+
+    for (uint32_t round = 0; round < 500; ++round) {
+        std::vector<nnoe::EtcdWatchEvent> events;
+        for (uint32_t n = 0; n < 20; ++n) {
+            const uint32_t id = 1000 + (round * 20 + n) % 2000;
+            events.push_back(round % 3 == 2 ? erase("hwaddr/" + mac_text(id))
+                                            : put("hwaddr/" + mac_text(id)));
+        }
+        blocklist.apply(events);
+    }
+    stop = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    CHECK(wrong == 0);
+    CHECK(lookups > 0);
+    CHECK(blocked_mac(blocklist, 1));
+}
+
+int main() {
+    test_lookup();
+    test_large_set();
+    test_concurrent_publish();
+
+    return check_result("blocklist_test");
+}
@@ -0,0 +1,50 @@
+/**
+ * Check macro and helpers shared by the unit tests
+ *
+ * CHECK records a failed condition and carries on, so one run reports
+ * every broken expectation. main() ends with check_result(), which prints
+ * the outcome and returns the exit status. wait_until() polls for what
+ * background threads do.
+ */
+
+#ifndef NNOE_TESTS_CHECK_H
+#define NNOE_TESTS_CHECK_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+
+inline int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__,      \
+                         __LINE__, #cond);                                   \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+// Polls done every 10 ms for up to ten seconds; true once it holds
+inline bool wait_until(const std::function<bool()>& done) {
+    for (int i = 0; i < 1000; ++i) {
+        if (done()) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return done();
+}
+
+inline int check_result(const char* test) {
+    if (failures) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    std::printf("%s: all checks passed\n", test);
+    return EXIT_SUCCESS;
+}
+
+#endif // NNOE_TESTS_CHECK_H
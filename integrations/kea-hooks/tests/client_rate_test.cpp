@@ -0,0 +1,131 @@
+/**
+ * Tests for the per-client packet rate limiter
+ */
+
+#include "client_rate.h"
+#include "check.h"
+
+#include <thread>
+#include <vector>
+
+static const uint8_t HWADDR = 1;
+
+static std::vector<uint8_t> mac(uint32_t n) {
+    return {0x02, 0x00, static_cast<uint8_t>(n >> 24), static_cast<uint8_t>(n >> 16),
+            static_cast<uint8_t>(n >> 8), static_cast<uint8_t>(n)};
+}
+
+static nnoe::ClientRateConfig config(nnoe::ClientRateConfig::Action action) {
+    nnoe::ClientRateConfig config;
+    config.threshold = 10;
+    config.interval_ms = 1000;
+    config.action = action;
+    config.width = 1024;
+    config.offenders = 4;
+    return config;
+}
+
+static void test_drop() {
+    nnoe::ClientRateLimiter limiter(config(nnoe::ClientRateConfig::DROP));
+    const std::vector<uint8_t> flooder = mac(1);
+    const std::vector<uint8_t> quiet = mac(2);
+
+    int admitted = 0;
+    for (int i = 0; i < 50; ++i) {
+        admitted += limiter.admit(HWADDR, flooder.data(), flooder.size(), 10000 + i);
+    }
+    CHECK(admitted == 10);
+    CHECK(limiter.admit(HWADDR, quiet.data(), quiet.size(), 10060));
+    CHECK(limiter.rate(HWADDR, flooder.data(), flooder.size(), 10060) == 50);
+
+    // Half of the previous interval still counts halfway through the next
+    CHECK(limiter.rate(HWADDR, flooder.data(), flooder.size(), 11500) == 25);
+    CHECK(!limiter.admit(HWADDR, flooder.data(), flooder.size(), 11500));
+    // Two intervals later the client starts over
+    CHECK(limiter.rate(HWADDR, flooder.data(), flooder.size(), 12100) == 0);
+    CHECK(limiter.admit(HWADDR, flooder.data(), flooder.size(), 12100));
+
+    const nnoe::ClientRateStats stats = limiter.stats();
+    CHECK(stats.checked == 53 && stats.over == 41 && stats.shed == 41);
+
+    const std::vector<nnoe::ClientRateOffender> offenders = limiter.offenders(12100);
+    CHECK(offenders.size() == 1);
+    CHECK(offenders.size() == 1 && offenders[0].id == flooder && offenders[0].shed == 41 &&
+          offenders[0].first_seen_ms == 10010);
+    CHECK(limiter.offenders(20000).empty());
+}
+
+static void test_throttle_and_monitor() {
+    nnoe::ClientRateLimiter throttle(config(nnoe::ClientRateConfig::THROTTLE));
+    nnoe::ClientRateLimiter monitor(config(nnoe::ClientRateConfig::MONITOR));
+    const std::vector<uint8_t> flooder = mac(3);
+
+    int throttled = 0, monitored = 0;
+    for (int i = 0; i < 1000; ++i) {
+        throttled += throttle.admit(HWADDR, flooder.data(), flooder.size(), 5000 + i % 1000);
+        monitored += monitor.admit(HWADDR, flooder.data(), flooder.size(), 5000 + i % 1000);
+    }
+    // About threshold-many get through per interval, not none
+    CHECK(throttled > 10 && throttled < 60);
+    CHECK(monitored == 1000);
+    CHECK(monitor.stats().over == 990 && monitor.stats().shed == 0);
+    CHECK(monitor.offenders(6000).size() == 1);
+}
+
+static void test_offender_table() {
+    nnoe::ClientRateLimiter limiter(config(nnoe::ClientRateConfig::DROP));
+
+    // Clients with growing rates; the table keeps the four largest
+    for (uint32_t client = 0; client < 8; ++client) {
+        const std::vector<uint8_t> id = mac(100 + client);
+        for (uint32_t i = 0; i < 20 + client * 5; ++i) {
+            limiter.admit(HWADDR, id.data(), id.size(), 1000 + client);
+        }
+    }
+    const std::vector<nnoe::ClientRateOffender> offenders = limiter.offenders(1100);
+    CHECK(offenders.size() == 4);
+    CHECK(offenders.size() == 4 && offenders[0].id == mac(107) && offenders[3].id == mac(104));
+    CHECK(limiter.stats().evicted == 4);
+}
+
+static void test_memory_and_threads() {
+    nnoe::MemoryBudget budget;
+    nnoe::MemoryAccount* account = budget.account("rate_limit");
+    {
+        nnoe::ClientRateConfig cfg = config(nnoe::ClientRateConfig::DROP);
+        cfg.threshold = 1000000;
+        nnoe::ClientRateLimiter limiter(cfg);
+        limiter.set_memory(account);
+        CHECK(account->used() >= 2 * 1024 * 4 * sizeof(uint32_t));
+
+        // Bounded memory and exact counts for one client under contention
+        const std::vector<uint8_t> id = mac(7);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&limiter, &id, t]() {
+                for (uint32_t i = 0; i < 20000; ++i) {
+                    const std::vector<uint8_t> other = mac(1000000 + t * 20000 + i);
+                    limiter.admit(HWADDR, other.data(), other.size(), 500);
+                    limiter.admit(HWADDR, id.data(), id.size(), 500);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        const uint32_t rate = limiter.rate(HWADDR, id.data(), id.size(), 500);
+        // Collisions with 80000 other clients only add to the estimate
+        CHECK(rate >= 80000 && rate < 80000 + 1000);
+        CHECK(limiter.stats().checked == 160000);
+    }
+    CHECK(account->used() == 0);
+}
+
+int main() {
+    test_drop();
+    test_throttle_and_monitor();
+    test_offender_table();
+    test_memory_and_threads();
+
+    return check_result("client_rate_test");
+}
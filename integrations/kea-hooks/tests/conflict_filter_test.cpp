@@ -0,0 +1,162 @@
+/**
+ * Tests for the cross-node address conflict filter
+ */
+
+#include "conflict_filter.h"
+#include "check.h"
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+static const std::string PREFIX = "/nnoe/dhcp/leases/";
+
+static nnoe::EtcdWatchEvent put(const std::string& name, const std::string& node,
+                                int64_t expires_at) {
+    nnoe::EtcdWatchEvent event;
+    event.kv.key = PREFIX + name;
+    event.kv.value = "{\"ip\":\"" + name + "\",\"node\":\"" + node +
+                     "\",\"state\":0,\"expires_at\":" + std::to_string(expires_at) + "}";
+    return event;
+}
+
+static nnoe::EtcdWatchEvent erase(const std::string& name) {
+    nnoe::EtcdWatchEvent event;
+    event.type = nnoe::EtcdWatchEvent::DELETE;
+    event.kv.key = PREFIX + name;
+    return event;
+}
+
+static void test_held_elsewhere() {
+    // Never started: events are fed in directly
+    nnoe::ConflictFilter filter(nullptr, "/nnoe/dhcp/leases", "site-a");
+    nnoe::Pool4 pool;
+    pool.subnet_id = 1;
+    pool.first = 0x0a000064;   // 10.0.0.100
+    pool.last = 0x0a0000c8;    // 10.0.0.200
+    filter.set_pools4({pool});
+
+    const int64_t now = time(nullptr);
+    filter.apply({put("10.0.0.150", "site-b", now + 3600),
+                  put("10.0.0.151", "site-a", now + 3600),       // our own
+                  put("10.0.0.152", "site-b", now - 10),         // ran out
+                  put("10.0.1.5", "site-b", now + 3600),         // outside the pools
+                  put("2001:db8::5", "site-b", now + 3600),
+                  put("2001:db8:1::/56", "site-b", now + 3600)});
+
+    CHECK(filter.held_elsewhere4(1, 0x0a000096, now));
+    CHECK(!filter.held_elsewhere4(1, 0x0a000097, now));
+    CHECK(!filter.held_elsewhere4(1, 0x0a000098, now));
+    CHECK(filter.held_elsewhere4(1, 0x0a000105, now));
+    CHECK(filter.held_elsewhere6("2001:db8::5", now));
+    CHECK(filter.held_elsewhere6("2001:db8:1::/56", now));
+    CHECK(!filter.held_elsewhere6("2001:db8:1::/64", now));
+    CHECK(filter.size() == 4);
+
+    // Expiry is checked on every hit
+    CHECK(!filter.held_elsewhere4(1, 0x0a000096, now + 7200));
+
+    // The other server releases the address
+    filter.apply({erase("10.0.0.150")});
+    CHECK(!filter.held_elsewhere4(1, 0x0a000096, now));
+    CHECK(filter.size() == 3);
+
+    // Taken over by this server
+    filter.apply({put("2001:db8::5", "site-a", now + 3600)});
+    CHECK(!filter.held_elsewhere6("2001:db8::5", now));
+
+    // Pools replaced after a reconfiguration keep the addresses held
+    pool.first = 0x0a000100;
+    pool.last = 0x0a0001ff;
+    filter.set_pools4({pool});
+    CHECK(filter.held_elsewhere4(1, 0x0a000105, now));
+}
+
+static nnoe::EtcdWatchEvent delegation(const std::string& name, const std::string& node,
+                                       const std::vector<std::string>& prefixes,
+                                       int64_t expires_at) {
+    nnoe::EtcdWatchEvent event;
+    event.kv.key = "/nnoe/dhcp/delegations/" + name;
+    std::string list;
+    for (const auto& prefix : prefixes) {
+        const size_t slash = prefix.find('/');
+        list += std::string(list.empty() ? "" : ",") + "{\"prefix\":\"" +
+                prefix.substr(0, slash) + "\",\"prefix_len\":" + prefix.substr(slash + 1) +
+                ",\"state\":0,\"expires_at\":" + std::to_string(expires_at) + "}";
+    }
+    event.kv.value = "{\"duid\":\"00:01\",\"iaid\":1,\"prefixes\":[" + list +
+                     "],\"node\":\"" + node + "\"}";
+    return event;
+}
+
+static void test_delegations() {
+    nnoe::ConflictFilter filter(nullptr, "/nnoe/dhcp/leases", "site-a",
+                                "/nnoe/dhcp/delegations");
+    const int64_t now = time(nullptr);
+    filter.apply_delegations({delegation("00:01/1", "site-b",
+                                         {"2001:db8:1::/56", "2001:db8:2::/56"}, now + 3600),
+                              delegation("00:02/1", "site-a", {"2001:db8:3::/56"}, now + 3600)});
+    CHECK(filter.held_elsewhere6("2001:db8:1::/56", now));
+    CHECK(filter.held_elsewhere6("2001:db8:2::/56", now));
+    CHECK(!filter.held_elsewhere6("2001:db8:3::/56", now));
+    CHECK(filter.size() == 2);
+
+    // The IA gives one prefix back, then the other
+    filter.apply_delegations({delegation("00:01/1", "site-b", {"2001:db8:2::/56"}, now + 3600)});
+    CHECK(!filter.held_elsewhere6("2001:db8:1::/56", now));
+    CHECK(filter.held_elsewhere6("2001:db8:2::/56", now));
+
+    nnoe::EtcdWatchEvent erased;
+    erased.type = nnoe::EtcdWatchEvent::DELETE;
+    erased.kv.key = "/nnoe/dhcp/delegations/00:01/1";
+    filter.apply_delegations({erased});
+    CHECK(!filter.held_elsewhere6("2001:db8:2::/56", now));
+    CHECK(filter.size() == 0);
+}
+
+static void test_shared_delegation() {
+    nnoe::ConflictFilter filter(nullptr, "/nnoe/dhcp/leases", "site-a",
+                                "/nnoe/dhcp/delegations");
+    const int64_t now = time(nullptr);
+    filter.apply_delegations({delegation("00:01/1", "site-b", {"2001:db8:1::/56"}, now + 7200),
+                              delegation("00:02/1", "site-c", {"2001:db8:1::/56"}, now + 3600)});
+    CHECK(filter.size() == 1);
+
+    // The other record still delegates the prefix, until its own expiry
+    nnoe::EtcdWatchEvent erased;
+    erased.type = nnoe::EtcdWatchEvent::DELETE;
+    erased.kv.key = "/nnoe/dhcp/delegations/00:01/1";
+    filter.apply_delegations({erased});
+    CHECK(filter.held_elsewhere6("2001:db8:1::/56", now));
+    CHECK(!filter.held_elsewhere6("2001:db8:1::/56", now + 5000));
+    CHECK(filter.size() == 1);
+
+    erased.kv.key = "/nnoe/dhcp/delegations/00:02/1";
+    filter.apply_delegations({erased});
+    CHECK(!filter.held_elsewhere6("2001:db8:1::/56", now));
+    CHECK(filter.size() == 0);
+}
+
+static void test_stats() {
+    nnoe::ConflictFilter filter(nullptr, "/nnoe/dhcp/leases", "site-a");
+    const int64_t now = time(nullptr);
+    filter.apply({put("10.0.0.1", "site-b", now + 60)});
+
+    filter.hint_dropped();
+    filter.hint_dropped();
+    filter.refused();
+
+    const nnoe::ConflictFilterStats stats = filter.stats();
+    CHECK(stats.tracked == 1);
+    CHECK(stats.hints_dropped == 2);
+    CHECK(stats.refused == 1);
+}
+
+int main() {
+    test_held_elsewhere();
+    test_delegations();
+    test_shared_delegation();
+    test_stats();
+
+    return check_result("conflict_filter_test");
+}
@@ -0,0 +1,66 @@
+/**
+ * Tests for the memfile CSV scanner
+ */
+
+#include "csv_scanner.h"
+#include "check.h"
+
+#include <string>
+#include <string_view>
+
+static void test_split() {
+    std::string_view fields[4];
+    CHECK(nnoe::split_csv_row("a,,c", fields, 4) == 3);
+    CHECK(fields[0] == "a" && fields[1].empty() && fields[2] == "c");
+
+    // A trailing comma ends in an empty field
+    CHECK(nnoe::split_csv_row("a,b,", fields, 4) == 3 && fields[2].empty());
+
+    // Fields past max_fields are not returned
+    CHECK(nnoe::split_csv_row("1,2,3,4,5,6", fields, 4) == 4 && fields[3] == "4");
+    CHECK(nnoe::split_csv_row("", fields, 4) == 1 && fields[0].empty());
+}
+
+static void test_parse_uint() {
+    uint64_t value = 0;
+    CHECK(nnoe::parse_csv_uint("4000", value) && value == 4000);
+    CHECK(nnoe::parse_csv_uint("18446744073709551615", value) && value == UINT64_MAX);
+    CHECK(!nnoe::parse_csv_uint("18446744073709551616", value));
+    CHECK(!nnoe::parse_csv_uint("", value));
+    CHECK(!nnoe::parse_csv_uint("-1", value));
+    CHECK(!nnoe::parse_csv_uint("12a", value));
+}
+
+static void test_unescape() {
+    CHECK(nnoe::unescape_csv_field("host") == "host");
+    CHECK(nnoe::unescape_csv_field("a&#x2cb&#x2c") == "a,b,");
+    CHECK(nnoe::unescape_csv_field("a&b") == "a&b");
+}
+
+static void test_columns() {
+    // Kea 2.x header; columns are found by name, not position
+    nnoe::MemfileColumns columns;
+    CHECK(columns.parse_header("address,hwaddr,client_id,valid_lifetime,expire,subnet_id,"
+                               "fqdn_fwd,fqdn_rev,hostname,state,user_context,pool_id"));
+    CHECK(columns.address == 0 && columns.expire == 4 && columns.hostname == 8 &&
+          columns.state == 9 && columns.duid == -1);
+
+    std::string_view fields[nnoe::MemfileColumns::MAX_FIELDS];
+    const size_t count = nnoe::split_csv_row("10.0.0.1,aa:bb,,3600,1003600,7", fields,
+                                             nnoe::MemfileColumns::MAX_FIELDS);
+    CHECK(nnoe::MemfileColumns::field(fields, count, columns.subnet_id) == "7");
+    CHECK(nnoe::MemfileColumns::field(fields, count, columns.state).empty());
+    CHECK(nnoe::MemfileColumns::field(fields, count, columns.duid).empty());
+
+    nnoe::MemfileColumns partial;
+    CHECK(!partial.parse_header("address,hwaddr,expire"));
+}
+
+int main() {
+    test_split();
+    test_parse_uint();
+    test_unescape();
+    test_columns();
+
+    return check_result("csv_scanner_test");
+}
@@ -0,0 +1,177 @@
+/**
+ * Tests for DHCP-driven DNS records: record keys and values, removal that
+ * leaves records a newer lease has taken over, and the records of a name a
+ * client renamed itself from
+ */
+
+#include "dns_records.h"
+#include "check.h"
+
+#include <json/json.h>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::map<std::string, std::string> Store;
+
+// Applies ops the way etcd would
+static void apply_ops(Store& store, const std::vector<nnoe::EtcdOp>& ops) {
+    for (const auto& op : ops) {
+        if (op.type == nnoe::EtcdOp::PUT) {
+            store[op.key] = op.value;
+            continue;
+        }
+        auto it = store.find(op.key);
+        if (it != store.end() && (op.value.empty() || it->second == op.value)) {
+            store.erase(it);
+        }
+    }
+}
+
+static std::string record_value(const Store& store, const std::string& key) {
+    auto it = store.find(key);
+    if (it == store.end()) {
+        return std::string();
+    }
+    Json::Value record;
+    Json::Reader().parse(it->second, record);
+    return record["value"].asString();
+}
+
+static nnoe::DnsRecordBuilder builder() {
+    nnoe::DnsRecordsConfig config;
+    config.forward_zone = "example.com.";
+    return nnoe::DnsRecordBuilder(config);
+}
+
+static const std::string A_KEY = "/nnoe/dns/zones/example.com/dhcp/laptop/A";
+
+static void test_records() {
+    std::vector<nnoe::EtcdOp> ops;
+    builder().add_publish_ops("Laptop.example.com", "192.0.2.10", ops);
+    CHECK(ops.size() == 2);
+
+    Store store;
+    apply_ops(store, ops);
+    CHECK(record_value(store, A_KEY) == "192.0.2.10");
+    CHECK(record_value(store, "/nnoe/dns/zones/2.0.192.in-addr.arpa/dhcp/10/PTR") ==
+          "laptop.example.com.");
+
+    // Unusable names publish nothing
+    ops.clear();
+    builder().add_publish_ops("bad name", "192.0.2.10", ops);
+    builder().add_publish_ops("laptop", "not-an-address", ops);
+    CHECK(ops.empty());
+
+    ops.clear();
+    builder().add_remove_ops("laptop", "192.0.2.10", ops);
+    apply_ops(store, ops);
+    CHECK(store.empty());
+}
+
+static void test_moved_hostname() {
+    const nnoe::DnsRecordBuilder records = builder();
+    Store store;
+
+    // The client moves from X to Y, then the lease on X runs out
+    std::vector<nnoe::EtcdOp> ops;
+    records.add_publish_ops("laptop", "192.0.2.10", ops);
+    records.add_publish_ops("laptop", "192.0.2.20", ops);
+    apply_ops(store, ops);
+    CHECK(record_value(store, A_KEY) == "192.0.2.20");
+
+    ops.clear();
+    records.add_remove_ops("laptop", "192.0.2.10", ops);
+    for (const auto& op : ops) {
+        CHECK(op.type == nnoe::EtcdOp::DELETE && !op.value.empty());
+    }
+    apply_ops(store, ops);
+
+    // Y keeps its name; only X's own PTR goes
+    CHECK(record_value(store, A_KEY) == "192.0.2.20");
+    CHECK(store.count("/nnoe/dns/zones/2.0.192.in-addr.arpa/dhcp/20/PTR") == 1);
+    CHECK(store.count("/nnoe/dns/zones/2.0.192.in-addr.arpa/dhcp/10/PTR") == 0);
+
+    // An address handed to another client keeps the new client's PTR
+    ops.clear();
+    records.add_publish_ops("phone", "192.0.2.20", ops);
+    apply_ops(store, ops);
+    ops.clear();
+    records.add_remove_ops("laptop", "192.0.2.20", ops);
+    apply_ops(store, ops);
+    CHECK(record_value(store, "/nnoe/dns/zones/2.0.192.in-addr.arpa/dhcp/20/PTR") ==
+          "phone.example.com.");
+    CHECK(store.count(A_KEY) == 0);
+}
+
+// The hook's publish and removal of one address under the name table
+static void publish(const nnoe::DnsRecordBuilder& records, nnoe::DnsNameTable& names,
+                    Store& store, const std::string& hostname, const std::string& address) {
+    std::vector<nnoe::EtcdOp> ops;
+    records.add_publish_ops(hostname, address, ops);
+    const std::string previous = names.publish(address, hostname);
+    if (!previous.empty()) {
+        records.add_remove_ops(previous, address, ops);
+    }
+    std::map<std::string, int> keys;
+    for (const auto& op : ops) {
+        CHECK(++keys[op.key] == 1);
+    }
+    apply_ops(store, ops);
+}
+
+static void remove(const nnoe::DnsRecordBuilder& records, nnoe::DnsNameTable& names,
+                   Store& store, const std::string& hostname, const std::string& address) {
+    std::vector<nnoe::EtcdOp> ops;
+    std::vector<std::string> published = names.forget(address);
+    published.insert(published.begin() + (published.empty() ? 0 : 1), hostname);
+    for (const auto& name : published) {
+        records.add_remove_ops(name, address, ops);
+    }
+    std::map<std::string, int> keys;
+    for (const auto& op : ops) {
+        CHECK(++keys[op.key] == 1);
+    }
+    apply_ops(store, ops);
+}
+
+static void test_renamed_client() {
+    const nnoe::DnsRecordBuilder records = builder();
+    nnoe::DnsNameTable names;
+    Store store;
+    const std::string ptr_key = "/nnoe/dns/zones/2.0.192.in-addr.arpa/dhcp/10/PTR";
+
+    // Renewed under a new name: the old A record goes, the PTR follows
+    publish(records, names, store, "laptop", "192.0.2.10");
+    publish(records, names, store, "desk", "192.0.2.10");
+    CHECK(store.count(A_KEY) == 0);
+    CHECK(record_value(store, "/nnoe/dns/zones/example.com/dhcp/desk/A") == "192.0.2.10");
+    CHECK(record_value(store, ptr_key) == "desk.example.com.");
+
+    // The removal of the old name is repeated, in case the write that
+    // carried it was coalesced away; another client's use of it survives
+    publish(records, names, store, "laptop", "192.0.2.20");
+    publish(records, names, store, "desk", "192.0.2.10");
+    CHECK(record_value(store, A_KEY) == "192.0.2.20");
+
+    // Released under its lease's current name, nothing of the address stays
+    remove(records, names, store, "desk", "192.0.2.10");
+    CHECK(store.count("/nnoe/dns/zones/example.com/dhcp/desk/A") == 0);
+    CHECK(store.count(ptr_key) == 0);
+    CHECK(names.size() == 1);
+
+    // Published under a name the lease no longer carries at removal
+    publish(records, names, store, "printer", "192.0.2.10");
+    remove(records, names, store, "", "192.0.2.10");
+    CHECK(store.count("/nnoe/dns/zones/example.com/dhcp/printer/A") == 0);
+    CHECK(store.count(ptr_key) == 0);
+    CHECK(record_value(store, A_KEY) == "192.0.2.20");
+}
+
+int main() {
+    test_records();
+    test_moved_hostname();
+    test_renamed_client();
+
+    return check_result("dns_records_test");
+}
@@ -0,0 +1,342 @@
+/**
+ * Tests for the etcd client's pluggable transport and the sync engine's
+ * completion-driven sending, with a fake asynchronous transport
+ */
+
+#include "etcd_auth.h"
+#include "etcd_client.h"
+#include "sync_engine.h"
+#include "check.h"
+#include "fake_transport.h"
+
+#include <curl/curl.h>
+#include <json/json.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static std::vector<nnoe::EtcdOp> lease_ops(const std::string& key) {
+    return {nnoe::EtcdOp::put(key, "{}")};
+}
+
+static void test_blocking_and_fallback() {
+    auto transport = std::make_shared<FakeTransport>();
+    // Nothing listens there: only the fallback would fail
+    nnoe::EtcdClient client("http://127.0.0.1:1");
+    client.set_transport(transport);
+
+    CHECK(client.asynchronous());
+    CHECK(client.put("/k", "v"));
+    CHECK(transport->requests() == 1);
+
+    bool done = false;
+    bool ok = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    nnoe::EtcdGuardedOps group;
+    group.guard.key = "/seq/a";
+    group.guard.sequence = 1;
+    group.ops = lease_ops("/leases/a");
+    std::vector<bool> applied;
+    client.txn_guarded_async({group}, [&](bool result, long, const std::vector<bool>& guards) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ok = result;
+        applied = guards;
+        done = true;
+        cv.notify_one();
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return done; });
+    }
+    CHECK(ok && applied.size() == 1 && applied[0]);
+    CHECK(transport->key_set().count("/leases/a") == 1);
+
+    // Unavailable: libcurl on the calling thread
+    transport->set_available(false);
+    CHECK(!client.asynchronous());
+    CHECK(!client.put("/k", "v"));
+    CHECK(transport->requests() == 2);
+}
+
+static void test_engine() {
+    auto transport = std::make_shared<FakeTransport>();
+    nnoe::EtcdClient client("http://127.0.0.1:1");
+    client.set_transport(transport);
+
+    nnoe::SyncEngineConfig config;
+    config.max_batch_ops = 8;
+    config.flush_interval_ms = 0;
+    config.senders = 3;
+    config.max_retry_ms = 50;
+    nnoe::MemoryBudget budget;
+    {
+        nnoe::SyncEngine engine(client, config);
+        engine.set_memory(budget.account("sync_queue"));
+        engine.start();
+
+        // Two failed batches are requeued and sent again after a backoff
+        transport->fail_next(2);
+        for (int i = 0; i < 200; ++i) {
+            const std::string key = "/leases/" + std::to_string(i);
+            nnoe::EtcdGuard guard;
+            guard.key = "/seq/" + std::to_string(i);
+            guard.sequence = 1;
+            CHECK(engine.submit(key, lease_ops(key), guard, i % 4));
+        }
+        CHECK(wait_until([&] { return transport->key_set().size() == 200; }));
+        CHECK(wait_until([&] { return engine.stats().pending == 0; }));
+
+        const nnoe::SyncEngineStats stats = engine.stats();
+        CHECK(stats.failures == 2);
+        CHECK(stats.stale == 0);
+        CHECK(transport->max_outstanding() <= 3);
+        CHECK(transport->max_outstanding() > 1);
+
+        // Events queued right before stop are flushed by it
+        for (int i = 200; i < 220; ++i) {
+            const std::string key = "/leases/" + std::to_string(i);
+            nnoe::EtcdGuard guard;
+            guard.key = "/seq/" + std::to_string(i);
+            guard.sequence = 1;
+            engine.submit(key, lease_ops(key), guard);
+        }
+        engine.stop();
+        CHECK(transport->key_set().size() == 220);
+    }
+    CHECK(budget.account("sync_queue")->used() == 0);
+}
+
+static std::string decoded(const Json::Value& value) {
+    return nnoe::base64_decode(value.asString());
+}
+
+static nnoe::EtcdGuardedOps guarded(const std::string& name, uint64_t sequence) {
+    nnoe::EtcdGuardedOps group;
+    group.guard.key = "/seq/" + name;
+    group.guard.sequence = sequence;
+    group.ops = lease_ops("/leases/" + name);
+    return group;
+}
+
+static void test_guarded_encoding() {
+    auto transport = std::make_shared<FakeTransport>();
+    nnoe::EtcdClient client("http://127.0.0.1:1");
+    client.set_transport(transport);
+
+    // Per request entry: the first guard passes, the second is stored
+    // and older, the third is stored and newer (the nested response has
+    // no "succeeded" then); the unguarded put sits in between
+    transport->set_responder([](const Json::Value&, Json::Value& response) {
+        Json::Value& responses = response["responses"];
+        responses[0]["response_txn"]["succeeded"] = true;
+        responses[1]["response_put"] = Json::objectValue;
+        responses[2]["response_txn"]["succeeded"] = false;
+        responses[2]["response_txn"]["responses"][0]["response_txn"]["succeeded"] = true;
+        responses[3]["response_txn"]["responses"][0]["response_txn"] = Json::objectValue;
+    });
+
+    nnoe::EtcdGuardedOps plain;
+    plain.ops = lease_ops("/leases/plain");
+    nnoe::EtcdGuardedOps removed = guarded("c", 9);
+    removed.ops = {nnoe::EtcdOp::del("/leases/c"), nnoe::EtcdOp::del_if("/dns/c", "record")};
+    removed.guard.lease = 99;
+
+    std::vector<bool> applied;
+    CHECK(client.txn_guarded({guarded("a", 5), plain, guarded("b", 6), removed}, &applied));
+    CHECK(applied.size() == 4 && applied[0] && applied[1] && applied[2] && !applied[3]);
+
+    const std::vector<Json::Value> txns = transport->txns();
+    CHECK(txns.size() == 1);
+    if (txns.size() != 1) {
+        return;
+    }
+    const Json::Value& success = txns[0]["success"];
+    CHECK(success.size() == 4);
+
+    // First write: create_revision 0, then the ops and the sequence stamp
+    const Json::Value& outer = success[0]["request_txn"];
+    CHECK(decoded(outer["compare"][0]["key"]) == "/seq/a");
+    CHECK(outer["compare"][0]["target"].asString() == "CREATE");
+    CHECK(outer["compare"][0]["result"].asString() == "EQUAL");
+    CHECK(outer["compare"][0]["create_revision"].asString() == "0");
+    CHECK(outer["success"].size() == 2);
+    CHECK(decoded(outer["success"][0]["request_put"]["key"]) == "/leases/a");
+    const Json::Value& stamp = outer["success"][1]["request_put"];
+    CHECK(decoded(stamp["key"]) == "/seq/a");
+    CHECK(decoded(stamp["value"]) == nnoe::format_sequence(5));
+    CHECK(!stamp.isMember("lease"));
+
+    // Ordered write nested in the failure branch with the same ops
+    const Json::Value& ordered = outer["failure"][0]["request_txn"];
+    CHECK(decoded(ordered["compare"][0]["key"]) == "/seq/a");
+    CHECK(ordered["compare"][0]["target"].asString() == "VALUE");
+    CHECK(ordered["compare"][0]["result"].asString() == "LESS");
+    CHECK(decoded(ordered["compare"][0]["value"]) == nnoe::format_sequence(5));
+    CHECK(ordered["success"] == outer["success"]);
+
+    // Unguarded ops go inline
+    CHECK(decoded(success[1]["request_put"]["key"]) == "/leases/plain");
+
+    // A guard lease is attached to the stamp only
+    const Json::Value& removal = success[3]["request_txn"]["success"];
+    CHECK(decoded(removal[0]["request_delete_range"]["key"]) == "/leases/c");
+    CHECK(removal[2]["request_put"]["lease"].asString() == "99");
+
+    // A conditional delete nests a txn on the value it expects
+    const Json::Value& held = removal[1]["request_txn"];
+    CHECK(decoded(held["compare"][0]["key"]) == "/dns/c");
+    CHECK(held["compare"][0]["target"].asString() == "VALUE");
+    CHECK(held["compare"][0]["result"].asString() == "EQUAL");
+    CHECK(decoded(held["compare"][0]["value"]) == "record");
+    CHECK(decoded(held["success"][0]["request_delete_range"]["key"]) == "/dns/c");
+    CHECK(!held.isMember("failure"));
+}
+
+static void test_create() {
+    auto transport = std::make_shared<FakeTransport>();
+    nnoe::EtcdClient client("http://127.0.0.1:1");
+    client.set_transport(transport);
+
+    // The first request finds the key free, the second held
+    int answered = 0;
+    transport->set_responder([&](const Json::Value&, Json::Value& response) {
+        if (answered++ == 0) {
+            response["succeeded"] = true;
+            return;
+        }
+        Json::Value kv;
+        kv["key"] = nnoe::base64_encode("/leases/a");
+        kv["value"] = nnoe::base64_encode("{\"node\":\"other\"}");
+        response["responses"][0]["response_range"]["kvs"].append(kv);
+    });
+
+    bool created = false;
+    std::string current;
+    CHECK(client.txn_create("/leases/a", lease_ops("/leases/a"), created, &current));
+    CHECK(created && current.empty());
+    CHECK(client.txn_create("/leases/a", lease_ops("/leases/a"), created, &current));
+    CHECK(!created && current == "{\"node\":\"other\"}");
+
+    const std::vector<Json::Value> txns = transport->txns();
+    CHECK(txns.size() == 2);
+    if (txns.size() != 2) {
+        return;
+    }
+    const Json::Value& request = txns[0];
+    CHECK(decoded(request["compare"][0]["key"]) == "/leases/a");
+    CHECK(request["compare"][0]["target"].asString() == "CREATE");
+    CHECK(request["compare"][0]["create_revision"].asString() == "0");
+    CHECK(decoded(request["success"][0]["request_put"]["key"]) == "/leases/a");
+    CHECK(decoded(request["failure"][0]["request_range"]["key"]) == "/leases/a");
+
+    // No answer: not created, and the caller is told
+    transport->fail_next(1);
+    CHECK(!client.txn_create("/leases/b", lease_ops("/leases/b"), created));
+}
+
+static void test_guard_grace() {
+    auto transport = std::make_shared<FakeTransport>();
+    nnoe::EtcdClient client("http://127.0.0.1:1");
+    client.set_transport(transport);
+
+    nnoe::SyncEngineConfig config;
+    config.flush_interval_ms = 0;
+    config.senders = 1;
+    config.guard_grace_s = 60;
+    {
+        nnoe::SyncEngine engine(client, config);
+        engine.start();
+        for (int i = 0; i < 3; ++i) {
+            const std::string key = "/leases/" + std::to_string(i);
+            nnoe::EtcdGuard guard;
+            guard.key = "/seq/" + std::to_string(i);
+            guard.sequence = 1;
+            std::vector<nnoe::EtcdOp> ops = lease_ops(key);
+            if (i > 0) {
+                ops = {nnoe::EtcdOp::del(key)};
+            }
+            engine.submit(key, ops, guard);
+        }
+        engine.stop();
+    }
+
+    // One grant serves every delete; a put stamps without a lease
+    CHECK(transport->grants() == 1);
+    int leased = 0;
+    int unleased = 0;
+    for (const auto& txn : transport->txns()) {
+        for (const auto& entry : txn["success"]) {
+            const Json::Value& ops = entry["request_txn"]["success"];
+            const Json::Value& stamp = ops[ops.size() - 1]["request_put"];
+            if (ops[0].isMember("request_delete_range")) {
+                leased += stamp["lease"].asString() == "77";
+            } else {
+                unleased += !stamp.isMember("lease");
+            }
+        }
+    }
+    CHECK(leased == 2);
+    CHECK(unleased == 1);
+}
+
+static void test_rejected_token() {
+    auto transport = std::make_shared<FakeTransport>();
+    nnoe::EtcdClient client("http://127.0.0.1:1");
+    client.set_transport(transport);
+    // Authentication fails (nothing listens), which is all the test needs:
+    // renewals are counted either way
+    auto auth = std::make_shared<nnoe::EtcdAuth>("http://127.0.0.1:1", "user", "secret");
+    client.set_auth(auth);
+
+    std::atomic<int> answered(0);
+    transport->set_responder([&](const Json::Value&, Json::Value& response) {
+        if (answered++ == 0) {
+            response["error"] = "etcdserver: invalid auth token";
+        }
+    });
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    int done = 0;
+    bool ok = true;
+    auto send = [&] {
+        client.txn_guarded_async({guarded("a", 1)},
+            [&](bool result, long, const std::vector<bool>&) {
+                std::lock_guard<std::mutex> lock(mutex);
+                ok = result;
+                done++;
+                cv.notify_one();
+            });
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return done > 0; });
+        done = 0;
+    };
+
+    // Rejected: failed without a renewal on the transport thread
+    send();
+    CHECK(!ok);
+    CHECK(auth->stats().rejected == 0);
+    CHECK(transport->requests() == 1);
+
+    // The caller's retry renews first
+    send();
+    CHECK(ok);
+    CHECK(auth->stats().rejected == 1);
+    CHECK(transport->requests() == 2);
+}
+
+int main() {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    test_blocking_and_fallback();
+    test_engine();
+    test_guarded_encoding();
+    test_create();
+    test_guard_grace();
+    test_rejected_token();
+    curl_global_cleanup();
+
+    return check_result("etcd_transport_test");
+}
@@ -0,0 +1,183 @@
+/**
+ * Fake asynchronous etcd transport shared by the unit tests
+ *
+ * Completes requests in order on a thread of its own after delay_ms,
+ * answering every txn with all guards passed (or as a responder decides)
+ * and every lease grant with lease 77. It records the lease key of each
+ * guarded group it applied, in sending order, and can fail the next
+ * requests, refuse txns with an HTTP status or report itself unavailable.
+ */
+
+#ifndef NNOE_TESTS_FAKE_TRANSPORT_H
+#define NNOE_TESTS_FAKE_TRANSPORT_H
+
+#include "etcd_client.h"
+
+#include <json/json.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+class FakeTransport : public nnoe::EtcdTransport {
+public:
+    typedef std::function<void(const Json::Value& request, Json::Value& response)> Responder;
+    // HTTP status for a txn; anything but 200 leaves it unapplied
+    typedef std::function<long(const Json::Value& request)> Status;
+
+    explicit FakeTransport(int delay_ms = 5)
+        : delay_ms_(delay_ms), thread_(&FakeTransport::run, this) {}
+
+    ~FakeTransport() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    bool available(bool) const override { return available_; }
+
+    void post(const std::string& path, const std::string& body, const std::string&,
+              const Completion& completion) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(Request{path, body, completion});
+        outstanding_++;
+        max_outstanding_ = std::max(max_outstanding_, outstanding_);
+        requests_++;
+        cv_.notify_all();
+    }
+
+    void set_available(bool available) { available_ = available; }
+    void set_responder(const Responder& responder) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        responder_ = responder;
+    }
+    void set_status(const Status& status) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        status_ = status;
+    }
+    void fail_next(int count) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fail_ = count;
+    }
+
+    // Lease keys in sending order
+    std::vector<std::string> keys() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return keys_;
+    }
+    std::set<std::string> key_set() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::set<std::string>(keys_.begin(), keys_.end());
+    }
+    std::vector<Json::Value> txns() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return txns_;
+    }
+    int requests() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return requests_;
+    }
+    int grants() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return grants_;
+    }
+    int max_outstanding() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return max_outstanding_;
+    }
+
+private:
+    struct Request {
+        std::string path;
+        std::string body;
+        Completion completion;
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            Request request = queue_.front();
+            queue_.pop_front();
+            const bool fail = fail_ > 0;
+            if (fail) {
+                fail_--;
+            }
+            const Responder responder = responder_;
+            const Status status_of = status_;
+            lock.unlock();
+            if (delay_ms_) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms_));
+            }
+
+            Json::Value parsed;
+            Json::Reader().parse(request.body, parsed);
+            Json::Value response;
+            response["header"]["revision"] = "7";
+            std::vector<std::string> keys;
+            const long status =
+                request.path == "/v3/kv/txn" && status_of ? status_of(parsed) : 200;
+            if (status != 200) {
+                response["message"] = "refused";
+            } else if (request.path == "/v3/kv/txn" && responder) {
+                responder(parsed, response);
+            } else if (request.path == "/v3/kv/txn") {
+                const Json::Value& success = parsed["success"];
+                for (Json::ArrayIndex i = 0; i < success.size(); ++i) {
+                    const Json::Value& put =
+                        success[i]["request_txn"]["success"][0]["request_put"];
+                    keys.push_back(nnoe::base64_decode(put["key"].asString()));
+                    response["responses"][i]["response_txn"]["succeeded"] = true;
+                }
+            } else if (request.path == "/v3/lease/grant") {
+                response["ID"] = "77";
+            }
+            std::string body = fail ? std::string() : Json::FastWriter().write(response);
+
+            lock.lock();
+            if (!fail) {
+                keys_.insert(keys_.end(), keys.begin(), keys.end());
+                if (request.path == "/v3/kv/txn" && status == 200) {
+                    txns_.push_back(parsed);
+                }
+                grants_ += request.path == "/v3/lease/grant";
+            }
+            outstanding_--;
+            lock.unlock();
+            request.completion(!fail, fail ? 0 : status, body);
+            lock.lock();
+        }
+    }
+
+    const int delay_ms_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Request> queue_;
+    std::atomic<bool> available_{true};
+    bool stop_ = false;
+    int fail_ = 0;
+    int outstanding_ = 0;
+    int max_outstanding_ = 0;
+    int requests_ = 0;
+    int grants_ = 0;
+    Responder responder_;
+    Status status_;
+    std::vector<std::string> keys_;
+    std::vector<Json::Value> txns_;
+    std::thread thread_;
+};
+
+#endif // NNOE_TESTS_FAKE_TRANSPORT_H
@@ -0,0 +1,212 @@
+/**
+ * Tests for the lease history archive
+ */
+
+#include "lease_history.h"
+#include "check.h"
+
+#include <dirent.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+static nnoe::HistoryEvent event(int64_t time, const std::string& operation,
+                                const std::string& address, const std::string& client,
+                                uint32_t valid_lft = 3600) {
+    nnoe::HistoryEvent entry;
+    entry.time = time;
+    entry.operation = operation;
+    entry.address = address;
+    entry.client = client;
+    entry.hostname = client.empty() ? "" : "host-" + client.substr(client.size() - 2);
+    entry.subnet_id = 7;
+    entry.valid_lft = valid_lft;
+    return entry;
+}
+
+static std::string temp_dir() {
+    char path[] = "/tmp/nnoe-history-test-XXXXXX";
+    return mkdtemp(path) ? path : "";
+}
+
+static void remove_dir(const std::string& path) {
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        return;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name != "." && name != "..") {
+            unlink((path + "/" + name).c_str());
+        }
+    }
+    closedir(dir);
+    rmdir(path.c_str());
+}
+
+static void write_segment(const std::string& dir, const std::vector<nnoe::HistoryEvent>& events,
+                          int64_t min_time, int64_t max_time) {
+    std::ofstream out(dir + "/" + nnoe::history_segment_name(min_time, max_time, 0),
+                      std::ios::binary);
+    out << nnoe::encode_history_segment(events);
+}
+
+static void test_segment_names() {
+    int64_t min_time = 0, max_time = 0;
+    CHECK(nnoe::parse_history_segment_name(nnoe::history_segment_name(100, 200, 3),
+                                           min_time, max_time));
+    CHECK(min_time == 100 && max_time == 200);
+    CHECK(!nnoe::parse_history_segment_name("history-100-200-3.seg.tmp", min_time, max_time));
+    CHECK(!nnoe::parse_history_segment_name(".partial-12.seg", min_time, max_time));
+}
+
+static void test_query() {
+    const std::string dir = temp_dir();
+    CHECK(!dir.empty());
+
+    // Out of order within a segment; sorted on encoding
+    write_segment(dir, {event(1030, "renew", "10.0.0.1", "aa:01"),
+                        event(1000, "ack", "10.0.0.1", "aa:01"),
+                        event(1010, "ack", "10.0.0.2", "aa:02")}, 1000, 1030);
+    write_segment(dir, {event(2000, "release", "10.0.0.1", "aa:01", 0),
+                        event(2100, "ack", "10.0.0.1", "aa:03"),
+                        event(2200, "ack", "10.0.0.4", "")}, 2000, 2200);
+
+    nnoe::LeaseHistoryReader reader(dir);
+    std::string error;
+    std::vector<nnoe::HistoryEvent> events;
+
+    nnoe::HistoryQuery by_address;
+    by_address.address = "10.0.0.1";
+    CHECK(reader.query(by_address, events, error));
+    CHECK(events.size() == 4);
+    CHECK(events.size() == 4 && events[0].time == 1000 && events[1].operation == "renew" &&
+          events[3].client == "aa:03" && events[3].hostname == "host-03" &&
+          events[3].subnet_id == 7 && events[3].valid_lft == 3600);
+
+    events.clear();
+    nnoe::HistoryQuery by_client;
+    by_client.client = "aa:01";
+    by_client.from = 1020;
+    CHECK(reader.query(by_client, events, error));
+    CHECK(events.size() == 2 && events[0].time == 1030 && events[1].operation == "release");
+
+    events.clear();
+    nnoe::HistoryQuery missing;
+    missing.address = "10.9.9.9";
+    CHECK(reader.query(missing, events, error) && events.empty());
+
+    nnoe::HistoryEvent last;
+    CHECK(reader.last_event("10.0.0.1", 1500, last, error));
+    CHECK(last.time == 1030 && last.client == "aa:01");
+    CHECK(nnoe::LeaseHistoryReader::holds(last, 1500));
+    CHECK(reader.last_event("10.0.0.1", 2050, last, error));
+    CHECK(last.operation == "release" && !nnoe::LeaseHistoryReader::holds(last, 2050));
+    CHECK(reader.last_event("10.0.0.1", 9999, last, error) && last.client == "aa:03");
+    CHECK(!reader.last_event("10.0.0.1", 999, last, error) && error.empty());
+
+    // A corrupt segment is reported, not skipped silently
+    std::ofstream(dir + "/" + nnoe::history_segment_name(3000, 3000, 0)) << "garbage";
+    events.clear();
+    CHECK(!reader.query(by_address, events, error) && !error.empty());
+
+    remove_dir(dir);
+}
+
+static uint32_t read_u32(const std::string& image, size_t pos) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; --i) {
+        value = (value << 8) | static_cast<uint8_t>(image[pos + i]);
+    }
+    return value;
+}
+
+static void write_u32(std::string& image, size_t pos, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        image[pos + i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+static void test_corrupt_dictionary() {
+    const std::string dir = temp_dir();
+    CHECK(!dir.empty());
+
+    std::string image = nnoe::encode_history_segment(
+        {event(1000, "ack", "10.0.0.1", "aa:01"), event(1010, "ack", "10.0.0.2", "aa:02")});
+
+    // Point the address dictionary's first string past its blob; the
+    // section table starts after the 32-byte header, 32 bytes an entry
+    const uint32_t sections = read_u32(image, 12);
+    size_t dict = 0;
+    for (uint32_t i = 0; i < sections; ++i) {
+        if (read_u32(image, 32 + 32 * i) == 2) {
+            dict = read_u32(image, 32 + 32 * i + 8);
+        }
+    }
+    CHECK(dict != 0);
+    write_u32(image, dict + 8, 0xffffff00);
+    std::ofstream(dir + "/" + nnoe::history_segment_name(1000, 1010, 0), std::ios::binary)
+        << image;
+
+    nnoe::LeaseHistoryReader reader(dir);
+    std::string error;
+    std::vector<nnoe::HistoryEvent> events;
+    nnoe::HistoryQuery query;
+    query.address = "10.0.0.1";
+    CHECK(!reader.query(query, events, error) && !error.empty());
+    CHECK(events.empty());
+
+    remove_dir(dir);
+}
+
+static void test_writer() {
+    const std::string dir = temp_dir();
+    CHECK(!dir.empty());
+
+    nnoe::MemoryBudget budget;
+    nnoe::MemoryAccount* account = budget.account("history");
+    {
+        nnoe::LeaseHistoryConfig config;
+        config.directory = dir;
+        config.partition_seconds = 3600;
+        config.segment_events = 100;
+        nnoe::LeaseHistoryWriter writer(config);
+        writer.set_memory(account);
+        CHECK(writer.start());
+
+        // Two partitions, the first one over the segment size
+        for (int i = 0; i < 250; ++i) {
+            writer.append(event(3600 + i, "ack", "10.0.1." + std::to_string(i % 50),
+                                "bb:" + std::to_string(10 + i % 50)));
+        }
+        writer.append(event(7300, "expire", "10.0.1.1", "bb:11", 0));
+        CHECK(account->used() > 0);
+        writer.stop();
+
+        const nnoe::LeaseHistoryStats stats = writer.stats();
+        CHECK(stats.appended == 251 && stats.buffered == 0 && stats.write_errors == 0);
+        CHECK(stats.segments == 4);
+    }
+    CHECK(account->used() == 0);
+
+    nnoe::LeaseHistoryReader reader(dir);
+    std::string error;
+    std::vector<nnoe::HistoryEvent> events;
+    nnoe::HistoryQuery query;
+    query.address = "10.0.1.1";
+    CHECK(reader.query(query, events, error));
+    CHECK(events.size() == 6 && events.back().operation == "expire");
+
+    remove_dir(dir);
+}
+
+int main() {
+    test_segment_names();
+    test_query();
+    test_corrupt_dictionary();
+    test_writer();
+
+    return check_result("lease_history_test");
+}
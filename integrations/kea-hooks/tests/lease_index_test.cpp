@@ -0,0 +1,203 @@
+/**
+ * Tests for the in-memory lease index
+ */
+
+#include "lease_index.h"
+#include "check.h"
+
+#include <arpa/inet.h>
+#include <array>
+#include <ctime>
+#include <string>
+
+static uint32_t v4(const char* text) {
+    in_addr addr;
+    inet_pton(AF_INET, text, &addr);
+    return ntohl(addr.s_addr);
+}
+
+static nnoe::IndexedLease lease(const std::string& address, uint32_t subnet_id,
+                                uint32_t state, int64_t expires_at,
+                                const std::string& hwaddr = "") {
+    nnoe::IndexedLease entry;
+    entry.address = address;
+    entry.hwaddr = hwaddr;
+    entry.subnet_id = subnet_id;
+    entry.state = state;
+    entry.expires_at = expires_at;
+    return entry;
+}
+
+static void test_subnet_and_client() {
+    const int64_t now = time(nullptr);
+    nnoe::LeaseIndex index;
+
+    index.upsert(lease("10.0.0.10", 1, 0, now + 600, "aa:aa"));
+    index.upsert(lease("10.0.0.11", 1, 1, now + 600, "bb:bb"));
+    index.upsert(lease("10.0.1.10", 2, 0, now + 600, "aa:aa"));
+    CHECK(index.size() == 3);
+
+    CHECK(index.by_subnet(1, -1, 100).size() == 2);
+    CHECK(index.by_subnet(1, 1, 100).size() == 1);
+    CHECK(index.by_subnet(1, -1, 1).size() == 1);
+    CHECK(index.by_subnet(3, -1, 100).empty());
+    CHECK(index.by_hwaddr("aa:aa").size() == 2);
+
+    // Moving a lease to another client and subnet updates every index
+    index.upsert(lease("10.0.0.10", 2, 0, now + 600, "cc:cc"));
+    CHECK(index.by_subnet(1, -1, 100).size() == 1);
+    CHECK(index.by_subnet(2, -1, 100).size() == 2);
+    CHECK(index.by_hwaddr("aa:aa").size() == 1);
+    CHECK(index.by_hwaddr("cc:cc").size() == 1);
+
+    index.remove("10.0.0.10");
+    index.remove("10.9.9.9");
+    CHECK(index.size() == 2);
+    CHECK(index.by_hwaddr("cc:cc").empty());
+}
+
+static void test_expiring() {
+    const int64_t now = time(nullptr);
+    nnoe::LeaseIndex index(60);
+
+    index.upsert(lease("10.0.0.1", 1, 0, now + 30));
+    index.upsert(lease("10.0.0.2", 1, 0, now + 5));
+    index.upsert(lease("10.0.0.3", 1, 0, now + 300));   // beyond the wheel
+    index.upsert(lease("10.0.0.4", 1, 0, now - 10));    // already expired
+    index.upsert(lease("10.0.0.5", 1, 0, now + 90));    // beyond the wheel
+
+    auto soon = index.expiring(now, 60, 100);
+    CHECK(soon.size() == 2);
+    CHECK(soon.size() == 2 && soon[0].address == "10.0.0.2" && soon[1].address == "10.0.0.1");
+
+    auto all = index.expiring(now, 3600, 100);
+    CHECK(all.size() == 4);
+    CHECK(all.size() == 4 && all[2].address == "10.0.0.5" && all[3].address == "10.0.0.3");
+
+    CHECK(index.expiring(now, 3600, 1).size() == 1);
+
+    // Renewal moves the lease out of the window
+    index.upsert(lease("10.0.0.2", 1, 0, now + 1000));
+    CHECK(index.expiring(now, 60, 100).size() == 1);
+}
+
+static void test_utilization() {
+    const int64_t now = time(nullptr);
+    nnoe::LeaseIndex index;
+
+    index.upsert(lease("192.168.1.10", 1, 0, now + 600));
+    index.set_pools4({{1, v4("192.168.1.10"), v4("192.168.1.109")},
+                      {1, v4("192.168.1.200"), v4("192.168.1.200")},
+                      {2, v4("192.168.2.0"), v4("192.168.2.255")}});
+
+    auto pools = index.utilization(1);
+    CHECK(pools.size() == 2);
+    CHECK(pools.size() == 2 && pools[0].total == 100 && pools[0].assigned == 1);
+    CHECK(pools.size() == 2 && pools[1].first == "192.168.1.200" && pools[1].total == 1);
+
+    index.upsert(lease("192.168.1.200", 1, 1, now + 600));   // declined counts
+    index.upsert(lease("192.168.1.11", 1, 2, now + 600));    // reclaimed does not
+    index.upsert(lease("192.168.1.10", 1, 0, now + 900));    // renewal, no double count
+    index.upsert(lease("192.168.9.9", 1, 0, now + 600));     // outside every pool
+    pools = index.utilization(1);
+    CHECK(pools.size() == 2 && pools[0].assigned == 1 && pools[1].assigned == 1);
+
+    index.remove("192.168.1.10");
+    CHECK(index.utilization(1)[0].assigned == 0);
+    CHECK(index.utilization(0).size() == 3);
+}
+
+static nnoe::Pool6 pool6(uint32_t subnet_id, const char* first, const char* last,
+                          uint64_t capacity) {
+    nnoe::Pool6 pool;
+    pool.subnet_id = subnet_id;
+    inet_pton(AF_INET6, first, pool.first.data());
+    inet_pton(AF_INET6, last, pool.last.data());
+    pool.capacity = capacity;
+    return pool;
+}
+
+static void test_utilization6() {
+    const int64_t now = time(nullptr);
+    nnoe::LeaseIndex index;
+
+    index.upsert(lease("2001:db8:1::10", 1, 0, now + 600));
+    index.set_pools6({pool6(1, "2001:db8:1::", "2001:db8:1::ffff", 65536),
+                      pool6(1, "2001:db8:100::", "2001:db8:1ff:ffff:ffff:ffff:ffff:ffff", 256),
+                      pool6(2, "2001:db8:2::", "2001:db8:2::ff", 256)});
+
+    uint64_t assigned = 0;
+    uint64_t total = 0;
+    CHECK(index.pool_usage(1, "2001:db8:1::1", assigned, total));
+    CHECK(assigned == 1 && total == 65536);
+
+    // Delegated prefixes count against their pool, by the prefix address
+    index.upsert(lease("2001:db8:100::", 1, 0, now + 600));
+    index.upsert(lease("2001:db8:101::", 1, 1, now + 600));    // declined counts
+    index.upsert(lease("2001:db8:102::", 1, 3, now + 600));    // released does not
+    index.upsert(lease("2001:db8:100::", 1, 0, now + 900));    // renewal, no double count
+    CHECK(index.pool_usage(1, "2001:db8:1ff::", assigned, total));
+    CHECK(assigned == 2 && total == 256);
+
+    index.upsert(lease("2001:db8:101::", 1, 2, now + 600));    // reclaimed
+    index.remove("2001:db8:100::");
+    CHECK(index.pool_usage(1, "2001:db8:100::", assigned, total) && assigned == 0);
+
+    // Outside every pool, another subnet's pool, IPv4 pools
+    CHECK(!index.pool_usage(1, "2001:db8:3::1", assigned, total));
+    CHECK(!index.pool_usage(3, "2001:db8:1::1", assigned, total));
+    index.set_pools4({{1, v4("192.168.1.10"), v4("192.168.1.19")}});
+    index.upsert(lease("192.168.1.12", 1, 0, now + 600));
+    CHECK(index.pool_usage(1, "192.168.1.10", assigned, total) && assigned == 1 && total == 10);
+    CHECK(!index.pool_usage(1, "192.168.1.20", assigned, total));
+
+    // Binary addresses, as the lifetime callouts pass them
+    CHECK(index.pool_usage(1, v4("192.168.1.19"), assigned, total) && assigned == 1);
+    CHECK(!index.pool_usage(1, v4("192.168.1.9"), assigned, total));
+    std::array<uint8_t, 16> addr6;
+    inet_pton(AF_INET6, "2001:db8:1::ffff", addr6.data());
+    CHECK(index.pool_usage(1, addr6, assigned, total) && assigned == 1 && total == 65536);
+    CHECK(!index.pool_usage(2, addr6, assigned, total));
+
+    // Rebuilding either family's pools leaves the other's counts alone
+    CHECK(index.pool_usage(1, "2001:db8:1::", assigned, total) && assigned == 1);
+    CHECK(index.utilization(1).size() == 3);
+
+    index.clear();
+    CHECK(index.pool_usage(1, "2001:db8:1::", assigned, total) && assigned == 0);
+}
+
+static void test_memory_budget() {
+    const int64_t now = time(nullptr);
+    nnoe::MemoryBudget budget(64 * 1024);
+    nnoe::MemoryAccount* account = budget.account("lease_index", 4096);
+
+    {
+        nnoe::LeaseIndex index;
+        index.set_memory(account);
+        for (int i = 0; i < 100; ++i) {
+            index.upsert(lease("10.0.0." + std::to_string(i), 1, 0, now + 60));
+        }
+
+        // New leases stop being indexed at the account cap, updates still apply
+        CHECK(index.size() > 0 && index.size() < 100);
+        CHECK(account->used() <= 4096 && account->stats().refused > 0);
+        const size_t indexed = index.size();
+        index.upsert(lease("10.0.0.0", 2, 0, now + 60));
+        CHECK(index.size() == indexed && index.by_subnet(2, -1, 10).size() == 1);
+
+        index.remove("10.0.0.0");
+        CHECK(index.size() == indexed - 1);
+    }
+    CHECK(account->used() == 0 && budget.used() == 0);
+}
+
+int main() {
+    test_subnet_and_client();
+    test_expiring();
+    test_utilization();
+    test_utilization6();
+    test_memory_budget();
+
+    return check_result("lease_index_test");
+}
@@ -0,0 +1,265 @@
+/**
+ * Tests for the header-only lease reader
+ */
+
+#include <nnoe/lease_reader.h>
+#include "check.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+static std::string encode(const std::string& in) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    size_t i = 0;
+    for (; i + 3 <= in.size(); i += 3) {
+        const uint32_t v = (static_cast<uint8_t>(in[i]) << 16) |
+                           (static_cast<uint8_t>(in[i + 1]) << 8) |
+                           static_cast<uint8_t>(in[i + 2]);
+        out.push_back(alphabet[(v >> 18) & 63]);
+        out.push_back(alphabet[(v >> 12) & 63]);
+        out.push_back(alphabet[(v >> 6) & 63]);
+        out.push_back(alphabet[v & 63]);
+    }
+    if (in.size() - i == 1) {
+        const uint32_t v = static_cast<uint8_t>(in[i]) << 16;
+        out.push_back(alphabet[(v >> 18) & 63]);
+        out.push_back(alphabet[(v >> 12) & 63]);
+        out += "==";
+    } else if (in.size() - i == 2) {
+        const uint32_t v = (static_cast<uint8_t>(in[i]) << 16) |
+                           (static_cast<uint8_t>(in[i + 1]) << 8);
+        out.push_back(alphabet[(v >> 18) & 63]);
+        out.push_back(alphabet[(v >> 12) & 63]);
+        out.push_back(alphabet[(v >> 6) & 63]);
+        out.push_back('=');
+    }
+    return out;
+}
+
+static std::string decode(const std::string& in) {
+    std::string buffer = in;
+    const size_t size = nnoe::base64_decode(buffer.data(), buffer.size(), &buffer[0]);
+    if (size == nnoe::BASE64_INVALID) {
+        return "<invalid>";
+    }
+    buffer.resize(size);
+    return buffer;
+}
+
+static void test_base64_vectors() {
+    CHECK(decode("") == "");
+    CHECK(decode("Zg==") == "f");
+    CHECK(decode("Zm8=") == "fo");
+    CHECK(decode("Zm9v") == "foo");
+    CHECK(decode("Zm9vYmFy") == "foobar");
+    CHECK(decode("L25ub2UvZGhjcC9sZWFzZXMvMTAuMC4wLjE=") == "/nnoe/dhcp/leases/10.0.0.1");
+
+    CHECK(decode("Zm9") == "<invalid>");
+    CHECK(decode("Zm9v!mFy") == "<invalid>");
+    CHECK(decode("Zg==Zm9v") == "<invalid>");
+}
+
+// Exercise the SIMD loop, its exit on invalid input and the scalar tail
+static void test_base64_random() {
+    std::mt19937 rng(42);
+    for (size_t len = 0; len < 300; ++len) {
+        std::string raw(len, '\0');
+        for (auto& c : raw) {
+            c = static_cast<char>(rng());
+        }
+        const std::string text = encode(raw);
+        CHECK(decode(text) == raw);
+
+        if (!text.empty()) {
+            std::string bad = text;
+            bad[rng() % (bad.size() - 2)] = '*';
+            CHECK(decode(bad) == "<invalid>");
+        }
+    }
+}
+
+static void test_parse_lease_v4() {
+    const std::string value =
+        "{\"cltt\":1705315200,\"client_id\":\"01:aa:bb\",\"expires_at\":1705401600,"
+        "\"hostname\":\"client\",\"hwaddr\":\"aa:bb:cc:dd:ee:ff\",\"ip\":\"192.168.1.100\",\"node\":\"kea-1\","
+        "\"operation\":\"renew\",\"seq\":1705315201000042,\"state\":0,\"subnet_id\":7,"
+        "\"timestamp\":1705315201,\"v\":1,\"valid_lft\":86400,\"future\":{\"nested\":[1,2]}}";
+
+    nnoe::LeaseView lease;
+    CHECK(nnoe::parse_lease(value, lease) == nnoe::LEASE_OK);
+    CHECK(lease.version == 1);
+    CHECK(lease.ip == "192.168.1.100");
+    CHECK(lease.hwaddr == "aa:bb:cc:dd:ee:ff");
+    CHECK(lease.client_id == "01:aa:bb");
+    CHECK(lease.hostname == "client");
+    CHECK(lease.operation == "renew");
+    CHECK(lease.node == "kea-1");
+    CHECK(lease.subnet_id == 7);
+    CHECK(lease.seq == 1705315201000042ULL);
+    CHECK(lease.cltt == 1705315200);
+    CHECK(lease.valid_lft == 86400);
+    CHECK(lease.expires_at == 1705401600);
+    CHECK(!lease.is_v6());
+}
+
+// Version 0 values: pretty-printed, no "v" field
+static void test_parse_lease_legacy_v6() {
+    const std::string value =
+        "{\n\t\"cltt\" : 1705315200,\n\t\"duid\" : \"00:01:00:01\",\n"
+        "\t\"expires_at\" : 1705401600,\n\t\"iaid\" : 12345,\n\t\"ip\" : \"2001:db8::1\",\n"
+        "\t\"preferred_lft\" : 3600,\n\t\"state\" : 1,\n\t\"type\" : 2,\n"
+        "\t\"valid_lft\" : 86400\n}";
+
+    nnoe::LeaseView lease;
+    CHECK(nnoe::parse_lease(value, lease) == nnoe::LEASE_OK);
+    CHECK(lease.version == 0);
+    CHECK(lease.ip == "2001:db8::1");
+    CHECK(lease.duid == "00:01:00:01");
+    CHECK(lease.iaid == 12345);
+    CHECK(lease.type == 2);
+    CHECK(lease.state == 1);
+    CHECK(lease.preferred_lft == 3600);
+    CHECK(lease.is_v6());
+}
+
+static void test_parse_lease_rejects() {
+    nnoe::LeaseView lease;
+    CHECK(nnoe::parse_lease("{\"ip\":\"10.0.0.1\",\"v\":99}", lease) ==
+          nnoe::LEASE_UNSUPPORTED_VERSION);
+    CHECK(nnoe::parse_lease("{\"state\":0}", lease) == nnoe::LEASE_MALFORMED);
+    CHECK(nnoe::parse_lease("{\"ip\":\"10.0.0.1\"", lease) == nnoe::LEASE_MALFORMED);
+    CHECK(nnoe::parse_lease("not json", lease) == nnoe::LEASE_MALFORMED);
+    CHECK(nnoe::parse_lease("{\"ip\":\"a\\\"b\",\"state\":3}", lease) == nnoe::LEASE_OK);
+    CHECK(lease.ip == "a\\\"b");
+    CHECK(lease.escaped);
+    CHECK(lease.state == 3);
+}
+
+static void test_parse_lease_escaped() {
+    // Hostname with a quote, a backslash, a tab, e-acute and an emoji
+    const std::string value =
+        "{\"hostname\":\"O\\\"Brien\\\\pc\\t\\u00e9\\ud83d\\ude00\",\"ip\":\"10.0.0.9\","
+        "\"node\":\"kea-1\",\"state\":0}";
+    const std::string decoded = "O\"Brien\\pc\t\xc3\xa9\xf0\x9f\x98\x80";
+
+    // No buffer: the raw text and a flag to fall back on
+    nnoe::LeaseView lease;
+    CHECK(nnoe::parse_lease(value, lease) == nnoe::LEASE_OK);
+    CHECK(lease.escaped);
+    CHECK(lease.hostname == "O\\\"Brien\\\\pc\\t\\u00e9\\ud83d\\ude00");
+    CHECK(lease.ip == "10.0.0.9");
+
+    // Separate buffer
+    std::string buffer(value.size(), '\0');
+    CHECK(nnoe::parse_lease(value, lease, &buffer[0]) == nnoe::LEASE_OK);
+    CHECK(!lease.escaped);
+    CHECK(lease.hostname == decoded);
+    CHECK(lease.ip == "10.0.0.9");
+    CHECK(lease.node == "kea-1");
+
+    // In place: later fields still parse from the original text
+    std::string copy = value;
+    CHECK(nnoe::parse_lease(copy, lease, &copy[0]) == nnoe::LEASE_OK);
+    CHECK(lease.hostname == decoded);
+    CHECK(lease.ip == "10.0.0.9");
+    CHECK(lease.node == "kea-1");
+
+    // Unescaped fields are never copied
+    const std::string plain = "{\"hostname\":\"pc\",\"ip\":\"10.0.0.9\"}";
+    CHECK(nnoe::parse_lease(plain, lease, &buffer[0]) == nnoe::LEASE_OK);
+    CHECK(lease.hostname.data() == plain.data() + 13);
+
+    // Malformed escapes are caught once decoded
+    const char* bad[] = {"{\"hostname\":\"a\\x\",\"ip\":\"10.0.0.9\"}",
+                         "{\"hostname\":\"\\u12\",\"ip\":\"10.0.0.9\"}",
+                         "{\"hostname\":\"\\ude00\",\"ip\":\"10.0.0.9\"}",
+                         "{\"hostname\":\"\\ud83dx\",\"ip\":\"10.0.0.9\"}"};
+    for (const char* text : bad) {
+        std::string scratch(text);
+        CHECK(nnoe::parse_lease(text, lease) == nnoe::LEASE_OK);
+        CHECK(nnoe::parse_lease(text, lease, &scratch[0]) == nnoe::LEASE_MALFORMED);
+    }
+}
+
+static void test_range_response() {
+    const std::string v1 = "{\"ip\":\"10.0.0.1\",\"v\":1,\"valid_lft\":60}";
+    const std::string v2 = "{\"ip\":\"10.0.0.2\",\"v\":1,\"valid_lft\":120}";
+    std::string body =
+        "{\"header\":{\"cluster_id\":\"1\",\"revision\":\"4242\",\"raft_term\":\"2\"},"
+        "\"kvs\":[{\"key\":\"" + encode("/nnoe/dhcp/leases/10.0.0.1") +
+        "\",\"create_revision\":\"5\",\"mod_revision\":\"17\",\"version\":\"3\","
+        "\"value\":\"" + encode(v1) + "\"},"
+        " {\"key\":\"" + encode("/nnoe/dhcp/leases/10.0.0.2") +
+        "\",\"mod_revision\":\"18\",\"value\":\"" + encode(v2) + "\"}],"
+        "\"more\":true,\"count\":\"10\"}";
+
+    nnoe::RangeResponseReader range(&body[0], body.size());
+    CHECK(range.valid());
+    CHECK(range.revision() == 4242);
+    CHECK(range.more());
+
+    nnoe::KeyValueView kv;
+    nnoe::LeaseView lease;
+
+    CHECK(range.next(kv));
+    CHECK(kv.key == "/nnoe/dhcp/leases/10.0.0.1");
+    CHECK(kv.value == v1);
+    CHECK(kv.mod_revision == 17);
+    CHECK(nnoe::parse_lease(kv.value, lease) == nnoe::LEASE_OK);
+    CHECK(lease.valid_lft == 60);
+
+    CHECK(range.next(kv));
+    CHECK(kv.key == "/nnoe/dhcp/leases/10.0.0.2");
+    CHECK(kv.mod_revision == 18);
+    CHECK(nnoe::parse_lease(kv.value, lease) == nnoe::LEASE_OK);
+    CHECK(lease.ip == "10.0.0.2");
+
+    CHECK(!range.next(kv));
+    CHECK(range.valid());
+}
+
+static void test_range_response_edge_cases() {
+    // Empty range: the gateway omits kvs entirely
+    std::string empty = "{\"header\":{\"revision\":\"9\"}}";
+    nnoe::RangeResponseReader none(&empty[0], empty.size());
+    nnoe::KeyValueView kv;
+    CHECK(none.valid());
+    CHECK(none.revision() == 9);
+    CHECK(!none.more());
+    CHECK(!none.next(kv));
+
+    // keys_only: no values
+    std::string keys = "{\"header\":{\"revision\":\"9\"},\"kvs\":[{\"key\":\"" +
+        encode("/a") + "\",\"mod_revision\":\"3\"}],\"count\":\"1\"}";
+    nnoe::RangeResponseReader keys_only(&keys[0], keys.size());
+    CHECK(keys_only.next(kv));
+    CHECK(kv.key == "/a");
+    CHECK(kv.value.empty());
+    CHECK(!keys_only.next(kv));
+
+    std::string broken = "{\"header\":{\"revision\":\"9\"},\"kvs\":[{\"key\":\"@@@@\"}]}";
+    nnoe::RangeResponseReader bad(&broken[0], broken.size());
+    CHECK(bad.valid());
+    CHECK(!bad.next(kv));
+    CHECK(!bad.valid());
+
+    std::string truncated = "{\"header\":{\"revision\":\"9\"},\"kvs\":[{\"key\":\"";
+    nnoe::RangeResponseReader cut(&truncated[0], truncated.size());
+    CHECK(!cut.valid());
+}
+
+int main() {
+    test_base64_vectors();
+    test_base64_random();
+    test_parse_lease_v4();
+    test_parse_lease_legacy_v6();
+    test_parse_lease_rejects();
+    test_parse_lease_escaped();
+    test_range_response();
+    test_range_response_edge_cases();
+
+    return check_result("lease_reader_test");
+}
@@ -0,0 +1,252 @@
+/**
+ * Tests for the memfile lease tailer: row parsing into lease values and
+ * guards, LFC rotation, split lines and resuming from the state file
+ */
+
+#include "etcd_client.h"
+#include "lease_tailer.h"
+#include "sync_engine.h"
+#include "check.h"
+#include "fake_transport.h"
+
+#include <dirent.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+
+static const char* HEADER4 =
+    "address,hwaddr,client_id,valid_lifetime,expire,subnet_id,fqdn_fwd,fqdn_rev,hostname,"
+    "state,user_context,pool_id\n";
+
+static const char* HEADER6 =
+    "address,duid,valid_lifetime,expire,subnet_id,pref_lifetime,lease_type,iaid,prefix_len,"
+    "fqdn_fwd,fqdn_rev,hostname,hwaddr,state,user_context,hwtype,hwaddr_source,pool_id\n";
+
+static std::string temp_dir() {
+    char path[] = "/tmp/nnoe-tailer-test-XXXXXX";
+    return mkdtemp(path) ? path : "";
+}
+
+static void remove_dir(const std::string& path) {
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        return;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name != "." && name != "..") {
+            unlink((path + "/" + name).c_str());
+        }
+    }
+    closedir(dir);
+    rmdir(path.c_str());
+}
+
+static void append(const std::string& path, const std::string& text) {
+    std::ofstream(path, std::ios::app) << text;
+}
+
+static std::string row4(const std::string& address, uint64_t valid, uint64_t expire,
+                        int state = 0, const std::string& hostname = "") {
+    return address + ",aa:bb:cc:dd:ee:ff,," + std::to_string(valid) + "," +
+           std::to_string(expire) + ",7,0,0," + hostname + "," + std::to_string(state) + ",,0\n";
+}
+
+struct Harness {
+    Harness() : transport(std::make_shared<FakeTransport>(0)), client("http://127.0.0.1:1") {
+        client.set_transport(transport);
+        nnoe::SyncEngineConfig engine_config;
+        engine_config.flush_interval_ms = 0;
+        engine_config.senders = 1;
+        engine_config.guard_grace_s = 0;
+        engine.reset(new nnoe::SyncEngine(client, engine_config));
+        engine->start();
+    }
+
+    // Lease key -> value put, or "-" for a delete, and its guard sequence
+    std::map<std::string, std::string> written() {
+        engine->stop();
+        std::map<std::string, std::string> out;
+        for (const auto& txn : transport->txns()) {
+            for (const auto& group : txn["success"]) {
+                const Json::Value& ops = group["request_txn"]["success"];
+                if (ops[0].isMember("request_put")) {
+                    out[nnoe::base64_decode(ops[0]["request_put"]["key"].asString())] =
+                        nnoe::base64_decode(ops[0]["request_put"]["value"].asString());
+                } else {
+                    out[nnoe::base64_decode(
+                        ops[0]["request_delete_range"]["key"].asString())] = "-";
+                }
+                sequences[nnoe::base64_decode(ops[1]["request_put"]["key"].asString())] =
+                    nnoe::base64_decode(ops[1]["request_put"]["value"].asString());
+            }
+        }
+        return out;
+    }
+
+    std::shared_ptr<FakeTransport> transport;
+    nnoe::EtcdClient client;
+    std::unique_ptr<nnoe::SyncEngine> engine;
+    std::map<std::string, std::string> sequences;
+};
+
+static Json::Value parse(const std::string& text) {
+    Json::Value value;
+    Json::Reader().parse(text, value);
+    return value;
+}
+
+static void test_rows4() {
+    const std::string dir = temp_dir();
+    CHECK(!dir.empty());
+    const std::string path = dir + "/kea-leases4.csv";
+    append(path, std::string(HEADER4) +
+                 row4("10.0.0.1", 3600, 1003600, 0, "pc&#x2c1") +
+                 row4("10.0.0.2", 3600, 1003600) +
+                 row4("10.0.0.2", 0, 1000000) +         // deleted
+                 row4("10.0.0.3", 3600, 1003600, 3) +   // released
+                 row4("10.0.0.4", 3600, 100) +          // expire before its lifetime
+                 "10.0.0.5,aa:bb,,x,1,7\n");             // not a number
+
+    nnoe::TailerConfig config;
+    config.from_start = true;
+    config.node_id = "site-a";
+    Harness harness;
+    nnoe::LeaseTailer tailer(config, *harness.engine);
+    tailer.add_file(path, false);
+    tailer.open_files();
+    tailer.poll_files();
+    tailer.close_files();
+    CHECK(tailer.rows() == 4);
+
+    std::map<std::string, std::string> written = harness.written();
+    CHECK(written.size() == 3);
+    const Json::Value lease = parse(written["/nnoe/dhcp/leases/10.0.0.1"]);
+    CHECK(lease["ip"] == "10.0.0.1" && lease["hwaddr"] == "aa:bb:cc:dd:ee:ff");
+    CHECK(lease["hostname"] == "pc,1" && lease["subnet_id"] == 7 && lease["node"] == "site-a");
+    CHECK(lease["cltt"] == 1000000 && lease["expires_at"] == 1003600);
+    CHECK(lease["seq"].asUInt64() == 1000000ULL * 1000000);
+    CHECK(written["/nnoe/dhcp/leases/10.0.0.2"] == "-");
+    CHECK(written["/nnoe/dhcp/leases/10.0.0.3"] == "-");
+    CHECK(written.count("/nnoe/dhcp/leases/10.0.0.4") == 0);
+
+    // The guard follows the row's time; the delete sorts after the put
+    CHECK(harness.sequences["/nnoe/dhcp/lease-seq/10.0.0.1"] ==
+          nnoe::format_sequence(1000000ULL * 1000000));
+    CHECK(harness.sequences["/nnoe/dhcp/lease-seq/10.0.0.2"] ==
+          nnoe::format_sequence(1000000ULL * 1000000 + 1));
+
+    remove_dir(dir);
+}
+
+static void test_rows6() {
+    const std::string dir = temp_dir();
+    const std::string path = dir + "/kea-leases6.csv";
+    append(path, std::string(HEADER6) +
+                 "2001:db8::5,00:01:02,3600,1003600,9,1800,0,11,128,0,0,,,0,,0,0,0\n"
+                 "2001:db8:1::,00:01:02,3600,1003600,9,1800,2,12,56,0,0,,,0,,0,0,0\n");
+
+    nnoe::TailerConfig config;
+    config.from_start = true;
+    Harness harness;
+    nnoe::LeaseTailer tailer(config, *harness.engine);
+    tailer.add_file(path, true);
+    tailer.open_files();
+    tailer.poll_files();
+    tailer.close_files();
+
+    std::map<std::string, std::string> written = harness.written();
+    const Json::Value address = parse(written["/nnoe/dhcp/leases/2001:db8::5"]);
+    CHECK(address["duid"] == "00:01:02" && address["iaid"] == 11 && address["type"] == 0);
+    CHECK(address["preferred_lft"] == 1800 && !address.isMember("prefix_len"));
+    const Json::Value prefix = parse(written["/nnoe/dhcp/leases/2001:db8:1::/56"]);
+    CHECK(prefix["type"] == 2 && prefix["prefix_len"] == 56 && prefix["subnet_id"] == 9);
+
+    remove_dir(dir);
+}
+
+static void test_rotation() {
+    const std::string dir = temp_dir();
+    const std::string path = dir + "/kea-leases4.csv";
+    append(path, std::string(HEADER4) + row4("10.0.1.1", 3600, 1003600));
+
+    // Without --from-start the rows already there are left alone
+    nnoe::TailerConfig config;
+    Harness harness;
+    nnoe::LeaseTailer tailer(config, *harness.engine);
+    tailer.add_file(path, false);
+    tailer.open_files();
+    tailer.poll_files();
+    CHECK(tailer.rows() == 0);
+
+    // A row written in two pieces is submitted once, when complete
+    const std::string row = row4("10.0.1.2", 3600, 1003600);
+    append(path, row.substr(0, 10));
+    tailer.poll_files();
+    CHECK(tailer.rows() == 0);
+    append(path, row.substr(10));
+    tailer.poll_files();
+    CHECK(tailer.rows() == 1);
+
+    // LFC: a last row in the old file, which is moved aside, then a new
+    // file with its own header
+    append(path, row4("10.0.1.3", 3600, 1003600));
+    CHECK(rename(path.c_str(), (path + ".2").c_str()) == 0);
+    append(path, std::string(HEADER4) + row4("10.0.1.4", 3600, 1003600));
+    tailer.poll_files();
+    CHECK(tailer.rows() == 3);
+    tailer.close_files();
+
+    std::map<std::string, std::string> written = harness.written();
+    CHECK(written.size() == 3);
+    CHECK(written.count("/nnoe/dhcp/leases/10.0.1.1") == 0);
+    CHECK(written.count("/nnoe/dhcp/leases/10.0.1.4") == 1);
+
+    remove_dir(dir);
+}
+
+static void test_state_file() {
+    const std::string dir = temp_dir();
+    const std::string path = dir + "/kea-leases4.csv";
+    append(path, std::string(HEADER4) + row4("10.0.2.1", 3600, 1003600));
+
+    nnoe::TailerConfig config;
+    config.from_start = true;
+    config.state_file = dir + "/tailer.state";
+    {
+        Harness harness;
+        nnoe::LeaseTailer tailer(config, *harness.engine);
+        tailer.add_file(path, false);
+        tailer.open_files();
+        tailer.poll_files();
+        tailer.close_files();
+        CHECK(tailer.rows() == 1);
+    }
+
+    // A restart resumes after the rows already sent
+    append(path, row4("10.0.2.2", 3600, 1003600));
+    Harness harness;
+    nnoe::LeaseTailer tailer(config, *harness.engine);
+    tailer.add_file(path, false);
+    tailer.open_files();
+    tailer.poll_files();
+    tailer.close_files();
+    CHECK(tailer.rows() == 1);
+    std::map<std::string, std::string> written = harness.written();
+    CHECK(written.size() == 1 && written.count("/nnoe/dhcp/leases/10.0.2.2") == 1);
+
+    remove_dir(dir);
+}
+
+int main() {
+    test_rows4();
+    test_rows6();
+    test_rotation();
+    test_state_file();
+
+    return check_result("lease_tailer_test");
+}
@@ -0,0 +1,520 @@
+/**
+ * Tests for the multi-node lease query index and the bulk leasequery
+ * service, over loopback TCP
+ */
+
+#include "bulk_leasequery.h"
+#include "lease_query_index.h"
+#include "memory_budget.h"
+#include "check.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <json/json.h>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+
+static const std::string PREFIX = "/nnoe/dhcp/leases/";
+
+static std::string record(const Json::Value& value) {
+    return Json::FastWriter().write(value);
+}
+
+static Json::Value lease4(const std::string& ip, const std::string& hwaddr,
+                          const std::string& node, int64_t now) {
+    Json::Value value;
+    value["v"] = 1;
+    value["ip"] = ip;
+    value["hwaddr"] = hwaddr;
+    value["subnet_id"] = 1;
+    value["state"] = 0;
+    value["cltt"] = static_cast<Json::Int64>(now - 100);
+    value["valid_lft"] = 3600;
+    value["expires_at"] = static_cast<Json::Int64>(now + 3500);
+    value["node"] = node;
+    return value;
+}
+
+static Json::Value lease6(const std::string& ip, const std::string& duid, int type,
+                          int prefix_len, const std::string& node, int64_t now) {
+    Json::Value value;
+    value["v"] = 1;
+    value["ip"] = ip;
+    value["type"] = type;
+    value["iaid"] = 7;
+    value["duid"] = duid;
+    if (type == 2) {
+        value["prefix_len"] = prefix_len;
+    }
+    value["subnet_id"] = 2;
+    value["state"] = 0;
+    value["cltt"] = static_cast<Json::Int64>(now - 100);
+    value["valid_lft"] = 3600;
+    value["preferred_lft"] = 1800;
+    value["expires_at"] = static_cast<Json::Int64>(now + 3500);
+    value["node"] = node;
+    return value;
+}
+
+static nnoe::EtcdWatchEvent put(const std::string& name, const Json::Value& value) {
+    nnoe::EtcdWatchEvent event;
+    event.kv.key = PREFIX + name;
+    event.kv.value = record(value);
+    return event;
+}
+
+static nnoe::EtcdWatchEvent del(const std::string& name) {
+    nnoe::EtcdWatchEvent event;
+    event.type = nnoe::EtcdWatchEvent::DELETE;
+    event.kv.key = PREFIX + name;
+    return event;
+}
+
+static void test_relay_ids() {
+    Json::Value context;
+    nnoe::QueriedLease lease;
+
+    // Kea 2.1+ keeps the ids next to the raw sub-options
+    context["ISC"]["relay-agent-info"]["sub-options"] = "0x0C03010203";
+    context["ISC"]["relay-agent-info"]["remote-id"] = "0xAABB";
+    nnoe::LeaseQueryIndex::read_relay_ids(context, lease);
+    CHECK(lease.remote_id == "aa:bb");
+    CHECK(lease.relay_id == "01:02:03");
+
+    // Older versions keep the sub-options only
+    lease = nnoe::QueriedLease();
+    context = Json::Value();
+    context["ISC"]["relay-agent-info"] = "0x0202CAFE";
+    nnoe::LeaseQueryIndex::read_relay_ids(context, lease);
+    CHECK(lease.remote_id == "ca:fe");
+    CHECK(lease.relay_id.empty());
+
+    // DHCPv6 relays: options of each relay message
+    lease = nnoe::QueriedLease();
+    context = Json::Value();
+    context["ISC"]["relay-info"][0]["hop"] = 0;
+    context["ISC"]["relay-info"][0]["options"] = "0x00350003000102";
+    context["ISC"]["relay-info"][1]["remote-id"] = "0x0000000901";
+    nnoe::LeaseQueryIndex::read_relay_ids(context, lease);
+    CHECK(lease.relay_id == "00:01:02");
+    CHECK(lease.remote_id == "00:00:00:09:01");
+}
+
+static void test_index() {
+    const int64_t now = time(nullptr);
+    nnoe::MemoryBudget budget;
+    nnoe::MemoryAccount* account = budget.account("leasequery");
+    {
+        auto watches = std::make_shared<nnoe::WatchManager>("http://127.0.0.1:1");
+        nnoe::LeaseQueryIndex index(watches, "/nnoe/dhcp/leases", "kea-1");
+        index.set_memory(account);
+
+        // Local lease from the callouts
+        nnoe::QueriedLease local;
+        local.name = local.address = "10.0.0.1";
+        local.hwaddr = "aa:aa:aa:aa:aa:01";
+        local.client_id = "01:aa:aa:aa:aa:aa:01";
+        local.expires_at = now + 600;
+        index.upsert(local);
+
+        Json::Value relayed = lease4("10.0.0.2", "aa:aa:aa:aa:aa:01", "kea-2", now);
+        relayed["context"]["ISC"]["relay-agent-info"]["relay-id"] = "0x0102";
+        index.apply({put("10.0.0.2", relayed),
+                     put("10.0.0.3", lease4("10.0.0.3", "bb:bb:bb:bb:bb:bb", "kea-2", now)),
+                     // This server's own records are the callouts' business
+                     put("10.0.0.4", lease4("10.0.0.4", "cc:cc:cc:cc:cc:cc", "kea-1", now))});
+        CHECK(index.size() == 3);
+        CHECK(index.remote_size() == 2);
+        CHECK(account->used() > 0);
+
+        CHECK(index.find(nnoe::LeaseQueryKey::HWADDR, "aa:aa:aa:aa:aa:01", now).size() == 2);
+        CHECK(index.find(nnoe::LeaseQueryKey::CLIENT_ID, "01:aa:aa:aa:aa:aa:01", now).size() == 1);
+        auto by_relay = index.find(nnoe::LeaseQueryKey::RELAY_ID, "01:02", now);
+        CHECK(by_relay.size() == 1 && by_relay[0].address == "10.0.0.2" && by_relay[0].remote);
+        CHECK(index.find(nnoe::LeaseQueryKey::ADDRESS, "10.0.0.4", now).empty());
+
+        // Deletes of another server's lease apply; of ours, not from the watch
+        index.apply({del("10.0.0.3"), del("10.0.0.1")});
+        CHECK(index.find(nnoe::LeaseQueryKey::ADDRESS, "10.0.0.3", now).empty());
+        CHECK(index.find(nnoe::LeaseQueryKey::ADDRESS, "10.0.0.1", now).size() == 1);
+
+        // A local remove leaves a lease another server took over
+        index.remove("10.0.0.2");
+        index.remove("10.0.0.1");
+        CHECK(index.size() == 1);
+
+        // Released and expired leases are not answered
+        Json::Value released = lease4("10.0.0.5", "dd:dd:dd:dd:dd:dd", "kea-2", now);
+        released["state"] = 3;
+        Json::Value expired = lease4("10.0.0.6", "dd:dd:dd:dd:dd:dd", "kea-2", now);
+        expired["expires_at"] = static_cast<Json::Int64>(now - 1);
+        index.apply({put("10.0.0.5", released), put("10.0.0.6", expired)});
+        CHECK(index.find(nnoe::LeaseQueryKey::HWADDR, "dd:dd:dd:dd:dd:dd", now).empty());
+
+        // An address inside a delegated prefix finds the prefix
+        index.apply({put("2001:db8:100::/56",
+                         lease6("2001:db8:100::", "00:01:02", 2, 56, "kea-2", now))});
+        auto in_prefix = index.find(nnoe::LeaseQueryKey::ADDRESS, "2001:db8:100:ff::1", now);
+        CHECK(in_prefix.size() == 1 && in_prefix[0].prefix_len == 56);
+        CHECK(index.find(nnoe::LeaseQueryKey::ADDRESS, "2001:db8:101::1", now).empty());
+    }
+    CHECK(account->used() == 0);
+}
+
+// Loopback requestor speaking length-prefixed messages
+class Requestor {
+public:
+    explicit Requestor(uint16_t port, int family) {
+        if (family == 4) {
+            fd_ = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address;
+            std::memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+            connected_ = connect(fd_, reinterpret_cast<sockaddr*>(&address),
+                                 sizeof(address)) == 0;
+        } else {
+            fd_ = socket(AF_INET6, SOCK_STREAM, 0);
+            sockaddr_in6 address;
+            std::memset(&address, 0, sizeof(address));
+            address.sin6_family = AF_INET6;
+            address.sin6_port = htons(port);
+            inet_pton(AF_INET6, "::1", &address.sin6_addr);
+            connected_ = connect(fd_, reinterpret_cast<sockaddr*>(&address),
+                                 sizeof(address)) == 0;
+        }
+        timeval timeout = {5, 0};
+        setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    ~Requestor() { close(fd_); }
+
+    bool connected() const { return connected_; }
+
+    void send_message(const std::string& message) {
+        std::string framed;
+        framed.push_back(static_cast<char>(message.size() >> 8));
+        framed.push_back(static_cast<char>(message.size()));
+        framed += message;
+        CHECK(send(fd_, framed.data(), framed.size(), MSG_NOSIGNAL) ==
+              static_cast<ssize_t>(framed.size()));
+    }
+
+    std::string receive() {
+        unsigned char prefix[2];
+        if (!read_exact(reinterpret_cast<char*>(prefix), 2)) {
+            return std::string();
+        }
+        std::string message(static_cast<size_t>(prefix[0] << 8 | prefix[1]), '\0');
+        if (!message.empty() && !read_exact(&message[0], message.size())) {
+            return std::string();
+        }
+        return message;
+    }
+
+private:
+    bool read_exact(char* out, size_t length) {
+        size_t got = 0;
+        while (got < length) {
+            const ssize_t n = recv(fd_, out + got, length - got, 0);
+            if (n <= 0) {
+                return false;
+            }
+            got += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    int fd_;
+    bool connected_;
+};
+
+static std::string query4(uint8_t type, const std::string& ciaddr, const std::string& chaddr,
+                          const std::string& options) {
+    std::string message(236, '\0');
+    message[0] = 1;
+    message[1] = 1;
+    message[2] = static_cast<char>(chaddr.size());
+    message[4] = 0x12;
+    message[7] = 0x34;
+    if (!ciaddr.empty()) {
+        inet_pton(AF_INET, ciaddr.c_str(), &message[12]);
+    }
+    message.replace(28, chaddr.size(), chaddr);
+    message += std::string("\x63\x82\x53\x63", 4);
+    message += std::string("\x35\x01", 2) + static_cast<char>(type);
+    message += options;
+    message.push_back(static_cast<char>(255));
+    return message;
+}
+
+// Value of a DHCPv4 option, or "" (with found false)
+static std::string option4(const std::string& message, uint8_t code, bool* found = nullptr) {
+    for (size_t i = 240; i + 1 < message.size();) {
+        const uint8_t current = static_cast<uint8_t>(message[i]);
+        if (current == 255) {
+            break;
+        }
+        if (current == 0) {
+            ++i;
+            continue;
+        }
+        const size_t length = static_cast<uint8_t>(message[i + 1]);
+        if (current == code) {
+            if (found) {
+                *found = true;
+            }
+            return message.substr(i + 2, length);
+        }
+        i += 2 + length;
+    }
+    if (found) {
+        *found = false;
+    }
+    return std::string();
+}
+
+static uint8_t type4(const std::string& message) {
+    const std::string type = option4(message, 53);
+    return type.empty() ? 0 : static_cast<uint8_t>(type[0]);
+}
+
+static std::string ciaddr4(const std::string& message) {
+    char text[INET_ADDRSTRLEN] = "";
+    if (message.size() >= 16) {
+        inet_ntop(AF_INET, message.data() + 12, text, sizeof(text));
+    }
+    return text;
+}
+
+static void test_dhcpv4() {
+    const int64_t now = time(nullptr);
+    auto watches = std::make_shared<nnoe::WatchManager>("http://127.0.0.1:1");
+    nnoe::LeaseQueryIndex index(watches, "/nnoe/dhcp/leases", "kea-1");
+
+    nnoe::QueriedLease local;
+    local.name = local.address = "10.0.0.1";
+    local.hwaddr = "aa:aa:aa:aa:aa:01";
+    local.cltt = now - 50;
+    local.expires_at = now + 600;
+    index.upsert(local);
+    Json::Value relayed = lease4("10.0.0.2", "aa:aa:aa:aa:aa:01", "kea-2", now);
+    relayed["context"]["ISC"]["relay-agent-info"]["relay-id"] = "0x0102";
+    index.apply({put("10.0.0.2", relayed)});
+
+    nnoe::LeaseQueryConfig config;
+    config.family = 4;
+    config.port = 0;
+    nnoe::BulkLeaseQuery service(config, index);
+    CHECK(service.start());
+
+    {
+        Requestor requestor(service.port(), 4);
+        CHECK(requestor.connected());
+
+        // Bulk by hardware address: both servers' leases, then done
+        requestor.send_message(query4(14, "", std::string("\xaa\xaa\xaa\xaa\xaa\x01", 6), ""));
+        std::vector<std::string> active;
+        std::string message;
+        bool remote_flag = false;
+        for (;;) {
+            message = requestor.receive();
+            if (type4(message) != 13) {
+                break;
+            }
+            CHECK(message[0] == 2 && message[4] == 0x12 && message[7] == 0x34);
+            active.push_back(ciaddr4(message));
+            bool found = false;
+            const std::string source = option4(message, 157, &found);
+            if (found && source == std::string(1, '\x01')) {
+                remote_flag = ciaddr4(message) == "10.0.0.2";
+            }
+        }
+        CHECK(active.size() == 2);
+        CHECK(remote_flag);
+        CHECK(type4(message) == 15);
+
+        // Bulk by relay-id (option 82, sub-option 12)
+        requestor.send_message(query4(14, "", "", std::string("\x52\x04\x0c\x02\x01\x02", 6)));
+        message = requestor.receive();
+        CHECK(type4(message) == 13 && ciaddr4(message) == "10.0.0.2");
+        const std::string info = option4(message, 82);
+        CHECK(info == std::string("\x0c\x02\x01\x02", 4));
+        CHECK(type4(requestor.receive()) == 15);
+
+        // Single leasequery by address
+        requestor.send_message(query4(10, "10.0.0.1", "", ""));
+        message = requestor.receive();
+        CHECK(type4(message) == 13 && ciaddr4(message) == "10.0.0.1");
+        CHECK(option4(message, 51).size() == 4);
+        requestor.send_message(query4(10, "10.0.0.9", "", ""));
+        CHECK(type4(requestor.receive()) == 12);
+
+        // No criteria: all configured addresses, not supported
+        requestor.send_message(query4(14, "", "", ""));
+        message = requestor.receive();
+        CHECK(type4(message) == 17);
+        CHECK(option4(message, 151).substr(0, 1) == std::string(1, '\x04'));
+    }
+
+    const nnoe::LeaseQueryStats stats = service.stats();
+    CHECK(stats.running);
+    CHECK(stats.connections == 1);
+    CHECK(stats.queries == 5);
+    CHECK(stats.leases == 4);
+    service.stop();
+    CHECK(!service.stats().running);
+}
+
+static std::string option6(uint16_t code, const std::string& data) {
+    std::string out;
+    out.push_back(static_cast<char>(code >> 8));
+    out.push_back(static_cast<char>(code));
+    out.push_back(static_cast<char>(data.size() >> 8));
+    out.push_back(static_cast<char>(data.size()));
+    return out + data;
+}
+
+static std::string query6(uint8_t query_type, const std::string& query_options) {
+    std::string lq(1, static_cast<char>(query_type));
+    lq += std::string(16, '\0');
+    lq += query_options;
+    return std::string("\x0e\x01\x02\x03", 4) + option6(1, std::string("\x00\x03\x00\x01\x99", 5)) +
+           option6(44, lq);
+}
+
+// Top-level options of a DHCPv6 message: (code, data) pairs
+static std::vector<std::pair<uint16_t, std::string>> options6(const std::string& data,
+                                                              size_t offset) {
+    std::vector<std::pair<uint16_t, std::string>> out;
+    while (offset + 4 <= data.size()) {
+        const uint16_t code = static_cast<uint16_t>(static_cast<uint8_t>(data[offset]) << 8 |
+                                                    static_cast<uint8_t>(data[offset + 1]));
+        const size_t length = static_cast<size_t>(static_cast<uint8_t>(data[offset + 2]) << 8 |
+                                                  static_cast<uint8_t>(data[offset + 3]));
+        out.emplace_back(code, data.substr(offset + 4, length));
+        offset += 4 + length;
+    }
+    return out;
+}
+
+static const std::string* find6(const std::vector<std::pair<uint16_t, std::string>>& options,
+                                uint16_t code) {
+    for (const auto& option : options) {
+        if (option.first == code) {
+            return &option.second;
+        }
+    }
+    return nullptr;
+}
+
+static void test_dhcpv6() {
+    const int64_t now = time(nullptr);
+    auto watches = std::make_shared<nnoe::WatchManager>("http://127.0.0.1:1");
+    nnoe::LeaseQueryIndex index(watches, "/nnoe/dhcp/leases", "kea-1");
+
+    Json::Value first = lease6("2001:db8::1", "00:03:00:01:01", 0, 128, "kea-2", now);
+    first["context"]["ISC"]["relay-info"][0]["relay-id"] = "0x0A0B";
+    Json::Value second = lease6("2001:db8:100::", "00:03:00:01:02", 2, 56, "kea-2", now);
+    second["context"]["ISC"]["relay-info"][0]["relay-id"] = "0x0A0B";
+    index.apply({put("2001:db8::1", first), put("2001:db8:100::/56", second)});
+
+    nnoe::LeaseQueryConfig config;
+    config.family = 6;
+    config.address = "::1";
+    config.port = 0;
+    config.server_id = "00:01:00:01:aa:bb";
+    nnoe::BulkLeaseQuery service(config, index);
+    if (!service.start()) {
+        std::printf("leasequery_test: no IPv6 loopback, skipping DHCPv6\n");
+        return;
+    }
+    Requestor requestor(service.port(), 6);
+    CHECK(requestor.connected());
+
+    // By client-id: a reply with the client's data
+    requestor.send_message(query6(2, option6(1, std::string("\x00\x03\x00\x01\x01", 5))));
+    std::string message = requestor.receive();
+    CHECK(message.size() > 4 && message[0] == 15 && message.substr(1, 3) == "\x01\x02\x03");
+    auto options = options6(message, 4);
+    CHECK(find6(options, 2) && *find6(options, 2) == std::string("\x00\x01\x00\x01\xaa\xbb", 6));
+    CHECK(find6(options, 1) && *find6(options, 1) == std::string("\x00\x03\x00\x01\x99", 5));
+    const std::string* client = find6(options, 45);
+    CHECK(client != nullptr);
+    if (client) {
+        auto data = options6(*client, 0);
+        CHECK(find6(data, 1) && *find6(data, 1) == std::string("\x00\x03\x00\x01\x01", 5));
+        CHECK(find6(data, 5) && find6(data, 5)->size() == 24);
+        CHECK(find6(data, 46) != nullptr);
+    }
+
+    // By an address inside a delegated prefix
+    uint8_t address[16];
+    inet_pton(AF_INET6, "2001:db8:100:1::5", address);
+    requestor.send_message(query6(1, option6(5, std::string(reinterpret_cast<char*>(address), 16) +
+                                                    std::string(8, '\0'))));
+    message = requestor.receive();
+    options = options6(message, 4);
+    client = find6(options, 45);
+    CHECK(message[0] == 15 && client != nullptr);
+    if (client) {
+        const auto data = options6(*client, 0);
+        const std::string* prefix = find6(data, 26);
+        CHECK(prefix && prefix->size() == 25 && static_cast<uint8_t>((*prefix)[8]) == 56);
+    }
+
+    // By relay-id: two clients, so a reply, a data message and done
+    requestor.send_message(query6(3, option6(53, std::string("\x0a\x0b", 2))));
+    CHECK(requestor.receive()[0] == 15);
+    message = requestor.receive();
+    CHECK(message[0] == 17 && find6(options6(message, 4), 45) != nullptr);
+    CHECK(requestor.receive()[0] == 16);
+
+    // Unknown client: a reply without client data
+    requestor.send_message(query6(2, option6(1, std::string("\x00\x03\x00\x01\x77", 5))));
+    message = requestor.receive();
+    CHECK(message[0] == 15 && find6(options6(message, 4), 45) == nullptr);
+
+    // By link address: not supported
+    requestor.send_message(query6(4, ""));
+    message = requestor.receive();
+    options = options6(message, 4);
+    const std::string* status = find6(options, 13);
+    CHECK(status && status->size() >= 2 && (*status)[1] == 7);
+
+    CHECK(service.stats().queries == 5);
+}
+
+static void test_requestors() {
+    auto watches = std::make_shared<nnoe::WatchManager>("http://127.0.0.1:1");
+    nnoe::LeaseQueryIndex index(watches, "/nnoe/dhcp/leases", "kea-1");
+    nnoe::LeaseQueryConfig config;
+    config.port = 0;
+    config.requestors = {"192.0.2.1"};
+    nnoe::BulkLeaseQuery service(config, index);
+    CHECK(service.start());
+
+    Requestor requestor(service.port(), 4);
+    requestor.send_message(query4(10, "10.0.0.1", "", ""));
+    CHECK(requestor.receive().empty());
+    CHECK(service.stats().refused == 1);
+    CHECK(service.stats().connections == 0);
+}
+
+int main() {
+    test_relay_ids();
+    test_index();
+    test_dhcpv4();
+    test_dhcpv6();
+    test_requestors();
+
+    return check_result("leasequery_test");
+}
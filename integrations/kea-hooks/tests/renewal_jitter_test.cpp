@@ -0,0 +1,150 @@
+/**
+ * Tests for renewal timer jitter and the renewal rate histogram
+ */
+
+#include "renewal_jitter.h"
+#include "check.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+static std::vector<uint8_t> mac(uint32_t n) {
+    return {0x02, 0x00, static_cast<uint8_t>(n >> 24), static_cast<uint8_t>(n >> 16),
+            static_cast<uint8_t>(n >> 8), static_cast<uint8_t>(n)};
+}
+
+static void test_band() {
+    nnoe::RenewalJitterConfig config;
+    config.percent = 20;
+    nnoe::RenewalJitter jitter(config);
+
+    // Offsets spread over the band, T1 <= T2, and a client always gets the same
+    std::vector<uint32_t> bins(10, 0);
+    for (uint32_t n = 0; n < 10000; ++n) {
+        const std::vector<uint8_t> id = mac(n);
+        uint32_t t1 = 1800;
+        uint32_t t2 = 3150;
+        jitter.jitter(id.data(), id.size(), t1, t2);
+        CHECK(t1 <= 1800 && t1 >= 1800 - 360);
+        CHECK(t2 <= 3150 && t2 >= 3150 - 630);
+        CHECK(t1 <= t2);
+        ++bins[std::min<uint32_t>((1800 - t1) * 10 / 360, 9)];
+
+        uint32_t again1 = 1800;
+        uint32_t again2 = 3150;
+        jitter.jitter(id.data(), id.size(), again1, again2);
+        CHECK(again1 == t1 && again2 == t2);
+    }
+    for (uint32_t count : bins) {
+        CHECK(count > 800 && count < 1200);
+    }
+    CHECK(jitter.stats(0).jittered > 19000);
+
+    // Zero and infinite timers are left alone
+    const std::vector<uint8_t> id = mac(7);
+    uint32_t t1 = 0;
+    uint32_t t2 = 0;
+    CHECK(!jitter.jitter(id.data(), id.size(), t1, t2));
+    CHECK(t1 == 0 && t2 == 0);
+    t1 = 0xffffffff;
+    t2 = 0xffffffff;
+    CHECK(!jitter.jitter(id.data(), id.size(), t1, t2));
+    CHECK(t1 == 0xffffffff && t2 == 0xffffffff);
+
+    // Equal timers stay equal, and never reach zero
+    t1 = 1;
+    t2 = 1;
+    jitter.jitter(id.data(), id.size(), t1, t2);
+    CHECK(t1 == 1 && t2 == 1);
+    t1 = 600;
+    t2 = 600;
+    jitter.jitter(id.data(), id.size(), t1, t2);
+    CHECK(t1 == t2);
+
+    // Measure only
+    config.percent = 0;
+    nnoe::RenewalJitter measure(config);
+    t1 = 1800;
+    t2 = 3150;
+    CHECK(!measure.jitter(id.data(), id.size(), t1, t2));
+    CHECK(t1 == 1800 && t2 == 3150);
+}
+
+static void test_histogram() {
+    nnoe::RenewalJitterConfig config;
+    config.window_s = 10;
+    nnoe::RenewalJitter jitter(config);
+
+    // 1000: 5 renewals, 1001: 1, 1003: 40, 1009: 2; 1010 is still running
+    for (int i = 0; i < 5; ++i) {
+        jitter.record_renewal(1000);
+    }
+    jitter.record_renewal(1001);
+    for (int i = 0; i < 40; ++i) {
+        jitter.record_renewal(1003);
+    }
+    jitter.record_renewal(1009);
+    jitter.record_renewal(1009);
+    jitter.record_renewal(1010);
+
+    nnoe::RenewalRateStats stats = jitter.stats(1010);
+    CHECK(stats.window_s == 10);
+    CHECK(stats.renewals == 49);
+    CHECK(stats.window_renewals == 48);
+    CHECK(stats.peak == 40);
+    CHECK(stats.histogram[0] == 6);   // 1002, 1004..1008
+    CHECK(stats.histogram[1] == 1);   // 1
+    CHECK(stats.histogram[2] == 1);   // 2-3
+    CHECK(stats.histogram[3] == 1);   // 4-7
+    CHECK(stats.histogram[6] == 1);   // 32-63
+    uint64_t seconds = 0;
+    for (uint64_t count : stats.histogram) {
+        seconds += count;
+    }
+    CHECK(seconds == 10);
+
+    // Slots of seconds that left the window are not counted again
+    stats = jitter.stats(1014);
+    CHECK(stats.window_renewals == 3);
+    CHECK(stats.peak == 2);
+
+    // A slot reused a window later starts over
+    jitter.record_renewal(1011);
+    jitter.record_renewal(1020);
+    stats = jitter.stats(1021);
+    CHECK(stats.window_renewals == 2);
+    CHECK(stats.peak == 1);
+}
+
+static void test_threads() {
+    nnoe::RenewalJitterConfig config;
+    nnoe::RenewalJitter jitter(config);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&jitter, t] {
+            for (uint32_t n = 0; n < 10000; ++n) {
+                const std::vector<uint8_t> id = mac(n * 4 + t);
+                uint32_t t1 = 1800;
+                uint32_t t2 = 3150;
+                jitter.jitter(id.data(), id.size(), t1, t2);
+                jitter.record_renewal(5000 + n % 100);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const nnoe::RenewalRateStats stats = jitter.stats(5100);
+    CHECK(stats.renewals == 40000);
+    CHECK(stats.window_renewals == 40000);
+    CHECK(stats.peak == 400);
+}
+
+int main() {
+    test_band();
+    test_histogram();
+    test_threads();
+
+    return check_result("renewal_jitter_test");
+}
@@ -0,0 +1,197 @@
+/**
+ * Tests for the DHCP scope watcher: translating scopes into Kea subnets,
+ * the changes reported for watch events and full reads, and subnet ids
+ * claimed by more than one scope
+ */
+
+#include "scope_watcher.h"
+#include "check.h"
+
+#include <json/json.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+static const std::string PREFIX = "/nnoe/dhcp/scopes/";
+
+static nnoe::EtcdWatchEvent put(const std::string& scope_id, const std::string& scope) {
+    nnoe::EtcdWatchEvent event;
+    event.type = nnoe::EtcdWatchEvent::PUT;
+    event.kv.key = PREFIX + scope_id;
+    event.kv.value = scope;
+    return event;
+}
+
+static nnoe::EtcdWatchEvent del(const std::string& scope_id) {
+    nnoe::EtcdWatchEvent event;
+    event.type = nnoe::EtcdWatchEvent::DELETE;
+    event.kv.key = PREFIX + scope_id;
+    return event;
+}
+
+static std::string scope(const std::string& subnet, int subnet_id = 0,
+                         const std::string& gateway = "") {
+    std::string text = "{\"subnet\":\"" + subnet + "\"";
+    if (subnet_id) {
+        text += ",\"subnet_id\":" + std::to_string(subnet_id);
+    }
+    if (!gateway.empty()) {
+        text += ",\"gateway\":\"" + gateway + "\"";
+    }
+    return text + "}";
+}
+
+// Feeds events to a watcher and collects what it hands to its handler. The
+// watch manager points at a closed port, so only the test delivers events.
+struct Recorder {
+    Recorder()
+        : watches(std::make_shared<nnoe::WatchManager>("http://127.0.0.1:1")),
+          watcher(watches, PREFIX) {
+        watcher.start([this](const std::vector<nnoe::ScopeChange>& batch) {
+            changes.insert(changes.end(), batch.begin(), batch.end());
+        });
+    }
+
+    std::vector<nnoe::ScopeChange> apply(const std::vector<nnoe::EtcdWatchEvent>& events) {
+        changes.clear();
+        watcher.apply(events);
+        return changes;
+    }
+
+    std::shared_ptr<nnoe::WatchManager> watches;
+    nnoe::ScopeWatcher watcher;
+    std::vector<nnoe::ScopeChange> changes;
+};
+
+static void test_translate() {
+    Json::Value subnet;
+    std::string error;
+    CHECK(nnoe::ScopeWatcher::translate("office",
+        "{\"subnet\":\"10.1.0.0/24\",\"pool\":{\"start\":\"10.1.0.10\",\"end\":\"10.1.0.99\"},"
+        "\"gateway\":\"10.1.0.1\",\"dns_servers\":[\"10.0.0.53\",\"10.0.0.54\"],"
+        "\"options\":{\"domain_name\":\"example.org\",\"router\":\"10.1.0.2\"}}",
+        subnet, error));
+    CHECK(subnet["id"].asUInt() == nnoe::ScopeWatcher::scope_subnet_id("office"));
+    CHECK(subnet["subnet"] == "10.1.0.0/24");
+    CHECK(subnet["pools"][0]["pool"] == "10.1.0.10 - 10.1.0.99");
+    CHECK(subnet["user-context"]["nnoe-scope"] == "office");
+
+    // Options sorted by Kea name; the "router" alias overrides the gateway
+    const Json::Value& options = subnet["option-data"];
+    CHECK(options.size() == 3);
+    CHECK(options[0]["name"] == "domain-name" && options[0]["data"] == "example.org");
+    CHECK(options[1]["name"] == "domain-name-servers" &&
+          options[1]["data"] == "10.0.0.53, 10.0.0.54");
+    CHECK(options[2]["name"] == "routers" && options[2]["data"] == "10.1.0.2");
+
+    CHECK(nnoe::ScopeWatcher::translate("lab", scope("10.2.0.0/24", 42), subnet, error));
+    CHECK(subnet["id"].asUInt() == 42 && !subnet.isMember("pools"));
+
+    CHECK(!nnoe::ScopeWatcher::translate("lab", "{\"subnet\":\"10.2.0.0\"}", subnet, error));
+    CHECK(error == "missing or invalid subnet");
+    CHECK(!nnoe::ScopeWatcher::translate("lab", "{\"subnet\":\"10.2.0.0/24\",\"subnet_id\":0}",
+                                         subnet, error));
+    CHECK(!nnoe::ScopeWatcher::translate("lab", "{\"subnet_id\":-1,\"subnet\":\"10.2.0.0/24\"}",
+                                         subnet, error));
+    CHECK(error == "invalid subnet_id");
+    CHECK(!nnoe::ScopeWatcher::translate("lab", "not json", subnet, error));
+
+    // Stable and inside Kea's positive id range
+    const uint32_t id = nnoe::ScopeWatcher::scope_subnet_id("office");
+    CHECK(id == nnoe::ScopeWatcher::scope_subnet_id("office"));
+    CHECK(id >= 1 && id <= 0x7fffffff);
+    CHECK(id != nnoe::ScopeWatcher::scope_subnet_id("office2"));
+}
+
+static void test_changes() {
+    Recorder recorder;
+    std::vector<nnoe::ScopeChange> changes =
+        recorder.apply({put("a", scope("10.1.0.0/24", 10)), put("b", scope("10.2.0.0/24", 20))});
+    CHECK(changes.size() == 2);
+    CHECK(changes[0].scope_id == "a" && changes[0].subnet_id == 10 && !changes[0].subnet.isNull());
+
+    // Same content, an invalid rewrite and keys outside the prefix change nothing
+    nnoe::EtcdWatchEvent other = put("a", scope("10.9.0.0/24", 10));
+    other.kv.key = "/nnoe/dhcp/other/a";
+    CHECK(recorder.apply({put("a", scope("10.1.0.0/24", 10)), put("b", "{}"), other}).empty());
+
+    changes = recorder.apply({put("a", scope("10.1.0.0/24", 10, "10.1.0.1"))});
+    CHECK(changes.size() == 1 && changes[0].subnet["option-data"][0]["name"] == "routers");
+
+    // A new id removes the old subnet first
+    changes = recorder.apply({put("a", scope("10.1.0.0/24", 11))});
+    CHECK(changes.size() == 2);
+    CHECK(changes[0].subnet_id == 10 && changes[0].subnet.isNull());
+    CHECK(changes[1].subnet_id == 11 && !changes[1].subnet.isNull());
+
+    changes = recorder.apply({del("b"), del("missing")});
+    CHECK(changes.size() == 1 && changes[0].scope_id == "b" && changes[0].subnet.isNull());
+
+    std::vector<nnoe::ScopeChange> current = recorder.watcher.snapshot();
+    CHECK(current.size() == 1 && current[0].scope_id == "a" && current[0].subnet_id == 11);
+}
+
+static void test_resync() {
+    Recorder recorder;
+    recorder.apply({put("a", scope("10.1.0.0/24", 10)), put("b", scope("10.2.0.0/24", 20)),
+                    put("c", scope("10.3.0.0/24", 30))});
+
+    // After a compaction: a gone, b unchanged, c changed, d new
+    std::vector<nnoe::ScopeChange> changes = recorder.watcher.resync({
+        {PREFIX + "b", scope("10.2.0.0/24", 20)},
+        {PREFIX + "c", scope("10.3.0.0/23", 30)},
+        {PREFIX + "d", scope("10.4.0.0/24", 40)},
+    });
+    CHECK(changes.size() == 3);
+    CHECK(changes[0].scope_id == "a" && changes[0].subnet.isNull());
+    CHECK(changes[1].scope_id == "c" && changes[1].subnet["subnet"] == "10.3.0.0/23");
+    CHECK(changes[2].scope_id == "d" && changes[2].subnet_id == 40);
+    CHECK(recorder.watcher.snapshot().size() == 3);
+}
+
+static void test_collision() {
+    Recorder recorder;
+    recorder.apply({put("a", scope("10.1.0.0/24", 10))});
+
+    // b asks for a's id: rejected, a's subnet is left alone
+    CHECK(recorder.apply({put("b", scope("10.2.0.0/24", 10))}).empty());
+    std::vector<nnoe::ScopeChange> current = recorder.watcher.snapshot();
+    CHECK(current.size() == 1 && current[0].scope_id == "a");
+
+    // Once a moves to another id, b gets 10
+    std::vector<nnoe::ScopeChange> changes =
+        recorder.apply({put("a", scope("10.1.0.0/24", 11))});
+    CHECK(changes.size() == 3);
+    CHECK(changes[0].scope_id == "a" && changes[0].subnet_id == 10 && changes[0].subnet.isNull());
+    CHECK(changes[1].scope_id == "a" && changes[1].subnet_id == 11);
+    CHECK(changes[2].scope_id == "b" && changes[2].subnet_id == 10 &&
+          changes[2].subnet["subnet"] == "10.2.0.0/24");
+
+    // c waits for b's id; removing b hands it over
+    CHECK(recorder.apply({put("c", scope("10.3.0.0/24", 10))}).empty());
+    changes = recorder.apply({del("b")});
+    CHECK(changes.size() == 2);
+    CHECK(changes[0].scope_id == "b" && changes[0].subnet.isNull());
+    CHECK(changes[1].scope_id == "c" && changes[1].subnet_id == 10);
+
+    // A scope that was waiting and is deleted does not come back
+    CHECK(recorder.apply({put("d", scope("10.4.0.0/24", 11)), del("d")}).empty());
+    changes = recorder.apply({del("a")});
+    CHECK(changes.size() == 1 && changes[0].scope_id == "a");
+
+    // On a full read the first scope in key order keeps a contested id
+    Recorder fresh;
+    changes = fresh.watcher.resync({{PREFIX + "y", scope("10.5.0.0/24", 50)},
+                                    {PREFIX + "x", scope("10.6.0.0/24", 50)}});
+    CHECK(changes.size() == 1 && changes[0].scope_id == "x");
+}
+
+int main() {
+    test_translate();
+    test_changes();
+    test_resync();
+    test_collision();
+
+    return check_result("scope_watcher_test");
+}
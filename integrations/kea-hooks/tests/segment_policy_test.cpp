@@ -0,0 +1,324 @@
+/**
+ * Tests for Cerbos segment admission, against a minimal fake of the Cerbos
+ * HTTP API (/api/check/resources): cache hits and misses, deny TTL, the
+ * background refresh, fail-open, single-flight misses and memory eviction
+ */
+
+#include "memory_budget.h"
+#include "segment_policy.h"
+#include "check.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <json/json.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Answers CheckResources with EFFECT_ALLOW unless the resource id is
+// denied; can also delay its answers or fail them with a 500
+class FakeCerbos {
+public:
+    FakeCerbos() : stop_(false), requests_(0), delay_ms_(0), status_(200) {
+        listener_ = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(listener_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        socklen_t len = sizeof(addr);
+        getsockname(listener_, reinterpret_cast<sockaddr*>(&addr), &len);
+        port_ = ntohs(addr.sin_port);
+        listen(listener_, 16);
+        thread_ = std::thread(&FakeCerbos::accept_loop, this);
+    }
+
+    ~FakeCerbos() {
+        stop_ = true;
+        shutdown(listener_, SHUT_RDWR);
+        close(listener_);
+        thread_.join();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    std::string endpoint() const { return "http://127.0.0.1:" + std::to_string(port_); }
+
+    void deny(const std::string& subnet_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        denied_.insert(subnet_id);
+    }
+
+    void set_delay(int delay_ms) { delay_ms_ = delay_ms; }
+    void set_status(int status) { status_ = status; }
+    int requests() const { return requests_; }
+
+private:
+    static void write_all(int fd, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            const ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return;
+            }
+            sent += n;
+        }
+    }
+
+    void accept_loop() {
+        while (!stop_) {
+            const int fd = accept(listener_, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            workers_.emplace_back(&FakeCerbos::serve, this, fd);
+        }
+    }
+
+    void serve(int fd) {
+        std::string request;
+        char buffer[4096];
+        size_t header_end = std::string::npos;
+        size_t length = 0;
+        while (true) {
+            if (header_end == std::string::npos) {
+                header_end = request.find("\r\n\r\n");
+                if (header_end != std::string::npos) {
+                    const size_t pos = request.find("Content-Length: ");
+                    length = pos == std::string::npos ? 0 : std::stoul(request.substr(pos + 16));
+                }
+            }
+            if (header_end != std::string::npos && request.size() >= header_end + 4 + length) {
+                break;
+            }
+            const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                close(fd);
+                return;
+            }
+            request.append(buffer, n);
+        }
+        requests_++;
+        if (delay_ms_) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms_));
+        }
+
+        Json::Value check;
+        Json::Reader().parse(request.substr(header_end + 4, length), check);
+        const std::string id = check["resources"][0]["resource"]["id"].asString();
+        Json::Value response;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            response["results"][0]["resource"]["id"] = id;
+            response["results"][0]["actions"]["admit"] =
+                denied_.count(id) ? "EFFECT_DENY" : "EFFECT_ALLOW";
+        }
+        const std::string text = Json::FastWriter().write(response);
+        const int status = status_;
+        write_all(fd, "HTTP/1.1 " + std::to_string(status) +
+                          (status == 200 ? " OK" : " Error") +
+                          "\r\nContent-Type: application/json\r\nConnection: close\r\n"
+                          "Content-Length: " + std::to_string(text.size()) + "\r\n\r\n" + text);
+        close(fd);
+    }
+
+    int listener_;
+    int port_;
+    std::thread thread_;
+    std::vector<std::thread> workers_;
+    std::atomic<bool> stop_;
+    std::atomic<int> requests_;
+    std::atomic<int> delay_ms_;
+    std::atomic<int> status_;
+
+    std::mutex mutex_;
+    std::set<std::string> denied_;
+};
+
+static nnoe::SegmentRequest request(const std::string& subnet_id) {
+    nnoe::SegmentRequest request;
+    request.principal_id = "kea";
+    request.interface = "eth0";
+    request.subnet_id = subnet_id;
+    return request;
+}
+
+static nnoe::SegmentPolicyConfig config(const FakeCerbos& cerbos) {
+    nnoe::SegmentPolicyConfig config;
+    config.endpoint = cerbos.endpoint();
+    config.timeout_ms = 1000;
+    return config;
+}
+
+static void test_hit_and_miss() {
+    FakeCerbos cerbos;
+    cerbos.deny("2");
+    nnoe::SegmentPolicy policy(config(cerbos));
+    policy.start();
+
+    CHECK(policy.admit(request("1")));
+    CHECK(!policy.admit(request("2")));
+    CHECK(policy.misses() == 2);
+    CHECK(cerbos.requests() == 2);
+
+    // Cached decisions are served without asking again
+    CHECK(policy.admit(request("1")));
+    CHECK(!policy.admit(request("2")));
+    CHECK(policy.hits() == 2);
+    CHECK(cerbos.requests() == 2);
+    policy.stop();
+}
+
+static void test_negative_ttl() {
+    FakeCerbos cerbos;
+    cerbos.deny("2");
+    nnoe::SegmentPolicyConfig cfg = config(cerbos);
+    cfg.negative_ttl = 1;
+    nnoe::SegmentPolicy policy(cfg);
+    policy.start();
+
+    CHECK(policy.admit(request("1")));
+    CHECK(!policy.admit(request("2")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+
+    // The deny has expired and is asked again; the allow is still fresh
+    CHECK(!policy.admit(request("2")));
+    CHECK(policy.admit(request("1")));
+    CHECK(cerbos.requests() == 3);
+    CHECK(policy.misses() == 3);
+    policy.stop();
+}
+
+static void test_refresh() {
+    FakeCerbos cerbos;
+    nnoe::SegmentPolicyConfig cfg = config(cerbos);
+    cfg.positive_ttl = 2;
+    nnoe::SegmentPolicy policy(cfg);
+    policy.start();
+
+    CHECK(policy.admit(request("1")));
+    CHECK(policy.admit(request("1")));
+    CHECK(cerbos.requests() == 1);
+
+    // Past 80% of the TTL the cached allow is served at once while the
+    // worker asks again, and its answer replaces the entry
+    std::this_thread::sleep_for(std::chrono::milliseconds(1700));
+    cerbos.deny("1");
+    cerbos.set_delay(100);
+    const auto start = std::chrono::steady_clock::now();
+    CHECK(policy.admit(request("1")));
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(50));
+    CHECK(wait_until([&] { return !policy.admit(request("1")); }));
+    CHECK(cerbos.requests() == 2);
+    CHECK(policy.misses() == 1);
+    policy.stop();
+}
+
+static void test_fail_open() {
+    FakeCerbos cerbos;
+    cerbos.set_status(500);
+    nnoe::SegmentPolicyConfig cfg = config(cerbos);
+    nnoe::SegmentPolicy open_policy(cfg);
+    cfg.fail_open = false;
+    nnoe::SegmentPolicy closed_policy(cfg);
+
+    CHECK(open_policy.admit(request("1")));
+    CHECK(!closed_policy.admit(request("1")));
+
+    // The fallback is cached, so an outage costs one call per key
+    CHECK(open_policy.admit(request("1")));
+    CHECK(!closed_policy.admit(request("1")));
+    CHECK(cerbos.requests() == 2);
+
+    // Unreachable Cerbos
+    cfg.endpoint = "http://127.0.0.1:1";
+    cfg.fail_open = true;
+    nnoe::SegmentPolicy unreachable(cfg);
+    CHECK(unreachable.admit(request("1")));
+}
+
+static void test_single_flight() {
+    FakeCerbos cerbos;
+    cerbos.set_delay(200);
+    nnoe::SegmentPolicy policy(config(cerbos));
+
+    // Concurrent misses of one key share the first thread's call
+    std::atomic<int> allowed(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&] { allowed += policy.admit(request("1")); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    CHECK(allowed == 8);
+    CHECK(cerbos.requests() == 1);
+    CHECK(policy.admit(request("1")));
+    CHECK(cerbos.requests() == 1);
+}
+
+static void test_memory_eviction() {
+    FakeCerbos cerbos;
+    for (int subnet = 100; subnet < 300; ++subnet) {
+        cerbos.deny(std::to_string(subnet));
+    }
+    nnoe::SegmentPolicyConfig cfg = config(cerbos);
+    cfg.negative_ttl = 1;
+
+    // Size of one entry; all keys below have the same length
+    uint64_t entry = 0;
+    {
+        nnoe::MemoryBudget budget;
+        nnoe::MemoryAccount* account = budget.account("segment_cache");
+        nnoe::SegmentPolicy policy(cfg);
+        policy.set_memory(account);
+        policy.admit(request("100"));
+        entry = account->used();
+    }
+    CHECK(entry > 0);
+
+    nnoe::MemoryBudget budget;
+    nnoe::MemoryAccount* account = budget.account("segment_cache", entry + entry / 2);
+    nnoe::SegmentPolicy policy(cfg);
+    policy.set_memory(account);
+
+    // Room for one decision: the second is answered but not cached
+    const int measured = cerbos.requests();
+    CHECK(!policy.admit(request("100")));
+    CHECK(!policy.admit(request("101")));
+    CHECK(!policy.admit(request("101")));
+    CHECK(cerbos.requests() == measured + 3);
+    CHECK(account->used() == entry);
+
+    // Once the first has expired, a new decision of its shard takes its place
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    bool replaced = false;
+    for (int subnet = 102; subnet < 300 && !replaced; ++subnet) {
+        const std::string id = std::to_string(subnet);
+        policy.admit(request(id));
+        const int asked = cerbos.requests();
+        policy.admit(request(id));
+        replaced = cerbos.requests() == asked;
+    }
+    CHECK(replaced);
+    CHECK(account->used() == entry);
+}
+
+int main() {
+    test_hit_and_miss();
+    test_negative_ttl();
+    test_refresh();
+    test_fail_open();
+    test_single_flight();
+    test_memory_eviction();
+
+    return check_result("segment_policy_test");
+}
@@ -0,0 +1,236 @@
+/**
+ * Tests for the sync engine's per-subnet scheduling: deficit round-robin
+ * weights and carry-over, eviction from the longest flow, lag statistics,
+ * the latency of a light subnet next to a noisy one and batches etcd refuses
+ */
+
+#include "etcd_client.h"
+#include "sync_engine.h"
+#include "check.h"
+#include "fake_transport.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Harness {
+    explicit Harness(const nnoe::SyncEngineConfig& config, int delay_ms = 0)
+        : transport(std::make_shared<FakeTransport>(delay_ms)), client("http://127.0.0.1:1") {
+        client.set_transport(transport);
+        engine.reset(new nnoe::SyncEngine(client, config));
+    }
+
+    // Lease key "<flow>/<n>" with a single put, so every event costs two ops
+    bool submit(uint32_t flow, int n) {
+        const std::string key = std::to_string(flow) + "/" + std::to_string(n);
+        nnoe::EtcdGuard guard;
+        guard.key = "/seq/" + key;
+        guard.sequence = 1;
+        return engine->submit(key, {nnoe::EtcdOp::put(key, "{}")}, guard, flow);
+    }
+
+    // Flow of every sent event, in sending order
+    std::string order() {
+        std::string flows;
+        for (const auto& key : transport->keys()) {
+            flows += key.substr(0, key.find('/'));
+        }
+        return flows;
+    }
+
+    std::shared_ptr<FakeTransport> transport;
+    nnoe::EtcdClient client;
+    std::unique_ptr<nnoe::SyncEngine> engine;
+};
+
+static nnoe::SyncFlowStats flow_stats(nnoe::SyncEngine& engine, uint32_t flow) {
+    for (const auto& stats : engine.flow_stats()) {
+        if (stats.flow == flow) {
+            return stats;
+        }
+    }
+    return nnoe::SyncFlowStats();
+}
+
+static nnoe::SyncEngineConfig scheduling_config() {
+    nnoe::SyncEngineConfig config;
+    config.flush_interval_ms = 0;
+    config.senders = 1;
+    config.guard_grace_s = 0;
+    return config;
+}
+
+static void test_weights() {
+    // Flow 1 may send six ops (three events) per turn, flow 2 two (one);
+    // a batch holds four events, so a turn cut short by a full batch
+    // continues in the next one
+    nnoe::SyncEngineConfig config = scheduling_config();
+    config.max_batch_ops = 8;
+    config.quantum_ops = 2;
+    config.weights[1] = 3;
+    Harness harness(config);
+    for (int i = 0; i < 12; ++i) {
+        harness.submit(1, i);
+        harness.submit(2, i);
+    }
+    harness.engine->start();
+    harness.engine->stop();
+
+    const std::string order = harness.order();
+    CHECK(order.size() == 24);
+    CHECK(order.size() == 24 && order.substr(0, 16) == "1112111211121112");
+    CHECK(order.size() == 24 && order.substr(16) == "22222222");
+    CHECK(harness.engine->stats().batches == 6);   // all full
+    CHECK(flow_stats(*harness.engine, 1).weight == 3);
+    CHECK(flow_stats(*harness.engine, 2).sent == 12);
+}
+
+static void test_deficit_carry_over() {
+    // A quantum of three ops pays for one two-op event; the unspent op
+    // carries over, so each flow alternates one and two events per turn
+    nnoe::SyncEngineConfig config = scheduling_config();
+    config.max_batch_ops = 100;
+    config.quantum_ops = 3;
+    Harness harness(config);
+    for (int i = 0; i < 6; ++i) {
+        harness.submit(1, i);
+        harness.submit(2, i);
+    }
+    harness.engine->start();
+    harness.engine->stop();
+
+    CHECK(harness.order() == "121122121122");
+    CHECK(harness.engine->stats().batches == 1);
+}
+
+static void test_eviction() {
+    nnoe::SyncEngineConfig config = scheduling_config();
+    config.queue_limit = 4;
+    Harness harness(config);
+    for (int i = 0; i < 3; ++i) {
+        CHECK(harness.submit(1, i));
+    }
+    CHECK(harness.submit(2, 0));
+
+    // Full: the longest flow loses its newest event
+    CHECK(harness.submit(2, 1));
+    CHECK(flow_stats(*harness.engine, 1).pending == 2);
+    CHECK(flow_stats(*harness.engine, 1).dropped == 1);
+
+    // Flow 1 is no longer the longest, so its own event is refused
+    CHECK(!harness.submit(1, 3));
+    CHECK(flow_stats(*harness.engine, 1).dropped == 2);
+    CHECK(flow_stats(*harness.engine, 2).dropped == 0);
+    CHECK(harness.engine->stats().dropped == 2);
+
+    harness.engine->start();
+    harness.engine->stop();
+    const std::vector<std::string> keys = harness.transport->keys();
+    CHECK(keys == std::vector<std::string>({"1/0", "1/1", "2/0", "2/1"}));
+}
+
+static void test_lag_stats() {
+    Harness harness(scheduling_config());
+    harness.submit(5, 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+
+    nnoe::SyncFlowStats stats = flow_stats(*harness.engine, 5);
+    CHECK(stats.pending == 1);
+    CHECK(stats.lag_ms >= 30);
+    CHECK(stats.max_lag_ms == 0);
+
+    harness.engine->start();
+    CHECK(wait_until([&] { return harness.engine->stats().pending == 0; }));
+    stats = flow_stats(*harness.engine, 5);
+    CHECK(stats.sent == 1);
+    CHECK(stats.lag_ms == 0);
+    CHECK(stats.max_lag_ms >= 30);
+    harness.engine->stop();
+}
+
+static void test_noisy_neighbour() {
+    // Every txn takes 2 ms and a batch holds four events, so the backlog
+    // of flow 1 needs well over a second to drain while flow 2 trickles
+    nnoe::SyncEngineConfig config = scheduling_config();
+    config.max_batch_ops = 8;
+    config.quantum_ops = 2;
+    config.weights[2] = 2;
+    Harness harness(config, 2);
+    for (int i = 0; i < 3000; ++i) {
+        harness.submit(1, i);
+    }
+    harness.engine->start();
+
+    for (int i = 0; i < 40; ++i) {
+        harness.submit(2, i);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    CHECK(wait_until([&] { return flow_stats(*harness.engine, 2).sent == 40; }));
+
+    // Flow 2 waits for about one txn, not for the backlog ahead of it
+    const nnoe::SyncFlowStats noisy = flow_stats(*harness.engine, 1);
+    const nnoe::SyncFlowStats light = flow_stats(*harness.engine, 2);
+    CHECK(noisy.pending > 0);
+    CHECK(noisy.lag_ms >= 200);
+    CHECK(light.max_lag_ms * 4 < noisy.lag_ms);
+    harness.engine->stop();
+}
+
+// Lease keys of the guarded groups in a txn request
+static std::vector<std::string> txn_keys(const Json::Value& request) {
+    std::vector<std::string> keys;
+    for (const auto& group : request["success"]) {
+        keys.push_back(nnoe::base64_decode(
+            group["request_txn"]["success"][0]["request_put"]["key"].asString()));
+    }
+    return keys;
+}
+
+static void test_refused_batch() {
+    // etcd refuses any txn with 1/2 in it: the batch is split into single
+    // events and only 1/2 is dropped
+    Harness harness(scheduling_config());
+    harness.transport->set_status([](const Json::Value& request) {
+        const std::vector<std::string> keys = txn_keys(request);
+        return std::count(keys.begin(), keys.end(), "1/2") ? 400L : 200L;
+    });
+    for (int i = 0; i < 5; ++i) {
+        harness.submit(1, i);
+    }
+    harness.engine->start();
+    CHECK(wait_until([&] { return harness.engine->stats().pending == 0; }));
+    harness.engine->stop();
+
+    CHECK(harness.transport->key_set() == std::set<std::string>({"1/0", "1/1", "1/3", "1/4"}));
+    const nnoe::SyncEngineStats stats = harness.engine->stats();
+    CHECK(stats.rejected == 1);
+    CHECK(stats.failures == 2);
+
+    // A txn refused for its size goes through event by event
+    Harness small(scheduling_config());
+    small.transport->set_status([](const Json::Value& request) {
+        return txn_keys(request).size() > 2 ? 400L : 200L;
+    });
+    for (int i = 0; i < 4; ++i) {
+        small.submit(2, i);
+    }
+    small.engine->start();
+    CHECK(wait_until([&] { return small.transport->key_set().size() == 4; }));
+    small.engine->stop();
+    CHECK(small.engine->stats().rejected == 0);
+}
+
+int main() {
+    test_weights();
+    test_deficit_carry_over();
+    test_eviction();
+    test_lag_stats();
+    test_noisy_neighbour();
+    test_refused_batch();
+
+    return check_result("sync_engine_test");
+}
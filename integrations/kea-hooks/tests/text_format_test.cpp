@@ -0,0 +1,116 @@
+/**
+ * Tests for the address and identifier formatters
+ */
+
+#include "text_format.h"
+#include "check.h"
+
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// What Kea's IOAddress::toText() produces
+static std::string ntop4(uint32_t address) {
+    in_addr addr;
+    addr.s_addr = htonl(address);
+    char text[INET_ADDRSTRLEN];
+    return inet_ntop(AF_INET, &addr, text, sizeof(text));
+}
+
+static std::string ntop6(const uint8_t* address) {
+    char text[INET6_ADDRSTRLEN];
+    return inet_ntop(AF_INET6, address, text, sizeof(text));
+}
+
+// What Kea's HWAddr::toText(false) and DUID::toText() produce
+static std::string stream_hex(const std::vector<uint8_t>& data) {
+    std::ostringstream text;
+    text << std::hex;
+    for (size_t i = 0; i < data.size(); ++i) {
+        if (i) {
+            text << ":";
+        }
+        text << std::setw(2) << std::setfill('0') << static_cast<unsigned int>(data[i]);
+    }
+    return text.str();
+}
+
+static void test_ipv4() {
+    const uint32_t cases[] = {0, 1, 0x0a000001, 0x7f000001, 0xc0a80164, 0xffffffff,
+                              0x09630a64, 0x640a6309};
+    for (uint32_t address : cases) {
+        CHECK(nnoe::ipv4_text(address) == ntop4(address));
+    }
+    std::mt19937 rng(1);
+    for (int i = 0; i < 100000; ++i) {
+        const uint32_t address = rng();
+        if (nnoe::ipv4_text(address) != ntop4(address)) {
+            CHECK(nnoe::ipv4_text(address) == ntop4(address));
+            break;
+        }
+    }
+}
+
+static void test_ipv6() {
+    const char* cases[] = {"::", "::1", "1::", "2001:db8::1", "2001:db8:0:1:1:1:1:1",
+                           "2001:0:0:1::1", "2001:db8::1:0:0:1", "fe80::1:2:3:4",
+                           "::ffff:192.0.2.1", "::192.0.2.1", "::ffff:0:1",
+                           "0:0:0:0:0:1:0:0", "1:0:0:2:0:0:0:3", "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff"};
+    for (const char* text : cases) {
+        uint8_t address[16];
+        inet_pton(AF_INET6, text, address);
+        CHECK(nnoe::ipv6_text(address) == ntop6(address));
+    }
+
+    // Random groups, mostly zero so that runs of every length show up
+    std::mt19937 rng(2);
+    for (int i = 0; i < 200000; ++i) {
+        uint8_t address[16];
+        for (int g = 0; g < 8; ++g) {
+            const uint32_t roll = rng();
+            const uint16_t group = roll % 3 ? 0 : ((roll >> 8) % 4 == 0 ? 0xffff : roll >> 16);
+            address[2 * g] = static_cast<uint8_t>(group >> 8);
+            address[2 * g + 1] = static_cast<uint8_t>(group);
+        }
+        if (nnoe::ipv6_text(address) != ntop6(address)) {
+            std::fprintf(stderr, "ipv6 mismatch: %s vs %s\n", nnoe::ipv6_text(address).c_str(),
+                         ntop6(address).c_str());
+            failures++;
+            break;
+        }
+    }
+}
+
+static void test_hex_colon() {
+    CHECK(nnoe::hex_colon_text(nullptr, 0).empty());
+    const std::vector<uint8_t> mac = {0x00, 0x1a, 0x2b, 0xff, 0x0c, 0x9d};
+    CHECK(nnoe::hex_colon_text(mac.data(), mac.size()) == "00:1a:2b:ff:0c:9d");
+
+    // Every length around the 16-byte SIMD step
+    std::mt19937 rng(3);
+    for (size_t length = 1; length <= 130; ++length) {
+        std::vector<uint8_t> data(length);
+        for (auto& byte : data) {
+            byte = static_cast<uint8_t>(rng());
+        }
+        CHECK(nnoe::hex_colon_text(data.data(), data.size()) == stream_hex(data));
+
+        // Writes stay within the documented buffer
+        std::vector<char> buffer(nnoe::hex_colon_buffer(length) + 1, '#');
+        const size_t written = nnoe::format_hex_colon(data.data(), length, buffer.data());
+        CHECK(written == 3 * length - 1 && buffer.back() == '#');
+    }
+}
+
+int main() {
+    test_ipv4();
+    test_ipv6();
+    test_hex_colon();
+
+    return check_result("text_format_test");
+}
@@ -0,0 +1,423 @@
+/**
+ * Tests for the shared etcd watch manager, against a minimal fake of the
+ * etcd gateway (/v3/kv/range and a multiplexed /v3/watch)
+ */
+
+#include "watch_manager.h"
+#include "check.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include <json/json.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::string compact_json(const Json::Value& value) {
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, value);
+}
+
+// Serves range reads from an in-memory store and streams its changes to
+// watch connections, one create request per body line
+class FakeGateway {
+public:
+    FakeGateway() : stop_(false), revision_(0) {
+        listener_ = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(listener_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        socklen_t len = sizeof(addr);
+        getsockname(listener_, reinterpret_cast<sockaddr*>(&addr), &len);
+        port_ = ntohs(addr.sin_port);
+        listen(listener_, 16);
+        thread_ = std::thread(&FakeGateway::accept_loop, this);
+    }
+
+    ~FakeGateway() {
+        stop_ = true;
+        shutdown(listener_, SHUT_RDWR);
+        close(listener_);
+        thread_.join();
+        drop_watches();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    std::string endpoint() const { return "http://127.0.0.1:" + std::to_string(port_); }
+
+    void put(const std::string& key, const std::string& value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Json::Value event;
+        event["kv"]["key"] = nnoe::base64_encode(key);
+        event["kv"]["value"] = nnoe::base64_encode(value);
+        event["kv"]["mod_revision"] = std::to_string(++revision_);
+        store_[key] = std::make_pair(value, revision_);
+        history_.push_back(std::make_pair(key, event));
+        for (auto& watch : watches_) {
+            for (size_t i = 0; i < watch.prefixes.size(); ++i) {
+                if (key.compare(0, watch.prefixes[i].size(), watch.prefixes[i]) == 0) {
+                    send_events(watch.fd, i, {event});
+                }
+            }
+        }
+    }
+
+    // Break every watch connection, as a network blip would
+    void drop_watches() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& watch : watches_) {
+            shutdown(watch.fd, SHUT_RDWR);
+            close(watch.fd);
+        }
+        watches_.clear();
+    }
+
+    // Cancel the watches on prefix as etcd does when their start revision
+    // has been compacted
+    void compact_watch(const std::string& prefix) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& watch : watches_) {
+            for (size_t i = 0; i < watch.prefixes.size(); ++i) {
+                if (watch.prefixes[i] == prefix) {
+                    Json::Value message;
+                    message["result"]["header"]["revision"] = std::to_string(revision_);
+                    message["result"]["watch_id"] = std::to_string(i);
+                    message["result"]["canceled"] = true;
+                    message["result"]["compact_revision"] = std::to_string(revision_);
+                    write_line(watch.fd, compact_json(message));
+                }
+            }
+        }
+    }
+
+    int ranges(const std::string& prefix) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return ranges_[prefix];
+    }
+
+    int watch_connections() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return watch_connections_;
+    }
+
+    std::vector<int64_t> last_start_revisions() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return last_starts_;
+    }
+
+private:
+    struct Watch {
+        int fd;
+        std::vector<std::string> prefixes;
+    };
+
+    static void write_all(int fd, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            const ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return;
+            }
+            sent += n;
+        }
+    }
+
+    static void write_line(int fd, const std::string& line) {
+        write_all(fd, line + "\n");
+    }
+
+    void send_events(int fd, size_t watch_id, const std::vector<Json::Value>& events) {
+        Json::Value message;
+        message["result"]["header"]["revision"] = std::to_string(revision_);
+        message["result"]["watch_id"] = std::to_string(watch_id);
+        for (const auto& event : events) {
+            message["result"]["events"].append(event);
+        }
+        write_line(fd, compact_json(message));
+    }
+
+    void accept_loop() {
+        while (!stop_) {
+            const int fd = accept(listener_, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            workers_.emplace_back(&FakeGateway::serve, this, fd);
+        }
+    }
+
+    void serve(int fd) {
+        std::string request;
+        char buffer[4096];
+        size_t header_end = std::string::npos;
+        size_t length = 0;
+        while (true) {
+            if (header_end == std::string::npos) {
+                header_end = request.find("\r\n\r\n");
+                if (header_end != std::string::npos) {
+                    const size_t pos = request.find("Content-Length: ");
+                    length = pos == std::string::npos ? 0 : std::stoul(request.substr(pos + 16));
+                }
+            }
+            if (header_end != std::string::npos && request.size() >= header_end + 4 + length) {
+                break;
+            }
+            const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                close(fd);
+                return;
+            }
+            request.append(buffer, n);
+        }
+        const std::string body = request.substr(header_end + 4, length);
+        const std::string head = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                                 "Connection: close\r\n";
+
+        if (request.compare(0, 17, "POST /v3/kv/range") == 0) {
+            Json::Value range;
+            Json::Reader().parse(body, range);
+            const std::string prefix = nnoe::base64_decode(range["key"].asString());
+            Json::Value response;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ranges_[prefix]++;
+                response["header"]["revision"] = std::to_string(revision_);
+                for (const auto& entry : store_) {
+                    if (entry.first.compare(0, prefix.size(), prefix) == 0) {
+                        Json::Value kv;
+                        kv["key"] = nnoe::base64_encode(entry.first);
+                        kv["value"] = nnoe::base64_encode(entry.second.first);
+                        kv["mod_revision"] = std::to_string(entry.second.second);
+                        response["kvs"].append(kv);
+                    }
+                }
+            }
+            const std::string text = compact_json(response);
+            write_all(fd, head + "Content-Length: " + std::to_string(text.size()) + "\r\n\r\n" +
+                          text);
+            close(fd);
+            return;
+        }
+
+        // Watch: one create request per line
+        Watch watch;
+        watch.fd = fd;
+        std::vector<int64_t> starts;
+        size_t pos = 0;
+        while (pos < body.size()) {
+            size_t end = body.find('\n', pos);
+            if (end == std::string::npos) {
+                end = body.size();
+            }
+            Json::Value line;
+            if (Json::Reader().parse(body.substr(pos, end - pos), line)) {
+                const Json::Value& create = line["create_request"];
+                watch.prefixes.push_back(nnoe::base64_decode(create["key"].asString()));
+                starts.push_back(create["start_revision"].asInt64());
+            }
+            pos = end + 1;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        watch_connections_++;
+        last_starts_ = starts;
+        write_all(fd, head + "\r\n");
+        for (size_t i = 0; i < watch.prefixes.size(); ++i) {
+            Json::Value created;
+            created["result"]["header"]["revision"] = std::to_string(revision_);
+            created["result"]["watch_id"] = std::to_string(i);
+            created["result"]["created"] = true;
+            write_line(fd, compact_json(created));
+
+            // Catch up from the start revision
+            std::vector<Json::Value> events;
+            for (const auto& entry : history_) {
+                if (entry.first.compare(0, watch.prefixes[i].size(), watch.prefixes[i]) == 0 &&
+                    std::stoll(entry.second["kv"]["mod_revision"].asString()) >= starts[i]) {
+                    events.push_back(entry.second);
+                }
+            }
+            if (!events.empty()) {
+                send_events(fd, i, events);
+            }
+        }
+        watches_.push_back(watch);
+    }
+
+    int listener_;
+    int port_;
+    std::thread thread_;
+    std::vector<std::thread> workers_;
+    std::atomic<bool> stop_;
+
+    std::mutex mutex_;
+    int64_t revision_;
+    std::map<std::string, std::pair<std::string, int64_t>> store_;
+    std::vector<std::pair<std::string, Json::Value>> history_;
+    std::vector<Watch> watches_;
+    std::map<std::string, int> ranges_;
+    int watch_connections_ = 0;
+    std::vector<int64_t> last_starts_;
+};
+
+class Mirror : public nnoe::WatchSubscriber {
+public:
+    Mirror(const std::string& prefix) : prefix_(prefix), reloads_(0) {}
+
+    bool reload(const nnoe::EtcdClient& client, int64_t& revision) override {
+        std::vector<nnoe::EtcdKeyValue> kvs;
+        if (!client.range_prefix(prefix_, kvs, revision)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        for (const auto& kv : kvs) {
+            entries_[kv.key] = kv.value;
+        }
+        reloads_++;
+        return true;
+    }
+
+    void apply(const std::vector<nnoe::EtcdWatchEvent>& events) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& event : events) {
+            if (event.type == nnoe::EtcdWatchEvent::DELETE) {
+                entries_.erase(event.kv.key);
+            } else {
+                entries_[event.kv.key] = event.kv.value;
+            }
+        }
+    }
+
+    std::string get(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        return it == entries_.end() ? "" : it->second;
+    }
+
+    int reloads() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return reloads_;
+    }
+
+private:
+    std::string prefix_;
+    std::mutex mutex_;
+    std::map<std::string, std::string> entries_;
+    int reloads_;
+};
+
+static void test_queue() {
+    nnoe::SpscQueue<std::vector<int>> queue(3);
+    std::vector<int> item;
+    for (int i = 0; i < 4; ++i) {
+        item = {i};
+        CHECK(queue.push(item));
+    }
+    item = {9};
+    CHECK(!queue.push(item) && item.size() == 1);
+    CHECK(queue.size() == 4);
+    for (int i = 0; i < 4; ++i) {
+        CHECK(queue.pop(item) && item.size() == 1 && item[0] == i);
+    }
+    CHECK(!queue.pop(item) && queue.empty());
+
+    // One producer and one consumer thread, in order and without loss
+    nnoe::SpscQueue<int> numbers(64);
+    const int count = 200000;
+    std::thread producer([&numbers]() {
+        for (int i = 0; i < count; ++i) {
+            int value = i;
+            while (!numbers.push(value)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    bool ordered = true;
+    for (int expected = 0; expected < count;) {
+        int value;
+        if (numbers.pop(value)) {
+            ordered = ordered && value == expected;
+            expected++;
+        }
+    }
+    producer.join();
+    CHECK(ordered);
+}
+
+static void test_resume_and_compaction() {
+    FakeGateway gateway;
+    gateway.put("/a/1", "a1");
+    gateway.put("/b/1", "b1");
+
+    nnoe::MemoryBudget budget;
+    Mirror a("/a/");
+    Mirror b("/b/");
+    {
+        nnoe::WatchManager watches(gateway.endpoint());
+        watches.set_memory(budget.account("watch"));
+        watches.start();
+        const uint64_t a_id = watches.subscribe("/a/", &a);
+        watches.subscribe("/b/", &b);
+
+        // One stream carries both watches once both prefixes are loaded
+        CHECK(wait_until([&] { return a.get("/a/1") == "a1" && b.get("/b/1") == "b1"; }));
+        CHECK(wait_until([&] { return gateway.last_start_revisions().size() == 2; }));
+        gateway.put("/a/2", "a2");
+        gateway.put("/b/2", "b2");
+        CHECK(wait_until([&] { return a.get("/a/2") == "a2" && b.get("/b/2") == "b2"; }));
+
+        // A blip: changes made meanwhile arrive after the reconnect, resumed
+        // from the last revision seen rather than re-read
+        const int connections = gateway.watch_connections();
+        gateway.drop_watches();
+        gateway.put("/a/3", "a3");
+        CHECK(wait_until([&] { return a.get("/a/3") == "a3"; }));
+        CHECK(gateway.watch_connections() > connections);
+        CHECK(gateway.ranges("/a/") == 1 && gateway.ranges("/b/") == 1);
+        CHECK(watches.stats().resumed >= 2);
+        const std::vector<int64_t> starts = gateway.last_start_revisions();
+        CHECK(starts.size() == 2 && starts[0] > 1 && starts[1] > 1);
+
+        // A compacted watch re-reads only its own prefix
+        gateway.compact_watch("/a/");
+        CHECK(wait_until([&] { return a.reloads() == 2; }));
+        gateway.put("/a/4", "a4");
+        gateway.put("/b/3", "b3");
+        CHECK(wait_until([&] { return a.get("/a/4") == "a4" && b.get("/b/3") == "b3"; }));
+        CHECK(gateway.ranges("/a/") == 2 && gateway.ranges("/b/") == 1);
+
+        const nnoe::WatchManagerStats stats = watches.stats();
+        CHECK(stats.compactions == 1 && stats.reloads == 3 && stats.subscriptions.size() == 2);
+
+        // After unsubscribing, only the other prefix is watched
+        watches.unsubscribe(a_id);
+        CHECK(wait_until([&] { return gateway.last_start_revisions().size() == 1; }));
+        gateway.put("/a/5", "a5");
+        gateway.put("/b/4", "b4");
+        CHECK(wait_until([&] { return b.get("/b/4") == "b4"; }));
+        CHECK(a.get("/a/5").empty());
+        watches.stop();
+    }
+    CHECK(budget.account("watch")->used() == 0);
+}
+
+int main() {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    test_queue();
+    test_resume_and_compaction();
+    curl_global_cleanup();
+
+    return check_result("watch_manager_test");
+}
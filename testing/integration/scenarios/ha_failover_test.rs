@@ -28,6 +28,7 @@ mod tests {
             ha_pair_id: Some("test-pair-1".to_string()),
             interface: "eth0".to_string(),
             control_port: 8000,
+            incremental_scopes: false,
         };
         
         let service = KeaService::new(config);